@@ -0,0 +1,82 @@
+/** @file
+  Bulk registration of shell commands from static descriptor tables.
+
+  ShellCommandRegisterCommandName() checks every new command against the
+  internal list and all dynamic command handles, then sorts it into place, so
+  a command library registering its commands one by one pays for that on
+  every command.  A command library can instead describe its commands in a
+  SHELL_COMMAND_TABLE and register it with one call: the commands are sorted
+  once and merged into the command list.
+
+  The HII package of a table is not needed until one of its commands runs or
+  its help is requested, so ShellCommandRegisterCommandTable() does not
+  publish it.  The table's PublishHii function is called the first time that
+  happens, and the returned handle is used for all commands of the table.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_COMMAND_TABLE_H_
+#define _SHELL_COMMAND_TABLE_H_
+
+/**
+  Publish the HII package of a command library.
+
+  The function also stores the handle wherever the library's command handlers
+  expect it.  A library that adds its strings at run time fills in the
+  ManFormatHelp ids of its table here.
+
+  @return                       The HII handle, or NULL if the package could
+                                not be published.
+**/
+typedef
+EFI_HII_HANDLE
+(EFIAPI *SHELL_COMMAND_PUBLISH_HII)(
+  VOID
+  );
+
+///
+/// One command, as it would be passed to ShellCommandRegisterCommandName().
+///
+typedef struct {
+  CONST CHAR16              *CommandString;
+  SHELL_RUN_COMMAND         CommandHandler;
+  SHELL_GET_MAN_FILENAME    GetManFileName;
+  UINT32                    ShellMinSupportLevel;
+  CONST CHAR16              *ProfileName;
+  BOOLEAN                   CanAffectLE;
+  EFI_STRING_ID             ManFormatHelp;
+} SHELL_COMMAND_DESCRIPTOR;
+
+///
+/// The commands of one command library.  The table must stay valid for as
+/// long as the commands are registered.
+///
+typedef struct {
+  CONST SHELL_COMMAND_DESCRIPTOR    *Commands;
+  UINTN                             CommandCount;
+  SHELL_COMMAND_PUBLISH_HII         PublishHii;
+} SHELL_COMMAND_TABLE;
+
+/**
+  Register all commands of a command table.
+
+  Commands above the current support level, and commands that are already
+  registered or provided by a dynamic command, are skipped as
+  ShellCommandRegisterCommandName() would refuse them.  The HII package of the
+  table is published on first use of one of its commands.
+
+  @param[in] Table              The command table.
+
+  @retval RETURN_SUCCESS           The commands were registered.
+  @retval RETURN_OUT_OF_RESOURCES  There are not enough resources available;
+                                   no command of the table was registered.
+**/
+RETURN_STATUS
+EFIAPI
+ShellCommandRegisterCommandTable (
+  IN CONST SHELL_COMMAND_TABLE  *Table
+  );
+
+#endif
@@ -0,0 +1,66 @@
+/** @file
+  Cached HII format strings for the shell and its command library.
+
+  ShellPrintHiiEx() fetches its format string from the HII database on every
+  call.  ShellCommandPrintHii() takes the same arguments but keeps every string
+  it fetched for the platform language, per HII handle and string id, so
+  messages that are printed again and again (the prompt, script echo, errors)
+  are formatted straight from memory.
+
+  The cache is dropped when PlatformLang changes; the shell checks that with
+  ShellCommandCheckHiiLanguage() after each command.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_HII_STRING_CACHE_H_
+#define _SHELL_HII_STRING_CACHE_H_
+
+/**
+  Print at a specific location on the screen, using a format string from HII,
+  as ShellPrintHiiEx() does.
+
+  @param[in] Col                The column to start at, or -1 for the current column.
+  @param[in] Row                The row to start at, or -1 for the current row.
+  @param[in] Language           The language of the string, or NULL for the
+                                platform language.  Only strings in the
+                                platform language are cached.
+  @param[in] HiiFormatStringId  The format string id for getting from HII.
+  @param[in] HiiFormatHandle    The format string handle for getting from HII.
+  @param[in] ...                The variable argument list.
+
+  @retval EFI_SUCCESS           The printing was successful.
+  @retval EFI_DEVICE_ERROR      The string was not found in HII.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+EFI_STATUS
+EFIAPI
+ShellCommandPrintHii (
+  IN INT32                 Col OPTIONAL,
+  IN INT32                 Row OPTIONAL,
+  IN CONST CHAR8           *Language OPTIONAL,
+  IN CONST EFI_STRING_ID   HiiFormatStringId,
+  IN CONST EFI_HII_HANDLE  HiiFormatHandle,
+  ...
+  );
+
+/**
+  Drop the cached HII strings if PlatformLang changed since they were fetched.
+**/
+VOID
+EFIAPI
+ShellCommandCheckHiiLanguage (
+  VOID
+  );
+
+/**
+  Drop all cached HII strings.
+**/
+VOID
+EFIAPI
+ShellCommandFlushHiiStrings (
+  VOID
+  );
+
+#endif
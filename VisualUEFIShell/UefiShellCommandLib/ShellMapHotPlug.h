@@ -0,0 +1,58 @@
+/** @file
+  Incremental mapping of devices that arrive or leave while the shell runs.
+
+  Without these functions the mappings only change when "map -r" or
+  ShellCommandUpdateMapping() enumerates every file system handle again.  The
+  command library remembers the handle behind each device it mapped, so the
+  shell can map the handles reported by its SimpleFileSystem and BlockIo
+  install notifications one at a time, and unmap the devices whose protocols
+  were uninstalled without enumerating any handles.
+
+  UEFI has no uninstall notification, so ShellCommandMapDeviceRemoval() checks
+  the remembered handles directly.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_MAP_HOT_PLUG_H_
+#define _SHELL_MAP_HOT_PLUG_H_
+
+/**
+  Map a handle on which a SimpleFileSystem or BlockIo protocol was installed.
+
+  A file system gets a default map name and, if the map name cache has one, a
+  consistent map name; a block device gets a default map name.  A protocol of
+  the handle that is already mapped is left alone, so the same handle may be
+  passed again when a protocol on it is reinstalled.  No handles are
+  enumerated: a file system that is not in the map name cache gets its
+  consistent name with the next "map -r".
+
+  @param[in] Handle             The handle.
+
+  @retval TRUE                  A mapping was added.
+  @retval FALSE                 The mappings did not change.
+**/
+BOOLEAN
+EFIAPI
+ShellCommandMapDeviceArrival (
+  IN EFI_HANDLE  Handle
+  );
+
+/**
+  Remove the mappings of devices whose mapped protocols were uninstalled.
+
+  If the current mapping is removed, gShellCurMapping is set to NULL.  A
+  device that lost only its file system keeps its block device name.  What is
+  still installed on the handle of a removed device is mapped again.
+
+  @retval TRUE                  Mappings were removed.
+  @retval FALSE                 The mappings did not change.
+**/
+BOOLEAN
+EFIAPI
+ShellCommandMapDeviceRemoval (
+  VOID
+  );
+
+#endif
@@ -0,0 +1,77 @@
+/** @file
+  Indexes over the mapping list.
+
+  Looking a mapping up by name or device path used to walk gShellMapList.
+  Converting a device path to a file path also called LocateDevicePath() for
+  every mapping.  The command library now keeps three indexes over the list:
+  - a hash of the map names;
+  - a trie of the device paths, one level per device path node;
+  - a hash of the SimpleFileSystem handle that each mapping resolves to.
+
+  The indexes are built on first use after the mapping list changed.  The
+  handle of a mapping is resolved once per build, the first time a lookup by
+  handle needs it.
+
+  Code that changes gShellMapList outside the command library must call
+  ShellCommandMapIndexInvalidate().
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_MAP_INDEX_H_
+#define _SHELL_MAP_INDEX_H_
+
+/**
+  Find a mapping by name.
+
+  @param[in] Name               The map name, with or without the trailing ':'.
+
+  @return                       The mapping, or NULL if there is none.
+**/
+SHELL_MAP_LIST *
+EFIAPI
+ShellCommandFindMapItemByName (
+  IN CONST CHAR16  *Name
+  );
+
+/**
+  Get the names of all mappings of a device path.
+
+  @param[in] DevicePath         The device path.  It must match the device
+                                path of a mapping node for node.
+
+  @return                       The pool allocated, semicolon separated map
+                                names in list order, or NULL if the device
+                                path has no mapping.
+**/
+CHAR16 *
+EFIAPI
+ShellCommandGetMapNamesFromDevicePath (
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath
+  );
+
+/**
+  Find the first mapping, in list order, whose device path resolves to a
+  SimpleFileSystem handle.
+
+  @param[in] Handle             The SimpleFileSystem handle.
+
+  @return                       The mapping, or NULL if there is none.
+**/
+SHELL_MAP_LIST *
+EFIAPI
+ShellCommandFindMapItemByFileSystem (
+  IN EFI_HANDLE  Handle
+  );
+
+/**
+  Drop the mapping indexes.  They are built again on next use.
+**/
+VOID
+EFIAPI
+ShellCommandMapIndexInvalidate (
+  VOID
+  );
+
+#endif
@@ -0,0 +1,98 @@
+/** @file
+  Growable string builder for the shell and its command library.
+
+  StrnCatGrow() measures the destination and may reallocate it on every call,
+  which makes building a string from many small pieces quadratic.  A
+  SHELL_STRING_BUILDER keeps the length and grows its capacity by doubling.
+
+  An allocation failure is sticky: the builder releases its buffer, later
+  appends return EFI_OUT_OF_RESOURCES and ShellStrBuilderFinalize() returns
+  NULL, so a sequence of appends only needs to be checked once at the end.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_STRING_BUILDER_H_
+#define _SHELL_STRING_BUILDER_H_
+
+typedef struct {
+  CHAR16     *Buffer;       ///< Pool buffer, NULL until the first append.
+  UINTN      Length;        ///< Characters in Buffer, not counting the terminator.
+  UINTN      Capacity;      ///< Characters Buffer can hold, terminator included.
+  BOOLEAN    Failed;        ///< An allocation failed.
+} SHELL_STRING_BUILDER;
+
+/**
+  Initialize an empty string builder.  Nothing is allocated.
+
+  @param[out] Builder           The builder.
+**/
+VOID
+EFIAPI
+ShellStrBuilderInit (
+  OUT SHELL_STRING_BUILDER  *Builder
+  );
+
+/**
+  Make sure a string builder can hold Length characters without growing.
+
+  @param[in, out] Builder       The builder.
+  @param[in] Length             Number of characters, not counting the terminator.
+
+  @retval EFI_SUCCESS           The capacity is available.
+  @retval EFI_OUT_OF_RESOURCES  An allocation failed now or earlier.
+**/
+EFI_STATUS
+EFIAPI
+ShellStrBuilderReserve (
+  IN OUT SHELL_STRING_BUILDER  *Builder,
+  IN     UINTN                 Length
+  );
+
+/**
+  Append a string to a string builder.
+
+  @param[in, out] Builder       The builder.
+  @param[in] String             The string to append.  NULL appends nothing.
+  @param[in] Count              Maximum number of characters to append, or 0
+                                to append all of String (as StrnCatGrow()).
+
+  @retval EFI_SUCCESS           The string was appended.
+  @retval EFI_OUT_OF_RESOURCES  An allocation failed now or earlier.
+**/
+EFI_STATUS
+EFIAPI
+ShellStrBuilderAppend (
+  IN OUT SHELL_STRING_BUILDER  *Builder,
+  IN     CONST CHAR16          *String,
+  IN     UINTN                 Count
+  );
+
+/**
+  Take the string out of a string builder.  The builder is empty afterwards.
+
+  @param[in, out] Builder       The builder.
+
+  @return                       The pool allocated string, to be freed by the
+                                caller, or NULL if nothing was appended or an
+                                allocation failed.
+**/
+CHAR16 *
+EFIAPI
+ShellStrBuilderFinalize (
+  IN OUT SHELL_STRING_BUILDER  *Builder
+  );
+
+/**
+  Free the string of a string builder.  The builder is empty afterwards.
+
+  @param[in, out] Builder       The builder.
+**/
+VOID
+EFIAPI
+ShellStrBuilderFree (
+  IN OUT SHELL_STRING_BUILDER  *Builder
+  );
+
+#endif
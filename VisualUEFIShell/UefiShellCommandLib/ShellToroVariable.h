@@ -0,0 +1,22 @@
+/** @file
+  Vendor GUID of the non-volatile variables the shell keeps across boots.
+
+  The shell and its command library remember what they found on the last
+  boot (the console mode, for instance) in variables under this GUID, so a
+  boot with the same hardware can skip probing for it.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _SHELL_TORO_VARIABLE_H_
+#define _SHELL_TORO_VARIABLE_H_
+
+#define TORO_SHELL_VARIABLE_GUID \
+  { \
+    0x5b2f4c1e, 0x8a3d, 0x4e7b, { 0x9c, 0x61, 0x2d, 0x7f, 0x40, 0xa8, 0x13, 0x95 } \
+  }
+
+extern EFI_GUID  gToroShellVariableGuid;
+
+#endif
@@ -10,9 +10,20 @@
 **/
 
 #include "UefiShellCommandLib.h"
+#include "ShellStringBuilder.h"
+#include "ShellHiiStringCache.h"
+#include "ShellCommandTable.h"
+#include "ShellMapHotPlug.h"
+#include "ShellMapIndex.h"
+#include "ShellToroVariable.h"
 
 extern char _gfDEFAULT_UEFI_DRIVE_NAMING;
 
+//
+// Vendor GUID of the shell's own non-volatile variables, see ShellToroVariable.h.
+//
+EFI_GUID  gToroShellVariableGuid = TORO_SHELL_VARIABLE_GUID;
+
 // STATIC local variables
 STATIC SHELL_COMMAND_INTERNAL_LIST_ENTRY  mCommandList;
 STATIC SCRIPT_FILE_LIST                   mScriptList;
@@ -21,11 +32,128 @@ STATIC BOOLEAN                            mEchoState;
 STATIC BOOLEAN                            mExitRequested;
 STATIC UINT64                             mExitCode;
 STATIC BOOLEAN                            mExitScript;
-STATIC CHAR16                             *mProfileList;
-STATIC UINTN                              mProfileListSize;
-STATIC UINTN                              mFsMaxCount  = 0;
-STATIC UINTN                              mBlkMaxCount = 0;
-STATIC BUFFER_LIST                        mFileHandleList;
+STATIC SHELL_STRING_BUILDER               mProfileList;
+STATIC UINTN                              mMapGeneration = 0;
+
+//
+// Open SHELL_FILE_HANDLEs are tracked in a small hash table keyed by the
+// EFI_FILE_PROTOCOL pointer, so path lookup and removal on close do not
+// depend on the number of handles currently open.
+//
+#define FILE_HANDLE_HASH_BUCKETS  64
+STATIC BUFFER_LIST  mFileHandleList[FILE_HANDLE_HASH_BUCKETS];
+STATIC UINTN        mFileHandleCount = 0;
+
+//
+// HII format string cache, see ShellHiiStringCache.h.  Strings are hashed by
+// HII handle and string id and stored with the %N, %E, %H, %B and %V color
+// markers already escaped, so a cached format only needs one CatVSPrint().
+//
+#define HII_STRING_HASH_BUCKETS  64
+#define HII_STRING_HASH(Handle, Id)  ((((UINTN)(Handle) >> 4) ^ (Id)) % HII_STRING_HASH_BUCKETS)
+
+typedef struct {
+  LIST_ENTRY        Link;
+  EFI_HII_HANDLE    Handle;
+  EFI_STRING_ID     Id;
+  CHAR16            *Format;            ///< The HII string with its color markers escaped.
+} SHELL_HII_STRING;
+
+STATIC LIST_ENTRY  mHiiStrings[HII_STRING_HASH_BUCKETS];
+STATIC UINTN       mHiiStringCount    = 0;
+STATIC CHAR8       *mHiiStringLanguage = NULL;
+
+//
+// Command tables whose commands are registered but whose HII package has not
+// been published yet, see ShellCommandTable.h.
+//
+typedef struct {
+  LIST_ENTRY                   Link;
+  CONST SHELL_COMMAND_TABLE    *Table;
+} SHELL_COMMAND_TABLE_LIST;
+
+STATIC LIST_ENTRY  mPendingCommandTables;
+
+STATIC
+VOID
+CommandTablePublishHii (
+  IN OUT SHELL_COMMAND_INTERNAL_LIST_ENTRY  *Command
+  );
+
+//
+// Consistent map names of the file systems found on the last boot, kept in a
+// non-volatile variable so a boot with the same devices does not have to
+// build the consistent mapping table.  The variable holds one MAP_CACHE_RECORD
+// per file system, in sorted device path order, each followed by the NULL
+// terminated consistent name (NameSize 0 if the device has none).
+//
+#define MAP_CACHE_VARIABLE  L"TOROMapCache"
+
+#pragma pack(1)
+typedef struct {
+  UINT64    PathHash;                   ///< FNV-1a hash of the device path.
+  UINT16    PathSize;                   ///< Size of the device path in bytes.
+  UINT16    NameSize;                   ///< Size of the name that follows in bytes.
+} MAP_CACHE_RECORD;
+#pragma pack()
+
+//
+// The cache only stands in for the consistent mapping table on the first
+// mapping of a boot.  Later rebuilds (map -r, new devices) generate all names.
+//
+STATIC BOOLEAN  mMapCacheUsed = FALSE;
+
+//
+// The devices behind the mappings, hashed by handle, see ShellMapHotPlug.h.
+//
+#define MAP_DEVICE_HASH_BUCKETS  32
+#define MAP_DEVICE_HASH(Handle)  (((UINTN)(Handle) >> 4) % MAP_DEVICE_HASH_BUCKETS)
+
+typedef struct {
+  LIST_ENTRY                  Link;
+  EFI_HANDLE                  Handle;
+  VOID                        *FileSystem;      ///< The mapped SimpleFileSystem interface, or NULL.
+  VOID                        *BlockIo;         ///< The mapped BlockIo interface, or NULL.
+  EFI_DEVICE_PATH_PROTOCOL    *DevicePath;      ///< Pool copy of the device path of Handle.
+} SHELL_MAP_DEVICE;
+
+STATIC LIST_ENTRY  mMapDevices[MAP_DEVICE_HASH_BUCKETS];
+
+//
+// Indexes over gShellMapList, see ShellMapIndex.h.  One MAP_INDEX_ENTRY per
+// mapping is chained into a name bucket, into the trie node its device path
+// ends at and, once resolved, into a handle bucket; every chain is in list
+// order.  The trie nodes point at the device path nodes of the mappings, so
+// the indexes are dropped whenever the list changes.
+//
+#define MAP_INDEX_HASH_BUCKETS  64
+
+typedef struct _MAP_INDEX_ENTRY MAP_INDEX_ENTRY;
+typedef struct _MAP_TRIE_NODE   MAP_TRIE_NODE;
+
+struct _MAP_INDEX_ENTRY {
+  SHELL_MAP_LIST     *MapItem;
+  UINTN              NameLength;        ///< Characters of MapName before the ':'.
+  EFI_HANDLE         FileSystem;        ///< Resolved SimpleFileSystem handle, or NULL.
+  MAP_INDEX_ENTRY    *NextName;
+  MAP_INDEX_ENTRY    *NextPath;
+  MAP_INDEX_ENTRY    *NextHandle;
+};
+
+struct _MAP_TRIE_NODE {
+  CONST EFI_DEVICE_PATH_PROTOCOL    *Key;   ///< The device path node, NULL for the root.
+  MAP_TRIE_NODE                     *Child;
+  MAP_TRIE_NODE                     *Sibling;
+  MAP_INDEX_ENTRY                   *Entries;   ///< Mappings whose device path ends here.
+};
+
+STATIC BOOLEAN          mMapIndexValid        = FALSE;
+STATIC BOOLEAN          mMapIndexHandlesValid = FALSE;
+STATIC MAP_INDEX_ENTRY  *mMapIndexEntries     = NULL;
+STATIC UINTN            mMapIndexCount        = 0;
+STATIC MAP_TRIE_NODE    *mMapIndexTrie        = NULL;
+STATIC MAP_INDEX_ENTRY  *mMapIndexNames[MAP_INDEX_HASH_BUCKETS];
+STATIC MAP_INDEX_ENTRY  *mMapIndexHandles[MAP_INDEX_HASH_BUCKETS];
 
 STATIC CONST CHAR8  Hex[] = {
   '0',
@@ -149,6 +277,28 @@ CommandInit (
   return (gUnicodeCollation == NULL) ? EFI_UNSUPPORTED : EFI_SUCCESS;
 }
 
+/**
+  Forget all devices behind the mappings.
+**/
+STATIC
+VOID
+MapDeviceFlush (
+  VOID
+  )
+{
+  SHELL_MAP_DEVICE  *Device;
+  UINTN             Index;
+
+  for (Index = 0; Index < MAP_DEVICE_HASH_BUCKETS; Index++) {
+    while (!IsListEmpty (&mMapDevices[Index])) {
+      Device = (SHELL_MAP_DEVICE *)GetFirstNode (&mMapDevices[Index]);
+      RemoveEntryList (&Device->Link);
+      SHELL_FREE_NON_NULL (Device->DevicePath);
+      FreePool (Device);
+    }
+  }
+}
+
 /**
   Constructor for the Shell Command library.
 
@@ -167,18 +317,32 @@ ShellCommandLibConstructor (
   )
 {
   EFI_STATUS  Status;
+  UINTN       Index;
 
   InitializeListHead (&gShellMapList.Link);
   InitializeListHead (&mCommandList.Link);
   InitializeListHead (&mAliasList.Link);
   InitializeListHead (&mScriptList.Link);
-  InitializeListHead (&mFileHandleList.Link);
-  mEchoState = TRUE;
+  for (Index = 0; Index < FILE_HANDLE_HASH_BUCKETS; Index++) {
+    InitializeListHead (&mFileHandleList[Index].Link);
+  }
+
+  for (Index = 0; Index < HII_STRING_HASH_BUCKETS; Index++) {
+    InitializeListHead (&mHiiStrings[Index]);
+  }
+
+  InitializeListHead (&mPendingCommandTables);
+
+  for (Index = 0; Index < MAP_DEVICE_HASH_BUCKETS; Index++) {
+    InitializeListHead (&mMapDevices[Index]);
+  }
+
+  mFileHandleCount = 0;
+  mEchoState       = TRUE;
 
   mExitRequested   = FALSE;
   mExitScript      = FALSE;
-  mProfileListSize = 0;
-  mProfileList     = NULL;
+  ShellStrBuilderInit (&mProfileList);
 
   Status = CommandInit ();
   if (EFI_ERROR (Status)) {
@@ -239,6 +403,8 @@ ShellCommandLibDestructor (
   ALIAS_LIST                         *Node2;
   SCRIPT_FILE_LIST                   *Node3;
   SHELL_MAP_LIST                     *MapNode;
+  SHELL_COMMAND_TABLE_LIST           *TableNode;
+  UINTN                              Index;
 
   //
   // enumerate throught the list and free all the memory
@@ -253,6 +419,12 @@ ShellCommandLibDestructor (
       );
   }
 
+  while (!IsListEmpty (&mPendingCommandTables)) {
+    TableNode = (SHELL_COMMAND_TABLE_LIST *)GetFirstNode (&mPendingCommandTables);
+    RemoveEntryList (&TableNode->Link);
+    FreePool (TableNode);
+  }
+
   //
   // enumerate through the alias list and free all memory
   //
@@ -295,13 +467,18 @@ ShellCommandLibDestructor (
     }
   }
 
-  if (!IsListEmpty (&mFileHandleList.Link)) {
-    FreeFileHandleList (&mFileHandleList);
+  for (Index = 0; Index < FILE_HANDLE_HASH_BUCKETS; Index++) {
+    if (!IsListEmpty (&mFileHandleList[Index].Link)) {
+      FreeFileHandleList (&mFileHandleList[Index]);
+    }
   }
 
-  if (mProfileList != NULL) {
-    FreePool (mProfileList);
-  }
+  mFileHandleCount = 0;
+
+  MapDeviceFlush ();
+  ShellCommandMapIndexInvalidate ();
+  ShellCommandFlushHiiStrings ();
+  ShellStrBuilderFree (&mProfileList);
 
   gUnicodeCollation = NULL;
   gShellCurMapping  = NULL;
@@ -310,31 +487,26 @@ ShellCommandLibDestructor (
 }
 
 /**
-  Find a dynamic command protocol instance given a command name string.
+  Find a dynamic command protocol instance on a list of handles.
 
-  @param CommandString  the command name string
+  @param[in] CommandHandleList  NULL terminated list of handles with the
+                                dynamic command protocol.
+  @param[in] CommandString      the command name string
 
   @return instance      the command protocol instance, if dynamic command instance found
   @retval NULL          no dynamic command protocol instance found for name
 **/
+STATIC
 CONST EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL *
-ShellCommandFindDynamicCommand (
-  IN CONST CHAR16  *CommandString
+FindDynamicCommandOnHandles (
+  IN CONST EFI_HANDLE  *CommandHandleList,
+  IN CONST CHAR16      *CommandString
   )
 {
   EFI_STATUS                          Status;
-  EFI_HANDLE                          *CommandHandleList;
-  EFI_HANDLE                          *NextCommand;
+  CONST EFI_HANDLE                    *NextCommand;
   EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL  *DynamicCommand;
 
-  CommandHandleList = GetHandleListByProtocol (&gEfiShellDynamicCommandProtocolGuid);
-  if (CommandHandleList == NULL) {
-    //
-    // not found or out of resources
-    //
-    return NULL;
-  }
-
   for (NextCommand = CommandHandleList; *NextCommand != NULL; NextCommand++) {
     Status = gBS->HandleProtocol (
                     *NextCommand,
@@ -353,15 +525,43 @@ ShellCommandFindDynamicCommand (
                              ) == 0
         )
     {
-      FreePool (CommandHandleList);
       return (DynamicCommand);
     }
   }
 
-  FreePool (CommandHandleList);
   return (NULL);
 }
 
+/**
+  Find a dynamic command protocol instance given a command name string.
+
+  @param CommandString  the command name string
+
+  @return instance      the command protocol instance, if dynamic command instance found
+  @retval NULL          no dynamic command protocol instance found for name
+**/
+CONST EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL *
+ShellCommandFindDynamicCommand (
+  IN CONST CHAR16  *CommandString
+  )
+{
+  EFI_HANDLE                                *CommandHandleList;
+  CONST EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL  *DynamicCommand;
+
+  CommandHandleList = GetHandleListByProtocol (&gEfiShellDynamicCommandProtocolGuid);
+  if (CommandHandleList == NULL) {
+    //
+    // not found or out of resources
+    //
+    return NULL;
+  }
+
+  DynamicCommand = FindDynamicCommandOnHandles (CommandHandleList, CommandString);
+
+  FreePool (CommandHandleList);
+  return (DynamicCommand);
+}
+
 /**
   Checks if a command exists as a dynamic command protocol instance
 
@@ -495,6 +695,10 @@ ShellCommandGetInternalCommandHelp (
                              ) == 0
         )
     {
+      if (Node->HiiHandle == NULL) {
+        CommandTablePublishHii (Node);
+      }
+
       return (HiiGetString (Node->HiiHandle, Node->ManFormatHelp, NULL));
     }
   }
@@ -527,6 +731,128 @@ ShellCommandGetCommandHelp (
   return HelpStr;
 }
 
+/**
+  Add a profile to the profile list if it is not on it yet.
+
+  @param[in] ProfileName    The profile name, may be empty.
+**/
+STATIC
+VOID
+CommandProfileAdd (
+  IN CONST CHAR16  *ProfileName
+  )
+{
+  if (  (StrLen (ProfileName) > 0)
+     && ((  (mProfileList.Buffer != NULL)
+         && (StrStr (mProfileList.Buffer, ProfileName) == NULL)) || (mProfileList.Buffer == NULL))
+        )
+  {
+    if (mProfileList.Buffer == NULL) {
+      //
+      // If this is the first make a leading ';'
+      //
+      ShellStrBuilderAppend (&mProfileList, L";", 0);
+    }
+
+    ShellStrBuilderAppend (&mProfileList, ProfileName, 0);
+    ShellStrBuilderAppend (&mProfileList, L";", 0);
+  }
+}
+
+/**
+  Publish the HII package of the command table a command was registered from,
+  if that has not happened yet.
+
+  All commands of the table get the published handle.  Their help string ids
+  are read from the table again, a table that builds its package when it is
+  published only knows them then.
+
+  @param[in, out] Command   The command, with a NULL HII handle.
+**/
+STATIC
+VOID
+CommandTablePublishHii (
+  IN OUT SHELL_COMMAND_INTERNAL_LIST_ENTRY  *Command
+  )
+{
+  SHELL_COMMAND_TABLE_LIST           *TableNode;
+  CONST SHELL_COMMAND_TABLE          *Table;
+  SHELL_COMMAND_INTERNAL_LIST_ENTRY  *Node;
+  EFI_HII_HANDLE                     HiiHandle;
+  UINTN                              Index;
+
+  for ( TableNode = (SHELL_COMMAND_TABLE_LIST *)GetFirstNode (&mPendingCommandTables)
+        ; !IsNull (&mPendingCommandTables, &TableNode->Link)
+        ; TableNode = (SHELL_COMMAND_TABLE_LIST *)GetNextNode (&mPendingCommandTables, &TableNode->Link)
+        )
+  {
+    Table = TableNode->Table;
+    for (Index = 0; Index < Table->CommandCount; Index++) {
+      if (Table->Commands[Index].CommandHandler == Command->CommandHandler) {
+        break;
+      }
+    }
+
+    if (Index == Table->CommandCount) {
+      continue;
+    }
+
+    //
+    // Publish only once, even if that fails.
+    //
+    RemoveEntryList (&TableNode->Link);
+    FreePool (TableNode);
+
+    HiiHandle = Table->PublishHii ();
+    if (HiiHandle == NULL) {
+      return;
+    }
+
+    for ( Node = (SHELL_COMMAND_INTERNAL_LIST_ENTRY *)GetFirstNode (&mCommandList.Link)
+          ; !IsNull (&mCommandList.Link, &Node->Link)
+          ; Node = (SHELL_COMMAND_INTERNAL_LIST_ENTRY *)GetNextNode (&mCommandList.Link, &Node->Link)
+          )
+    {
+      if (Node->HiiHandle != NULL) {
+        continue;
+      }
+
+      for (Index = 0; Index < Table->CommandCount; Index++) {
+        if (Table->Commands[Index].CommandHandler == Node->CommandHandler) {
+          Node->HiiHandle     = HiiHandle;
+          Node->ManFormatHelp = Table->Commands[Index].ManFormatHelp;
+          break;
+        }
+      }
+    }
+
+    return;
+  }
+}
+
+/**
+  Compare two command list entries by name, for PerformQuickSort().
+
+  @param[in] Buffer1    Pointer to the first SHELL_COMMAND_INTERNAL_LIST_ENTRY pointer.
+  @param[in] Buffer2    Pointer to the second SHELL_COMMAND_INTERNAL_LIST_ENTRY pointer.
+
+  @return               The StriColl() result for the two command names.
+**/
+STATIC
+INTN
+EFIAPI
+CommandNodeCompare (
+  IN CONST VOID  *Buffer1,
+  IN CONST VOID  *Buffer2
+  )
+{
+  return (gUnicodeCollation->StriColl (
+                               gUnicodeCollation,
+                               (*(SHELL_COMMAND_INTERNAL_LIST_ENTRY **)Buffer1)->CommandString,
+                               (*(SHELL_COMMAND_INTERNAL_LIST_ENTRY **)Buffer2)->CommandString
+                               ));
+}
+
 /**
   Registers handlers of type SHELL_RUN_COMMAND and
   SHELL_GET_MAN_FILENAME for each shell command.
@@ -641,22 +967,7 @@ ShellCommandRegisterCommandName (
   Node->HiiHandle      = HiiHandle;
   Node->ManFormatHelp  = ManFormatHelp;
 
-  if (  (StrLen (ProfileName) > 0)
-     && ((  (mProfileList != NULL)
-         && (StrStr (mProfileList, ProfileName) == NULL)) || (mProfileList == NULL))
-        )
-  {
-    ASSERT ((mProfileList == NULL && mProfileListSize == 0) || (mProfileList != NULL));
-    if (mProfileList == NULL) {
-      //
-      // If this is the first make a leading ';'
-      //
-      StrnCatGrow (&mProfileList, &mProfileListSize, L";", 0);
-    }
-
-    StrnCatGrow (&mProfileList, &mProfileListSize, ProfileName, 0);
-    StrnCatGrow (&mProfileList, &mProfileListSize, L";", 0);
-  }
+  CommandProfileAdd (ProfileName);
 
   //
   // Insert a new entry on top of the list
@@ -697,6 +1008,144 @@ ShellCommandRegisterCommandName (
   return (RETURN_SUCCESS);
 }
 
+/**
+  Register all commands of a command table.
+
+  Commands above the current support level, and commands that are already
+  registered or provided by a dynamic command, are skipped as
+  ShellCommandRegisterCommandName() would refuse them.  The HII package of the
+  table is published on first use of one of its commands.
+
+  @param[in] Table              The command table.
+
+  @retval RETURN_SUCCESS           The commands were registered.
+  @retval RETURN_OUT_OF_RESOURCES  There are not enough resources available;
+                                   no command of the table was registered.
+**/
+RETURN_STATUS
+EFIAPI
+ShellCommandRegisterCommandTable (
+  IN CONST SHELL_COMMAND_TABLE  *Table
+  )
+{
+  CONST SHELL_COMMAND_DESCRIPTOR     *Descriptor;
+  SHELL_COMMAND_INTERNAL_LIST_ENTRY  **NewNodes;
+  SHELL_COMMAND_INTERNAL_LIST_ENTRY  *Node;
+  SHELL_COMMAND_TABLE_LIST           *TableNode;
+  EFI_HANDLE                         *DynamicHandles;
+  LIST_ENTRY                         *Link;
+  UINTN                              Count;
+  UINTN                              Index;
+  INTN                               LexicalMatchValue;
+
+  ASSERT (Table != NULL);
+  ASSERT (Table->PublishHii != NULL);
+
+  if (Table->CommandCount == 0) {
+    return (RETURN_SUCCESS);
+  }
+
+  NewNodes  = AllocateZeroPool (Table->CommandCount * sizeof (SHELL_COMMAND_INTERNAL_LIST_ENTRY *));
+  TableNode = AllocateZeroPool (sizeof (SHELL_COMMAND_TABLE_LIST));
+  if ((NewNodes == NULL) || (TableNode == NULL)) {
+    SHELL_FREE_NON_NULL (NewNodes);
+    SHELL_FREE_NON_NULL (TableNode);
+    return (RETURN_OUT_OF_RESOURCES);
+  }
+
+  //
+  // Dynamic commands are rare, only look names up when some are installed.
+  //
+  DynamicHandles = GetHandleListByProtocol (&gEfiShellDynamicCommandProtocolGuid);
+
+  for (Index = 0, Count = 0; Index < Table->CommandCount; Index++) {
+    Descriptor = &Table->Commands[Index];
+    ASSERT (Descriptor->CommandString  != NULL);
+    ASSERT (Descriptor->GetManFileName != NULL);
+    ASSERT (Descriptor->CommandHandler != NULL);
+    ASSERT (Descriptor->ProfileName    != NULL);
+
+    if (PcdGet8 (PcdShellSupportLevel) < Descriptor->ShellMinSupportLevel) {
+      continue;
+    }
+
+    if ((DynamicHandles != NULL) && (FindDynamicCommandOnHandles (DynamicHandles, Descriptor->CommandString) != NULL)) {
+      continue;
+    }
+
+    Node = AllocateZeroPool (sizeof (SHELL_COMMAND_INTERNAL_LIST_ENTRY));
+    if (Node != NULL) {
+      Node->CommandString = AllocateCopyPool (StrSize (Descriptor->CommandString), Descriptor->CommandString);
+    }
+
+    if ((Node == NULL) || (Node->CommandString == NULL)) {
+      SHELL_FREE_NON_NULL (Node);
+      while (Count > 0) {
+        Count--;
+        FreePool (NewNodes[Count]->CommandString);
+        FreePool (NewNodes[Count]);
+      }
+
+      SHELL_FREE_NON_NULL (DynamicHandles);
+      FreePool (NewNodes);
+      FreePool (TableNode);
+      return (RETURN_OUT_OF_RESOURCES);
+    }
+
+    Node->GetManFileName = Descriptor->GetManFileName;
+    Node->CommandHandler = Descriptor->CommandHandler;
+    Node->LastError      = Descriptor->CanAffectLE;
+    Node->HiiHandle      = NULL;
+    Node->ManFormatHelp  = Descriptor->ManFormatHelp;
+    NewNodes[Count++]    = Node;
+    CommandProfileAdd (Descriptor->ProfileName);
+  }
+
+  SHELL_FREE_NON_NULL (DynamicHandles);
+
+  //
+  // Sort the new commands once, then merge them into the sorted command list
+  // in a single walk.  A name equal to its predecessor is already registered.
+  //
+  PerformQuickSort (NewNodes, Count, sizeof (SHELL_COMMAND_INTERNAL_LIST_ENTRY *), CommandNodeCompare);
+  Link = GetFirstNode (&mCommandList.Link);
+  for (Index = 0; Index < Count; Index++) {
+    Node              = NewNodes[Index];
+    LexicalMatchValue = 1;
+    while (!IsNull (&mCommandList.Link, Link)) {
+      LexicalMatchValue = gUnicodeCollation->StriColl (
+                                               gUnicodeCollation,
+                                               Node->CommandString,
+                                               ((SHELL_COMMAND_INTERNAL_LIST_ENTRY *)Link)->CommandString
+                                               );
+      if (LexicalMatchValue <= 0) {
+        break;
+      }
+
+      Link = GetNextNode (&mCommandList.Link, Link);
+    }
+
+    if (LexicalMatchValue == 0) {
+      FreePool (Node->CommandString);
+      FreePool (Node);
+      continue;
+    }
+
+    //
+    // Insert in front of Link, and compare the next command against this one.
+    //
+    InsertTailList (Link, &Node->Link);
+    Link = &Node->Link;
+  }
+
+  FreePool (NewNodes);
+
+  TableNode->Table = Table;
+  InsertTailList (&mPendingCommandTables, &TableNode->Link);
+
+  return (RETURN_SUCCESS);
+}
+
 /**
   Function to get the current Profile string.
 
@@ -709,7 +1158,7 @@ ShellCommandGetProfileList (
   VOID
   )
 {
-  return (mProfileList);
+  return (mProfileList.Buffer);
 }
 
 /**
@@ -768,6 +1217,10 @@ ShellCommandRunCommandHandler (
                              ) == 0
         )
     {
+      if (Node->HiiHandle == NULL) {
+        CommandTablePublishHii (Node);
+      }
+
       if (CanAffectLE != NULL) {
         *CanAffectLE = Node->LastError;
       }
@@ -841,6 +1294,10 @@ ShellCommandGetManFileNameHandler (
                              ) == 0
         )
     {
+      if (Node->HiiHandle == NULL) {
+        CommandTablePublishHii (Node);
+      }
+
       return (Node->GetManFileName ());
     }
   }
@@ -1243,141 +1700,1125 @@ ShellCommandSetNewScript (
 }
 
 /**
-  Function to generate the next default mapping name.
+  Hash a map name for the name index.
 
-  If the return value is not NULL then it must be callee freed.
+  Only ASCII letters are folded, matching MapIndexNameEqual().
 
-  @param Type                   What kind of mapping name to make.
+  @param[in] Name               The map name.
+  @param[in] Length             The number of characters to hash.
 
-  @retval NULL                  a memory allocation failed.
-  @return a new map name string
+  @return                       The bucket of the name.
 **/
-CHAR16 *
-EFIAPI
-ShellCommandCreateNewMappingName (
-  IN CONST SHELL_MAPPING_TYPE  Type
+STATIC
+UINTN
+MapIndexNameHash (
+  IN CONST CHAR16  *Name,
+  IN UINTN         Length
   )
 {
-  CHAR16  *String;
+  UINTN  Hash;
 
-  ASSERT (Type < MappingTypeMax);
+  for (Hash = 0; Length > 0; Name++, Length--) {
+    Hash = Hash * 31 + CharToUpper (*Name);
+  }
 
-  String = NULL;
+  return (Hash % MAP_INDEX_HASH_BUCKETS);
+}
 
-  String = AllocateZeroPool (PcdGet8 (PcdShellMapNameLength) * sizeof (String[0]));
-  if (String == NULL) {
-    return (NULL);
-  }
+/**
+  Compare two map names of the same length, ignoring the case of ASCII letters.
 
-  if (1 == _gfDEFAULT_UEFI_DRIVE_NAMING)
-  {
-      UnicodeSPrint(
-          String,
-          PcdGet8(PcdShellMapNameLength) * sizeof(String[0]),
-          Type == MappingTypeFileSystem ? L"FS%d:" : L"BLK%d:",
-          Type == MappingTypeFileSystem ? mFsMaxCount++ : mBlkMaxCount++
-      );
-  }
-  else
-  {
-      UnicodeSPrint(
-          String,
-          PcdGet8(PcdShellMapNameLength) * sizeof(String[0]),
-          Type == MappingTypeFileSystem ? L"%c:" : L"BLK%d:",
-          Type == MappingTypeFileSystem ? 'A' + mFsMaxCount++ : mBlkMaxCount++
-      );
+  @param[in] Name1              The first name.
+  @param[in] Name2              The second name.
+  @param[in] Length             The number of characters to compare.
+
+  @retval TRUE                  The names are equal.
+  @retval FALSE                 The names differ.
+**/
+STATIC
+BOOLEAN
+MapIndexNameEqual (
+  IN CONST CHAR16  *Name1,
+  IN CONST CHAR16  *Name2,
+  IN UINTN         Length
+  )
+{
+  for ( ; Length > 0; Name1++, Name2++, Length--) {
+    if (CharToUpper (*Name1) != CharToUpper (*Name2)) {
+      return (FALSE);
+    }
   }
-  return (String);
+
+  return (TRUE);
 }
 
 /**
-  Function to add a map node to the list of map items and update the "path" environment variable (optionally).
-
-  If Path is TRUE (during initialization only), the path environment variable will also be updated to include
-  default paths on the new map name...
+  Get the length of a map name without its trailing ':'.
 
-  Path should be FALSE when this function is called from the protocol SetMap function.
+  @param[in] Name               The map name.
 
-  @param[in] Name               The human readable mapped name.
+  @return                       The number of characters.
+**/
+STATIC
+UINTN
+MapIndexNameLength (
+  IN CONST CHAR16  *Name
+  )
+{
+  UINTN  Length;
+
+  Length = StrLen (Name);
+  if ((Length > 0) && (Name[Length - 1] == L':')) {
+    Length--;
+  }
+
+  return (Length);
+}
+
+/**
+  Count the nodes of a device path, the end node excluded.
+
+  @param[in] DevicePath         The device path, or NULL.
+
+  @return                       The number of nodes.
+**/
+STATIC
+UINTN
+MapIndexNodeCount (
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath
+  )
+{
+  UINTN  Count;
+
+  if (DevicePath == NULL) {
+    return (0);
+  }
+
+  for (Count = 0; !IsDevicePathEnd (DevicePath); Count++) {
+    if (DevicePathNodeLength (DevicePath) < sizeof (EFI_DEVICE_PATH_PROTOCOL)) {
+      break;
+    }
+
+    DevicePath = NextDevicePathNode (DevicePath);
+  }
+
+  return (Count);
+}
+
+/**
+  Find the child of a trie node for a device path node.
+
+  @param[in] Parent             The trie node.
+  @param[in] Key                The device path node.
+
+  @return                       The child, or NULL if there is none.
+**/
+STATIC
+MAP_TRIE_NODE *
+MapIndexTrieChild (
+  IN CONST MAP_TRIE_NODE             *Parent,
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *Key
+  )
+{
+  MAP_TRIE_NODE  *Child;
+  UINTN          Length;
+
+  Length = DevicePathNodeLength (Key);
+  for (Child = Parent->Child; Child != NULL; Child = Child->Sibling) {
+    if (  (DevicePathNodeLength (Child->Key) == Length)
+       && (CompareMem (Child->Key, Key, Length) == 0))
+    {
+      return (Child);
+    }
+  }
+
+  return (NULL);
+}
+
+/**
+  Free the mapping indexes.
+**/
+STATIC
+VOID
+MapIndexFree (
+  VOID
+  )
+{
+  SHELL_FREE_NON_NULL (mMapIndexEntries);
+  SHELL_FREE_NON_NULL (mMapIndexTrie);
+  mMapIndexCount        = 0;
+  mMapIndexValid        = FALSE;
+  mMapIndexHandlesValid = FALSE;
+}
+
+/**
+  Build the name index and the device path trie from gShellMapList.
+
+  @retval EFI_SUCCESS           The indexes are valid.
+  @retval EFI_OUT_OF_RESOURCES  There is not enough memory for the indexes.
+**/
+STATIC
+EFI_STATUS
+MapIndexBuild (
+  VOID
+  )
+{
+  SHELL_MAP_LIST                  *MapListItem;
+  MAP_INDEX_ENTRY                 *Entry;
+  MAP_TRIE_NODE                   *Node;
+  MAP_TRIE_NODE                   *Child;
+  CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  UINTN                           NodeCount;
+  UINTN                           TrieUsed;
+  UINTN                           Bucket;
+
+  MapIndexFree ();
+  ZeroMem (mMapIndexNames, sizeof (mMapIndexNames));
+  ZeroMem (mMapIndexHandles, sizeof (mMapIndexHandles));
+
+  NodeCount = 0;
+  for ( MapListItem = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
+        ; !IsNull (&gShellMapList.Link, &MapListItem->Link)
+        ; MapListItem = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &MapListItem->Link)
+        )
+  {
+    mMapIndexCount++;
+    NodeCount += MapIndexNodeCount (MapListItem->DevicePath);
+  }
+
+  mMapIndexEntries = AllocateZeroPool (MAX (mMapIndexCount, 1) * sizeof (MAP_INDEX_ENTRY));
+  mMapIndexTrie    = AllocateZeroPool ((NodeCount + 1) * sizeof (MAP_TRIE_NODE));
+  if ((mMapIndexEntries == NULL) || (mMapIndexTrie == NULL)) {
+    MapIndexFree ();
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  //
+  // The list is walked backwards and every entry is put at the head of its
+  // chains, which leaves the chains in list order.
+  //
+  TrieUsed = 1;
+  Entry    = mMapIndexEntries;
+  for ( MapListItem = (SHELL_MAP_LIST *)GetPreviousNode (&gShellMapList.Link, &gShellMapList.Link)
+        ; !IsNull (&gShellMapList.Link, &MapListItem->Link)
+        ; MapListItem = (SHELL_MAP_LIST *)GetPreviousNode (&gShellMapList.Link, &MapListItem->Link), Entry++
+        )
+  {
+    Entry->MapItem = MapListItem;
+    if (MapListItem->MapName != NULL) {
+      Entry->NameLength      = MapIndexNameLength (MapListItem->MapName);
+      Bucket                 = MapIndexNameHash (MapListItem->MapName, Entry->NameLength);
+      Entry->NextName        = mMapIndexNames[Bucket];
+      mMapIndexNames[Bucket] = Entry;
+    }
+
+    if (MapListItem->DevicePath == NULL) {
+      continue;
+    }
+
+    Node = mMapIndexTrie;
+    for ( DevicePath = MapListItem->DevicePath
+          ; !IsDevicePathEnd (DevicePath) && (DevicePathNodeLength (DevicePath) >= sizeof (EFI_DEVICE_PATH_PROTOCOL))
+          ; DevicePath = NextDevicePathNode (DevicePath)
+          )
+    {
+      Child = MapIndexTrieChild (Node, DevicePath);
+      if (Child == NULL) {
+        Child          = &mMapIndexTrie[TrieUsed++];
+        Child->Key     = DevicePath;
+        Child->Sibling = Node->Child;
+        Node->Child    = Child;
+      }
+
+      Node = Child;
+    }
+
+    Entry->NextPath = Node->Entries;
+    Node->Entries   = Entry;
+  }
+
+  mMapIndexValid = TRUE;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Resolve the SimpleFileSystem handle of every mapping and build the handle
+  index.
+**/
+STATIC
+VOID
+MapIndexResolveHandles (
+  VOID
+  )
+{
+  MAP_INDEX_ENTRY           *Entry;
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  UINTN                     Bucket;
+
+  for (Entry = mMapIndexEntries; Entry < mMapIndexEntries + mMapIndexCount; Entry++) {
+    DevicePath = Entry->MapItem->DevicePath;
+    if (  (DevicePath == NULL)
+       || EFI_ERROR (gBS->LocateDevicePath (&gEfiSimpleFileSystemProtocolGuid, &DevicePath, &Entry->FileSystem)))
+    {
+      Entry->FileSystem = NULL;
+      continue;
+    }
+
+    Bucket                   = ((UINTN)Entry->FileSystem >> 4) % MAP_INDEX_HASH_BUCKETS;
+    Entry->NextHandle        = mMapIndexHandles[Bucket];
+    mMapIndexHandles[Bucket] = Entry;
+  }
+
+  mMapIndexHandlesValid = TRUE;
+}
+
+/**
+  Drop the mapping indexes.  They are built again on next use.
+**/
+VOID
+EFIAPI
+ShellCommandMapIndexInvalidate (
+  VOID
+  )
+{
+  MapIndexFree ();
+}
+
+/**
+  Find a mapping by name.
+
+  @param[in] Name               The map name, with or without the trailing ':'.
+
+  @return                       The mapping, or NULL if there is none.
+**/
+SHELL_MAP_LIST *
+EFIAPI
+ShellCommandFindMapItemByName (
+  IN CONST CHAR16  *Name
+  )
+{
+  MAP_INDEX_ENTRY  *Entry;
+  UINTN            Length;
+
+  if ((Name == NULL) || (!mMapIndexValid && EFI_ERROR (MapIndexBuild ()))) {
+    return (NULL);
+  }
+
+  Length = MapIndexNameLength (Name);
+  for (Entry = mMapIndexNames[MapIndexNameHash (Name, Length)]; Entry != NULL; Entry = Entry->NextName) {
+    if ((Entry->NameLength == Length) && MapIndexNameEqual (Entry->MapItem->MapName, Name, Length)) {
+      return (Entry->MapItem);
+    }
+  }
+
+  return (NULL);
+}
+
+/**
+  Determine if a given map name exists and return its mapping.
+
+  @param[in] MapKey             The map name, including the trailing ':'.
+
+  @retval NULL                  The mapping was not found.
+  @return                       The SHELL_MAP_LIST for the mapping.
+**/
+SHELL_MAP_LIST *
+EFIAPI
+ShellCommandFindMapItem (
+  IN CONST CHAR16  *MapKey
+  )
+{
+  UINTN  Length;
+
+  if (MapKey == NULL) {
+    return (NULL);
+  }
+
+  Length = StrLen (MapKey);
+  if ((Length == 0) || (MapKey[Length - 1] != L':')) {
+    return (NULL);
+  }
+
+  return (ShellCommandFindMapItemByName (MapKey));
+}
+
+/**
+  Get the names of all mappings of a device path.
+
+  @param[in] DevicePath         The device path.  It must match the device
+                                path of a mapping node for node.
+
+  @return                       The pool allocated, semicolon separated map
+                                names in list order, or NULL if the device
+                                path has no mapping.
+**/
+CHAR16 *
+EFIAPI
+ShellCommandGetMapNamesFromDevicePath (
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath
+  )
+{
+  MAP_TRIE_NODE         *Node;
+  MAP_INDEX_ENTRY       *Entry;
+  SHELL_STRING_BUILDER  Builder;
+
+  if ((DevicePath == NULL) || (!mMapIndexValid && EFI_ERROR (MapIndexBuild ()))) {
+    return (NULL);
+  }
+
+  for ( Node = mMapIndexTrie
+        ; (Node != NULL) && !IsDevicePathEnd (DevicePath) && (DevicePathNodeLength (DevicePath) >= sizeof (EFI_DEVICE_PATH_PROTOCOL))
+        ; DevicePath = NextDevicePathNode (DevicePath)
+        )
+  {
+    Node = MapIndexTrieChild (Node, DevicePath);
+  }
+
+  if ((Node == NULL) || (Node->Entries == NULL)) {
+    return (NULL);
+  }
+
+  ShellStrBuilderInit (&Builder);
+  for (Entry = Node->Entries; Entry != NULL; Entry = Entry->NextPath) {
+    if (Builder.Length != 0) {
+      ShellStrBuilderAppend (&Builder, L";", 0);
+    }
+
+    ShellStrBuilderAppend (&Builder, Entry->MapItem->MapName, 0);
+  }
+
+  return (ShellStrBuilderFinalize (&Builder));
+}
+
+/**
+  Find the first mapping, in list order, whose device path resolves to a
+  SimpleFileSystem handle.
+
+  @param[in] Handle             The SimpleFileSystem handle.
+
+  @return                       The mapping, or NULL if there is none.
+**/
+SHELL_MAP_LIST *
+EFIAPI
+ShellCommandFindMapItemByFileSystem (
+  IN EFI_HANDLE  Handle
+  )
+{
+  MAP_INDEX_ENTRY  *Entry;
+
+  if ((Handle == NULL) || (!mMapIndexValid && EFI_ERROR (MapIndexBuild ()))) {
+    return (NULL);
+  }
+
+  if (!mMapIndexHandlesValid) {
+    MapIndexResolveHandles ();
+  }
+
+  for (Entry = mMapIndexHandles[((UINTN)Handle >> 4) % MAP_INDEX_HASH_BUCKETS]; Entry != NULL; Entry = Entry->NextHandle) {
+    if (Entry->FileSystem == Handle) {
+      return (Entry->MapItem);
+    }
+  }
+
+  return (NULL);
+}
+
+/**
+  Find the lowest number n for which the default map name "<Prefix>n:" is not
+  in use.
+
+  @param[in] Prefix             The name prefix, "FS" or "BLK".
+
+  @return                       The number.
+**/
+STATIC
+UINTN
+MapNameLowestFreeNumber (
+  IN CONST CHAR16  *Prefix
+  )
+{
+  SHELL_MAP_LIST  *MapListNode;
+  CONST CHAR16    *Walker;
+  UINT64          Used;
+  UINTN           Number;
+  UINTN           Next;
+  UINTN           PrefixLength;
+
+  Used         = 0;
+  Next         = 0;
+  PrefixLength = StrLen (Prefix);
+  for ( MapListNode = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
+        ; !IsNull (&gShellMapList.Link, &MapListNode->Link)
+        ; MapListNode = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &MapListNode->Link)
+        )
+  {
+    if ((MapListNode->MapName == NULL) || (StrnCmp (MapListNode->MapName, Prefix, PrefixLength) != 0)) {
+      continue;
+    }
+
+    Walker = MapListNode->MapName + PrefixLength;
+    if ((*Walker < L'0') || (*Walker > L'9')) {
+      continue;
+    }
+
+    for (Number = 0; (*Walker >= L'0') && (*Walker <= L'9'); Walker++) {
+      Number = Number * 10 + (*Walker - L'0');
+    }
+
+    if ((Walker[0] != L':') || (Walker[1] != CHAR_NULL)) {
+      continue;
+    }
+
+    if (Number < 64) {
+      Used |= LShiftU64 (1, Number);
+    }
+
+    Next = MAX (Next, Number + 1);
+  }
+
+  for (Number = 0; Number < 64; Number++) {
+    if ((Used & LShiftU64 (1, Number)) == 0) {
+      return (Number);
+    }
+  }
+
+  return (Next);
+}
+
+/**
+  Find the lowest drive letter X for which the map name "X:" is not in use.
+
+  @retval CHAR_NULL             All letters are in use.
+  @return                       The letter.
+**/
+STATIC
+CHAR16
+MapNameLowestFreeLetter (
+  VOID
+  )
+{
+  SHELL_MAP_LIST  *MapListNode;
+  CHAR16          Letter;
+  UINT32          Used;
+
+  Used = 0;
+  for ( MapListNode = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
+        ; !IsNull (&gShellMapList.Link, &MapListNode->Link)
+        ; MapListNode = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &MapListNode->Link)
+        )
+  {
+    if ((MapListNode->MapName == NULL) || (MapListNode->MapName[0] == CHAR_NULL)) {
+      continue;
+    }
+
+    if ((MapListNode->MapName[1] != L':') || (MapListNode->MapName[2] != CHAR_NULL)) {
+      continue;
+    }
+
+    Letter = MapListNode->MapName[0];
+    if ((Letter >= L'a') && (Letter <= L'z')) {
+      Letter = Letter - L'a' + L'A';
+    }
+
+    if ((Letter >= L'A') && (Letter <= L'Z')) {
+      Used |= 1u << (Letter - L'A');
+    }
+  }
+
+  for (Letter = L'A'; Letter <= L'Z'; Letter++) {
+    if ((Used & (1u << (Letter - L'A'))) == 0) {
+      return (Letter);
+    }
+  }
+
+  return (CHAR_NULL);
+}
+
+/**
+  Function to generate the next default mapping name.
+
+  The lowest name not in gShellMapList is used, so the names of removed
+  devices are given out again: a device that is removed and arrives again,
+  any number of times, gets back the same letter or number if no other device
+  took it in between.  When all drive letters A: to Z: are in use, file
+  systems are named FSn: instead.
+
+  If the return value is not NULL then it must be callee freed.
+
+  @param Type                   What kind of mapping name to make.
+
+  @retval NULL                  a memory allocation failed.
+  @return a new map name string
+**/
+CHAR16 *
+EFIAPI
+ShellCommandCreateNewMappingName (
+  IN CONST SHELL_MAPPING_TYPE  Type
+  )
+{
+  CHAR16  *String;
+  CHAR16  Letter;
+
+  ASSERT (Type < MappingTypeMax);
+
+  String = NULL;
+
+  String = AllocateZeroPool (PcdGet8 (PcdShellMapNameLength) * sizeof (String[0]));
+  if (String == NULL) {
+    return (NULL);
+  }
+
+  Letter = CHAR_NULL;
+  if ((Type == MappingTypeFileSystem) && (1 != _gfDEFAULT_UEFI_DRIVE_NAMING)) {
+    Letter = MapNameLowestFreeLetter ();
+  }
+
+  if (Letter != CHAR_NULL)
+  {
+      UnicodeSPrint(
+          String,
+          PcdGet8(PcdShellMapNameLength) * sizeof(String[0]),
+          L"%c:",
+          Letter
+      );
+  }
+  else
+  {
+      UnicodeSPrint(
+          String,
+          PcdGet8(PcdShellMapNameLength) * sizeof(String[0]),
+          Type == MappingTypeFileSystem ? L"FS%Lu:" : L"BLK%Lu:",
+          (UINT64)MapNameLowestFreeNumber (Type == MappingTypeFileSystem ? L"FS" : L"BLK")
+      );
+  }
+  return (String);
+}
+
+/**
+  Function to add a map node to the list of map items and update the "path" environment variable (optionally).
+
+  If Path is TRUE (during initialization only), the path environment variable will also be updated to include
+  default paths on the new map name...
+
+  Path should be FALSE when this function is called from the protocol SetMap function.
+
+  @param[in] Name               The human readable mapped name.
   @param[in] DevicePath         The Device Path for this map.
   @param[in] Flags              The Flags attribute for this map item.
   @param[in] Path               TRUE to update path, FALSE to skip this step (should only be TRUE during initialization).
 
-  @retval EFI_SUCCESS           The addition was successful.
-  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
-  @retval EFI_INVALID_PARAMETER A parameter was invalid.
+  @retval EFI_SUCCESS           The addition was successful.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval EFI_INVALID_PARAMETER A parameter was invalid.
+**/
+EFI_STATUS
+EFIAPI
+ShellCommandAddMapItemAndUpdatePath (
+  IN CONST CHAR16                    *Name,
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  IN CONST UINT64                    Flags,
+  IN CONST BOOLEAN                   Path
+  )
+{
+  EFI_STATUS            Status;
+  SHELL_MAP_LIST        *MapListNode;
+  CONST CHAR16          *OriginalPath;
+  SHELL_STRING_BUILDER  NewPath;
+
+  OriginalPath = NULL;
+  Status       = EFI_SUCCESS;
+
+  MapListNode = AllocateZeroPool (sizeof (SHELL_MAP_LIST));
+  if (MapListNode == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+  } else {
+    MapListNode->Flags      = Flags;
+    MapListNode->MapName    = AllocateCopyPool (StrSize (Name), Name);
+    MapListNode->DevicePath = DuplicateDevicePath (DevicePath);
+    if ((MapListNode->MapName == NULL) || (MapListNode->DevicePath == NULL)) {
+      Status = EFI_OUT_OF_RESOURCES;
+    } else {
+      InsertTailList (&gShellMapList.Link, &MapListNode->Link);
+      ShellCommandMapIndexInvalidate ();
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    if (MapListNode != NULL) {
+      if (MapListNode->DevicePath != NULL) {
+        FreePool (MapListNode->DevicePath);
+      }
+
+      if (MapListNode->MapName != NULL) {
+        FreePool (MapListNode->MapName);
+      }
+
+      FreePool (MapListNode);
+    }
+  } else if (Path) {
+    //
+    // Since there was no error and Path was TRUE
+    // Now add the correct path for that mapping
+    //
+    OriginalPath = gEfiShellProtocol->GetEnv (L"path");
+    ShellStrBuilderInit (&NewPath);
+    //
+    // one allocation: the fixed parts below add up to 24 characters
+    //
+    ShellStrBuilderReserve (
+      &NewPath,
+      (OriginalPath == NULL ? 0 : StrLen (OriginalPath) + 1) + 3 * StrLen (Name) + 24
+      );
+    if (OriginalPath != NULL) {
+      ShellStrBuilderAppend (&NewPath, OriginalPath, 0);
+      ShellStrBuilderAppend (&NewPath, L";", 0);
+    }
+
+    ShellStrBuilderAppend (&NewPath, Name, 0);
+    ShellStrBuilderAppend (&NewPath, L"\\efi\\tools\\;", 0);
+    ShellStrBuilderAppend (&NewPath, Name, 0);
+    ShellStrBuilderAppend (&NewPath, L"\\efi\\boot\\;", 0);
+    ShellStrBuilderAppend (&NewPath, Name, 0);
+    Status = ShellStrBuilderAppend (&NewPath, L"\\", 0);
+    if (EFI_ERROR (Status)) {
+      return (Status);
+    }
+
+    Status = gEfiShellProtocol->SetEnv (L"path", NewPath.Buffer, TRUE);
+    ASSERT_EFI_ERROR (Status);
+    ShellStrBuilderFree (&NewPath);
+  }
+
+  return (Status);
+}
+
+/**
+  Hash a device path for the map name cache.
+
+  @param[in] DevicePath         The device path.
+  @param[in] Size               The size of the device path in bytes.
+
+  @return                       The hash.
+**/
+STATIC
+UINT64
+MapCacheHash (
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  IN UINTN                           Size
+  )
+{
+  CONST UINT8  *Byte;
+  UINT64       Hash;
+
+  Hash = 0xCBF29CE484222325ULL;
+  for (Byte = (CONST UINT8 *)DevicePath; Size > 0; Byte++, Size--) {
+    Hash = (Hash ^ *Byte) * 0x100000001B3ULL;
+  }
+
+  return (Hash);
+}
+
+/**
+  Look up the consistent name of a device path in the map name cache.
+
+  @param[in] Cache              The contents of the cache variable.
+  @param[in] CacheSize          The size of Cache in bytes.
+  @param[in] DevicePath         The device path.
+  @param[out] Name              The pool allocated consistent name, or NULL if
+                                the device has none.
+
+  @retval TRUE                  The device path was found in the cache.
+  @retval FALSE                 The device path is not in the cache.
+**/
+STATIC
+BOOLEAN
+MapCacheFind (
+  IN CONST UINT8                     *Cache,
+  IN UINTN                           CacheSize,
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  OUT CHAR16                         **Name
+  )
+{
+  MAP_CACHE_RECORD  Record;
+  UINTN             PathSize;
+  UINT64            PathHash;
+  UINTN             Offset;
+
+  PathSize = GetDevicePathSize (DevicePath);
+  PathHash = MapCacheHash (DevicePath, PathSize);
+
+  for (Offset = 0; Offset + sizeof (Record) <= CacheSize; Offset += sizeof (Record) + Record.NameSize) {
+    CopyMem (&Record, Cache + Offset, sizeof (Record));
+    if (  (Offset + sizeof (Record) + Record.NameSize > CacheSize)
+       || ((Record.NameSize % sizeof (CHAR16)) != 0))
+    {
+      break;
+    }
+
+    if ((Record.PathHash != PathHash) || (Record.PathSize != PathSize)) {
+      continue;
+    }
+
+    *Name = NULL;
+    if (Record.NameSize > sizeof (CHAR16)) {
+      *Name = AllocateCopyPool (Record.NameSize, Cache + Offset + sizeof (Record));
+      if (*Name == NULL) {
+        return (FALSE);
+      }
+
+      (*Name)[Record.NameSize / sizeof (CHAR16) - 1] = CHAR_NULL;
+    }
+
+    return (TRUE);
+  }
+
+  return (FALSE);
+}
+
+/**
+  Count the records in the map name cache.
+
+  @param[in] Cache              The contents of the cache variable.
+  @param[in] CacheSize          The size of Cache in bytes.
+
+  @return                       The number of records.
+**/
+STATIC
+UINTN
+MapCacheCount (
+  IN CONST UINT8  *Cache,
+  IN UINTN        CacheSize
+  )
+{
+  MAP_CACHE_RECORD  Record;
+  UINTN             Offset;
+  UINTN             Count;
+
+  Count = 0;
+  for (Offset = 0; Offset + sizeof (Record) <= CacheSize; Offset += sizeof (Record) + Record.NameSize) {
+    CopyMem (&Record, Cache + Offset, sizeof (Record));
+    if (Offset + sizeof (Record) + Record.NameSize > CacheSize) {
+      break;
+    }
+
+    Count++;
+  }
+
+  return (Count);
+}
+
+/**
+  Write the map name cache if it differs from what the variable holds.
+
+  @param[in] DevicePathList     The sorted device paths of all file systems.
+  @param[in] Names              The consistent name of each device path.
+  @param[in] Count              The number of device paths.
+  @param[in] OldCache           The contents of the cache variable, or NULL.
+  @param[in] OldCacheSize       The size of OldCache in bytes.
+**/
+STATIC
+VOID
+MapCacheSave (
+  IN EFI_DEVICE_PATH_PROTOCOL  **DevicePathList,
+  IN CHAR16                    **Names,
+  IN UINTN                     Count,
+  IN CONST UINT8               *OldCache OPTIONAL,
+  IN UINTN                     OldCacheSize
+  )
+{
+  MAP_CACHE_RECORD  Record;
+  UINT8             *Cache;
+  UINTN             CacheSize;
+  UINTN             Offset;
+  UINTN             Index;
+
+  CacheSize = 0;
+  for (Index = 0; Index < Count; Index++) {
+    if (DevicePathList[Index] != NULL) {
+      CacheSize += sizeof (Record) + ((Names[Index] == NULL) ? 0 : StrSize (Names[Index]));
+    }
+  }
+
+  if (CacheSize == 0) {
+    if (OldCacheSize != 0) {
+      gST->RuntimeServices->SetVariable (MAP_CACHE_VARIABLE, &gToroShellVariableGuid, 0, 0, NULL);
+    }
+
+    return;
+  }
+
+  Cache = AllocatePool (CacheSize);
+  if (Cache == NULL) {
+    return;
+  }
+
+  for (Index = 0, Offset = 0; Index < Count; Index++) {
+    if (DevicePathList[Index] == NULL) {
+      continue;
+    }
+
+    Record.PathSize = (UINT16)GetDevicePathSize (DevicePathList[Index]);
+    Record.PathHash = MapCacheHash (DevicePathList[Index], Record.PathSize);
+    Record.NameSize = (UINT16)((Names[Index] == NULL) ? 0 : StrSize (Names[Index]));
+    CopyMem (Cache + Offset, &Record, sizeof (Record));
+    CopyMem (Cache + Offset + sizeof (Record), Names[Index], Record.NameSize);
+    Offset += sizeof (Record) + Record.NameSize;
+  }
+
+  if ((CacheSize != OldCacheSize) || (CompareMem (Cache, OldCache, CacheSize) != 0)) {
+    gST->RuntimeServices->SetVariable (
+                            MAP_CACHE_VARIABLE,
+                            &gToroShellVariableGuid,
+                            EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                            CacheSize,
+                            Cache
+                            );
+  }
+
+  FreePool (Cache);
+}
+
+/**
+  Get the consistent map names of a list of file system device paths.
+
+  Names of devices found in the map name cache are taken from it.  Only if a
+  device is missing is the consistent mapping table built, and only the
+  missing names are generated, unless one of them collides with a cached name:
+  then the cache is stale and all names are generated again.
+
+  Consistent names number the devices of a kind in order, so they shift when a
+  device goes away.  The cache is therefore only used when every cached device
+  is still present, and only for the first update of a boot; later updates,
+  such as map -r, generate all names.
+
+  @param[in] DevicePathList     The sorted device paths.
+  @param[in] Count              The number of device paths.
+  @param[in] UpdateCache        TRUE if DevicePathList holds all file systems
+                                and the cache is to be updated to them.
+
+  @return                       An array of Count pool allocated names, an
+                                entry is NULL if the device has no consistent
+                                name.  Free with MapCacheFreeNames().  NULL if
+                                out of resources.
+**/
+STATIC
+CHAR16 **
+MapCacheGetConsistNames (
+  IN EFI_DEVICE_PATH_PROTOCOL  **DevicePathList,
+  IN UINTN                     Count,
+  IN BOOLEAN                   UpdateCache
+  )
+{
+  CHAR16                    **Names;
+  BOOLEAN                   *Known;
+  UINT8                     *Cache;
+  UINTN                     CacheSize;
+  EFI_DEVICE_PATH_PROTOCOL  **ConsistMappingTable;
+  UINTN                     Index;
+  UINTN                     Other;
+  UINTN                     Misses;
+  UINTN                     Hits;
+  BOOLEAN                   Collision;
+
+  Names = AllocateZeroPool (Count * sizeof (CHAR16 *));
+  Known = AllocateZeroPool (Count * sizeof (BOOLEAN));
+  if ((Names == NULL) || (Known == NULL)) {
+    SHELL_FREE_NON_NULL (Names);
+    SHELL_FREE_NON_NULL (Known);
+    return (NULL);
+  }
+
+  Cache     = NULL;
+  CacheSize = 0;
+  if (EFI_ERROR (GetVariable2 (MAP_CACHE_VARIABLE, &gToroShellVariableGuid, (VOID **)&Cache, &CacheSize))) {
+    Cache     = NULL;
+    CacheSize = 0;
+  }
+
+  Misses = 0;
+  Hits   = 0;
+  for (Index = 0; Index < Count; Index++) {
+    if (!mMapCacheUsed && (Cache != NULL) && (DevicePathList[Index] != NULL)) {
+      Known[Index] = MapCacheFind (Cache, CacheSize, DevicePathList[Index], &Names[Index]);
+    }
+
+    if (Known[Index]) {
+      Hits++;
+    } else {
+      Misses++;
+    }
+  }
+
+  if ((Hits > 0) && (Hits < MapCacheCount (Cache, CacheSize))) {
+    //
+    // A cached device is gone, the names after it have moved.
+    //
+    for (Index = 0; Index < Count; Index++) {
+      SHELL_FREE_NON_NULL (Names[Index]);
+      Known[Index] = FALSE;
+    }
+
+    Misses = Count;
+  }
+
+  if ((Misses > 0) && !EFI_ERROR (ShellCommandConsistMappingInitialize (&ConsistMappingTable))) {
+    Collision = FALSE;
+    for (Index = 0; Index < Count; Index++) {
+      if (Known[Index] || (DevicePathList[Index] == NULL)) {
+        continue;
+      }
+
+      Names[Index] = ShellCommandConsistMappingGenMappingName (DevicePathList[Index], ConsistMappingTable);
+      for (Other = 0; Names[Index] != NULL && Other < Count; Other++) {
+        if (Known[Other] && (Names[Other] != NULL) && (StrCmp (Names[Other], Names[Index]) == 0)) {
+          Collision = TRUE;
+        }
+      }
+    }
+
+    if (Collision) {
+      for (Index = 0; Index < Count; Index++) {
+        if (Known[Index]) {
+          SHELL_FREE_NON_NULL (Names[Index]);
+          Names[Index] = ShellCommandConsistMappingGenMappingName (DevicePathList[Index], ConsistMappingTable);
+        }
+      }
+    }
+
+    ShellCommandConsistMappingUnInitialize (ConsistMappingTable);
+  }
+
+  if (UpdateCache) {
+    MapCacheSave (DevicePathList, Names, Count, Cache, CacheSize);
+    mMapCacheUsed = TRUE;
+  }
+
+  SHELL_FREE_NON_NULL (Cache);
+  FreePool (Known);
+  return (Names);
+}
+
+/**
+  Free the names returned by MapCacheGetConsistNames().
+
+  @param[in] Names              The names.
+  @param[in] Count              The number of names.
 **/
-EFI_STATUS
-EFIAPI
-ShellCommandAddMapItemAndUpdatePath (
-  IN CONST CHAR16                    *Name,
-  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
-  IN CONST UINT64                    Flags,
-  IN CONST BOOLEAN                   Path
+STATIC
+VOID
+MapCacheFreeNames (
+  IN CHAR16  **Names,
+  IN UINTN   Count
   )
 {
-  EFI_STATUS      Status;
-  SHELL_MAP_LIST  *MapListNode;
-  CONST CHAR16    *OriginalPath;
-  CHAR16          *NewPath;
-  UINTN           NewPathSize;
+  UINTN  Index;
 
-  NewPathSize  = 0;
-  NewPath      = NULL;
-  OriginalPath = NULL;
-  Status       = EFI_SUCCESS;
+  for (Index = 0; Index < Count; Index++) {
+    SHELL_FREE_NON_NULL (Names[Index]);
+  }
 
-  MapListNode = AllocateZeroPool (sizeof (SHELL_MAP_LIST));
-  if (MapListNode == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-  } else {
-    MapListNode->Flags      = Flags;
-    MapListNode->MapName    = AllocateCopyPool (StrSize (Name), Name);
-    MapListNode->DevicePath = DuplicateDevicePath (DevicePath);
-    if ((MapListNode->MapName == NULL) || (MapListNode->DevicePath == NULL)) {
-      Status = EFI_OUT_OF_RESOURCES;
-    } else {
-      InsertTailList (&gShellMapList.Link, &MapListNode->Link);
+  FreePool (Names);
+}
+
+/**
+  Find the device record of a handle.
+
+  @param[in] Handle             The handle.
+
+  @return                       The device record, or NULL if there is none.
+**/
+STATIC
+SHELL_MAP_DEVICE *
+MapDeviceFind (
+  IN EFI_HANDLE  Handle
+  )
+{
+  LIST_ENTRY        *Bucket;
+  SHELL_MAP_DEVICE  *Device;
+
+  Bucket = &mMapDevices[MAP_DEVICE_HASH (Handle)];
+  for ( Device = (SHELL_MAP_DEVICE *)GetFirstNode (Bucket)
+        ; !IsNull (Bucket, &Device->Link)
+        ; Device = (SHELL_MAP_DEVICE *)GetNextNode (Bucket, &Device->Link)
+        )
+  {
+    if (Device->Handle == Handle) {
+      return (Device);
     }
   }
 
-  if (EFI_ERROR (Status)) {
-    if (MapListNode != NULL) {
-      if (MapListNode->DevicePath != NULL) {
-        FreePool (MapListNode->DevicePath);
-      }
+  return (NULL);
+}
 
-      if (MapListNode->MapName != NULL) {
-        FreePool (MapListNode->MapName);
-      }
+/**
+  Find or create the device record of a handle.
 
-      FreePool (MapListNode);
-    }
-  } else if (Path) {
-    //
-    // Since there was no error and Path was TRUE
-    // Now add the correct path for that mapping
-    //
-    OriginalPath = gEfiShellProtocol->GetEnv (L"path");
-    ASSERT ((NewPath == NULL && NewPathSize == 0) || (NewPath != NULL));
-    if (OriginalPath != NULL) {
-      StrnCatGrow (&NewPath, &NewPathSize, OriginalPath, 0);
-      StrnCatGrow (&NewPath, &NewPathSize, L";", 0);
-    }
+  @param[in] Handle             The handle.
+
+  @return                       The device record, or NULL if the handle has
+                                no device path or out of resources.
+**/
+STATIC
+SHELL_MAP_DEVICE *
+MapDeviceGet (
+  IN EFI_HANDLE  Handle
+  )
+{
+  SHELL_MAP_DEVICE          *Device;
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
 
-    StrnCatGrow (&NewPath, &NewPathSize, Name, 0);
-    StrnCatGrow (&NewPath, &NewPathSize, L"\\efi\\tools\\;", 0);
-    StrnCatGrow (&NewPath, &NewPathSize, Name, 0);
-    StrnCatGrow (&NewPath, &NewPathSize, L"\\efi\\boot\\;", 0);
-    StrnCatGrow (&NewPath, &NewPathSize, Name, 0);
-    StrnCatGrow (&NewPath, &NewPathSize, L"\\", 0);
+  Device = MapDeviceFind (Handle);
+  if (Device != NULL) {
+    return (Device);
+  }
 
-    Status = gEfiShellProtocol->SetEnv (L"path", NewPath, TRUE);
-    ASSERT_EFI_ERROR (Status);
-    FreePool (NewPath);
+  DevicePath = DevicePathFromHandle (Handle);
+  if (DevicePath == NULL) {
+    return (NULL);
   }
 
-  return (Status);
+  Device = AllocateZeroPool (sizeof (SHELL_MAP_DEVICE));
+  if (Device == NULL) {
+    return (NULL);
+  }
+
+  Device->Handle     = Handle;
+  Device->DevicePath = DuplicateDevicePath (DevicePath);
+  if (Device->DevicePath == NULL) {
+    FreePool (Device);
+    return (NULL);
+  }
+
+  InsertTailList (&mMapDevices[MAP_DEVICE_HASH (Handle)], &Device->Link);
+  return (Device);
+}
+
+/**
+  Remember the handle behind a device that was just mapped.
+
+  @param[in] Handle             The handle.
+  @param[in] FileSystem         TRUE if the handle was mapped as a file system,
+                                FALSE if as a block device.
+**/
+STATIC
+VOID
+MapDeviceRecord (
+  IN EFI_HANDLE  Handle,
+  IN BOOLEAN     FileSystem
+  )
+{
+  SHELL_MAP_DEVICE  *Device;
+
+  Device = MapDeviceGet (Handle);
+  if (Device == NULL) {
+    return;
+  }
+
+  if (FileSystem) {
+    gBS->HandleProtocol (Handle, &gEfiSimpleFileSystemProtocolGuid, &Device->FileSystem);
+  } else {
+    gBS->HandleProtocol (Handle, &gEfiBlockIoProtocolGuid, &Device->BlockIo);
+  }
 }
 
 /**
@@ -1408,25 +2849,22 @@ ShellCommandCreateInitialMappingsAndPaths (
   UINTN                     Count;
   EFI_DEVICE_PATH_PROTOCOL  **DevicePathList;
   CHAR16                    *NewDefaultName;
-  CHAR16                    *NewConsistName;
-  EFI_DEVICE_PATH_PROTOCOL  **ConsistMappingTable;
+  CHAR16                    **ConsistNames;
+  UINTN                     NameCount;
   SHELL_MAP_LIST            *MapListNode;
   CONST CHAR16              *CurDir;
   CHAR16                    *SplitCurDir;
   CHAR16                    *MapName;
   SHELL_MAP_LIST            *MapListItem;
 
-  ConsistMappingTable = NULL;
-  SplitCurDir         = NULL;
-  MapName             = NULL;
-  MapListItem         = NULL;
-  HandleList          = NULL;
+  SplitCurDir = NULL;
+  MapName     = NULL;
+  MapListItem = NULL;
+  HandleList  = NULL;
 
-  //
-  // Reset the static members back to zero
-  //
-  mFsMaxCount  = 0;
-  mBlkMaxCount = 0;
+  mMapGeneration++;
+  MapDeviceFlush ();
+  ShellCommandMapIndexInvalidate ();
 
   gEfiShellProtocol->SetEnv (L"path", L"", TRUE);
 
@@ -1469,6 +2907,7 @@ ShellCommandCreateInitialMappingsAndPaths (
 
     for (Count = 0; HandleList[Count] != NULL; Count++) {
       DevicePathList[Count] = DevicePathFromHandle (HandleList[Count]);
+      MapDeviceRecord (HandleList[Count], TRUE);
     }
 
     //
@@ -1476,11 +2915,12 @@ ShellCommandCreateInitialMappingsAndPaths (
     //
     PerformQuickSort (DevicePathList, Count, sizeof (EFI_DEVICE_PATH_PROTOCOL *), DevicePathCompare);
 
-    Status = ShellCommandConsistMappingInitialize (&ConsistMappingTable);
-    if (EFI_ERROR (Status)) {
+    NameCount    = Count;
+    ConsistNames = MapCacheGetConsistNames (DevicePathList, NameCount, TRUE);
+    if (ConsistNames == NULL) {
       SHELL_FREE_NON_NULL (HandleList);
       SHELL_FREE_NON_NULL (DevicePathList);
-      return Status;
+      return EFI_OUT_OF_RESOURCES;
     }
 
     //
@@ -1504,17 +2944,13 @@ ShellCommandCreateInitialMappingsAndPaths (
       //
       // Now do consistent name
       //
-      NewConsistName = ShellCommandConsistMappingGenMappingName (DevicePathList[Count], ConsistMappingTable);
-      if (NewConsistName != NULL) {
-        Status = ShellCommandAddMapItemAndUpdatePath (NewConsistName, DevicePathList[Count], 0, FALSE);
+      if (ConsistNames[Count] != NULL) {
+        Status = ShellCommandAddMapItemAndUpdatePath (ConsistNames[Count], DevicePathList[Count], 0, FALSE);
         ASSERT_EFI_ERROR (Status);
-        FreePool (NewConsistName);
       }
     }
 
-    if (ConsistMappingTable != NULL) {
-      ShellCommandConsistMappingUnInitialize (ConsistMappingTable);
-    }
+    MapCacheFreeNames (ConsistNames, NameCount);
 
     SHELL_FREE_NON_NULL (HandleList);
     SHELL_FREE_NON_NULL (DevicePathList);
@@ -1573,6 +3009,7 @@ ShellCommandCreateInitialMappingsAndPaths (
 
     for (Count = 0; HandleList[Count] != NULL; Count++) {
       DevicePathList[Count] = DevicePathFromHandle (HandleList[Count]);
+      MapDeviceRecord (HandleList[Count], FALSE);
     }
 
     //
@@ -1609,6 +3046,24 @@ ShellCommandCreateInitialMappingsAndPaths (
   return (EFI_SUCCESS);
 }
 
+/**
+  Get the generation number of the mapping table.
+
+  The number changes whenever all mappings are reset ("map -r") or mappings
+  of a removed device are deleted, so callers caching per-mapping state can
+  tell when to drop it.
+
+  @return   The current mapping generation.
+**/
+UINTN
+EFIAPI
+ShellCommandGetMapGeneration (
+  VOID
+  )
+{
+  return (mMapGeneration);
+}
+
 /**
   Add mappings for any devices without one.  Do not change any existing maps.
 
@@ -1625,8 +3080,8 @@ ShellCommandUpdateMapping (
   UINTN                     Count;
   EFI_DEVICE_PATH_PROTOCOL  **DevicePathList;
   CHAR16                    *NewDefaultName;
-  CHAR16                    *NewConsistName;
-  EFI_DEVICE_PATH_PROTOCOL  **ConsistMappingTable;
+  CHAR16                    **ConsistNames;
+  UINTN                     NameCount;
 
   HandleList = NULL;
   Status     = EFI_SUCCESS;
@@ -1656,6 +3111,7 @@ ShellCommandUpdateMapping (
 
     for (Count = 0; HandleList[Count] != NULL; Count++) {
       DevicePathList[Count] = DevicePathFromHandle (HandleList[Count]);
+      MapDeviceRecord (HandleList[Count], TRUE);
     }
 
     //
@@ -1663,11 +3119,12 @@ ShellCommandUpdateMapping (
     //
     PerformQuickSort (DevicePathList, Count, sizeof (EFI_DEVICE_PATH_PROTOCOL *), DevicePathCompare);
 
-    Status = ShellCommandConsistMappingInitialize (&ConsistMappingTable);
-    if (EFI_ERROR (Status)) {
+    NameCount    = Count;
+    ConsistNames = MapCacheGetConsistNames (DevicePathList, NameCount, TRUE);
+    if (ConsistNames == NULL) {
       SHELL_FREE_NON_NULL (HandleList);
       SHELL_FREE_NON_NULL (DevicePathList);
-      return Status;
+      return (EFI_OUT_OF_RESOURCES);
     }
 
     //
@@ -1681,48 +3138,309 @@ ShellCommandUpdateMapping (
         continue;
       }
 
-      //
-      // Get default name
-      //
-      NewDefaultName = ShellCommandCreateNewMappingName (MappingTypeFileSystem);
-      if (NewDefaultName == NULL) {
-        Status = EFI_OUT_OF_RESOURCES;
-        break;
-      }
+      //
+      // Get default name
+      //
+      NewDefaultName = ShellCommandCreateNewMappingName (MappingTypeFileSystem);
+      if (NewDefaultName == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        break;
+      }
+
+      //
+      // Call shell protocol SetMap function now...
+      //
+      Status = gEfiShellProtocol->SetMap (DevicePathList[Count], NewDefaultName);
+
+      if (!EFI_ERROR (Status)) {
+        //
+        // Now do consistent name
+        //
+        if (ConsistNames[Count] != NULL) {
+          Status = gEfiShellProtocol->SetMap (DevicePathList[Count], ConsistNames[Count]);
+        }
+      }
+
+      FreePool (NewDefaultName);
+    }
+
+    MapCacheFreeNames (ConsistNames, NameCount);
+    SHELL_FREE_NON_NULL (HandleList);
+    SHELL_FREE_NON_NULL (DevicePathList);
+
+    HandleList = NULL;
+  } else {
+    Count = (UINTN)-1;
+  }
+
+  //
+  // Do it all over again for gEfiBlockIoProtocolGuid
+  //
+
+  return (Status);
+}
+
+/**
+  Map a handle on which a SimpleFileSystem or BlockIo protocol was installed.
+
+  A file system gets a default map name and, if the map name cache has one, a
+  consistent map name; a block device gets a default map name.  A protocol of
+  the handle that is already mapped is left alone, so the same handle may be
+  passed again when a protocol on it is reinstalled.
+
+  @param[in] Handle             The handle.
+
+  @retval TRUE                  A mapping was added.
+  @retval FALSE                 The mappings did not change.
+**/
+BOOLEAN
+EFIAPI
+ShellCommandMapDeviceArrival (
+  IN EFI_HANDLE  Handle
+  )
+{
+  SHELL_MAP_DEVICE  *Device;
+  VOID              *FileSystem;
+  VOID              *BlockIo;
+  CHAR16            *NewDefaultName;
+  CHAR16            *ConsistName;
+  UINT8             *Cache;
+  UINTN             CacheSize;
+  BOOLEAN           Changed;
+
+  if (EFI_ERROR (gBS->HandleProtocol (Handle, &gEfiSimpleFileSystemProtocolGuid, &FileSystem))) {
+    FileSystem = NULL;
+  }
+
+  if (EFI_ERROR (gBS->HandleProtocol (Handle, &gEfiBlockIoProtocolGuid, &BlockIo))) {
+    BlockIo = NULL;
+  }
+
+  Device = MapDeviceFind (Handle);
+  if (  ((FileSystem == NULL) || ((Device != NULL) && (Device->FileSystem != NULL)))
+     && ((BlockIo == NULL) || ((Device != NULL) && (Device->BlockIo != NULL))))
+  {
+    return (FALSE);
+  }
+
+  Device = MapDeviceGet (Handle);
+  if (Device == NULL) {
+    return (FALSE);
+  }
+
+  Changed = FALSE;
+
+  if ((FileSystem != NULL) && (Device->FileSystem == NULL)) {
+    NewDefaultName = ShellCommandCreateNewMappingName (MappingTypeFileSystem);
+    if (NewDefaultName == NULL) {
+      return (Changed);
+    }
+
+    if (!EFI_ERROR (ShellCommandAddMapItemAndUpdatePath (NewDefaultName, Device->DevicePath, 0, FALSE))) {
+      Device->FileSystem = FileSystem;
+      Changed            = TRUE;
+
+      //
+      // The consistent name comes only from the map name cache, if the device
+      // was seen before, and is not taken if another device has it.  Building
+      // the consistent mapping table would scan every handle, so an unknown
+      // device gets its consistent name with the next "map -r".
+      //
+      Cache = NULL;
+      if (!EFI_ERROR (GetVariable2 (MAP_CACHE_VARIABLE, &gToroShellVariableGuid, (VOID **)&Cache, &CacheSize)) && (Cache != NULL)) {
+        ConsistName = NULL;
+        if (  MapCacheFind (Cache, CacheSize, Device->DevicePath, &ConsistName)
+           && (ConsistName != NULL)
+           && (ShellCommandFindMapItem (ConsistName) == NULL))
+        {
+          ShellCommandAddMapItemAndUpdatePath (ConsistName, Device->DevicePath, 0, FALSE);
+        }
+
+        SHELL_FREE_NON_NULL (ConsistName);
+        FreePool (Cache);
+      }
+    }
+
+    FreePool (NewDefaultName);
+  }
+
+  if ((BlockIo != NULL) && (Device->BlockIo == NULL)) {
+    NewDefaultName = ShellCommandCreateNewMappingName (MappingTypeBlockIo);
+    if (NewDefaultName == NULL) {
+      return (Changed);
+    }
+
+    if (!EFI_ERROR (ShellCommandAddMapItemAndUpdatePath (NewDefaultName, Device->DevicePath, 0, FALSE))) {
+      Device->BlockIo = BlockIo;
+      Changed         = TRUE;
+    }
+
+    FreePool (NewDefaultName);
+  }
+
+  return (Changed);
+}
+
+/**
+  Determine whether a mapped protocol of a device was uninstalled.
+
+  @param[in] Handle             The handle of the device.
+  @param[in] Protocol           The protocol.
+  @param[in] Mapped             The interface that was mapped, or NULL if the
+                                protocol was not mapped.
+
+  @retval TRUE                  The handle is gone or carries another interface.
+  @retval FALSE                 The protocol was not mapped or is still installed.
+**/
+STATIC
+BOOLEAN
+MapDeviceProtocolGone (
+  IN EFI_HANDLE  Handle,
+  IN EFI_GUID    *Protocol,
+  IN VOID        *Mapped
+  )
+{
+  VOID  *Interface;
+
+  return (BOOLEAN)(  (Mapped != NULL)
+                  && (  EFI_ERROR (gBS->HandleProtocol (Handle, Protocol, &Interface))
+                     || (Interface != Mapped)));
+}
+
+/**
+  Determine whether a map name is a default block device name, "BLKn:".
+
+  @param[in] MapName            The map name.
+
+  @retval TRUE                  It is a block device name.
+  @retval FALSE                 It is a file system or consistent name.
+**/
+STATIC
+BOOLEAN
+MapNameIsBlockIo (
+  IN CONST CHAR16  *MapName
+  )
+{
+  return (BOOLEAN)(  (MapName != NULL)
+                  && (StrnCmp (MapName, L"BLK", 3) == 0)
+                  && (MapName[3] >= L'0') && (MapName[3] <= L'9'));
+}
+
+/**
+  Delete the mappings of a device path.
+
+  @param[in] DevicePath         The device path.
+  @param[in] KeepBlockIo        TRUE to keep the block device name, because
+                                only the file system of the device went away.
+**/
+STATIC
+VOID
+MapRemoveDevicePath (
+  IN CONST EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  IN BOOLEAN                         KeepBlockIo
+  )
+{
+  SHELL_MAP_LIST  *MapListNode;
+  SHELL_MAP_LIST  *NextNode;
+  UINTN           Size;
+
+  Size = GetDevicePathSize (DevicePath);
+  for ( MapListNode = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
+        ; !IsNull (&gShellMapList.Link, &MapListNode->Link)
+        ; MapListNode = NextNode
+        )
+  {
+    NextNode = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &MapListNode->Link);
+    if (  (MapListNode->DevicePath == NULL)
+       || (GetDevicePathSize (MapListNode->DevicePath) != Size)
+       || (CompareMem (MapListNode->DevicePath, DevicePath, Size) != 0)
+       || (KeepBlockIo && MapNameIsBlockIo (MapListNode->MapName)))
+    {
+      continue;
+    }
+
+    if (MapListNode == gShellCurMapping) {
+      gShellCurMapping = NULL;
+    }
+
+    ShellCommandMapIndexInvalidate ();
+    RemoveEntryList (&MapListNode->Link);
+    SHELL_FREE_NON_NULL (MapListNode->DevicePath);
+    SHELL_FREE_NON_NULL (MapListNode->MapName);
+    SHELL_FREE_NON_NULL (MapListNode->CurrentDirectoryPath);
+    FreePool (MapListNode);
+  }
+}
+
+/**
+  Remove the mappings of devices whose mapped protocols were uninstalled.
+
+  If the current mapping is removed, gShellCurMapping is set to NULL.  A
+  device that lost only its file system keeps its block device name.  What is
+  still installed on the handle of a removed device is mapped again.
+
+  @retval TRUE                  Mappings were removed.
+  @retval FALSE                 The mappings did not change.
+**/
+BOOLEAN
+EFIAPI
+ShellCommandMapDeviceRemoval (
+  VOID
+  )
+{
+  SHELL_MAP_DEVICE  *Device;
+  SHELL_MAP_DEVICE  *NextDevice;
+  EFI_HANDLE        Handle;
+  UINTN             Index;
+  BOOLEAN           FileSystemGone;
+  BOOLEAN           BlockIoGone;
+  BOOLEAN           Changed;
+
+  Changed = FALSE;
+  for (Index = 0; Index < MAP_DEVICE_HASH_BUCKETS; Index++) {
+    for ( Device = (SHELL_MAP_DEVICE *)GetFirstNode (&mMapDevices[Index])
+          ; !IsNull (&mMapDevices[Index], &Device->Link)
+          ; Device = NextDevice
+          )
+    {
+      NextDevice     = (SHELL_MAP_DEVICE *)GetNextNode (&mMapDevices[Index], &Device->Link);
+      FileSystemGone = MapDeviceProtocolGone (Device->Handle, &gEfiSimpleFileSystemProtocolGuid, Device->FileSystem);
+      BlockIoGone    = MapDeviceProtocolGone (Device->Handle, &gEfiBlockIoProtocolGuid, Device->BlockIo);
+      if (!FileSystemGone && !BlockIoGone) {
+        continue;
+      }
+
+      Handle  = Device->Handle;
+      Changed = TRUE;
 
-      //
-      // Call shell protocol SetMap function now...
-      //
-      Status = gEfiShellProtocol->SetMap (DevicePathList[Count], NewDefaultName);
-
-      if (!EFI_ERROR (Status)) {
+      if (!BlockIoGone && (Device->BlockIo != NULL)) {
         //
-        // Now do consistent name
+        // Only the file system went away, the block device keeps its name.
         //
-        NewConsistName = ShellCommandConsistMappingGenMappingName (DevicePathList[Count], ConsistMappingTable);
-        if (NewConsistName != NULL) {
-          Status = gEfiShellProtocol->SetMap (DevicePathList[Count], NewConsistName);
-          FreePool (NewConsistName);
-        }
+        MapRemoveDevicePath (Device->DevicePath, TRUE);
+        Device->FileSystem = NULL;
+        ShellCommandMapDeviceArrival (Handle);
+        continue;
       }
 
-      FreePool (NewDefaultName);
-    }
-
-    ShellCommandConsistMappingUnInitialize (ConsistMappingTable);
-    SHELL_FREE_NON_NULL (HandleList);
-    SHELL_FREE_NON_NULL (DevicePathList);
+      MapRemoveDevicePath (Device->DevicePath, FALSE);
+      RemoveEntryList (&Device->Link);
+      FreePool (Device->DevicePath);
+      FreePool (Device);
 
-    HandleList = NULL;
-  } else {
-    Count = (UINTN)-1;
+      //
+      // A new record for the handle goes to the end of a bucket; if the walk
+      // reaches it, it is found to be current.
+      //
+      ShellCommandMapDeviceArrival (Handle);
+    }
   }
 
-  //
-  // Do it all over again for gEfiBlockIoProtocolGuid
-  //
+  if (Changed) {
+    mMapGeneration++;
+  }
 
-  return (Status);
+  return (Changed);
 }
 
 /**
@@ -1741,6 +3459,77 @@ ConvertShellHandleToEfiFileProtocol (
   return ((EFI_FILE_PROTOCOL *)(Handle));
 }
 
+/**
+  Get the hash bucket that tracks a SHELL_FILE_HANDLE.
+
+  File protocol instances are pool allocations, so the low bits carry no
+  information and are dropped before folding the pointer into a bucket index.
+
+  @param[in] Handle     The SHELL_FILE_HANDLE to hash.
+
+  @return               The list head of the bucket for Handle.
+**/
+STATIC
+BUFFER_LIST *
+FileHandleBucket (
+  IN CONST SHELL_FILE_HANDLE  Handle
+  )
+{
+  UINTN  Key;
+
+  Key  = (UINTN)Handle >> 4;
+  Key ^= Key >> 6;
+  Key ^= Key >> 12;
+  return (&mFileHandleList[Key % FILE_HANDLE_HASH_BUCKETS]);
+}
+
+/**
+  Find the tracking node for a SHELL_FILE_HANDLE.
+
+  @param[in] Handle     The SHELL_FILE_HANDLE to find.
+
+  @return               The BUFFER_LIST node holding the handle.
+  @retval NULL          The handle is not tracked.
+**/
+STATIC
+BUFFER_LIST *
+FileHandleFindNode (
+  IN CONST SHELL_FILE_HANDLE  Handle
+  )
+{
+  BUFFER_LIST  *Bucket;
+  BUFFER_LIST  *Node;
+
+  Bucket = FileHandleBucket (Handle);
+  for (Node = (BUFFER_LIST *)GetFirstNode (&Bucket->Link)
+       ; !IsNull (&Bucket->Link, &Node->Link)
+       ; Node = (BUFFER_LIST *)GetNextNode (&Bucket->Link, &Node->Link)
+       )
+  {
+    if ((Node->Buffer) && (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->FileHandle == Handle)) {
+      return (Node);
+    }
+  }
+
+  return (NULL);
+}
+
+/**
+  Get the number of SHELL_FILE_HANDLEs currently tracked with a path.
+
+  A count that keeps growing across commands points at a handle leak.
+
+  @return               The number of open, tracked file handles.
+**/
+UINTN
+EFIAPI
+ShellFileHandleGetOpenCount (
+  VOID
+  )
+{
+  return (mFileHandleCount);
+}
+
 /**
   Converts a EFI_FILE_PROTOCOL* to an SHELL_FILE_HANDLE.
 
@@ -1782,7 +3571,8 @@ ConvertEfiFileProtocolToShellHandle (
 
     NewNode->Buffer = Buffer;
 
-    InsertHeadList (&mFileHandleList.Link, &NewNode->Link);
+    InsertHeadList (&FileHandleBucket (Handle)->Link, &NewNode->Link);
+    mFileHandleCount++;
   }
 
   return ((SHELL_FILE_HANDLE)(Handle));
@@ -1803,17 +3593,12 @@ ShellFileHandleGetPath (
 {
   BUFFER_LIST  *Node;
 
-  for (Node = (BUFFER_LIST *)GetFirstNode (&mFileHandleList.Link)
-       ; !IsNull (&mFileHandleList.Link, &Node->Link)
-       ; Node = (BUFFER_LIST *)GetNextNode (&mFileHandleList.Link, &Node->Link)
-       )
-  {
-    if ((Node->Buffer) && (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->FileHandle == Handle)) {
-      return (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->Path);
-    }
+  Node = FileHandleFindNode (Handle);
+  if (Node == NULL) {
+    return (NULL);
   }
 
-  return (NULL);
+  return (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->Path);
 }
 
 /**
@@ -1832,21 +3617,17 @@ ShellFileHandleRemove (
 {
   BUFFER_LIST  *Node;
 
-  for (Node = (BUFFER_LIST *)GetFirstNode (&mFileHandleList.Link)
-       ; !IsNull (&mFileHandleList.Link, &Node->Link)
-       ; Node = (BUFFER_LIST *)GetNextNode (&mFileHandleList.Link, &Node->Link)
-       )
-  {
-    if ((Node->Buffer) && (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->FileHandle == Handle)) {
-      RemoveEntryList (&Node->Link);
-      SHELL_FREE_NON_NULL (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->Path);
-      SHELL_FREE_NON_NULL (Node->Buffer);
-      SHELL_FREE_NON_NULL (Node);
-      return (TRUE);
-    }
+  Node = FileHandleFindNode (Handle);
+  if (Node == NULL) {
+    return (FALSE);
   }
 
-  return (FALSE);
+  RemoveEntryList (&Node->Link);
+  SHELL_FREE_NON_NULL (((SHELL_COMMAND_FILE_HANDLE *)Node->Buffer)->Path);
+  SHELL_FREE_NON_NULL (Node->Buffer);
+  SHELL_FREE_NON_NULL (Node);
+  mFileHandleCount--;
+  return (TRUE);
 }
 
 /**
@@ -2364,3 +4145,375 @@ UninitSort:
 
   return Status;
 }
+
+//
+// Smallest capacity, in characters, of a SHELL_STRING_BUILDER buffer.
+//
+#define SHELL_STRING_BUILDER_MIN_CAPACITY  32
+
+/**
+  Initialize an empty string builder.  Nothing is allocated.
+
+  @param[out] Builder           The builder.
+**/
+VOID
+EFIAPI
+ShellStrBuilderInit (
+  OUT SHELL_STRING_BUILDER  *Builder
+  )
+{
+  ZeroMem (Builder, sizeof (SHELL_STRING_BUILDER));
+}
+
+/**
+  Free the string of a string builder.  The builder is empty afterwards.
+
+  @param[in, out] Builder       The builder.
+**/
+VOID
+EFIAPI
+ShellStrBuilderFree (
+  IN OUT SHELL_STRING_BUILDER  *Builder
+  )
+{
+  SHELL_FREE_NON_NULL (Builder->Buffer);
+  ShellStrBuilderInit (Builder);
+}
+
+/**
+  Make sure a string builder can hold Length characters without growing.
+
+  The capacity grows to the next power of two multiple of the current one,
+  so n appends cost O(n) copying in total.
+
+  @param[in, out] Builder       The builder.
+  @param[in] Length             Number of characters, not counting the terminator.
+
+  @retval EFI_SUCCESS           The capacity is available.
+  @retval EFI_OUT_OF_RESOURCES  An allocation failed now or earlier.
+**/
+EFI_STATUS
+EFIAPI
+ShellStrBuilderReserve (
+  IN OUT SHELL_STRING_BUILDER  *Builder,
+  IN     UINTN                 Length
+  )
+{
+  UINTN   NewCapacity;
+  CHAR16  *NewBuffer;
+
+  if (Builder->Failed) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  if (Length < Builder->Capacity) {
+    return (EFI_SUCCESS);
+  }
+
+  NewCapacity = (Builder->Capacity == 0) ? SHELL_STRING_BUILDER_MIN_CAPACITY : Builder->Capacity;
+  while (NewCapacity <= Length) {
+    NewCapacity *= 2;
+  }
+
+  NewBuffer = ReallocatePool (
+                Builder->Capacity * sizeof (CHAR16),
+                NewCapacity * sizeof (CHAR16),
+                Builder->Buffer
+                );
+  if (NewBuffer == NULL) {
+    ShellStrBuilderFree (Builder);
+    Builder->Failed = TRUE;
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  if (Builder->Buffer == NULL) {
+    NewBuffer[0] = CHAR_NULL;
+  }
+
+  Builder->Buffer   = NewBuffer;
+  Builder->Capacity = NewCapacity;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Append a string to a string builder.
+
+  @param[in, out] Builder       The builder.
+  @param[in] String             The string to append.  NULL appends nothing.
+  @param[in] Count              Maximum number of characters to append, or 0
+                                to append all of String (as StrnCatGrow()).
+
+  @retval EFI_SUCCESS           The string was appended.
+  @retval EFI_OUT_OF_RESOURCES  An allocation failed now or earlier.
+**/
+EFI_STATUS
+EFIAPI
+ShellStrBuilderAppend (
+  IN OUT SHELL_STRING_BUILDER  *Builder,
+  IN     CONST CHAR16          *String,
+  IN     UINTN                 Count
+  )
+{
+  UINTN  Length;
+
+  if (Builder->Failed) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  if (String == NULL) {
+    return (EFI_SUCCESS);
+  }
+
+  Length = (Count == 0) ? StrLen (String) : StrnLenS (String, Count);
+  if (EFI_ERROR (ShellStrBuilderReserve (Builder, Builder->Length + Length))) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  CopyMem (Builder->Buffer + Builder->Length, String, Length * sizeof (CHAR16));
+  Builder->Length                 += Length;
+  Builder->Buffer[Builder->Length] = CHAR_NULL;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Take the string out of a string builder.  The builder is empty afterwards.
+
+  @param[in, out] Builder       The builder.
+
+  @return                       The pool allocated string, to be freed by the
+                                caller, or NULL if nothing was appended or an
+                                allocation failed.
+**/
+CHAR16 *
+EFIAPI
+ShellStrBuilderFinalize (
+  IN OUT SHELL_STRING_BUILDER  *Builder
+  )
+{
+  CHAR16  *String;
+
+  String = Builder->Buffer;
+  ShellStrBuilderInit (Builder);
+  return (String);
+}
+
+/**
+  Fetch a string from HII and escape the color markers in it, so that they
+  survive formatting and are applied by ShellPrintEx() afterwards.
+
+  @param[in] Handle     The HII handle.
+  @param[in] Id         The string id.
+  @param[in] Language   The language, or NULL for the platform language.
+
+  @return               The pool allocated format, or NULL if the string was
+                        not found or an allocation failed.
+**/
+STATIC
+CHAR16 *
+HiiStringLoad (
+  IN EFI_HII_HANDLE  Handle,
+  IN EFI_STRING_ID   Id,
+  IN CONST CHAR8     *Language OPTIONAL
+  )
+{
+  SHELL_STRING_BUILDER  Builder;
+  CHAR16                *String;
+  CONST CHAR16          *Walker;
+
+  String = HiiGetString (Handle, Id, Language);
+  if (String == NULL) {
+    return (NULL);
+  }
+
+  ShellStrBuilderInit (&Builder);
+  ShellStrBuilderReserve (&Builder, StrLen (String));
+  for (Walker = String; *Walker != CHAR_NULL; Walker++) {
+    if (*Walker == L'%') {
+      switch (Walker[1]) {
+        case L'N':
+        case L'E':
+        case L'H':
+        case L'B':
+        case L'V':
+          ShellStrBuilderAppend (&Builder, L"%", 0);
+          break;
+        default:
+          break;
+      }
+    }
+
+    ShellStrBuilderAppend (&Builder, Walker, 1);
+  }
+
+  FreePool (String);
+  return (ShellStrBuilderFinalize (&Builder));
+}
+
+/**
+  Find a format string in the cache, fetching it from HII on a miss.
+
+  @param[in] Handle     The HII handle.
+  @param[in] Id         The string id.
+
+  @return               The cached format, or NULL if the string was not found
+                        or an allocation failed.
+**/
+STATIC
+CONST CHAR16 *
+HiiStringCacheGet (
+  IN EFI_HII_HANDLE  Handle,
+  IN EFI_STRING_ID   Id
+  )
+{
+  LIST_ENTRY        *Bucket;
+  LIST_ENTRY        *Link;
+  SHELL_HII_STRING  *Entry;
+
+  Bucket = &mHiiStrings[HII_STRING_HASH (Handle, Id)];
+  for (Link = GetFirstNode (Bucket); !IsNull (Bucket, Link); Link = GetNextNode (Bucket, Link)) {
+    Entry = BASE_CR (Link, SHELL_HII_STRING, Link);
+    if ((Entry->Handle == Handle) && (Entry->Id == Id)) {
+      return (Entry->Format);
+    }
+  }
+
+  Entry = AllocateZeroPool (sizeof (SHELL_HII_STRING));
+  if (Entry == NULL) {
+    return (NULL);
+  }
+
+  Entry->Format = HiiStringLoad (Handle, Id, NULL);
+  if (Entry->Format == NULL) {
+    FreePool (Entry);
+    return (NULL);
+  }
+
+  //
+  // Remember the language the cache is filled in, to notice when it changes.
+  //
+  if (mHiiStringCount == 0) {
+    SHELL_FREE_NON_NULL (mHiiStringLanguage);
+    GetEfiGlobalVariable2 (EFI_PLATFORM_LANG_VARIABLE_NAME, (VOID **)&mHiiStringLanguage, NULL);
+  }
+
+  Entry->Handle = Handle;
+  Entry->Id     = Id;
+  InsertHeadList (Bucket, &Entry->Link);
+  mHiiStringCount++;
+
+  return (Entry->Format);
+}
+
+/**
+  Print at a specific location on the screen, using a format string from HII,
+  as ShellPrintHiiEx() does.
+
+  @param[in] Col                The column to start at, or -1 for the current column.
+  @param[in] Row                The row to start at, or -1 for the current row.
+  @param[in] Language           The language of the string, or NULL for the
+                                platform language.  Only strings in the
+                                platform language are cached.
+  @param[in] HiiFormatStringId  The format string id for getting from HII.
+  @param[in] HiiFormatHandle    The format string handle for getting from HII.
+  @param[in] ...                The variable argument list.
+
+  @retval EFI_SUCCESS           The printing was successful.
+  @retval EFI_DEVICE_ERROR      The string was not found in HII.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+EFI_STATUS
+EFIAPI
+ShellCommandPrintHii (
+  IN INT32                 Col OPTIONAL,
+  IN INT32                 Row OPTIONAL,
+  IN CONST CHAR8           *Language OPTIONAL,
+  IN CONST EFI_STRING_ID   HiiFormatStringId,
+  IN CONST EFI_HII_HANDLE  HiiFormatHandle,
+  ...
+  )
+{
+  VA_LIST       Marker;
+  CONST CHAR16  *Format;
+  CHAR16        *Uncached;
+  CHAR16        *Output;
+  EFI_STATUS    Status;
+
+  Uncached = NULL;
+  if (Language == NULL) {
+    Format = HiiStringCacheGet (HiiFormatHandle, HiiFormatStringId);
+  } else {
+    Uncached = HiiStringLoad (HiiFormatHandle, HiiFormatStringId, Language);
+    Format   = Uncached;
+  }
+
+  if (Format == NULL) {
+    return (EFI_DEVICE_ERROR);
+  }
+
+  //
+  // Format the arguments here; the escaped color markers come out as plain
+  // %N, %E, %H, %B and %V, which ShellPrintEx() then applies.
+  //
+  VA_START (Marker, HiiFormatHandle);
+  Output = CatVSPrint (NULL, Format, Marker);
+  VA_END (Marker);
+  SHELL_FREE_NON_NULL (Uncached);
+  if (Output == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  Status = ShellPrintEx (Col, Row, L"%s", Output);
+  FreePool (Output);
+  return (Status);
+}
+
+/**
+  Drop all cached HII strings.
+**/
+VOID
+EFIAPI
+ShellCommandFlushHiiStrings (
+  VOID
+  )
+{
+  SHELL_HII_STRING  *Entry;
+  UINTN             Index;
+
+  for (Index = 0; Index < HII_STRING_HASH_BUCKETS; Index++) {
+    while (!IsListEmpty (&mHiiStrings[Index])) {
+      Entry = BASE_CR (GetFirstNode (&mHiiStrings[Index]), SHELL_HII_STRING, Link);
+      RemoveEntryList (&Entry->Link);
+      FreePool (Entry->Format);
+      FreePool (Entry);
+    }
+  }
+
+  mHiiStringCount = 0;
+  SHELL_FREE_NON_NULL (mHiiStringLanguage);
+}
+
+/**
+  Drop the cached HII strings if PlatformLang changed since they were fetched.
+**/
+VOID
+EFIAPI
+ShellCommandCheckHiiLanguage (
+  VOID
+  )
+{
+  CHAR8  *Language;
+
+  if (mHiiStringCount == 0) {
+    return;
+  }
+
+  Language = NULL;
+  GetEfiGlobalVariable2 (EFI_PLATFORM_LANG_VARIABLE_NAME, (VOID **)&Language, NULL);
+  if (  ((Language == NULL) != (mHiiStringLanguage == NULL))
+     || ((Language != NULL) && (AsciiStrCmp (Language, mHiiStringLanguage) != 0)))
+  {
+    ShellCommandFlushHiiStrings ();
+  }
+
+  SHELL_FREE_NON_NULL (Language);
+}
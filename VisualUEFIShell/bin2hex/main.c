@@ -2,16 +2,331 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "pluginpak.h"
+
+//
+// one PLUGINLZ sequence: literals, then a match unless MatchLen is 0
+//
+static unsigned char* LzSequence(unsigned char* op, const unsigned char* pLiterals, size_t nLiterals, size_t Offset, size_t MatchLen)
+{
+	unsigned char* pToken = op++;
+	size_t n;
+
+	*pToken = (unsigned char)((nLiterals < 15 ? nLiterals : 15) << 4);
+	if (15 <= nLiterals)
+		for (n = nLiterals - 15; ; n -= 255)
+		{
+			*op++ = (unsigned char)(n < 255 ? n : 255);
+			if (n < 255)
+				break;
+		}
+	memcpy(op, pLiterals, nLiterals);
+	op += nLiterals;
+
+	if (0 != MatchLen)
+	{
+		*op++ = (unsigned char)Offset;
+		*op++ = (unsigned char)(Offset >> 8);
+		n = MatchLen - PLUGINLZ_MIN_MATCH;
+		*pToken |= (unsigned char)(n < 15 ? n : 15);
+		if (15 <= n)
+			for (n -= 15; ; n -= 255)
+			{
+				*op++ = (unsigned char)(n < 255 ? n : 255);
+				if (n < 255)
+					break;
+			}
+	}
+	return op;
+}
+
+//
+// compress to a PLUGINLZ stream, greedy matches found by a hash of the next 4 bytes;
+// pDst must hold LZ_BOUND(SrcSize) bytes
+//
+#define LZ_BOUND(SrcSize) (4 + (SrcSize) + (SrcSize) / 255 + 16)
+#define LZ_HASH(p) ((((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24) * 2654435761U) >> 16)
+
+static size_t LzCompress(const unsigned char* pSrc, size_t SrcSize, unsigned char* pDst)
+{
+	static size_t rgHead[1 << 16];		// last position + 1 of each hash, 0 for none
+	unsigned char* op = pDst;
+	size_t i = 0, Anchor = 0, Match, Len;
+
+	memset(rgHead, 0, sizeof(rgHead));
+
+	*op++ = (unsigned char)SrcSize;
+	*op++ = (unsigned char)(SrcSize >> 8);
+	*op++ = (unsigned char)(SrcSize >> 16);
+	*op++ = (unsigned char)(SrcSize >> 24);
+
+	while (i + PLUGINLZ_MIN_MATCH <= SrcSize)
+	{
+		Match = rgHead[LZ_HASH(&pSrc[i])];
+		rgHead[LZ_HASH(&pSrc[i])] = i + 1;
+
+		if (0 == Match-- || 65535 < i - Match || 0 != memcmp(&pSrc[Match], &pSrc[i], PLUGINLZ_MIN_MATCH))
+		{
+			i++;
+			continue;
+		}
+
+		for (Len = PLUGINLZ_MIN_MATCH; i + Len < SrcSize && pSrc[Match + Len] == pSrc[i + Len]; Len++)
+			;
+		op = LzSequence(op, &pSrc[Anchor], i - Anchor, i - Match, Len);
+
+		for (Anchor = i + Len, i++; i < Anchor && i + PLUGINLZ_MIN_MATCH <= SrcSize; i++)
+			rgHead[LZ_HASH(&pSrc[i])] = i + 1;
+		i = Anchor;
+	}
+
+	if (Anchor < SrcSize)
+		op = LzSequence(op, &pSrc[Anchor], SrcSize - Anchor, 0, 0);
+
+	return op - pDst;
+}
+
+//
+// replace a binary by its PLUGINLZ stream if that is smaller, return PLUGINPAK_FLAG_...
+//
+static unsigned CompressPlugin(unsigned char** ppBinary, size_t* pSize)
+{
+	unsigned char* pLz = malloc(LZ_BOUND(*pSize)), * pCheck = malloc(*pSize + 1);
+	size_t LzSize;
+	unsigned Flags = 0;
+
+	do {
+		if (NULL == pLz || NULL == pCheck || 0xFFFFFFFFULL < (unsigned long long)*pSize)
+			break;
+
+		LzSize = LzCompress(*ppBinary, *pSize, pLz);
+		if (LzSize >= *pSize)
+			break;
+
+		//
+		// check the stream with the decompressor the shell uses
+		//
+		if (!PluginLzDecompress(pLz, LzSize, pCheck) || 0 != memcmp(pCheck, *ppBinary, *pSize))
+		{
+			fprintf(stderr, "compression check failed, stored uncompressed\n");
+			break;
+		}
+
+		printf("    compressed %lld -> %lld bytes\n", (long long)*pSize, (long long)LzSize);
+		free(*ppBinary);
+		*ppBinary = pLz, pLz = NULL;
+		*pSize = LzSize;
+		Flags = PLUGINPAK_FLAG_COMPRESSED;
+
+	} while (0);
+
+	free(pLz);
+	free(pCheck);
+	return Flags;
+}
+
+//
+// C source text of a binary: 32 "0xXX," per line, each line with an offset comment and a
+// '\\' continuation. Formatted from tables into pBuf, which must hold HEX_BOUND(size) bytes.
+//
+#define HEX_LINE_SIZE (sizeof("  /*87654321: */  ") - 1 + 32 * (sizeof("0xXX,") - 1) + sizeof("\\\n") - 1)
+#define HEX_BOUND(size) (((size) + 31) / 32 * HEX_LINE_SIZE)
+
+static size_t HexLines(char* pBuf, const unsigned char* pData, size_t size)
+{
+	static const char szDigits[] = "0123456789ABCDEF";
+	static char rgHex[256][5];			// "0xXX," of each byte value
+	char* p = pBuf;
+	size_t f, i;
+	int d;
+
+	if ('0' != rgHex[0][0])
+		for (i = 0; i < 256; i++)
+			rgHex[i][0] = '0',
+			rgHex[i][1] = 'x',
+			rgHex[i][2] = szDigits[i >> 4],
+			rgHex[i][3] = szDigits[i & 15],
+			rgHex[i][4] = ',';
+
+	for (f = 0; f < size; f += 32)
+	{
+		memcpy(p, "  /*", 4);
+		for (d = 0; d < 8; d++)
+			p[4 + d] = szDigits[(f >> (28 - 4 * d)) & 15];
+		memcpy(&p[12], ": */  ", 6);
+		p += 18;
+
+		for (i = f; i < f + 32 && i < size; i++, p += 5)
+			memcpy(p, rgHex[pData[i]], 5);
+
+		if (0 == i % 32)
+			*p++ = '\\',
+			*p++ = '\n';
+	}
+	return p - pBuf;
+}
+
+//
+// COFF object (x64) with the plugins in a read-only .rdata section, each one 16 byte aligned
+// and named by an external symbol "<name>_PLUGIN"
+//
+static void CoffPut(unsigned char** pp, uint64_t Value, int nBytes)
+{
+	while (nBytes--)
+		*(*pp)++ = (unsigned char)Value,
+		Value >>= 8;
+}
+
+static int WritePluginObject(const char* pszObjFile, int nPlugins, char** ppszName, unsigned char** ppBinary, size_t* pSize)
+{
+	size_t SectionSize = 0, StringsSize = 4, ObjSize, i;
+	unsigned char* pObj, * p, * pSection, * pSymbol, * pStrings;
+	FILE* fp;
+	int Status = 0;
+
+	for (i = 0; i < (size_t)nPlugins; i++)
+		SectionSize = (SectionSize + pSize[i] + 15) & ~(size_t)15,
+		StringsSize += strlen(ppszName[i]) + sizeof("_PLUGIN");
+
+	if (0xFFFFFFFFULL < (unsigned long long)SectionSize)
+	{
+		fprintf(stderr, "plugins too large for \"%s\"\n", pszObjFile);
+		return 0;
+	}
+
+	ObjSize = 20 + 40 + SectionSize + 18 * (2 + nPlugins) + StringsSize;
+	if (NULL == (pObj = calloc(ObjSize, 1)))
+	{
+		fprintf(stderr, "out of memory for \"%s\"\n", pszObjFile);
+		return 0;
+	}
+	pSection = &pObj[20 + 40];
+	pSymbol = &pSection[SectionSize];
+	pStrings = &pSymbol[18 * (2 + nPlugins)];
+
+	//
+	// IMAGE_FILE_HEADER, IMAGE_SECTION_HEADER
+	//
+	p = pObj;
+	CoffPut(&p, 0x8664, 2);					// IMAGE_FILE_MACHINE_AMD64
+	CoffPut(&p, 1, 2);						// NumberOfSections
+	CoffPut(&p, 0, 4);						// TimeDateStamp
+	CoffPut(&p, pSymbol - pObj, 4);			// PointerToSymbolTable
+	CoffPut(&p, 2 + nPlugins, 4);			// NumberOfSymbols
+	CoffPut(&p, 0, 2);						// SizeOfOptionalHeader
+	CoffPut(&p, 0, 2);						// Characteristics
+
+	memcpy(p, ".rdata", 6), p += 8;
+	CoffPut(&p, 0, 4);						// VirtualSize
+	CoffPut(&p, 0, 4);						// VirtualAddress
+	CoffPut(&p, SectionSize, 4);			// SizeOfRawData
+	CoffPut(&p, pSection - pObj, 4);		// PointerToRawData
+	CoffPut(&p, 0, 4 + 4 + 2 + 2);			// relocations, line numbers
+	CoffPut(&p, 0x40500040, 4);				// INITIALIZED_DATA | ALIGN_16BYTES | MEM_READ
+
+	//
+	// section symbol with its auxiliary record, then one external symbol per plugin
+	//
+	p = pSymbol;
+	memcpy(p, ".rdata", 6), p += 8;
+	CoffPut(&p, 0, 4);						// Value
+	CoffPut(&p, 1, 2);						// SectionNumber
+	CoffPut(&p, 0, 2);						// Type
+	CoffPut(&p, 3, 1);						// IMAGE_SYM_CLASS_STATIC
+	CoffPut(&p, 1, 1);						// NumberOfAuxSymbols
+	CoffPut(&p, SectionSize, 4);			// Length
+	p += 14;
+
+	for (i = 0, SectionSize = 0, StringsSize = 4; i < (size_t)nPlugins; i++)
+	{
+		memcpy(&pSection[SectionSize], ppBinary[i], pSize[i]);
+
+		CoffPut(&p, 0, 4);					// name in the string table
+		CoffPut(&p, StringsSize, 4);
+		CoffPut(&p, SectionSize, 4);		// Value
+		CoffPut(&p, 1, 2);					// SectionNumber
+		CoffPut(&p, 0, 2);					// Type
+		CoffPut(&p, 2, 1);					// IMAGE_SYM_CLASS_EXTERNAL
+		CoffPut(&p, 0, 1);					// NumberOfAuxSymbols
+
+		StringsSize += sprintf((char*)&pStrings[StringsSize], "%s_PLUGIN", ppszName[i]) + 1;
+		SectionSize = (SectionSize + pSize[i] + 15) & ~(size_t)15;
+	}
+	p = pStrings;
+	CoffPut(&p, StringsSize, 4);
+
+	fp = fopen(pszObjFile, "wb");
+	if (NULL == fp || 1 != fwrite(pObj, ObjSize, 1, fp) || 0 != fclose(fp))
+		fprintf(stderr, "failed writing \"%s\"\n", pszObjFile);
+	else
+		printf("OBJECT: %s, %d plugins, %lld bytes\n", pszObjFile, nPlugins, (long long)ObjSize),
+		Status = 1;
+
+	free(pObj);
+	return Status;
+}
+
+//
+// write all plugins to a PLUGINS.PAK package: header, index, payloads
+//
+static int WritePluginPackage(const char* pszPakFile, int nPlugins, char** ppszName, unsigned char** ppBinary, size_t* pSize, unsigned* pFlags)
+{
+	PLUGINPAK_HEADER Header;
+	PLUGINPAK_ENTRY Entry;
+	uint64_t Offset = sizeof(Header) + nPlugins * sizeof(Entry);
+	FILE* fp = fopen(pszPakFile, "wb");
+	int i;
+
+	if (NULL == fp)
+	{
+		fprintf(stderr, "failed to create \"%s\"\n", pszPakFile);
+		return 0;
+	}
+
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header.Signature, PLUGINPAK_SIGNATURE, sizeof(Header.Signature));
+	Header.Version = PLUGINPAK_VERSION;
+	Header.Count = nPlugins;
+	fwrite(&Header, sizeof(Header), 1, fp);
+
+	for (i = 0; i < nPlugins; i++)
+	{
+		memset(&Entry, 0, sizeof(Entry));
+		strcpy(Entry.szName, ppszName[i]);
+		Entry.Offset = Offset;
+		Entry.Size = pSize[i];
+		Entry.Hash = PluginPakHash(ppBinary[i], pSize[i]);
+		Entry.Flags = pFlags[i];
+		fwrite(&Entry, sizeof(Entry), 1, fp);
+		Offset += pSize[i];
+	}
+
+	for (i = 0; i < nPlugins; i++)
+		fwrite(ppBinary[i], pSize[i], 1, fp);
+
+	if (0 != fclose(fp))
+	{
+		fprintf(stderr, "failed writing \"%s\"\n", pszPakFile);
+		return 0;
+	}
+
+	printf("PACKAGE: %s, %d plugins, %lld bytes\n", pszPakFile, nPlugins, (long long)Offset);
+	return 1;
+}
 
 int main(int argc, char** argv)
 {
 	int Status = EXIT_FAILURE;
 	do {
-		static struct {
-			char* pszPlugInName;	// command name
-			unsigned char* pBinary; // pointer to binary
-		}rgPlugIn[512];				// array of plugins
+		static char* rgpszPlugInName[512];		// command names
+		static unsigned char* rgpBinary[512];	// pointers to binaries
+		static size_t rgSize[512];				// sizes of binaries
+		static unsigned rgFlags[512];			// PLUGINPAK_FLAG_...
+		int fCompress = 1;						// /nocompress stores all plugins uncompressed
+		int nPlugins = 0;
 		char* pszHeaderFile = NULL;
+		char* pszPakFile = NULL;				// /pak:filename, plugins go to a package instead of the header
+		char* pszObjFile = NULL;				// /obj:filename, plugins go to a COFF object instead of the header
 		FILE* fpHeaderFile;
 
 		//
@@ -24,6 +339,18 @@ int main(int argc, char** argv)
 				pszHeaderFile = &argv[i][strlen("/out:")];
 				printf("HEADERFILE: %s\n", pszHeaderFile);
 			}
+			if (0 == _strnicmp(argv[i], "/pak:", strlen("/pak:")))
+			{
+				pszPakFile = &argv[i][strlen("/pak:")];
+				printf("PACKAGEFILE: %s\n", pszPakFile);
+			}
+			if (0 == _strnicmp(argv[i], "/obj:", strlen("/obj:")))
+			{
+				pszObjFile = &argv[i][strlen("/obj:")];
+				printf("OBJECTFILE: %s\n", pszObjFile);
+			}
+			if (0 == _stricmp(argv[i], "/nocompress"))
+				fCompress = 0;
 		}
 
 		if (NULL == pszHeaderFile)
@@ -32,6 +359,12 @@ int main(int argc, char** argv)
 			break;
 		}
 
+		if (NULL != pszPakFile && NULL != pszObjFile)
+		{
+			fprintf(stderr, "\"/pak:filename\" and \"/obj:filename\" exclude each other\n");
+			break;
+		}
+
 		//
 		// create header file, start header file
 		//
@@ -44,24 +377,30 @@ int main(int argc, char** argv)
 		fprintf(fpHeaderFile, "//\n//DON'T EDIT THIS FILE: this include file is automatically generated at build time\n//\n#ifndef _UEFI_SHELL_PLUGIN_H_\n#define _UEFI_SHELL_PLUGIN_H_\n");
 
 		//////////////////////////////////////////////////////////////////////////////////
-		// process all filenames given in the command line, except "/out:filename"
+		// process all filenames given in the command line, except "/out:filename", "/pak:filename",
+		// "/obj:filename" and "/nocompress"; "/store:filename" is a plugin that is stored uncompressed
 		//////////////////////////////////////////////////////////////////////////////////
-		for (int i = 1,iPlugin = 0; i < argc; i++)
+		for (int i = 1; i < argc; i++)
 		{
 			unsigned char* pc, *pclast = NULL;
 			size_t fsize = (size_t) -1LL;
 			FILE* fp;
 			static char szTemp[2048];	// copy / working copy of current command line option for processing 
+			char* pszFile = argv[i];
+			int fStore = !fCompress;
 
-			if (0 == _strnicmp(argv[i], "/out:", strlen("/out:")))
+			if (0 == _strnicmp(argv[i], "/out:", strlen("/out:")) || 0 == _strnicmp(argv[i], "/pak:", strlen("/pak:")) || 0 == _strnicmp(argv[i], "/obj:", strlen("/obj:")) || 0 == _stricmp(argv[i], "/nocompress"))
 				continue;
+			if (0 == _strnicmp(argv[i], "/store:", strlen("/store:")))
+				pszFile = &argv[i][strlen("/store:")],
+				fStore = 1;
 			//
 			// read the binary given in the command line
 			//
-			fp = fopen(argv[i], "r+b");
+			fp = fopen(pszFile, "r+b");
 			if (NULL == fp)
 			{
-				fprintf(stderr, "failed open \"%s\"\n", argv[i]);
+				fprintf(stderr, "failed open \"%s\"\n", pszFile);
 				break;
 			}
 
@@ -70,40 +409,71 @@ int main(int argc, char** argv)
 			rewind(fp);
 			printf("--> %lld\n", fsize);
 
-			rgPlugIn[iPlugin].pBinary = malloc(fsize);
-			if (1 != fread(rgPlugIn[iPlugin].pBinary, fsize, 1, fp))
+			rgpBinary[nPlugins] = malloc(fsize);
+			rgSize[nPlugins] = fsize;
+			if (1 != fread(rgpBinary[nPlugins], fsize, 1, fp))
 			{
-				fprintf(stderr, "failed reading \"%s\"\n", argv[i]);
+				fprintf(stderr, "failed reading \"%s\"\n", pszFile);
 				break;
 			}
+			fclose(fp);
 			
 			//
 			// isolate the pluginname, cut extension (".EFI"), remove leading path
 			//
-			strcpy(szTemp, argv[i]);
+			strcpy(szTemp, pszFile);
 			pc = strtok(szTemp, "\\/");
 			while (NULL != pc)
 				pclast = pc,
 				pc = strtok(NULL, "\\/");
 			pc = strtok(pclast, ".");
-			rgPlugIn[iPlugin].pszPlugInName = malloc(strlen(pc));
-			strcpy(rgPlugIn[iPlugin].pszPlugInName, pc);
+			rgpszPlugInName[nPlugins] = malloc(strlen(pc) + 1);
+			strcpy(rgpszPlugInName[nPlugins], pc);
 
 			printf("------------> \"%s\"\n", pc);
 
+			rgFlags[nPlugins] = fStore ? 0 : CompressPlugin(&rgpBinary[nPlugins], &rgSize[nPlugins]);
+			fsize = rgSize[nPlugins];
+
+			if (NULL != pszPakFile)
+			{
+				if (PLUGINPAK_NAME_MAX <= strlen(pc))
+				{
+					fprintf(stderr, "plugin name \"%s\" too long for a package\n", pc);
+					break;
+				}
+				nPlugins++;
+				continue;
+			}
+
+			if (NULL != pszObjFile)
+			{
+				//
+				// the object holds the bytes, the header only declares them
+				//
+				fprintf(fpHeaderFile, "extern char %s_PLUGIN[];\n", rgpszPlugInName[nPlugins]);
+				nPlugins++;
+				continue;
+			}
+
 			//
 			// append termination '\0' that is valid for non-binary files only
 			//
-			fprintf(fpHeaderFile, "char %s_PLUGIN[] = {\\\n", rgPlugIn[iPlugin].pszPlugInName);
+			fprintf(fpHeaderFile, "char %s_PLUGIN[] = {\\\n", rgpszPlugInName[nPlugins]);
 
-			for (size_t f = 0; f < fsize; f++)
+			if (1)
 			{
-				char strOffset[] = { "  /*87654321: */  " };
-				if (!(f % 32))
-					sprintf(strOffset, "  /*%08zX: */  ", f);
-				fprintf(fpHeaderFile, "%s0x%02X,%s", (f + 0) % 32 ? "" : strOffset, rgPlugIn[iPlugin].pBinary[f], (f + 1) % 32 ? "" : "\\\n");
+				char* pHex = malloc(HEX_BOUND(fsize) + 1);
+
+				if (NULL == pHex)
+				{
+					fprintf(stderr, "out of memory for \"%s\"\n", pszFile);
+					break;
+				}
+				fwrite(pHex, HexLines(pHex, rgpBinary[nPlugins], fsize), 1, fpHeaderFile);
+				free(pHex);
 			}
-			iPlugin++;
+			nPlugins++;
 			//if (i % 32)
 			//	fprintf(fp, "\\\n");
 
@@ -112,13 +482,34 @@ int main(int argc, char** argv)
 			//rgPlugIn[iPlugin].pszPlugInName = strrchr(&)
 		}
 
-		fprintf(fpHeaderFile, "struct _PLUGIN {\n    wchar_t *wcsCmd;\n    char *pStart;\n    size_t size;\n}plugin[] = {");
-
-		for (int i = 0; NULL != rgPlugIn[i].pszPlugInName; i++)
+		if (NULL != pszPakFile)
 		{
-			fprintf(fpHeaderFile,"\n    { L\"%s\", &%s_PLUGIN[0], sizeof(%s_PLUGIN) },\\", rgPlugIn[i].pszPlugInName, rgPlugIn[i].pszPlugInName, rgPlugIn[i].pszPlugInName);
+			//
+			// the shell reads the plugins from the package, the header only says so
+			//
+			if (!WritePluginPackage(pszPakFile, nPlugins, rgpszPlugInName, rgpBinary, rgSize, rgFlags))
+				break;
+			fprintf(fpHeaderFile, "#define UEFI_SHELL_PLUGIN_PACKAGE\n");
+		}
+		else
+		{
+			//
+			// sizes of plugins in the object are numbers, the arrays are incomplete in the header
+			//
+			if (NULL != pszObjFile && !WritePluginObject(pszObjFile, nPlugins, rgpszPlugInName, rgpBinary, rgSize))
+				break;
+
+			fprintf(fpHeaderFile, "struct _PLUGIN {\n    wchar_t *wcsCmd;\n    char *pStart;\n    size_t size;\n    unsigned Flags;\n}plugin[] = {");
+
+			for (int i = 0; i < nPlugins; i++)
+			{
+				if (NULL != pszObjFile)
+					fprintf(fpHeaderFile,"\n    { L\"%s\", &%s_PLUGIN[0], %zu, %u },\\", rgpszPlugInName[i], rgpszPlugInName[i], rgSize[i], rgFlags[i]);
+				else
+					fprintf(fpHeaderFile,"\n    { L\"%s\", &%s_PLUGIN[0], sizeof(%s_PLUGIN), %u },\\", rgpszPlugInName[i], rgpszPlugInName[i], rgpszPlugInName[i], rgFlags[i]);
+			}
+			fprintf(fpHeaderFile, "\n};\n\n");
 		}
-		fprintf(fpHeaderFile, "\n};\n\n");
 
 		//
 		// finalize header file
@@ -0,0 +1,137 @@
+//
+// PLUGINS.PAK layout, written by "bin2hex /pak:filename" and read by the shell from
+// \EFI\BOOT\PLUGINS.PAK on its boot volume
+//
+// PLUGINPAK_HEADER, PLUGINPAK_ENTRY[Count], payloads; little endian. The shell reads
+// the header and the index at boot, a payload when its plugin runs for the first time.
+//
+// A payload with PLUGINPAK_FLAG_COMPRESSED, in the package or embedded in plugins.h, is
+// a PLUGINLZ stream: uint32_t original size, then sequences of
+//   token           high nibble literal count, low nibble match length - PLUGINLZ_MIN_MATCH,
+//                   a nibble of 15 is continued by bytes added up to the first one below 255
+//   literals
+//   uint16_t offset match distance back from the current output position, 1..65535
+// the last sequence ends after its literals.
+//
+#ifndef _UEFI_SHELL_PLUGINPAK_H_
+#define _UEFI_SHELL_PLUGINPAK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PLUGINPAK_SIGNATURE "TOROPAK"           // 8 bytes including '\0'
+#define PLUGINPAK_VERSION   2
+#define PLUGINPAK_NAME_MAX  32                  // including '\0'
+
+#define PLUGINPAK_FLAG_COMPRESSED   1           // payload is a PLUGINLZ stream
+
+#define PLUGINLZ_MIN_MATCH  4
+
+typedef struct _PLUGINPAK_HEADER {
+    char     Signature[8];
+    uint32_t Version;
+    uint32_t Count;                             // index entries following the header
+} PLUGINPAK_HEADER;
+
+typedef struct _PLUGINPAK_ENTRY {
+    char     szName[PLUGINPAK_NAME_MAX];        // command name
+    uint64_t Offset;                            // payload offset from start of file
+    uint64_t Size;                              // payload size
+    uint32_t Hash;                              // PluginPakHash() of the payload
+    uint32_t Flags;                             // PLUGINPAK_FLAG_...
+} PLUGINPAK_ENTRY;
+
+//
+// FNV-1a, to detect a PLUGINS.PAK that does not match its index
+//
+static uint32_t PluginPakHash(const void* pData, size_t size)
+{
+    const unsigned char* p = pData;
+    uint32_t Hash = 0x811C9DC5;
+
+    while (size--)
+        Hash = (Hash ^ *p++) * 0x01000193;
+
+    return Hash;
+}
+
+//
+// original size of a PLUGINLZ stream, 0 if there is none
+//
+static size_t PluginLzSize(const void* pSrc, size_t SrcSize)
+{
+    const unsigned char* p = pSrc;
+
+    if (SrcSize < 4)
+        return 0;
+
+    return (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+}
+
+//
+// decompress a PLUGINLZ stream to pDst, PluginLzSize() bytes; 0 if the stream is damaged
+//
+static int PluginLzDecompress(const void* pSrc, size_t SrcSize, void* pDst)
+{
+    const unsigned char* ip = pSrc, * iend = ip + SrcSize, * pMatch;
+    unsigned char* op = pDst, * oend = op + PluginLzSize(pSrc, SrcSize);
+    unsigned Token, b;
+    size_t n, Offset;
+
+    if (SrcSize < 4)
+        return 0;
+    ip += 4;
+
+    while (op < oend)
+    {
+        if (ip >= iend)
+            return 0;
+        Token = *ip++;
+
+        //
+        // literals
+        //
+        n = Token >> 4;
+        if (15 == n)
+            do {
+                if (ip >= iend)
+                    return 0;
+                n += b = *ip++;
+            } while (255 == b);
+
+        if ((size_t)(iend - ip) < n || (size_t)(oend - op) < n)
+            return 0;
+        memcpy(op, ip, n);
+        op += n, ip += n;
+
+        if (op == oend)
+            break;
+
+        //
+        // match, may overlap the output it is copied to
+        //
+        if (iend - ip < 2)
+            return 0;
+        Offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        n = (Token & 15) + PLUGINLZ_MIN_MATCH;
+        if (15 + PLUGINLZ_MIN_MATCH == n)
+            do {
+                if (ip >= iend)
+                    return 0;
+                n += b = *ip++;
+            } while (255 == b);
+
+        if (0 == Offset || (size_t)(op - (unsigned char*)pDst) < Offset || (size_t)(oend - op) < n)
+            return 0;
+
+        for (pMatch = op - Offset; n--; )
+            *op++ = *pMatch++;
+    }
+
+    return ip == iend;
+}
+
+#endif//_UEFI_SHELL_PLUGINPAK_H_
@@ -10,17 +10,26 @@
 **/
 #define _CRT_SECURE_NO_WARNINGS
 #include "Shell.h"
+#include "../UefiShellCommandLib/ShellStringBuilder.h"
+#include "../UefiShellCommandLib/ShellHiiStringCache.h"
+#include "../UefiShellCommandLib/ShellCommandTable.h"
+#include "../UefiShellCommandLib/ShellMapHotPlug.h"
+#include "../UefiShellCommandLib/ShellMapIndex.h"
+#include "../UefiShellCommandLib/ShellToroVariable.h"
 #define NCDETRACE/* REMOVE TO ENABLE TRACES */
 #include "VERSION.h"
 #include "BUILDNUM.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <wchar.h>
 #include <cde.h>
 #include "plugins.h"
+#include "../bin2hex/pluginpak.h"
 #include <protocol\GraphicsOutput.h>
 
 #include <Protocol\DevicePath.h>
@@ -45,6 +54,12 @@ EFI_HANDLE        gImageHandle;
 EFI_SYSTEM_TABLE* gSystemTable;
 
 extern char* _strefierror(EFI_STATUS);
+extern UINTN EFIAPI ShellFileHandleGetOpenCount(VOID);
+extern UINTN EFIAPI ShellCommandGetMapGeneration(VOID);
+extern VOID ShellEnvBatchBegin(VOID);
+extern VOID ShellEnvBatchEnd(VOID);
+extern EFI_STATUS ShellEnvCommit(VOID);
+extern VOID FileOpenCacheFlush(IN BOOLEAN KeepRoots);
 char _gfDEFAULT_UEFI_DRIVE_NAMING = 0;          // 1 -> FS0:..., 0 -> A:...
 char*  _gPLUGINSTART;                           // .COFF plugin address im memory
 size_t _gPLUGINSIZE;                            // .COFF plugin size
@@ -58,6 +73,23 @@ extern unsigned _gCdeRTUefiShellInstanceType;   // flag to distinguish normal SH
 //                   For this case suppress F8-delay and supress all output messages 
 //      value of 2:  not yet defined
 
+//
+// \EFI\BOOT\BOOTX64.INI, read once by BootIniLoad() in main() before the shell starts.
+// Options are described by mBootIniKeys[], a new option is a field here and a line there.
+//
+typedef struct _BOOTINI_CONFIG {
+    char   fFound;                              // BOOTX64.INI exists on the boot volume
+    size_t TextColumns;                         // TEXTRESOLUTION <columns> <rows>, 0 if not given
+    size_t TextRows;
+    char   fDefaultUefiDriveNaming;             // DEFAULT_UEFI_DRIVE_NAMING: FS0:, FS1: ... instead of A:, B: ...
+    char   fPersistentHistory;                  // PERSISTENT_HISTORY: keep command history in \EFI\BOOT\HISTORY.TXT
+    size_t BootDelay;                           // BOOT_DELAY <milliseconds>: F5/F8 countdown, 0 for none
+} BOOTINI_CONFIG;
+
+#define BOOTINI_DEFAULT_BOOT_DELAY 1333         // milliseconds
+
+static BOOTINI_CONFIG mBootIni;
+
 //
 // Initialize the global structure
 //
@@ -127,6 +159,132 @@ CONST CHAR16         mNoNestingEnvVarName[]  = L"nonesting";
 CONST CHAR16         mNoNestingTrue[]        = L"True";
 CONST CHAR16         mNoNestingFalse[]       = L"False";
 
+//
+// State used to skip the per-command cwd existence probe in RunShellCommand.
+// The probe only runs when a SimpleFileSystem/BlockIo install notification
+// fired, the media or mapping changed, or an image/script ran since the
+// last time the cwd was found to exist.
+// The same notifications drive the hot-plug mapping updates, see
+// MapHotPlugProcess.
+//
+STATIC EFI_EVENT       mCwdFsNotifyEvent   = NULL;
+STATIC EFI_EVENT       mCwdBlkNotifyEvent  = NULL;
+STATIC VOID           *mCwdFsRegistration  = NULL;
+STATIC VOID           *mCwdBlkRegistration = NULL;
+STATIC BOOLEAN         mCwdCheckPending    = TRUE;
+STATIC CHAR16         *mCwdCheckedPath     = NULL;
+STATIC SHELL_MAP_LIST *mCwdCheckedMapping  = NULL;
+STATIC UINTN           mCwdCheckedMapGen   = 0;
+STATIC EFI_HANDLE      mCwdDevice          = NULL;
+STATIC VOID           *mCwdFileSystem      = NULL;
+STATIC BOOLEAN         mCwdMediaPresent    = FALSE;
+STATIC UINT32          mCwdMediaId         = 0;
+STATIC BOOLEAN         mMapHotPlugPending  = FALSE;
+
+//
+// Values the environment and alias caches returned to a caller and then
+// replaced.  The caller may still use such a value until the command that
+// obtained it returns.  Commands nest (Execute), and each level has its own
+// buffer free list, see SaveBufferList().  So a replaced value is kept on the
+// list of the outermost level it was returned at, and freed when that level
+// ends.  Levels past BUFFER_LIST_LEVELS share the last list.
+//
+#define BUFFER_LIST_LEVELS  16
+
+STATIC BUFFER_LIST  mLevelBufferList[BUFFER_LIST_LEVELS];
+STATIC UINTN        mBufferListLevel = 0;
+
+//
+// Command history ring.  The nodes of ShellInfoObject.ViewingSettings.CommandHistory,
+// which the StdIn line editor walks, come from one array sized from
+// PcdShellMaxHistoryCommandCount.  Once it is full the oldest node is reused, so
+// adding a line never walks the list.  With PERSISTENT_HISTORY in BOOTX64.INI the
+// lines are also appended to mHistoryFileName on the boot volume; the file is read
+// once at startup and rewritten there when it has grown past
+// HISTORY_FILE_COMPACT_FACTOR times the ring size.
+//
+#define HISTORY_FILE_COMPACT_FACTOR  4
+
+STATIC BUFFER_LIST      *mHistoryNodes     = NULL;
+STATIC UINTN            mHistoryCapacity   = 0;
+STATIC UINTN            mHistoryCount      = 0;
+STATIC UINTN            mHistoryNext       = 0;
+STATIC EFI_FILE_HANDLE  mHistoryFile       = NULL;
+STATIC CONST CHAR16     mHistoryFileName[] = L"\\EFI\\BOOT\\HISTORY.TXT";
+
+//
+// Console line reader for the interactive prompt.  All keys that are already
+// waiting are applied to the line before it is drawn again, and only the part
+// of the line that changed is redrawn, so pasted text is taken in as fast as it
+// arrives.  Complete lines that arrive behind the current one (a multi-line
+// paste) are queued in mPendingLines and run by the following prompts; a
+// trailing partial line is kept in mPendingPartial for the next prompt.  PAGE
+// UP/DOWN scroll the console logger history and INSERT toggles
+// ViewingSettings.InsertMode, as with the StdIn line editor.
+//
+
+typedef struct {
+  CHAR16                 *Buffer;       ///< The line, always NULL terminated.
+  UINTN                  MaxLength;     ///< Characters Buffer can hold, terminator excluded.
+  UINTN                  Length;        ///< Characters in the line.
+  UINTN                  Cursor;        ///< Insertion point.
+  UINTN                  Drawn;         ///< Characters of the line on the screen.
+  UINTN                  Dirty;         ///< First character that differs from the screen.
+  UINTN                  Columns;       ///< Width of the console.
+  UINTN                  StartColumn;   ///< Screen position of the first character.
+  UINTN                  StartRow;
+  BOOLEAN                Scrolling;     ///< PAGE UP/DOWN show the console history.
+  LIST_ENTRY             *History;      ///< CommandHistory node shown, or the list head.
+  EFI_SHELL_FILE_INFO    *TabList;      ///< TAB completion candidates, NULL if not completing.
+  LIST_ENTRY             *TabEntry;     ///< Candidate shown last, or the list head.
+  UINTN                  TabStart;      ///< Start of the completed name in the line.
+} SHELL_LINE_EDITOR;
+
+STATIC LIST_ENTRY  mPendingLines   = INITIALIZE_LIST_HEAD_VARIABLE (mPendingLines);
+STATIC CHAR16      *mPendingPartial = NULL;
+
+//
+// Boot phase timing.  BOOT_PHASE_MARK() stores the TSC at the end of a phase in
+// mBootPhaseTsc[], BootPhaseEntry is the entry to main().  The TSC rate is only
+// measured when the times are reported for the first time, after the first
+// prompt is shown, so the boot path pays one AsmReadTsc() per phase.
+//
+typedef enum {
+  BootPhaseEntry,
+  BootPhaseIni,
+  BootPhaseConsoleMode,
+  BootPhaseCountdown,
+  BootPhaseConsoleLogger,
+  BootPhaseProtocols,
+  BootPhaseShellInit,
+  BootPhaseMappings,
+  BootPhaseMapDisplay,
+  BootPhaseAliases,
+  BootPhaseStartupScript,
+  BootPhasePrompt,
+  BootPhaseMax
+} BOOT_PHASE;
+
+STATIC CONST CHAR16  *mBootPhaseNames[BootPhaseMax] = {
+  L"entry",
+  L"ini",
+  L"mode",
+  L"countdown",
+  L"logger",
+  L"protocols",
+  L"init",
+  L"mappings",
+  L"map",
+  L"alias",
+  L"startup",
+  L"prompt"
+};
+
+STATIC UINT64  mBootPhaseTsc[BootPhaseMax];
+STATIC UINT64  mBootTscPerSec = 0;
+
+#define BOOT_PHASE_MARK(Phase)  (mBootPhaseTsc[(Phase)] = AsmReadTsc ())
+
 /**
   Cleans off leading and trailing spaces and tabs.
 
@@ -137,22 +295,29 @@ TrimSpaces (
   IN CHAR16  **String
   )
 {
+  CHAR16  *Start;
+  UINTN   Length;
+
   ASSERT (String != NULL);
   ASSERT (*String != NULL);
   //
-  // Remove any spaces and tabs at the beginning of the (*String).
+  // Find the first character that is not a space or tab, and the length of
+  // the (*String) from there without the spaces and tabs at the end.
   //
-  while (((*String)[0] == L' ') || ((*String)[0] == L'\t')) {
-    CopyMem ((*String), (*String)+1, StrSize ((*String)) - sizeof ((*String)[0]));
+  for (Start = *String; (*Start == L' ') || (*Start == L'\t'); Start++) {
   }
 
-  //
-  // Remove any spaces and tabs at the end of the (*String).
-  //
-  while ((StrLen (*String) > 0) && (((*String)[StrLen ((*String))-1] == L' ') || ((*String)[StrLen ((*String))-1] == L'\t'))) {
-    (*String)[StrLen ((*String))-1] = CHAR_NULL;
+  Length = StrLen (Start);
+  while ((Length > 0) && ((Start[Length - 1] == L' ') || (Start[Length - 1] == L'\t'))) {
+    Length--;
+  }
+
+  if (Start != *String) {
+    CopyMem (*String, Start, Length * sizeof (CHAR16));
   }
 
+  (*String)[Length] = CHAR_NULL;
+
   return (EFI_SUCCESS);
 }
 
@@ -205,186 +370,1981 @@ FindNextInstance (
   @param[in] BeginPercent       pointer to the first percent.
   @param[in] EndPercent          pointer to the last percent.
 
-  @retval TRUE                          is a valid environment variable name.
-  @retval FALSE                         is NOT a valid environment variable name.
+  @retval TRUE                          is a valid environment variable name.
+  @retval FALSE                         is NOT a valid environment variable name.
+**/
+BOOLEAN
+IsValidEnvironmentVariableName (
+  IN CONST CHAR16  *BeginPercent,
+  IN CONST CHAR16  *EndPercent
+  )
+{
+  CONST CHAR16  *Walker;
+
+  Walker = NULL;
+
+  ASSERT (BeginPercent != NULL);
+  ASSERT (EndPercent != NULL);
+  ASSERT (BeginPercent < EndPercent);
+
+  if ((BeginPercent + 1) == EndPercent) {
+    return FALSE;
+  }
+
+  for (Walker = BeginPercent + 1; Walker < EndPercent; Walker++) {
+    if (
+        ((*Walker >= L'0') && (*Walker <= L'9')) ||
+        ((*Walker >= L'A') && (*Walker <= L'Z')) ||
+        ((*Walker >= L'a') && (*Walker <= L'z')) ||
+        (*Walker == L'_')
+        )
+    {
+      if ((Walker == BeginPercent + 1) && ((*Walker >= L'0') && (*Walker <= L'9'))) {
+        return FALSE;
+      } else {
+        continue;
+      }
+    } else {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+//
+// Command line lexer.  A command line is scanned once into an array of
+// tokens (space or tab separated parameters, with quoted sections kept
+// together); the preprocessing stages in RunShellCommand() read the token
+// flags and patch the array instead of rescanning the text for quotes,
+// ^ escapes, pipes and comments.
+//
+#define SHELL_TOKEN_QUOTED      BIT0    ///< Contains a "..." section.
+#define SHELL_TOKEN_ESCAPED     BIT1    ///< Contains a ^ escape.
+#define SHELL_TOKEN_PERCENT     BIT2    ///< Contains a %, escaped or not.
+#define SHELL_TOKEN_PIPE        BIT3    ///< Contains an unescaped | outside quotes.
+#define SHELL_TOKEN_REDIRECT    BIT4    ///< Starts with an unquoted <, > (optionally after 1 or 2).
+#define SHELL_TOKEN_HELP        BIT5    ///< Starts with -? once quotes and escapes are removed.
+#define SHELL_TOKEN_OPEN_QUOTE  BIT6    ///< Line only: the last quote is not closed.
+
+#define SHELL_LEX_MIN_TOKENS  8
+
+typedef struct {
+  UINTN     Start;                      ///< Offset of the first character in the line.
+  UINTN     Length;                     ///< Characters in the token, quotes and escapes included.
+  UINT32    Flags;                      ///< SHELL_TOKEN_* bits.
+} SHELL_TOKEN;
+
+typedef struct {
+  SHELL_TOKEN    *Tokens;
+  UINTN          Count;
+  UINTN          Capacity;
+  UINTN          Length;                ///< Characters scanned, up to a comment or the end of the line.
+  UINT32         Flags;                 ///< SHELL_TOKEN_* bits of all tokens combined.
+} SHELL_LEXED_LINE;
+
+/**
+  Make sure a lexed line can hold Count tokens.
+
+  @param[in, out] Lexed         The lexed line.
+  @param[in] Count              The number of tokens needed.
+
+  @retval EFI_SUCCESS           The space is available.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+ShellLexReserve (
+  IN OUT SHELL_LEXED_LINE  *Lexed,
+  IN     UINTN             Count
+  )
+{
+  UINTN        NewCapacity;
+  SHELL_TOKEN  *NewTokens;
+
+  if (Count <= Lexed->Capacity) {
+    return (EFI_SUCCESS);
+  }
+
+  NewCapacity = (Lexed->Capacity == 0) ? SHELL_LEX_MIN_TOKENS : Lexed->Capacity;
+  while (NewCapacity < Count) {
+    NewCapacity *= 2;
+  }
+
+  NewTokens = ReallocatePool (
+                Lexed->Capacity * sizeof (SHELL_TOKEN),
+                NewCapacity * sizeof (SHELL_TOKEN),
+                Lexed->Tokens
+                );
+  if (NewTokens == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  Lexed->Tokens   = NewTokens;
+  Lexed->Capacity = NewCapacity;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Free the token array of a lexed line.
+
+  @param[in, out] Lexed         The lexed line.
+**/
+STATIC
+VOID
+ShellLexFree (
+  IN OUT SHELL_LEXED_LINE  *Lexed
+  )
+{
+  SHELL_FREE_NON_NULL (Lexed->Tokens);
+  ZeroMem (Lexed, sizeof (SHELL_LEXED_LINE));
+}
+
+/**
+  Finish the token being scanned and fold its flags into the line.
+
+  @param[in] Line               The command line.
+  @param[in, out] Lexed         The lexed line.
+  @param[in, out] Token         The token being scanned.
+  @param[in] End                Offset of the first character after the token.
+**/
+STATIC
+VOID
+ShellLexEndToken (
+  IN     CONST CHAR16      *Line,
+  IN OUT SHELL_LEXED_LINE  *Lexed,
+  IN OUT SHELL_TOKEN       *Token,
+  IN     UINTN             End
+  )
+{
+  CONST CHAR16  *Walker;
+
+  Token->Length = End - Token->Start;
+
+  Walker = Line + Token->Start;
+  if ((*Walker == L'1') || (*Walker == L'2')) {
+    Walker++;
+  }
+
+  if (((*Walker == L'<') || (*Walker == L'>')) &&
+      ((Token->Flags & (SHELL_TOKEN_QUOTED | SHELL_TOKEN_ESCAPED)) == 0))
+  {
+    Token->Flags |= SHELL_TOKEN_REDIRECT;
+  }
+
+  Lexed->Flags |= Token->Flags;
+}
+
+/**
+  Split a command line into tokens.
+
+  A ^ escapes the character after it and a " toggles quoting; spaces and tabs
+  outside quotes separate tokens.  As in script files, a # ends the line even
+  inside quotes when StopAtComment is TRUE, unless the character before it is
+  a ^.  So "echo ^^#" keeps "^^#" on the line (an escaped ^ and a #), and
+  "echo a#b" ends at the #.  A quote left open makes the rest of the line part
+  of the last token and sets SHELL_TOKEN_OPEN_QUOTE; a line that starts with
+  an open quote, such as "ls, is then a single token that the caller rejects
+  as a first parameter.
+
+  @param[in] Line               The command line.  It is not modified.
+  @param[in] StopAtComment      TRUE to stop scanning at an unescaped #.
+  @param[in, out] Lexed         The lexed line.  Its token array is reused.
+
+  @retval EFI_SUCCESS           The line was split.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+ShellLexCommandLine (
+  IN     CONST CHAR16      *Line,
+  IN     BOOLEAN           StopAtComment,
+  IN OUT SHELL_LEXED_LINE  *Lexed
+  )
+{
+  SHELL_TOKEN  *Token;
+  UINTN        Index;
+  UINTN        Kept;
+  CHAR16       FirstKept;
+  CHAR16       Char;
+  BOOLEAN      InQuote;
+  BOOLEAN      Escaped;
+
+  Lexed->Count = 0;
+  Lexed->Flags = 0;
+  Token        = NULL;
+  Kept         = 0;
+  FirstKept    = CHAR_NULL;
+  InQuote      = FALSE;
+
+  for (Index = 0; Line[Index] != CHAR_NULL; Index++) {
+    Char = Line[Index];
+    if (StopAtComment && (Char == L'#') && ((Index == 0) || (Line[Index - 1] != L'^'))) {
+      break;
+    }
+
+    if (!InQuote && ((Char == L' ') || (Char == L'\t'))) {
+      if (Token != NULL) {
+        ShellLexEndToken (Line, Lexed, Token, Index);
+        Token = NULL;
+      }
+
+      continue;
+    }
+
+    if (Token == NULL) {
+      if (EFI_ERROR (ShellLexReserve (Lexed, Lexed->Count + 1))) {
+        return (EFI_OUT_OF_RESOURCES);
+      }
+
+      Token        = &Lexed->Tokens[Lexed->Count++];
+      Token->Start = Index;
+      Token->Flags = 0;
+      Kept         = 0;
+    }
+
+    Escaped = FALSE;
+    if ((Char == L'^') && (Line[Index + 1] != CHAR_NULL)) {
+      Token->Flags |= SHELL_TOKEN_ESCAPED;
+      Escaped       = TRUE;
+      Char          = Line[++Index];
+    } else if (Char == L'\"') {
+      Token->Flags |= SHELL_TOKEN_QUOTED;
+      InQuote       = (BOOLEAN)!InQuote;
+      continue;
+    }
+
+    if (Char == L'%') {
+      Token->Flags |= SHELL_TOKEN_PERCENT;
+    } else if ((Char == L'|') && !Escaped && !InQuote) {
+      Token->Flags |= SHELL_TOKEN_PIPE;
+    }
+
+    if ((Kept == 1) && (FirstKept == L'-') && (Char == L'?')) {
+      Token->Flags |= SHELL_TOKEN_HELP;
+    } else if (Kept == 0) {
+      FirstKept = Char;
+    }
+
+    Kept++;
+  }
+
+  if (Token != NULL) {
+    ShellLexEndToken (Line, Lexed, Token, Index);
+  }
+
+  if (InQuote) {
+    Lexed->Flags |= SHELL_TOKEN_OPEN_QUOTE;
+  }
+
+  Lexed->Length = Index;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Drop the spaces and tabs before the first and after the last token, and
+  anything after the scanned part of the line (a comment).
+
+  @param[in, out] Line          The command line the tokens refer to.
+  @param[in, out] Lexed         The lexed line.
+**/
+STATIC
+VOID
+ShellLexTrim (
+  IN OUT CHAR16            *Line,
+  IN OUT SHELL_LEXED_LINE  *Lexed
+  )
+{
+  UINTN  First;
+  UINTN  End;
+  UINTN  Index;
+
+  if (Lexed->Count == 0) {
+    Line[0]       = CHAR_NULL;
+    Lexed->Length = 0;
+    return;
+  }
+
+  First = Lexed->Tokens[0].Start;
+  End   = Lexed->Tokens[Lexed->Count - 1].Start + Lexed->Tokens[Lexed->Count - 1].Length;
+  if (First > 0) {
+    CopyMem (Line, Line + First, (End - First) * sizeof (CHAR16));
+    for (Index = 0; Index < Lexed->Count; Index++) {
+      Lexed->Tokens[Index].Start -= First;
+    }
+  }
+
+  Line[End - First] = CHAR_NULL;
+  Lexed->Length     = End - First;
+}
+
+/**
+  Copy a token with its quotes and ^ escapes removed, as GetNextParameter()
+  returns it.
+
+  @param[in] Line               The command line the token refers to.
+  @param[in] Token              The token.
+  @param[out] Buffer            Receives the parameter.  It must hold at least
+                                Token->Length + 1 characters.
+
+  @return                       Buffer.
+**/
+STATIC
+CHAR16 *
+ShellLexCopyToken (
+  IN  CONST CHAR16       *Line,
+  IN  CONST SHELL_TOKEN  *Token,
+  OUT CHAR16             *Buffer
+  )
+{
+  UINTN  Index;
+  UINTN  End;
+  UINTN  Out;
+
+  End = Token->Start + Token->Length;
+  Out = 0;
+  for (Index = Token->Start; Index < End; Index++) {
+    if ((Line[Index] == L'^') && (Index + 1 < End)) {
+      Index++;
+    } else if (Line[Index] == L'\"') {
+      continue;
+    }
+
+    Buffer[Out++] = Line[Index];
+  }
+
+  Buffer[Out] = CHAR_NULL;
+  return (Buffer);
+}
+
+/**
+  Replace a token with new text, or insert new text in front of it, and patch
+  the token array to match.  Only the new text is lexed, unless it leaves a
+  quote open and so changes how the rest of the line reads.
+
+  Inserted text must end with a space to stay apart from the token after it.
+
+  @param[in, out] Line          The command line.  It is reallocated.
+  @param[in, out] Lexed         The lexed line.
+  @param[in] Index              The token to replace or insert before.
+  @param[in] Replace            TRUE to replace the token, FALSE to insert.
+  @param[in] Text               The new text.
+
+  @retval EFI_SUCCESS           The line and the tokens were updated.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+ShellLexSplice (
+  IN OUT CHAR16            **Line,
+  IN OUT SHELL_LEXED_LINE  *Lexed,
+  IN     UINTN             Index,
+  IN     BOOLEAN           Replace,
+  IN     CONST CHAR16      *Text
+  )
+{
+  SHELL_STRING_BUILDER  Builder;
+  SHELL_LEXED_LINE      Inserted;
+  CHAR16                *NewLine;
+  UINTN                 Offset;
+  UINTN                 Removed;
+  UINTN                 TextLength;
+  UINTN                 Tail;
+  UINTN                 Walk;
+  EFI_STATUS            Status;
+
+  ASSERT (Index < Lexed->Count);
+
+  Offset     = Lexed->Tokens[Index].Start;
+  Removed    = Replace ? Lexed->Tokens[Index].Length : 0;
+  Tail       = Lexed->Length - Offset - Removed;
+  TextLength = StrLen (Text);
+
+  ShellStrBuilderInit (&Builder);
+  ShellStrBuilderReserve (&Builder, Offset + TextLength + Tail);
+  if (Offset > 0) {
+    ShellStrBuilderAppend (&Builder, *Line, Offset);
+  }
+
+  ShellStrBuilderAppend (&Builder, Text, 0);
+  if (Tail > 0) {
+    ShellStrBuilderAppend (&Builder, *Line + Offset + Removed, Tail);
+  }
+
+  NewLine = ShellStrBuilderFinalize (&Builder);
+  if (NewLine == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  ZeroMem (&Inserted, sizeof (Inserted));
+  Status = ShellLexCommandLine (Text, FALSE, &Inserted);
+  if (!EFI_ERROR (Status) && ((Inserted.Flags & SHELL_TOKEN_OPEN_QUOTE) != 0)) {
+    Status = ShellLexCommandLine (NewLine, FALSE, Lexed);
+  } else if (!EFI_ERROR (Status)) {
+    Status = ShellLexReserve (Lexed, Lexed->Count - (Replace ? 1 : 0) + Inserted.Count);
+    if (!EFI_ERROR (Status)) {
+      //
+      // Move the tokens after the spliced one into place, then drop in the new ones.
+      //
+      CopyMem (
+        &Lexed->Tokens[Index + Inserted.Count],
+        &Lexed->Tokens[Index + (Replace ? 1 : 0)],
+        (Lexed->Count - Index - (Replace ? 1 : 0)) * sizeof (SHELL_TOKEN)
+        );
+      Lexed->Count = Lexed->Count - (Replace ? 1 : 0) + Inserted.Count;
+      for (Walk = Index + Inserted.Count; Walk < Lexed->Count; Walk++) {
+        Lexed->Tokens[Walk].Start = Lexed->Tokens[Walk].Start + TextLength - Removed;
+      }
+
+      for (Walk = 0; Walk < Inserted.Count; Walk++) {
+        Lexed->Tokens[Index + Walk]        = Inserted.Tokens[Walk];
+        Lexed->Tokens[Index + Walk].Start += Offset;
+      }
+
+      Lexed->Flags = 0;
+      for (Walk = 0; Walk < Lexed->Count; Walk++) {
+        Lexed->Flags |= Lexed->Tokens[Walk].Flags;
+      }
+
+      Lexed->Length = Offset + TextLength + Tail;
+    }
+  }
+
+  ShellLexFree (&Inserted);
+  if (EFI_ERROR (Status)) {
+    FreePool (NewLine);
+    return (Status);
+  }
+
+  FreePool (*Line);
+  *Line = NewLine;
+  return (EFI_SUCCESS);
+}
+
+/**
+  Determine if a command line contains a split operation
+
+  @param[in] CmdLine      The command line to parse.
+
+  @retval TRUE            CmdLine has a valid split.
+  @retval FALSE           CmdLine does not have a valid split.
+**/
+BOOLEAN
+ContainsSplit (
+  IN CONST CHAR16  *CmdLine
+  )
+{
+  SHELL_LEXED_LINE  Lexed;
+  BOOLEAN           Split;
+
+  ZeroMem (&Lexed, sizeof (Lexed));
+  Split = FALSE;
+  if (!EFI_ERROR (ShellLexCommandLine (CmdLine, FALSE, &Lexed))) {
+    Split = (BOOLEAN)((Lexed.Flags & SHELL_TOKEN_PIPE) != 0);
+  }
+
+  ShellLexFree (&Lexed);
+
+  //CDETRACE((TRCINF(1) "SPLIT: %d\n", Split));
+
+  return (Split);
+}
+
+/**
+  Function to start monitoring for CTRL-S using SimpleTextInputEx.  This
+  feature's enabled state was not known when the shell initially launched.
+
+  @retval EFI_SUCCESS           The feature is enabled.
+  @retval EFI_OUT_OF_RESOURCES  There is not enough memory available.
+**/
+EFI_STATUS
+InternalEfiShellStartCtrlSMonitor (
+  VOID
+  )
+{
+  EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL  *SimpleEx;
+  EFI_KEY_DATA                       KeyData;
+  EFI_STATUS                         Status;
+
+  Status = gBS->OpenProtocol (
+                  gST->ConsoleInHandle,
+                  &gEfiSimpleTextInputExProtocolGuid,
+                  (VOID **)&SimpleEx,
+                  gImageHandle,
+                  NULL,
+                  EFI_OPEN_PROTOCOL_GET_PROTOCOL
+                  );
+  if (EFI_ERROR (Status)) {
+    ShellPrintHiiEx (
+      -1,
+      -1,
+      NULL,
+      STRING_TOKEN (STR_SHELL_NO_IN_EX),
+      ShellInfoObject.HiiHandle
+      );
+    return (EFI_SUCCESS);
+  }
+
+  KeyData.KeyState.KeyToggleState = 0;
+  KeyData.Key.ScanCode            = 0;
+  KeyData.KeyState.KeyShiftState  = EFI_SHIFT_STATE_VALID|EFI_LEFT_CONTROL_PRESSED;
+  KeyData.Key.UnicodeChar         = L's';
+
+  Status = SimpleEx->RegisterKeyNotify (
+                       SimpleEx,
+                       &KeyData,
+                       NotificationFunction,
+                       &ShellInfoObject.CtrlSNotifyHandle1
+                       );
+
+  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_RIGHT_CONTROL_PRESSED;
+  if (!EFI_ERROR (Status)) {
+    Status = SimpleEx->RegisterKeyNotify (
+                         SimpleEx,
+                         &KeyData,
+                         NotificationFunction,
+                         &ShellInfoObject.CtrlSNotifyHandle2
+                         );
+  }
+
+  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_LEFT_CONTROL_PRESSED;
+  KeyData.Key.UnicodeChar        = 19;
+
+  if (!EFI_ERROR (Status)) {
+    Status = SimpleEx->RegisterKeyNotify (
+                         SimpleEx,
+                         &KeyData,
+                         NotificationFunction,
+                         &ShellInfoObject.CtrlSNotifyHandle3
+                         );
+  }
+
+  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_RIGHT_CONTROL_PRESSED;
+  if (!EFI_ERROR (Status)) {
+    Status = SimpleEx->RegisterKeyNotify (
+                         SimpleEx,
+                         &KeyData,
+                         NotificationFunction,
+                         &ShellInfoObject.CtrlSNotifyHandle4
+                         );
+  }
+
+  return (Status);
+}
+
+/**
+  Notification function for SimpleFileSystem and BlockIo protocol installs.
+
+  Devices arriving, leaving through a reinstall, or changing media force the
+  next cwd check in RunShellCommand to go to the file system, and have the
+  new handles mapped before the next command.
+
+  @param[in] Event      The event that fired.
+  @param[in] Context    Not used.
+**/
+VOID
+EFIAPI
+CwdProtocolNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  mCwdCheckPending   = TRUE;
+  mMapHotPlugPending = TRUE;
+}
+
+/**
+  Start watching for file system changes that may invalidate the cwd.
+
+  @retval EFI_SUCCESS   The notifications are registered.
+  @return               An error from CreateEvent or RegisterProtocolNotify.
+**/
+EFI_STATUS
+CwdTrackingStart (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+
+  mCwdCheckPending = TRUE;
+
+  Status = gBS->CreateEvent (EVT_NOTIFY_SIGNAL, TPL_CALLBACK, CwdProtocolNotify, NULL, &mCwdFsNotifyEvent);
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->RegisterProtocolNotify (&gEfiSimpleFileSystemProtocolGuid, mCwdFsNotifyEvent, &mCwdFsRegistration);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->CreateEvent (EVT_NOTIFY_SIGNAL, TPL_CALLBACK, CwdProtocolNotify, NULL, &mCwdBlkNotifyEvent);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->RegisterProtocolNotify (&gEfiBlockIoProtocolGuid, mCwdBlkNotifyEvent, &mCwdBlkRegistration);
+  }
+
+  return (Status);
+}
+
+/**
+  Stop watching for file system changes and free the tracking state.
+**/
+VOID
+CwdTrackingStop (
+  VOID
+  )
+{
+  if (mCwdFsNotifyEvent != NULL) {
+    gBS->CloseEvent (mCwdFsNotifyEvent);
+    mCwdFsNotifyEvent = NULL;
+  }
+
+  if (mCwdBlkNotifyEvent != NULL) {
+    gBS->CloseEvent (mCwdBlkNotifyEvent);
+    mCwdBlkNotifyEvent = NULL;
+  }
+
+  SHELL_FREE_NON_NULL (mCwdCheckedPath);
+  mCwdCheckPending = TRUE;
+}
+
+/**
+  Bring the mappings up to date with the devices that arrived or left.
+
+  Only the handles reported by the install notifications are mapped.  As
+  UEFI does not report uninstalls, the mapped devices are checked for
+  removal when a notification fired or CheckRemovals is set.
+
+  @param[in] CheckRemovals  TRUE to check for removed devices even if no
+                            notification fired.
+**/
+STATIC
+VOID
+MapHotPlugProcess (
+  IN BOOLEAN  CheckRemovals
+  )
+{
+  SHELL_MAP_LIST  *CurMapping;
+  VOID            *Registrations[2];
+  EFI_HANDLE      Handle;
+  UINTN           Size;
+  UINTN           Index;
+  BOOLEAN         Changed;
+
+  if ((PcdGet8 (PcdShellSupportLevel) < 1) || (!CheckRemovals && !mMapHotPlugPending)) {
+    return;
+  }
+
+  CurMapping = gShellCurMapping;
+  Changed    = ShellCommandMapDeviceRemoval ();
+
+  if (mMapHotPlugPending) {
+    mMapHotPlugPending = FALSE;
+
+    //
+    // A file system may now resolve to another handle than the map index has.
+    //
+    ShellCommandMapIndexInvalidate ();
+    Registrations[0]   = mCwdFsRegistration;
+    Registrations[1]   = mCwdBlkRegistration;
+    for (Index = 0; Index < ARRAY_SIZE (Registrations); Index++) {
+      if (Registrations[Index] == NULL) {
+        continue;
+      }
+
+      //
+      // Each call returns the next handle installed since the last call.
+      //
+      for ( ; ;) {
+        Size = sizeof (Handle);
+        if (EFI_ERROR (gBS->LocateHandle (ByRegisterNotify, NULL, Registrations[Index], &Size, &Handle))) {
+          break;
+        }
+
+        if (ShellCommandMapDeviceArrival (Handle)) {
+          Changed = TRUE;
+        }
+      }
+    }
+  }
+
+  if (!Changed) {
+    return;
+  }
+
+  FileOpenCacheFlush (FALSE);
+  mCwdCheckPending = TRUE;
+
+  if ((CurMapping != NULL) && (gShellCurMapping == NULL)) {
+    InternalEfiShellSetEnv (L"cwd", NULL, TRUE);
+  }
+}
+
+/**
+  Find the file system under the current mapping and read its media state.
+
+  This does not touch the file system itself.
+
+  @param[out] Device          The SimpleFileSystem handle.
+  @param[out] FileSystem      The SimpleFileSystem interface on Device.
+  @param[out] MediaPresent    The BlockIo media presence, TRUE without BlockIo.
+  @param[out] MediaId         The BlockIo media id, 0 without BlockIo.
+
+  @retval EFI_SUCCESS         The file system was found.
+  @retval EFI_NOT_FOUND       There is no current mapping or no file system on it.
+**/
+STATIC
+EFI_STATUS
+CwdGetDeviceState (
+  OUT EFI_HANDLE  *Device,
+  OUT VOID        **FileSystem,
+  OUT BOOLEAN     *MediaPresent,
+  OUT UINT32      *MediaId
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  EFI_BLOCK_IO_PROTOCOL     *BlockIo;
+
+  if ((gShellCurMapping == NULL) || (gShellCurMapping->DevicePath == NULL)) {
+    return (EFI_NOT_FOUND);
+  }
+
+  DevicePath = gShellCurMapping->DevicePath;
+  if (EFI_ERROR (gBS->LocateDevicePath (&gEfiSimpleFileSystemProtocolGuid, &DevicePath, Device))) {
+    return (EFI_NOT_FOUND);
+  }
+
+  if (EFI_ERROR (gBS->HandleProtocol (*Device, &gEfiSimpleFileSystemProtocolGuid, FileSystem))) {
+    return (EFI_NOT_FOUND);
+  }
+
+  *MediaPresent = TRUE;
+  *MediaId      = 0;
+  if (!EFI_ERROR (gBS->HandleProtocol (*Device, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo)) && (BlockIo->Media != NULL)) {
+    *MediaPresent = BlockIo->Media->MediaPresent;
+    *MediaId      = BlockIo->Media->MediaId;
+  }
+
+  return (EFI_SUCCESS);
+}
+
+/**
+  Determine whether the cwd has to be probed on the file system again.
+
+  @param[in] CurDir     The current directory.
+
+  @retval TRUE          Something changed since the last successful probe.
+  @retval FALSE         The last probe result still holds.
+**/
+STATIC
+BOOLEAN
+CwdNeedsValidation (
+  IN CONST CHAR16  *CurDir
+  )
+{
+  EFI_HANDLE  Device;
+  VOID        *FileSystem;
+  BOOLEAN     MediaPresent;
+  UINT32      MediaId;
+
+  if (  mCwdCheckPending
+     || (mCwdCheckedPath == NULL)
+     || (mCwdCheckedMapping != gShellCurMapping)
+     || (mCwdCheckedMapGen != ShellCommandGetMapGeneration ())
+     || (StrCmp (mCwdCheckedPath, CurDir) != 0))
+  {
+    return (TRUE);
+  }
+
+  if (EFI_ERROR (CwdGetDeviceState (&Device, &FileSystem, &MediaPresent, &MediaId))) {
+    return (TRUE);
+  }
+
+  return ((BOOLEAN)(  (Device != mCwdDevice)
+                   || (FileSystem != mCwdFileSystem)
+                   || (MediaPresent != mCwdMediaPresent)
+                   || (MediaId != mCwdMediaId)));
+}
+
+/**
+  Remember that the cwd was found to exist in the current state.
+
+  @param[in] CurDir     The current directory that was probed.
+**/
+STATIC
+VOID
+CwdValidated (
+  IN CONST CHAR16  *CurDir
+  )
+{
+  SHELL_FREE_NON_NULL (mCwdCheckedPath);
+  mCwdCheckPending = TRUE;
+
+  if (EFI_ERROR (CwdGetDeviceState (&mCwdDevice, &mCwdFileSystem, &mCwdMediaPresent, &mCwdMediaId))) {
+    return;
+  }
+
+  mCwdCheckedPath = AllocateCopyPool (StrSize (CurDir), CurDir);
+  if (mCwdCheckedPath != NULL) {
+    mCwdCheckedMapping = gShellCurMapping;
+    mCwdCheckedMapGen  = ShellCommandGetMapGeneration ();
+    mCwdCheckPending   = FALSE;
+  }
+}
+
+/**
+  Allocate the command history ring on first use.
+
+  @retval TRUE          The ring is available.
+  @retval FALSE         History is disabled or the allocation failed.
+**/
+STATIC
+BOOLEAN
+CommandHistoryReady (
+  VOID
+  )
+{
+  if (mHistoryNodes != NULL) {
+    return (TRUE);
+  }
+
+  mHistoryCapacity = PcdGet16 (PcdShellMaxHistoryCommandCount);
+  if (mHistoryCapacity == 0) {
+    return (FALSE);
+  }
+
+  mHistoryNodes = AllocateZeroPool (mHistoryCapacity * sizeof (BUFFER_LIST));
+  return ((BOOLEAN)(mHistoryNodes != NULL));
+}
+
+/**
+  Put a line into the command history ring, replacing the oldest one if the
+  ring is full.
+
+  @param[in] Buffer     The pool allocated line.  The ring takes ownership.
+**/
+STATIC
+VOID
+CommandHistoryInsert (
+  IN CHAR16  *Buffer
+  )
+{
+  BUFFER_LIST  *Node;
+
+  Node = &mHistoryNodes[mHistoryNext];
+  if (mHistoryCount == mHistoryCapacity) {
+    RemoveEntryList (&Node->Link);
+    SHELL_FREE_NON_NULL (Node->Buffer);
+  } else {
+    mHistoryCount++;
+  }
+
+  Node->Buffer = Buffer;
+  InsertTailList (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Node->Link);
+  mHistoryNext = (mHistoryNext + 1) % mHistoryCapacity;
+}
+
+/**
+  Append one line to the history file and flush it, so the line survives a reset.
+
+  @param[in] Line       The line to write.
+
+  @retval EFI_SUCCESS   The line was written.
+  @return               The error from the file system.
+**/
+STATIC
+EFI_STATUS
+CommandHistoryWriteLine (
+  IN CONST CHAR16  *Line
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Size;
+
+  Size   = StrLen (Line) * sizeof (CHAR16);
+  Status = FileHandleWrite (mHistoryFile, &Size, (VOID *)Line);
+  if (!EFI_ERROR (Status)) {
+    Size   = StrLen (L"\r\n") * sizeof (CHAR16);
+    Status = FileHandleWrite (mHistoryFile, &Size, L"\r\n");
+  }
+
+  return (Status);
+}
+
+/**
+  Rewrite the history file with the lines currently in the ring.
+
+  @retval EFI_SUCCESS   The file was rewritten.
+  @return               The error from the file system.
+**/
+STATIC
+EFI_STATUS
+CommandHistoryCompactFile (
+  VOID
+  )
+{
+  EFI_STATUS   Status;
+  BUFFER_LIST  *Walker;
+  CHAR16       Bom;
+  UINTN        Size;
+
+  Status = FileHandleSetSize (mHistoryFile, 0);
+  if (!EFI_ERROR (Status)) {
+    Status = FileHandleSetPosition (mHistoryFile, 0);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Bom    = gUnicodeFileTag;
+    Size   = sizeof (Bom);
+    Status = FileHandleWrite (mHistoryFile, &Size, &Bom);
+  }
+
+  for ( Walker = (BUFFER_LIST *)GetFirstNode (&ShellInfoObject.ViewingSettings.CommandHistory.Link)
+        ; !EFI_ERROR (Status) && !IsNull (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Walker->Link)
+        ; Walker = (BUFFER_LIST *)GetNextNode (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Walker->Link)
+        )
+  {
+    Status = CommandHistoryWriteLine (Walker->Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = FileHandleFlush (mHistoryFile);
+  }
+
+  return (Status);
+}
+
+/**
+  Open the history file on the boot volume, load its last lines into the
+  command history ring and leave the file positioned for appending.
+
+  Failures are not reported; the shell then simply runs without a persistent
+  history.
+**/
+STATIC
+VOID
+CommandHistoryLoad (
+  VOID
+  )
+{
+  EFI_STATUS                       Status;
+  EFI_LOADED_IMAGE_PROTOCOL        *LoadedImage;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *FileSystem;
+  EFI_FILE_HANDLE                  Root;
+  UINT64                           FileSize;
+  CHAR16                           *Contents;
+  CHAR16                           *Line;
+  CHAR16                           *Walker;
+  CHAR16                           *LineCopy;
+  UINTN                            Size;
+  UINTN                            Length;
+  UINTN                            LineCount;
+
+  if ((mHistoryFile != NULL) || !CommandHistoryReady ()) {
+    return;
+  }
+
+  Status = gBS->HandleProtocol (gImageHandle, &gEfiLoadedImageProtocolGuid, (VOID **)&LoadedImage);
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->HandleProtocol (LoadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&FileSystem);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = FileSystem->OpenVolume (FileSystem, &Root);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  Status = Root->Open (
+                   Root,
+                   &mHistoryFile,
+                   (CHAR16 *)mHistoryFileName,
+                   EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                   0
+                   );
+  Root->Close (Root);
+  if (EFI_ERROR (Status)) {
+    mHistoryFile = NULL;
+    return;
+  }
+
+  Contents = NULL;
+  FileSize = 0;
+  Status   = FileHandleGetSize (mHistoryFile, &FileSize);
+  if (!EFI_ERROR (Status) && (FileSize >= sizeof (CHAR16))) {
+    Size     = (UINTN)FileSize & ~(sizeof (CHAR16) - 1);
+    Contents = AllocatePool (Size + sizeof (CHAR16));
+    if (Contents != NULL) {
+      Status = FileHandleRead (mHistoryFile, &Size, Contents);
+      if (EFI_ERROR (Status)) {
+        Size = 0;
+      }
+
+      Contents[Size / sizeof (CHAR16)] = CHAR_NULL;
+    }
+  }
+
+  //
+  // Load the lines; the ring keeps the newest ones.  A file that was not
+  // written by this code (no BOM) is left alone.
+  //
+  LineCount = 0;
+  if ((Contents != NULL) && (Contents[0] == gUnicodeFileTag)) {
+    for (Line = Contents + 1; *Line != CHAR_NULL; Line = Walker) {
+      for (Walker = Line; (*Walker != CHAR_NULL) && (*Walker != L'\n'); Walker++) {
+      }
+
+      Length = Walker - Line;
+      if (*Walker == L'\n') {
+        Walker++;
+      }
+
+      if ((Length > 0) && (Line[Length - 1] == L'\r')) {
+        Length--;
+      }
+
+      if (Length == 0) {
+        continue;
+      }
+
+      LineCopy = AllocateCopyPool ((Length + 1) * sizeof (CHAR16), Line);
+      if (LineCopy == NULL) {
+        break;
+      }
+
+      LineCopy[Length] = CHAR_NULL;
+      CommandHistoryInsert (LineCopy);
+      LineCount++;
+    }
+  } else if ((Contents != NULL) || EFI_ERROR (Status)) {
+    FileHandleClose (mHistoryFile);
+    mHistoryFile = NULL;
+  }
+
+  SHELL_FREE_NON_NULL (Contents);
+
+  if (mHistoryFile == NULL) {
+    return;
+  }
+
+  if ((FileSize < sizeof (CHAR16)) || (LineCount > HISTORY_FILE_COMPACT_FACTOR * mHistoryCapacity)) {
+    Status = CommandHistoryCompactFile ();
+  } else {
+    Status = FileHandleSetPosition (mHistoryFile, FileSize);
+  }
+
+  if (EFI_ERROR (Status)) {
+    FileHandleClose (mHistoryFile);
+    mHistoryFile = NULL;
+  }
+}
+
+/**
+  Close the history file and free the command history ring.
+**/
+STATIC
+VOID
+CommandHistoryFree (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  if (mHistoryFile != NULL) {
+    FileHandleClose (mHistoryFile);
+    mHistoryFile = NULL;
+  }
+
+  if (mHistoryNodes != NULL) {
+    for (Index = 0; Index < mHistoryCapacity; Index++) {
+      SHELL_FREE_NON_NULL (mHistoryNodes[Index].Buffer);
+    }
+
+    FreePool (mHistoryNodes);
+    mHistoryNodes = NULL;
+  }
+
+  mHistoryCount = 0;
+  mHistoryNext  = 0;
+  InitializeListHead (&ShellInfoObject.ViewingSettings.CommandHistory.Link);
+}
+
+/**
+  Free the command lines queued by the console line reader.
+**/
+STATIC
+VOID
+LineEditorFreePending (
+  VOID
+  )
+{
+  BUFFER_LIST  *Node;
+
+  while (!IsListEmpty (&mPendingLines)) {
+    Node = (BUFFER_LIST *)GetFirstNode (&mPendingLines);
+    RemoveEntryList (&Node->Link);
+    SHELL_FREE_NON_NULL (Node->Buffer);
+    FreePool (Node);
+  }
+
+  SHELL_FREE_NON_NULL (mPendingPartial);
+}
+
+/**
+  Move the console cursor to a character of the line.
+
+  @param[in] Editor     The line editor.
+  @param[in] Index      The character.
+**/
+STATIC
+VOID
+LineEditorSetCursor (
+  IN SHELL_LINE_EDITOR  *Editor,
+  IN UINTN              Index
+  )
+{
+  UINTN  Linear;
+
+  Linear = Editor->StartColumn + Index;
+  gST->ConOut->SetCursorPosition (gST->ConOut, Linear % Editor->Columns, Editor->StartRow + Linear / Editor->Columns);
+}
+
+/**
+  Replace characters of the line.  Text that does not fit is cut off.
+
+  @param[in, out] Editor    The line editor.
+  @param[in] Start          First character to replace.
+  @param[in] End            First character after the ones to replace.
+  @param[in] Text           The new characters.  Can be NULL if TextLength is 0.
+  @param[in] TextLength     Number of new characters.
+**/
+STATIC
+VOID
+LineEditorReplace (
+  IN OUT SHELL_LINE_EDITOR  *Editor,
+  IN     UINTN              Start,
+  IN     UINTN              End,
+  IN     CONST CHAR16       *Text,
+  IN     UINTN              TextLength
+  )
+{
+  UINTN  Tail;
+
+  ASSERT (Start <= End && End <= Editor->Length);
+
+  Tail = Editor->Length - End;
+  if (Start + TextLength + Tail > Editor->MaxLength) {
+    TextLength = Editor->MaxLength - Start - Tail;
+  }
+
+  CopyMem (Editor->Buffer + Start + TextLength, Editor->Buffer + End, Tail * sizeof (CHAR16));
+  if (TextLength > 0) {
+    CopyMem (Editor->Buffer + Start, Text, TextLength * sizeof (CHAR16));
+  }
+
+  Editor->Length                 = Start + TextLength + Tail;
+  Editor->Buffer[Editor->Length] = CHAR_NULL;
+  Editor->Cursor                 = Start + TextLength;
+  Editor->Dirty                  = MIN (Editor->Dirty, Start);
+}
+
+/**
+  Bring the screen up to date with the line.  Only the characters from the
+  first change on are written.
+
+  @param[in, out] Editor    The line editor.
+**/
+STATIC
+VOID
+LineEditorRedraw (
+  IN OUT SHELL_LINE_EDITOR  *Editor
+  )
+{
+  CHAR16  Blanks[17];
+  UINTN   Erase;
+  UINTN   Chunk;
+  UINTN   Linear;
+
+  if ((Editor->Dirty < Editor->Length) || (Editor->Drawn != Editor->Length)) {
+    LineEditorSetCursor (Editor, Editor->Dirty);
+    gST->ConOut->OutputString (gST->ConOut, Editor->Buffer + Editor->Dirty);
+
+    SetMem16 (Blanks, sizeof (Blanks) - sizeof (CHAR16), L' ');
+    for (Erase = (Editor->Drawn > Editor->Length) ? Editor->Drawn - Editor->Length : 0; Erase > 0; Erase -= Chunk) {
+      Chunk         = MIN (Erase, ARRAY_SIZE (Blanks) - 1);
+      Blanks[Chunk] = CHAR_NULL;
+      gST->ConOut->OutputString (gST->ConOut, Blanks);
+      Blanks[Chunk] = L' ';
+    }
+
+    //
+    // The console scrolls when the line runs past the last row; find where
+    // the line starts now.
+    //
+    Linear = gST->ConOut->Mode->CursorRow * Editor->Columns + gST->ConOut->Mode->CursorColumn;
+    if (Linear >= Editor->StartColumn + MAX (Editor->Drawn, Editor->Length)) {
+      Editor->StartRow = (Linear - Editor->StartColumn - MAX (Editor->Drawn, Editor->Length)) / Editor->Columns;
+    }
+
+    Editor->Drawn = Editor->Length;
+  }
+
+  Editor->Dirty = Editor->Length;
+  LineEditorSetCursor (Editor, Editor->Cursor);
+}
+
+/**
+  Complete the file name before the cursor.  The first TAB collects the files
+  matching the name; each further TAB replaces the name with the next one.
+
+  @param[in, out] Editor    The line editor.
+**/
+STATIC
+VOID
+LineEditorComplete (
+  IN OUT SHELL_LINE_EDITOR  *Editor
+  )
+{
+  SHELL_STRING_BUILDER  Pattern;
+  EFI_SHELL_FILE_INFO   *Entry;
+  CHAR16                *PatternString;
+  CONST CHAR16          *CurDir;
+  CONST CHAR16          *Colon;
+  UINTN                 Start;
+  UINTN                 Index;
+  UINTN                 Length;
+  BOOLEAN               InQuote;
+
+  if (Editor->TabList == NULL) {
+    Start   = 0;
+    InQuote = FALSE;
+    for (Index = 0; Index < Editor->Cursor; Index++) {
+      if (Editor->Buffer[Index] == L'\"') {
+        InQuote = (BOOLEAN)!InQuote;
+      } else if (!InQuote && (Editor->Buffer[Index] == L' ')) {
+        Start = Index + 1;
+      }
+    }
+
+    //
+    // EfiShellFindFiles() wants a full path; relative names are taken from the cwd.
+    //
+    ShellStrBuilderInit (&Pattern);
+    CurDir = EfiShellGetCurDir (NULL);
+    for (Index = Start; (Index < Editor->Cursor) && (Editor->Buffer[Index] != L':'); Index++) {
+    }
+
+    Colon = (CurDir != NULL) ? StrStr (CurDir, L":") : NULL;
+    if ((Index == Editor->Cursor) && (Colon != NULL)) {
+      if (Editor->Buffer[Start] == L'\\') {
+        ShellStrBuilderAppend (&Pattern, CurDir, Colon - CurDir + 1);
+      } else {
+        ShellStrBuilderAppend (&Pattern, CurDir, 0);
+        if ((Pattern.Length > 0) && (Pattern.Buffer[Pattern.Length - 1] != L'\\')) {
+          ShellStrBuilderAppend (&Pattern, L"\\", 0);
+        }
+      }
+    }
+
+    for (Index = Start; Index < Editor->Cursor; Index++) {
+      if (Editor->Buffer[Index] != L'\"') {
+        ShellStrBuilderAppend (&Pattern, Editor->Buffer + Index, 1);
+      }
+    }
+
+    ShellStrBuilderAppend (&Pattern, L"*", 0);
+    PatternString = ShellStrBuilderFinalize (&Pattern);
+    if (PatternString == NULL) {
+      return;
+    }
+
+    if (EFI_ERROR (EfiShellFindFiles (PatternString, &Editor->TabList))) {
+      Editor->TabList = NULL;
+    }
+
+    FreePool (PatternString);
+    if (Editor->TabList == NULL) {
+      return;
+    }
+
+    //
+    // The candidates replace everything after the last path separator.
+    //
+    Editor->TabStart = Start;
+    for (Index = Start; Index < Editor->Cursor; Index++) {
+      if ((Editor->Buffer[Index] == L'\\') || (Editor->Buffer[Index] == L':')) {
+        Editor->TabStart = Index + 1;
+      }
+    }
+
+    Editor->TabEntry = &Editor->TabList->Link;
+  }
+
+  //
+  // Step to the next candidate, wrapping around and skipping . and ..
+  //
+  for (Entry = NULL, Index = 0; Entry == NULL && Index < 2; ) {
+    Editor->TabEntry = GetNextNode (&Editor->TabList->Link, Editor->TabEntry);
+    if (IsNull (&Editor->TabList->Link, Editor->TabEntry)) {
+      Index++;
+      continue;
+    }
+
+    Entry = (EFI_SHELL_FILE_INFO *)Editor->TabEntry;
+    if ((StrCmp (Entry->FileName, L".") == 0) || (StrCmp (Entry->FileName, L"..") == 0)) {
+      Entry = NULL;
+    }
+  }
+
+  if (Entry == NULL) {
+    return;
+  }
+
+  Length = StrLen (Entry->FileName);
+  LineEditorReplace (Editor, Editor->TabStart, Editor->Cursor, Entry->FileName, Length);
+  if ((Entry->Info != NULL) && ((Entry->Info->Attribute & EFI_FILE_DIRECTORY) != 0)) {
+    LineEditorReplace (Editor, Editor->Cursor, Editor->Cursor, L"\\", 1);
+  }
+}
+
+/**
+  Show a command history entry in the line.
+
+  @param[in, out] Editor    The line editor.
+  @param[in] Entry          The CommandHistory node, or the list head for an empty line.
+**/
+STATIC
+VOID
+LineEditorShowHistory (
+  IN OUT SHELL_LINE_EDITOR  *Editor,
+  IN     LIST_ENTRY         *Entry
+  )
+{
+  CONST CHAR16  *Text;
+
+  Editor->History = Entry;
+  Text            = L"";
+  if (!IsNull (&ShellInfoObject.ViewingSettings.CommandHistory.Link, Entry)) {
+    Text = ((BUFFER_LIST *)Entry)->Buffer;
+  }
+
+  LineEditorReplace (Editor, 0, Editor->Length, Text, StrLen (Text));
+}
+
+/**
+  Apply one key to the line.
+
+  @param[in, out] Editor    The line editor.
+  @param[in] Key            The key.
+
+  @retval TRUE              The key completed the line.
+  @retval FALSE             The line is still being edited.
+**/
+STATIC
+BOOLEAN
+LineEditorKey (
+  IN OUT SHELL_LINE_EDITOR  *Editor,
+  IN     EFI_INPUT_KEY      *Key
+  )
+{
+  LIST_ENTRY  *History;
+  LIST_ENTRY  *Entry;
+
+  if ((Key->UnicodeChar != CHAR_TAB) && (Editor->TabList != NULL)) {
+    EfiShellFreeFileList (&Editor->TabList);
+    Editor->TabList = NULL;
+  }
+
+  History = &ShellInfoObject.ViewingSettings.CommandHistory.Link;
+
+  //
+  // Any other key ends the scrolling through the console history.
+  //
+  if (  Editor->Scrolling
+     && ((Key->UnicodeChar != CHAR_NULL) || ((Key->ScanCode != SCAN_PAGE_UP) && (Key->ScanCode != SCAN_PAGE_DOWN))))
+  {
+    ConsoleLoggerStopHistory (ShellInfoObject.ConsoleInfo);
+    Editor->Scrolling = FALSE;
+  }
+
+  switch (Key->UnicodeChar) {
+    case CHAR_CARRIAGE_RETURN:
+    case CHAR_LINEFEED:
+      return (TRUE);
+    case CHAR_BACKSPACE:
+      if (Editor->Cursor > 0) {
+        LineEditorReplace (Editor, Editor->Cursor - 1, Editor->Cursor, NULL, 0);
+      }
+
+      return (FALSE);
+    case CHAR_TAB:
+      LineEditorComplete (Editor);
+      return (FALSE);
+    case CHAR_NULL:
+      break;
+    default:
+      if (Key->UnicodeChar >= L' ') {
+        LineEditorReplace (
+          Editor,
+          Editor->Cursor,
+          (!ShellInfoObject.ViewingSettings.InsertMode && (Editor->Cursor < Editor->Length)) ? Editor->Cursor + 1 : Editor->Cursor,
+          &Key->UnicodeChar,
+          1
+          );
+      }
+
+      return (FALSE);
+  }
+
+  switch (Key->ScanCode) {
+    case SCAN_LEFT:
+      if (Editor->Cursor > 0) {
+        Editor->Cursor--;
+      }
+
+      break;
+    case SCAN_RIGHT:
+      if (Editor->Cursor < Editor->Length) {
+        Editor->Cursor++;
+      }
+
+      break;
+    case SCAN_HOME:
+      Editor->Cursor = 0;
+      break;
+    case SCAN_END:
+      Editor->Cursor = Editor->Length;
+      break;
+    case SCAN_DELETE:
+      if (Editor->Cursor < Editor->Length) {
+        LineEditorReplace (Editor, Editor->Cursor, Editor->Cursor + 1, NULL, 0);
+      }
+
+      break;
+    case SCAN_INSERT:
+      ShellInfoObject.ViewingSettings.InsertMode = (BOOLEAN)!ShellInfoObject.ViewingSettings.InsertMode;
+      break;
+    case SCAN_PAGE_UP:
+      ConsoleLoggerDisplayHistory (FALSE, 0, ShellInfoObject.ConsoleInfo);
+      Editor->Scrolling = TRUE;
+      break;
+    case SCAN_PAGE_DOWN:
+      ConsoleLoggerDisplayHistory (TRUE, 0, ShellInfoObject.ConsoleInfo);
+      Editor->Scrolling = TRUE;
+      break;
+    case SCAN_ESC:
+      LineEditorReplace (Editor, 0, Editor->Length, NULL, 0);
+      Editor->History = History;
+      break;
+    case SCAN_UP:
+      Entry = GetPreviousNode (History, Editor->History);
+      if (!IsNull (History, Entry)) {
+        LineEditorShowHistory (Editor, Entry);
+      }
+
+      break;
+    case SCAN_DOWN:
+      if (!IsNull (History, Editor->History)) {
+        LineEditorShowHistory (Editor, GetNextNode (History, Editor->History));
+      }
+
+      break;
+    default:
+      break;
+  }
+
+  return (FALSE);
+}
+
+/**
+  Queue a line that arrived behind the one being read.
+
+  @param[in, out] Line      The line.  Taken over on success, emptied either way.
+**/
+STATIC
+VOID
+LineEditorQueue (
+  IN OUT SHELL_STRING_BUILDER  *Line
+  )
+{
+  BUFFER_LIST  *Node;
+
+  Node = AllocateZeroPool (sizeof (BUFFER_LIST));
+  if (Node != NULL) {
+    Node->Buffer = ShellStrBuilderFinalize (Line);
+    if (Node->Buffer == NULL) {
+      Node->Buffer = AllocateZeroPool (sizeof (CHAR16));
+    }
+
+    if (Node->Buffer != NULL) {
+      InsertTailList (&mPendingLines, &Node->Link);
+      return;
+    }
+
+    FreePool (Node);
+  }
+
+  ShellStrBuilderFree (Line);
+}
+
+/**
+  Apply a key that arrived after the end of the line being read.
+
+  @param[in, out] Next      The line the key belongs to.
+  @param[in] Key            The key.
+**/
+STATIC
+VOID
+LineEditorPasteKey (
+  IN OUT SHELL_STRING_BUILDER  *Next,
+  IN     EFI_INPUT_KEY         *Key
+  )
+{
+  if ((Key->UnicodeChar == CHAR_CARRIAGE_RETURN) || (Key->UnicodeChar == CHAR_LINEFEED)) {
+    LineEditorQueue (Next);
+  } else if (Key->UnicodeChar == CHAR_BACKSPACE) {
+    if (Next->Length > 0) {
+      Next->Buffer[--Next->Length] = CHAR_NULL;
+    }
+  } else if (Key->UnicodeChar >= L' ') {
+    ShellStrBuilderAppend (Next, &Key->UnicodeChar, 1);
+  }
+}
+
+/**
+  Read a command line from the console.
+
+  Keys are taken in batches: everything already waiting is applied before the
+  line is redrawn.  Keys after the end of the line are queued as the following
+  command lines, with only BACKSPACE applied to them.
+
+  @param[out] Buffer        Receives the NULL terminated line.
+  @param[in] MaxLength      Characters Buffer can hold, terminator excluded.
+
+  @retval EFI_SUCCESS       A line was read.
+  @return                   The error from the console.
+**/
+STATIC
+EFI_STATUS
+ShellConsoleReadLine (
+  OUT CHAR16  *Buffer,
+  IN  UINTN   MaxLength
+  )
+{
+  SHELL_LINE_EDITOR     Editor;
+  SHELL_STRING_BUILDER  Next;
+  BUFFER_LIST           *Node;
+  EFI_INPUT_KEY         Key;
+  EFI_STATUS            Status;
+  UINTN                 Rows;
+  UINTN                 EventIndex;
+  BOOLEAN               Done;
+  BOOLEAN               AfterCr;
+
+  //
+  // A line queued by an earlier paste is shown as if it was typed.
+  //
+  if (!IsListEmpty (&mPendingLines)) {
+    Node = (BUFFER_LIST *)GetFirstNode (&mPendingLines);
+    RemoveEntryList (&Node->Link);
+    StrnCpyS (Buffer, MaxLength + 1, Node->Buffer, MaxLength);
+    gST->ConOut->OutputString (gST->ConOut, Buffer);
+    gST->ConOut->OutputString (gST->ConOut, L"\r\n");
+    if (*Buffer != CHAR_NULL) {
+      AddLineToCommandHistory (Buffer);
+    }
+
+    FreePool (Node->Buffer);
+    FreePool (Node);
+    return (EFI_SUCCESS);
+  }
+
+  ZeroMem (&Editor, sizeof (Editor));
+  Editor.Buffer      = Buffer;
+  Editor.MaxLength   = MaxLength;
+  Editor.StartColumn = gST->ConOut->Mode->CursorColumn;
+  Editor.StartRow    = gST->ConOut->Mode->CursorRow;
+  Editor.History     = &ShellInfoObject.ViewingSettings.CommandHistory.Link;
+  Buffer[0]          = CHAR_NULL;
+  if (EFI_ERROR (gST->ConOut->QueryMode (gST->ConOut, gST->ConOut->Mode->Mode, &Editor.Columns, &Rows)) || (Editor.Columns == 0)) {
+    Editor.Columns = 80;
+  }
+
+  if (mPendingPartial != NULL) {
+    LineEditorReplace (&Editor, 0, 0, mPendingPartial, StrLen (mPendingPartial));
+    SHELL_FREE_NON_NULL (mPendingPartial);
+    LineEditorRedraw (&Editor);
+  }
+
+  ShellStrBuilderInit (&Next);
+  Status  = EFI_SUCCESS;
+  Done    = FALSE;
+  AfterCr = FALSE;
+  while (!Done) {
+    Status = gBS->WaitForEvent (1, &gST->ConIn->WaitForKey, &EventIndex);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+
+    //
+    // Drain everything that is waiting before drawing anything.
+    //
+    while (!EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, &Key))) {
+      if ((Key.UnicodeChar == CHAR_LINEFEED) && AfterCr) {
+        AfterCr = FALSE;
+        continue;
+      }
+
+      AfterCr = (BOOLEAN)(Key.UnicodeChar == CHAR_CARRIAGE_RETURN);
+      if (!Done) {
+        Done = LineEditorKey (&Editor, &Key);
+      } else {
+        LineEditorPasteKey (&Next, &Key);
+      }
+    }
+
+    //
+    // The screen shows the console history until scrolling ends.
+    //
+    if (!Editor.Scrolling) {
+      LineEditorRedraw (&Editor);
+    }
+  }
+
+  if (Editor.Scrolling) {
+    ConsoleLoggerStopHistory (ShellInfoObject.ConsoleInfo);
+  }
+
+  if (Editor.TabList != NULL) {
+    EfiShellFreeFileList (&Editor.TabList);
+  }
+
+  if (Done) {
+    LineEditorSetCursor (&Editor, Editor.Length);
+    gST->ConOut->OutputString (gST->ConOut, L"\r\n");
+    if (Editor.Length > 0) {
+      AddLineToCommandHistory (Buffer);
+    }
+  }
+
+  if (Next.Length > 0) {
+    mPendingPartial = ShellStrBuilderFinalize (&Next);
+  }
+
+  ShellStrBuilderFree (&Next);
+
+  return (Status);
+}
+
+/**
+  Find the ACPI power management timer I/O port in the FADT.
+
+  @return               The port, or 0 if there is none.
+**/
+STATIC
+UINT16
+BootTimePmTimerPort (
+  VOID
+  )
+{
+  EFI_ACPI_6_2_ROOT_SYSTEM_DESCRIPTION_POINTER  *Rsdp;
+  EFI_ACPI_DESCRIPTION_HEADER                   *Xsdt;
+  EFI_ACPI_6_2_FIXED_ACPI_DESCRIPTION_TABLE     *Fadt;
+  UINT64                                        Entry;
+  UINTN                                         Index;
+  UINTN                                         Count;
+
+  if (EFI_ERROR (EfiGetSystemConfigurationTable (&gEfiAcpi20TableGuid, (VOID **)&Rsdp)) || (Rsdp->XsdtAddress == 0)) {
+    return (0);
+  }
+
+  Xsdt  = (EFI_ACPI_DESCRIPTION_HEADER *)(UINTN)Rsdp->XsdtAddress;
+  Count = (Xsdt->Length - sizeof (EFI_ACPI_DESCRIPTION_HEADER)) / sizeof (UINT64);
+  for (Index = 0; Index < Count; Index++) {
+    //
+    // XSDT entries are not naturally aligned
+    //
+    CopyMem (&Entry, (UINT8 *)(Xsdt + 1) + Index * sizeof (UINT64), sizeof (UINT64));
+    Fadt = (EFI_ACPI_6_2_FIXED_ACPI_DESCRIPTION_TABLE *)(UINTN)Entry;
+    if ((Fadt == NULL) || (Fadt->Header.Signature != EFI_ACPI_6_2_FIXED_ACPI_DESCRIPTION_TABLE_SIGNATURE)) {
+      continue;
+    }
+
+    if (  (Fadt->Header.Length >= OFFSET_OF (EFI_ACPI_6_2_FIXED_ACPI_DESCRIPTION_TABLE, XPmTmrBlk) + sizeof (Fadt->XPmTmrBlk))
+       && (Fadt->XPmTmrBlk.AddressSpaceId == EFI_ACPI_6_2_SYSTEM_IO)
+       && (Fadt->XPmTmrBlk.Address != 0))
+    {
+      return ((UINT16)Fadt->XPmTmrBlk.Address);
+    }
+
+    return ((UINT16)Fadt->PmTmrBlk);
+  }
+
+  return (0);
+}
+
+/**
+  Get the TSC rate, measuring it the first time.
+
+  The ACPI power management timer is used through _osifUefiShellGetTscPerSec()
+  when the platform has one, otherwise a 10ms Stall().
+
+  @return               TSC ticks per second.
+**/
+STATIC
+UINT64
+BootTimeTscPerSec (
+  VOID
+  )
+{
+  UINT16  PmTimerPort;
+  UINT64  Start;
+
+  if (mBootTscPerSec == 0) {
+    PmTimerPort = BootTimePmTimerPort ();
+    if (PmTimerPort != 0) {
+      mBootTscPerSec = _osifUefiShellGetTscPerSec (NULL, PmTimerPort);
+    }
+
+    if (mBootTscPerSec == 0) {
+      Start = AsmReadTsc ();
+      gBS->Stall (10000);
+      mBootTscPerSec = MultU64x32 (AsmReadTsc () - Start, 100);
+    }
+  }
+
+  return (mBootTscPerSec);
+}
+
+/**
+  Get the duration of a boot phase in microseconds.
+
+  @param[in] Phase      The phase, not BootPhaseEntry.
+  @param[out] Micro     The duration.
+
+  @retval TRUE          The phase was timed.
+  @retval FALSE         The phase did not run.
 **/
+STATIC
 BOOLEAN
-IsValidEnvironmentVariableName (
-  IN CONST CHAR16  *BeginPercent,
-  IN CONST CHAR16  *EndPercent
+BootTimePhase (
+  IN  BOOT_PHASE  Phase,
+  OUT UINT64      *Micro
   )
 {
-  CONST CHAR16  *Walker;
-
-  Walker = NULL;
+  UINTN  Previous;
 
-  ASSERT (BeginPercent != NULL);
-  ASSERT (EndPercent != NULL);
-  ASSERT (BeginPercent < EndPercent);
-
-  if ((BeginPercent + 1) == EndPercent) {
-    return FALSE;
+  if (mBootPhaseTsc[Phase] == 0) {
+    return (FALSE);
   }
 
-  for (Walker = BeginPercent + 1; Walker < EndPercent; Walker++) {
-    if (
-        ((*Walker >= L'0') && (*Walker <= L'9')) ||
-        ((*Walker >= L'A') && (*Walker <= L'Z')) ||
-        ((*Walker >= L'a') && (*Walker <= L'z')) ||
-        (*Walker == L'_')
-        )
-    {
-      if ((Walker == BeginPercent + 1) && ((*Walker >= L'0') && (*Walker <= L'9'))) {
-        return FALSE;
-      } else {
-        continue;
-      }
-    } else {
-      return FALSE;
-    }
+  //
+  // A phase lasts from the end of the last phase that ran before it.
+  //
+  for (Previous = Phase - 1; Previous > BootPhaseEntry && mBootPhaseTsc[Previous] == 0; Previous--) {
   }
 
-  return TRUE;
+  *Micro = DivU64x64Remainder (
+             MultU64x32 (mBootPhaseTsc[Phase] - mBootPhaseTsc[Previous], 1000000),
+             BootTimeTscPerSec (),
+             NULL
+             );
+  return (TRUE);
 }
 
 /**
-  Determine if a command line contains a split operation
-
-  @param[in] CmdLine      The command line to parse.
-
-  @retval TRUE            CmdLine has a valid split.
-  @retval FALSE           CmdLine does not have a valid split.
+  Publish the boot phase times in the read-only "startuptimes" environment
+  variable, as "phase=milliseconds" pairs separated by ';' and followed by the
+  total from the entry to main() to the first prompt.
 **/
-BOOLEAN
-ContainsSplit (
-  IN CONST CHAR16  *CmdLine
+STATIC
+VOID
+BootTimePublish (
+  VOID
   )
 {
-  CONST CHAR16  *TempSpot;
-  CONST CHAR16  *FirstQuote;
-  CONST CHAR16  *SecondQuote;
+  SHELL_STRING_BUILDER  Builder;
+  CHAR16                Item[48];
+  CHAR16                *Value;
+  UINTN                 Phase;
+  UINT64                Micro;
+  UINT64                Total;
+
+  if (mBootPhaseTsc[BootPhaseEntry] == 0) {
+    return;
+  }
 
-  FirstQuote  = FindNextInstance (CmdLine, L"\"", TRUE);
-  SecondQuote = NULL;
-  TempSpot    = FindFirstCharacter (CmdLine, L"|", L'^');
+  ShellStrBuilderInit (&Builder);
+  Total = 0;
+  for (Phase = BootPhaseEntry + 1; Phase < BootPhaseMax; Phase++) {
+    if (BootTimePhase ((BOOT_PHASE)Phase, &Micro)) {
+      UnicodeSPrint (Item, sizeof (Item), L"%s=%Ld.%03Ld;", mBootPhaseNames[Phase], Micro / 1000, Micro % 1000);
+      ShellStrBuilderAppend (&Builder, Item, 0);
+      Total += Micro;
+    }
+  }
 
-  if ((FirstQuote == NULL) ||
-      (TempSpot == NULL) ||
-      (TempSpot == CHAR_NULL) ||
-      (FirstQuote > TempSpot)
-      )
-  {
-      //CDETRACE((TRCINF(1) "SPLIT: %d\n", (BOOLEAN)((TempSpot != NULL) && (*TempSpot != CHAR_NULL))));
-      return (BOOLEAN)((TempSpot != NULL) && (*TempSpot != CHAR_NULL));
+  UnicodeSPrint (Item, sizeof (Item), L"total=%Ld.%03Ld", Total / 1000, Total % 1000);
+  ShellStrBuilderAppend (&Builder, Item, 0);
+
+  Value = ShellStrBuilderFinalize (&Builder);
+  if (Value != NULL) {
+    InternalEfiShellSetEnv (L"startuptimes", Value, TRUE);
+    FreePool (Value);
   }
+}
 
-  while ((TempSpot != NULL) && (*TempSpot != CHAR_NULL)) {
-    if ((FirstQuote == NULL) || (FirstQuote > TempSpot)) {
-      break;
-    }
+/**
+  Print the boot phase times, for "ver -t".
+**/
+STATIC
+VOID
+BootTimeReport (
+  VOID
+  )
+{
+  UINTN   Phase;
+  UINT64  Micro;
+  UINT64  Total;
 
-    SecondQuote = FindNextInstance (FirstQuote + 1, L"\"", TRUE);
-    if (SecondQuote == NULL) {
-      break;
-    }
+  if (mBootPhaseTsc[BootPhaseEntry] == 0) {
+    return;
+  }
 
-    if (SecondQuote < TempSpot) {
-      FirstQuote = FindNextInstance (SecondQuote + 1, L"\"", TRUE);
-      continue;
+  Total = 0;
+  for (Phase = BootPhaseEntry + 1; Phase < BootPhaseMax; Phase++) {
+    if (BootTimePhase ((BOOT_PHASE)Phase, &Micro)) {
+      ShellPrintEx (-1, -1, L"  %-10s %6Ld.%03Ld ms\r\n", mBootPhaseNames[Phase], Micro / 1000, Micro % 1000);
+      Total += Micro;
     } else {
-      FirstQuote = FindNextInstance (SecondQuote + 1, L"\"", TRUE);
-      TempSpot   = FindFirstCharacter (TempSpot + 1, L"|", L'^');
-      continue;
+      ShellPrintEx (-1, -1, L"  %-10s %10s\r\n", mBootPhaseNames[Phase], L"-");
     }
   }
-  
-  //CDETRACE((TRCINF(1) "SPLIT: %d\n", (BOOLEAN)((TempSpot != NULL) && (*TempSpot != CHAR_NULL))));
 
-  return (BOOLEAN)((TempSpot != NULL) && (*TempSpot != CHAR_NULL));
+  ShellPrintEx (-1, -1, L"  %-10s %6Ld.%03Ld ms (TSC %Ld Hz)\r\n", L"total", Total / 1000, Total % 1000, BootTimeTscPerSec ());
 }
 
 /**
-  Function to start monitoring for CTRL-S using SimpleTextInputEx.  This
-  feature's enabled state was not known when the shell initially launched.
+  Function for the internal "commit" command: write the non volatile
+  environment variables that a batch deferred to the variable store now.
 
-  @retval EFI_SUCCESS           The feature is enabled.
-  @retval EFI_OUT_OF_RESOURCES  There is not enough memory available.
+  @param[in] ImageHandle  The image handle.
+  @param[in] SystemTable  The system table.
+
+  @retval SHELL_SUCCESS             The variables were written.
+  @retval SHELL_INVALID_PARAMETER   A parameter was given.
+  @retval SHELL_DEVICE_ERROR        A variable could not be written.
 **/
-EFI_STATUS
-InternalEfiShellStartCtrlSMonitor (
-  VOID
+STATIC
+SHELL_STATUS
+EFIAPI
+ShellCommandRunCommit (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
   )
 {
-  EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL  *SimpleEx;
-  EFI_KEY_DATA                       KeyData;
-  EFI_STATUS                         Status;
+  EFI_STATUS  Status;
+  LIST_ENTRY  *Package;
+  CHAR16      *ProblemParam;
 
-  Status = gBS->OpenProtocol (
-                  gST->ConsoleInHandle,
-                  &gEfiSimpleTextInputExProtocolGuid,
-                  (VOID **)&SimpleEx,
-                  gImageHandle,
-                  NULL,
-                  EFI_OPEN_PROTOCOL_GET_PROTOCOL
-                  );
+  ProblemParam = NULL;
+  Status       = ShellCommandLineParse (EmptyParamList, &Package, &ProblemParam, TRUE);
   if (EFI_ERROR (Status)) {
-    ShellPrintHiiEx (
-      -1,
-      -1,
-      NULL,
-      STRING_TOKEN (STR_SHELL_NO_IN_EX),
-      ShellInfoObject.HiiHandle
-      );
-    return (EFI_SUCCESS);
+    if ((Status == EFI_VOLUME_CORRUPTED) && (ProblemParam != NULL)) {
+      ShellPrintEx (-1, -1, L"commit: unknown parameter '%s'\r\n", ProblemParam);
+      FreePool (ProblemParam);
+    }
+
+    return (SHELL_INVALID_PARAMETER);
   }
 
-  KeyData.KeyState.KeyToggleState = 0;
-  KeyData.Key.ScanCode            = 0;
-  KeyData.KeyState.KeyShiftState  = EFI_SHIFT_STATE_VALID|EFI_LEFT_CONTROL_PRESSED;
-  KeyData.Key.UnicodeChar         = L's';
+  if (ShellCommandLineGetCount (Package) > 1) {
+    ShellPrintEx (-1, -1, L"commit: too many arguments\r\n");
+    ShellCommandLineFreeVarList (Package);
+    return (SHELL_INVALID_PARAMETER);
+  }
 
-  Status = SimpleEx->RegisterKeyNotify (
-                       SimpleEx,
-                       &KeyData,
-                       NotificationFunction,
-                       &ShellInfoObject.CtrlSNotifyHandle1
-                       );
+  ShellCommandLineFreeVarList (Package);
 
-  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_RIGHT_CONTROL_PRESSED;
-  if (!EFI_ERROR (Status)) {
-    Status = SimpleEx->RegisterKeyNotify (
-                         SimpleEx,
-                         &KeyData,
-                         NotificationFunction,
-                         &ShellInfoObject.CtrlSNotifyHandle2
-                         );
-  }
+  return (EFI_ERROR (ShellEnvCommit ()) ? SHELL_DEVICE_ERROR : SHELL_SUCCESS);
+}
 
-  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_LEFT_CONTROL_PRESSED;
-  KeyData.Key.UnicodeChar        = 19;
+//
+// Help text of the "commit" command, in the format the help command reads
+// from HII for all internal commands.  It is added to the shell's package
+// when the help is first needed, see ShellCommandsPublishHii().
+//
+STATIC CONST CHAR16  mCommitHelp[] =
+  L".TH commit 0 \"Writes deferred non-volatile environment variables.\"\r\n"
+  L".SH NAME\r\n"
+  L"Writes deferred non-volatile environment variables to the variable store.\r\n"
+  L".SH SYNOPSIS\r\n"
+  L" \r\n"
+  L"COMMIT\r\n"
+  L".SH DESCRIPTION\r\n"
+  L" \r\n"
+  L"NOTES:\r\n"
+  L"  1. While a script runs, and while the shell starts, changes to non-volatile\r\n"
+  L"     environment variables are kept in memory. They are written to the\r\n"
+  L"     variable store when the outermost script ends.\r\n"
+  L"  2. This command writes them at once.\r\n"
+  L".SH RETURNVALUES\r\n"
+  L" \r\n"
+  L"RETURN VALUES:\r\n"
+  L"  SHELL_SUCCESS             The variables were written.\r\n"
+  L"  SHELL_INVALID_PARAMETER   A parameter was given.\r\n"
+  L"  SHELL_DEVICE_ERROR        A variable could not be written.\r\n";
 
-  if (!EFI_ERROR (Status)) {
-    Status = SimpleEx->RegisterKeyNotify (
-                         SimpleEx,
-                         &KeyData,
-                         NotificationFunction,
-                         &ShellInfoObject.CtrlSNotifyHandle3
-                         );
-  }
+/**
+  Get the manual file name of the "commit" command; its help text is in HII.
 
-  KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID|EFI_RIGHT_CONTROL_PRESSED;
-  if (!EFI_ERROR (Status)) {
-    Status = SimpleEx->RegisterKeyNotify (
-                         SimpleEx,
-                         &KeyData,
-                         NotificationFunction,
-                         &ShellInfoObject.CtrlSNotifyHandle4
-                         );
+  @return NULL.
+**/
+STATIC
+CONST CHAR16 *
+EFIAPI
+ShellCommandGetManFileNameCommit (
+  VOID
+  )
+{
+  return (NULL);
+}
+
+//
+// Internal commands of this shell, registered as one command table.  The help
+// string ids are filled in by ShellCommandsPublishHii().
+//
+STATIC SHELL_COMMAND_DESCRIPTOR  mShellCommands[] = {
+  { L"commit", ShellCommandRunCommit, ShellCommandGetManFileNameCommit, 0, L"", TRUE, 0 },
+};
+
+/**
+  Add the help text of the shell's internal commands to its HII package.
+
+  @return                       The shell's HII handle, or NULL if a string
+                                could not be added.
+**/
+STATIC
+EFI_HII_HANDLE
+EFIAPI
+ShellCommandsPublishHii (
+  VOID
+  )
+{
+  mShellCommands[0].ManFormatHelp = HiiSetString (ShellInfoObject.HiiHandle, 0, (EFI_STRING)mCommitHelp, NULL);
+  if (mShellCommands[0].ManFormatHelp == 0) {
+    return (NULL);
   }
 
-  return (Status);
+  return (ShellInfoObject.HiiHandle);
 }
 
+STATIC CONST SHELL_COMMAND_TABLE  mShellCommandTable = {
+  mShellCommands,
+  ARRAY_SIZE (mShellCommands),
+  ShellCommandsPublishHii
+};
+
 /**
   The entry point for the application.
 
@@ -408,6 +2368,7 @@ UefiMain (
   EFI_HANDLE                      ConInHandle;
   EFI_SIMPLE_TEXT_INPUT_PROTOCOL  *OldConIn;
   SPLIT_LIST                      *Split;
+  UINTN                           Index;
 
   if (PcdGet8 (PcdShellSupportLevel) > 3) {
     return (EFI_UNSUPPORTED);
@@ -439,6 +2400,10 @@ UefiMain (
   // Initialize the LIST ENTRY objects...
   //
   InitializeListHead (&ShellInfoObject.BufferToFreeList.Link);
+  for (Index = 0; Index < BUFFER_LIST_LEVELS; Index++) {
+    InitializeListHead (&mLevelBufferList[Index].Link);
+  }
+
   InitializeListHead (&ShellInfoObject.ViewingSettings.CommandHistory.Link);
   InitializeListHead (&ShellInfoObject.SplitList.Link);
 
@@ -462,6 +2427,7 @@ UefiMain (
   // install our console logger.  This will keep a log of the output for back-browsing
   //
   Status = ConsoleLoggerInstall (ShellInfoObject.LogScreenCount, &ShellInfoObject.ConsoleInfo);
+  BOOT_PHASE_MARK (BootPhaseConsoleLogger);
   if (!EFI_ERROR (Status)) {
     //
     // Enable the cursor to be visible
@@ -503,6 +2469,7 @@ UefiMain (
     Status = CreatePopulateInstallShellProtocol (&ShellInfoObject.NewEfiShellProtocol);
     ASSERT_EFI_ERROR (Status);
     ASSERT (ShellInfoObject.NewEfiShellProtocol != NULL);
+    BOOT_PHASE_MARK (BootPhaseProtocols);
 
     //
     // Now initialize the shell library (it requires Shell Parameters protocol)
@@ -515,6 +2482,17 @@ UefiMain (
 
     Status = ShellInitEnvVarList ();
 
+    //
+    // the shell's own commands ("commit" writes the deferred non volatile
+    // environment variables at once)
+    //
+    ShellCommandRegisterCommandTable (&mShellCommandTable);
+
+    //
+    // non volatile environment writes during startup are committed once, after the startup script
+    //
+    ShellEnvBatchBegin ();
+
     //
     // Check the command line
     //
@@ -523,13 +2501,18 @@ UefiMain (
       goto FreeResources;
     }
 
+    BOOT_PHASE_MARK (BootPhaseShellInit);
+
     //
     // If shell support level is >= 1 create the mappings and paths
     //
     if (PcdGet8 (PcdShellSupportLevel) >= 1) {
       Status = ShellCommandCreateInitialMappingsAndPaths ();
+      BOOT_PHASE_MARK (BootPhaseMappings);
     }
 
+    CwdTrackingStart ();
+
     //
     // Set the environment variable for nesting support
     //
@@ -610,6 +2593,7 @@ UefiMain (
         if ((PcdGet8 (PcdShellSupportLevel) >= 2) && !ShellInfoObject.ShellInitSettings.BitUnion.Bits.NoMap) {
           Status = RunCommand (L"map");
           ASSERT_EFI_ERROR (Status);
+          BOOT_PHASE_MARK (BootPhaseMapDisplay);
         }
     }
 
@@ -618,6 +2602,7 @@ UefiMain (
     //
     Status = SetBuiltInAlias ();
     ASSERT_EFI_ERROR (Status);
+    BOOT_PHASE_MARK (BootPhaseAliases);
 
     //
     // Initialize environment variables
@@ -690,9 +2675,19 @@ UefiMain (
         // process the startup script or launch the called app.
         //
         Status = DoStartupScript (ShellInfoObject.ImageDevPath, ShellInfoObject.FileDevPath);
+        BOOT_PHASE_MARK (BootPhaseStartupScript);
       }
 
+      ShellEnvBatchEnd ();
+
       if (!ShellInfoObject.ShellInitSettings.BitUnion.Bits.Exit && !ShellCommandGetExit () && ((PcdGet8 (PcdShellSupportLevel) >= 3) || PcdGetBool (PcdShellForceConsole)) && !EFI_ERROR (Status) && !ShellInfoObject.ShellInitSettings.BitUnion.Bits.NoConsoleIn) {
+        //
+        // read the persistent command history once, before the first prompt
+        //
+        if (mBootIni.fPersistentHistory && (1 != _gCdeRTUefiShellInstanceType)) {
+          CommandHistoryLoad ();
+        }
+
         //
         // begin the UI waiting loop
         //
@@ -705,6 +2700,8 @@ UefiMain (
             FreeBufferList (&ShellInfoObject.BufferToFreeList);
           }
 
+          FreeBufferList (&mLevelBufferList[0]);
+
           //
           // Reset page break back to default.
           //
@@ -721,13 +2718,18 @@ UefiMain (
               if (0 == fInitiallyChangeToBootDrive)
               {
                   fInitiallyChangeToBootDrive = 1;
-                  FILE* fp = fopen("\\EFI\\BOOT\\bootx64.ini", "r");
                   // RunCommand(wcsBootDrive);
                   
-                  if (NULL == fp) {
-                      fp = fopen("\\EFI\\BOOT\\bootx64.ini", "w");
-                      fprintf(fp, "#\n# remove comment to enable low res video mode\n#\n#TEXTRESOLUTION 80 25\n#DEFAULT_UEFI_DRIVE_NAMING");
-                      fclose(fp);
+                  //
+                  // BOOTX64.INI was already looked for by main(), create the template if it was not there
+                  //
+                  if (0 == mBootIni.fFound) {
+                      FILE* fp = fopen("\\EFI\\BOOT\\bootx64.ini", "w");
+                      if (NULL != fp)
+                      {
+                          fprintf(fp, "#\n# remove comment to enable low res video mode\n#\n#TEXTRESOLUTION 80 25\n#DEFAULT_UEFI_DRIVE_NAMING\n#PERSISTENT_HISTORY\n#BOOT_DELAY 1333");
+                          fclose(fp);
+                      }
                   }
               }
           }
@@ -752,6 +2754,8 @@ FreeResources:
   //
   // uninstall protocols / free memory / etc...
   //
+  CwdTrackingStop ();
+
   if (ShellInfoObject.UserBreakTimer != NULL) {
     gBS->CloseEvent (ShellInfoObject.UserBreakTimer);
     DEBUG_CODE (
@@ -791,10 +2795,19 @@ FreeResources:
       );
   }
 
+  //
+  // before the buffer free list is drained, values handed out by GetEnv go there
+  //
+  ShellFreeEnvVarList ();
+
   if (!IsListEmpty (&ShellInfoObject.BufferToFreeList.Link)) {
     FreeBufferList (&ShellInfoObject.BufferToFreeList);
   }
 
+  for (Index = 0; Index < BUFFER_LIST_LEVELS; Index++) {
+    FreeBufferList (&mLevelBufferList[Index]);
+  }
+
   if (!IsListEmpty (&ShellInfoObject.SplitList.Link)) {
     ASSERT (FALSE); /// @todo finish this de-allocation (free SplitStdIn/Out when needed).
 
@@ -833,9 +2846,8 @@ FreeResources:
       );
   }
 
-  if (!IsListEmpty (&ShellInfoObject.ViewingSettings.CommandHistory.Link)) {
-    FreeBufferList (&ShellInfoObject.ViewingSettings.CommandHistory);
-  }
+  CommandHistoryFree ();
+  LineEditorFreePending ();
 
   ASSERT (ShellInfoObject.ConsoleInfo != NULL);
   if (ShellInfoObject.ConsoleInfo != NULL) {
@@ -846,8 +2858,6 @@ FreeResources:
       );
   }
 
-  ShellFreeEnvVarList ();
-
   if (ShellCommandGetExit ()) {
     return ((EFI_STATUS)ShellCommandGetExitCode ());
   }
@@ -1038,9 +3048,11 @@ ProcessCommandLine (
   VOID
   )
 {
-  UINTN                           Size;
+  UINTN                           FirstOption;
   UINTN                           LoopVar;
   CHAR16                          *CurrentArg;
+  SHELL_STRING_BUILDER            Builder;
+  BOOLEAN                         Quote;
   CHAR16                          *DelayValueStr;
   UINT64                          DelayValue;
   EFI_STATUS                      Status;
@@ -1202,31 +3214,23 @@ ProcessCommandLine (
         continue;
       }
 
-      ShellInfoObject.ShellInitSettings.FileName = NULL;
-      Size                                       = 0;
       //
-      // If first argument contains a space, then add double quotes before the argument
+      // If first argument contains a space, then add double quotes around the argument
       //
-      if (StrStr (CurrentArg, L" ") != NULL) {
-        StrnCatGrow (&ShellInfoObject.ShellInitSettings.FileName, &Size, L"\"", 0);
-        if (ShellInfoObject.ShellInitSettings.FileName == NULL) {
-          return (EFI_OUT_OF_RESOURCES);
-        }
+      ShellStrBuilderInit (&Builder);
+      Quote = (BOOLEAN)(StrStr (CurrentArg, L" ") != NULL);
+      if (Quote) {
+        ShellStrBuilderAppend (&Builder, L"\"", 0);
       }
 
-      StrnCatGrow (&ShellInfoObject.ShellInitSettings.FileName, &Size, CurrentArg, 0);
-      if (ShellInfoObject.ShellInitSettings.FileName == NULL) {
-        return (EFI_OUT_OF_RESOURCES);
+      ShellStrBuilderAppend (&Builder, CurrentArg, 0);
+      if (Quote) {
+        ShellStrBuilderAppend (&Builder, L"\"", 0);
       }
 
-      //
-      // If first argument contains a space, then add double quotes after the argument
-      //
-      if (StrStr (CurrentArg, L" ") != NULL) {
-        StrnCatGrow (&ShellInfoObject.ShellInitSettings.FileName, &Size, L"\"", 0);
-        if (ShellInfoObject.ShellInitSettings.FileName == NULL) {
-          return (EFI_OUT_OF_RESOURCES);
-        }
+      ShellInfoObject.ShellInitSettings.FileName = ShellStrBuilderFinalize (&Builder);
+      if (ShellInfoObject.ShellInitSettings.FileName == NULL) {
+        return (EFI_OUT_OF_RESOURCES);
       }
 
       //
@@ -1236,62 +3240,34 @@ ProcessCommandLine (
       LoopVar++;
 
       // Add `file-name-options`
-      for (Size = 0; LoopVar < gEfiShellParametersProtocol->Argc; LoopVar++) {
-        ASSERT ((ShellInfoObject.ShellInitSettings.FileOptions == NULL && Size == 0) || (ShellInfoObject.ShellInitSettings.FileOptions != NULL));
+      for (FirstOption = LoopVar; LoopVar < gEfiShellParametersProtocol->Argc; LoopVar++) {
         //
         // Add a space between arguments
         //
-        if (ShellInfoObject.ShellInitSettings.FileOptions != NULL) {
-          StrnCatGrow (&ShellInfoObject.ShellInitSettings.FileOptions, &Size, L" ", 0);
-          if (ShellInfoObject.ShellInitSettings.FileOptions == NULL) {
-            SHELL_FREE_NON_NULL (ShellInfoObject.ShellInitSettings.FileName);
-            return (EFI_OUT_OF_RESOURCES);
-          }
+        if (LoopVar != FirstOption) {
+          ShellStrBuilderAppend (&Builder, L" ", 0);
         }
 
         //
-        // If an argument contains a space, then add double quotes before the argument
+        // If an argument contains a space, then add double quotes around the argument
         //
-        if (StrStr (gEfiShellParametersProtocol->Argv[LoopVar], L" ") != NULL) {
-          StrnCatGrow (
-            &ShellInfoObject.ShellInitSettings.FileOptions,
-            &Size,
-            L"\"",
-            0
-            );
-          if (ShellInfoObject.ShellInitSettings.FileOptions == NULL) {
-            SHELL_FREE_NON_NULL (ShellInfoObject.ShellInitSettings.FileName);
-            return (EFI_OUT_OF_RESOURCES);
-          }
+        Quote = (BOOLEAN)(StrStr (gEfiShellParametersProtocol->Argv[LoopVar], L" ") != NULL);
+        if (Quote) {
+          ShellStrBuilderAppend (&Builder, L"\"", 0);
         }
 
-        StrnCatGrow (
-          &ShellInfoObject.ShellInitSettings.FileOptions,
-          &Size,
-          gEfiShellParametersProtocol->Argv[LoopVar],
-          0
-          );
-        if (ShellInfoObject.ShellInitSettings.FileOptions == NULL) {
-          SHELL_FREE_NON_NULL (ShellInfoObject.ShellInitSettings.FileName);
-          return (EFI_OUT_OF_RESOURCES);
+        ShellStrBuilderAppend (&Builder, gEfiShellParametersProtocol->Argv[LoopVar], 0);
+        if (Quote) {
+          ShellStrBuilderAppend (&Builder, L"\"", 0);
         }
+      }
 
-        //
-        // If an argument contains a space, then add double quotes after the argument
-        //
-        if (StrStr (gEfiShellParametersProtocol->Argv[LoopVar], L" ") != NULL) {
-          StrnCatGrow (
-            &ShellInfoObject.ShellInitSettings.FileOptions,
-            &Size,
-            L"\"",
-            0
-            );
-          if (ShellInfoObject.ShellInitSettings.FileOptions == NULL) {
-            SHELL_FREE_NON_NULL (ShellInfoObject.ShellInitSettings.FileName);
-            return (EFI_OUT_OF_RESOURCES);
-          }
-        }
+      if (Builder.Failed) {
+        SHELL_FREE_NON_NULL (ShellInfoObject.ShellInitSettings.FileName);
+        return (EFI_OUT_OF_RESOURCES);
       }
+
+      ShellInfoObject.ShellInitSettings.FileOptions = ShellStrBuilderFinalize (&Builder);
     }
   }
 
@@ -1448,14 +3424,14 @@ DoStartupScript(
             ; Delay--
             )
         {
-            ShellPrintHiiEx(0, gST->ConOut->Mode->CursorRow, NULL, STRING_TOKEN(STR_SHELL_STARTUP_QUESTION), ShellInfoObject.HiiHandle, Delay);
+            ShellCommandPrintHii (0, gST->ConOut->Mode->CursorRow, NULL, STRING_TOKEN(STR_SHELL_STARTUP_QUESTION), ShellInfoObject.HiiHandle, Delay);
             gBS->Stall(1000000);
             if (!ShellInfoObject.ShellInitSettings.BitUnion.Bits.NoConsoleIn) {
                 Status = gST->ConIn->ReadKeyStroke(gST->ConIn, &Key);
             }
         }
 
-        ShellPrintHiiEx(-1, -1, NULL, STRING_TOKEN(STR_SHELL_CRLF), ShellInfoObject.HiiHandle);
+        ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN(STR_SHELL_CRLF), ShellInfoObject.HiiHandle);
         gST->ConOut->EnableCursor(gST->ConOut, TRUE);
 
         //
@@ -1526,6 +3502,7 @@ DoShellPrompt (
   }
 
   SaveBufferList (&OldBufferList);
+  MapHotPlugProcess (TRUE);
   CurDir = ShellInfoObject.NewEfiShellProtocol->GetEnv (L"cwd");
 
   //
@@ -1534,15 +3511,30 @@ DoShellPrompt (
   gST->ConOut->SetCursorPosition (gST->ConOut, 0, gST->ConOut->Mode->CursorRow);
 
   if ((CurDir != NULL) && (StrLen (CurDir) > 1)) {
-    ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_CURDIR), ShellInfoObject.HiiHandle, CurDir);
+    ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_CURDIR), ShellInfoObject.HiiHandle, CurDir);
   } else {
-    ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_SHELL), ShellInfoObject.HiiHandle);
+    ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_SHELL), ShellInfoObject.HiiHandle);
+  }
+
+  //
+  // The boot is over when the first prompt is up; the TSC rate is measured
+  // now, while keys typed meanwhile are buffered.
+  //
+  if (mBootPhaseTsc[BootPhasePrompt] == 0) {
+    BOOT_PHASE_MARK (BootPhasePrompt);
+    BootTimePublish ();
   }
 
   //
-  // Read a line from the console
+  // Read a line from the console.  The shell's own line reader is used when
+  // StdIn is the console, so that pasted input keeps up.
   //
-  Status = ShellInfoObject.NewEfiShellProtocol->ReadFile (ShellInfoObject.NewShellParametersProtocol->StdIn, &BufferSize, CmdLine);
+  if ((ShellInfoObject.NewShellParametersProtocol->StdIn == &FileInterfaceStdIn) && (gST->ConIn != NULL)) {
+    Status     = ShellConsoleReadLine (CmdLine, BufferSize / sizeof (CHAR16) - 1);
+    BufferSize = StrLen (CmdLine) * sizeof (CHAR16);
+  } else {
+    Status = ShellInfoObject.NewEfiShellProtocol->ReadFile (ShellInfoObject.NewShellParametersProtocol->StdIn, &BufferSize, CmdLine);
+  }
 
   //
   // Null terminate the string and parse it
@@ -1595,29 +3587,84 @@ AddBufferToFreeList (
 /**
   Create a new buffer list and stores the old one to OldBufferList
 
-  @param OldBufferList   The temporary list head used to store the nodes in BufferToFreeList.
+  @param OldBufferList   The temporary list head used to store the nodes in BufferToFreeList.
+**/
+VOID
+SaveBufferList (
+  OUT LIST_ENTRY  *OldBufferList
+  )
+{
+  CopyMem (OldBufferList, &ShellInfoObject.BufferToFreeList.Link, sizeof (LIST_ENTRY));
+  InitializeListHead (&ShellInfoObject.BufferToFreeList.Link);
+  mBufferListLevel++;
+}
+
+/**
+  Restore previous nodes into BufferToFreeList .
+
+  @param OldBufferList   The temporary list head used to store the nodes in BufferToFreeList.
+**/
+VOID
+RestoreBufferList (
+  IN OUT LIST_ENTRY  *OldBufferList
+  )
+{
+  FreeBufferList (&ShellInfoObject.BufferToFreeList);
+  CopyMem (&ShellInfoObject.BufferToFreeList.Link, OldBufferList, sizeof (LIST_ENTRY));
+
+  if (mBufferListLevel < BUFFER_LIST_LEVELS) {
+    FreeBufferList (&mLevelBufferList[mBufferListLevel]);
+  }
+
+  ASSERT (mBufferListLevel > 0);
+  if (mBufferListLevel > 0) {
+    mBufferListLevel--;
+  }
+}
+
+/**
+  Get the current buffer free list level, the number of commands running
+  inside each other.
+
+  @return The level, 0 at the prompt.
 **/
-VOID
-SaveBufferList (
-  OUT LIST_ENTRY  *OldBufferList
+UINTN
+GetBufferListLevel (
+  VOID
   )
 {
-  CopyMem (OldBufferList, &ShellInfoObject.BufferToFreeList.Link, sizeof (LIST_ENTRY));
-  InitializeListHead (&ShellInfoObject.BufferToFreeList.Link);
+  return (mBufferListLevel);
 }
 
 /**
-  Restore previous nodes into BufferToFreeList .
+  Add a buffer to the free list of a level, so it is freed when the command
+  running at that level returns.
 
-  @param OldBufferList   The temporary list head used to store the nodes in BufferToFreeList.
+  @param[in] Buffer   Something to pass to FreePool.
+  @param[in] Level    The level, from GetBufferListLevel().
 **/
 VOID
-RestoreBufferList (
-  IN OUT LIST_ENTRY  *OldBufferList
+AddBufferToLevelFreeList (
+  IN VOID   *Buffer,
+  IN UINTN  Level
   )
 {
-  FreeBufferList (&ShellInfoObject.BufferToFreeList);
-  CopyMem (&ShellInfoObject.BufferToFreeList.Link, OldBufferList, sizeof (LIST_ENTRY));
+  BUFFER_LIST  *BufferListEntry;
+
+  if (Buffer == NULL) {
+    return;
+  }
+
+  BufferListEntry = AllocateZeroPool (sizeof (BUFFER_LIST));
+  if (BufferListEntry == NULL) {
+    //
+    // a caller may still use the buffer, so it is better lost than freed
+    //
+    return;
+  }
+
+  BufferListEntry->Buffer = Buffer;
+  InsertTailList (&mLevelBufferList[MIN (Level, BUFFER_LIST_LEVELS - 1)].Link, &BufferListEntry->Link);
 }
 
 /**
@@ -1630,48 +3677,27 @@ AddLineToCommandHistory (
   IN CONST CHAR16  *Buffer
   )
 {
-  BUFFER_LIST  *Node;
-  BUFFER_LIST  *Walker;
-  UINT16       MaxHistoryCmdCount;
-  UINT16       Count;
-
-  Count              = 0;
-  MaxHistoryCmdCount = PcdGet16 (PcdShellMaxHistoryCommandCount);
-
-  if (MaxHistoryCmdCount == 0) {
-    return;
-  }
+  CHAR16  *Line;
 
-  Node = AllocateZeroPool (sizeof (BUFFER_LIST));
-  if (Node == NULL) {
+  if (!CommandHistoryReady ()) {
     return;
   }
 
-  Node->Buffer = AllocateCopyPool (StrSize (Buffer), Buffer);
-  if (Node->Buffer == NULL) {
-    FreePool (Node);
+  Line = AllocateCopyPool (StrSize (Buffer), Buffer);
+  if (Line == NULL) {
     return;
   }
 
-  for ( Walker = (BUFFER_LIST *)GetFirstNode (&ShellInfoObject.ViewingSettings.CommandHistory.Link)
-        ; !IsNull (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Walker->Link)
-        ; Walker = (BUFFER_LIST *)GetNextNode (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Walker->Link)
-        )
-  {
-    Count++;
-  }
+  CommandHistoryInsert (Line);
 
-  if (Count < MaxHistoryCmdCount) {
-    InsertTailList (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Node->Link);
-  } else {
-    Walker = (BUFFER_LIST *)GetFirstNode (&ShellInfoObject.ViewingSettings.CommandHistory.Link);
-    RemoveEntryList (&Walker->Link);
-    if (Walker->Buffer != NULL) {
-      FreePool (Walker->Buffer);
+  if (mHistoryFile != NULL) {
+    if (EFI_ERROR (CommandHistoryWriteLine (Buffer)) || EFI_ERROR (FileHandleFlush (mHistoryFile))) {
+      //
+      // Stop persisting rather than leave a torn file behind on every command.
+      //
+      FileHandleClose (mHistoryFile);
+      mHistoryFile = NULL;
     }
-
-    FreePool (Walker);
-    InsertTailList (&ShellInfoObject.ViewingSettings.CommandHistory.Link, &Node->Link);
   }
 }
 
@@ -1712,6 +3738,11 @@ ShellConvertAlias (
 /**
   This function will eliminate unreplaced (and therefore non-found) environment variables.
 
+  The line is compacted in a single pass.  A pair of unescaped % characters is
+  removed with the name between them if that is a valid variable name; a pair
+  that does not enclose a name is kept, and its second % does not start a new
+  pair.  A quote between two % characters ends the search for the second one.
+
   @param[in,out] CmdLine   The command line to update.
 **/
 EFI_STATUS
@@ -1719,64 +3750,49 @@ StripUnreplacedEnvironmentVariables (
   IN OUT CHAR16  *CmdLine
   )
 {
-  CHAR16  *FirstPercent;
-  CHAR16  *FirstQuote;
+  CHAR16  *Reader;
+  CHAR16  *Writer;
   CHAR16  *SecondPercent;
-  CHAR16  *SecondQuote;
-  CHAR16  *CurrentLocator;
-
-  for (CurrentLocator = CmdLine; CurrentLocator != NULL; ) {
-    FirstQuote    = FindNextInstance (CurrentLocator, L"\"", TRUE);
-    FirstPercent  = FindNextInstance (CurrentLocator, L"%", TRUE);
-    SecondPercent = FirstPercent != NULL ? FindNextInstance (FirstPercent+1, L"%", TRUE) : NULL;
-    if ((FirstPercent == NULL) || (SecondPercent == NULL)) {
-      //
-      // If we ever don't have 2 % we are done.
-      //
-      break;
-    }
-
-    if ((FirstQuote != NULL) && (FirstQuote < FirstPercent)) {
-      SecondQuote = FindNextInstance (FirstQuote+1, L"\"", TRUE);
-      //
-      // Quote is first found
-      //
-
-      if (SecondQuote < FirstPercent) {
-        //
-        // restart after the pair of "
-        //
-        CurrentLocator = SecondQuote + 1;
-      } else {
-        /* FirstPercent < SecondQuote */
-        //
-        // Restart on the first percent
-        //
-        CurrentLocator = FirstPercent;
-      }
 
+  Writer = CmdLine;
+  for (Reader = CmdLine; *Reader != CHAR_NULL; ) {
+    if ((*Reader == L'^') && (*(Reader + 1) != CHAR_NULL)) {
+      *Writer++ = *Reader++;
+      *Writer++ = *Reader++;
       continue;
     }
 
-    if ((FirstQuote == NULL) || (SecondPercent < FirstQuote)) {
-      if (IsValidEnvironmentVariableName (FirstPercent, SecondPercent)) {
-        //
-        // We need to remove from FirstPercent to SecondPercent
-        //
-        CopyMem (FirstPercent, SecondPercent + 1, StrSize (SecondPercent + 1));
-        //
-        // don't need to update the locator.  both % characters are gone.
-        //
-      } else {
-        CurrentLocator = SecondPercent + 1;
+    if (*Reader == L'%') {
+      for (SecondPercent = Reader + 1
+           ; (*SecondPercent != CHAR_NULL) && (*SecondPercent != L'%') && (*SecondPercent != L'\"')
+           ; SecondPercent++
+           )
+      {
+        if ((*SecondPercent == L'^') && (*(SecondPercent + 1) != CHAR_NULL)) {
+          SecondPercent++;
+        }
       }
 
-      continue;
+      if (*SecondPercent == L'%') {
+        if (IsValidEnvironmentVariableName (Reader, SecondPercent)) {
+          //
+          // Drop both % characters and the name between them
+          //
+          Reader = SecondPercent + 1;
+          continue;
+        }
+
+        while (Reader < SecondPercent) {
+          *Writer++ = *Reader++;
+        }
+      }
     }
 
-    CurrentLocator = FirstQuote;
+    *Writer++ = *Reader++;
   }
 
+  *Writer = CHAR_NULL;
+
   return (EFI_SUCCESS);
 }
 
@@ -2080,6 +4096,54 @@ ShellSubstituteVariables (
   return (EFI_SUCCESS);
 }
 
+/**
+  Substitute an alias for the first token of a lexed command line and patch
+  the tokens to match.
+
+  @param[in, out] CmdLine       pointer to the command line to update.
+  @param[in, out] Lexed         the tokens of the command line.
+
+  @retval EFI_SUCCESS           the function was successful.
+  @retval EFI_OUT_OF_RESOURCES  a memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+ShellLexSubstituteAlias (
+  IN OUT CHAR16            **CmdLine,
+  IN OUT SHELL_LEXED_LINE  *Lexed
+  )
+{
+  CHAR16        *CommandName;
+  CONST CHAR16  *Alias;
+  EFI_STATUS    Status;
+
+  if (Lexed->Count == 0) {
+    return (EFI_SUCCESS);
+  }
+
+  CommandName = AllocateCopyPool ((Lexed->Tokens[0].Length + 1) * sizeof (CHAR16), *CmdLine + Lexed->Tokens[0].Start);
+  if (CommandName == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  CommandName[Lexed->Tokens[0].Length] = CHAR_NULL;
+
+  Status = EFI_SUCCESS;
+  if (!ShellCommandIsCommandOnList (CommandName)) {
+    Alias = ShellInfoObject.NewEfiShellProtocol->GetAlias (CommandName, NULL);
+    if (Alias != NULL) {
+      Status = ShellLexSplice (CmdLine, Lexed, 0, TRUE, Alias);
+      if (!EFI_ERROR (Status)) {
+        ShellLexTrim (*CmdLine, Lexed);
+      }
+    }
+  }
+
+  FreePool (CommandName);
+
+  return (Status);
+}
+
 /**
   Take the original command line, substitute any alias in the first group of space delimited characters, free
   the original string, return the modified copy.
@@ -2094,61 +4158,202 @@ ShellSubstituteAliases (
   IN CHAR16  **CmdLine
   )
 {
-  CHAR16      *NewCmdLine;
-  CHAR16      *CommandName;
-  EFI_STATUS  Status;
-  UINTN       PostAliasSize;
+  SHELL_LEXED_LINE  Lexed;
+  EFI_STATUS        Status;
 
   ASSERT (CmdLine != NULL);
   ASSERT (*CmdLine != NULL);
 
-  CommandName = NULL;
-  if (StrStr ((*CmdLine), L" ") == NULL) {
-    StrnCatGrow (&CommandName, NULL, (*CmdLine), 0);
-  } else {
-    StrnCatGrow (&CommandName, NULL, (*CmdLine), StrStr ((*CmdLine), L" ") - (*CmdLine));
+  ZeroMem (&Lexed, sizeof (Lexed));
+  Status = ShellLexCommandLine (*CmdLine, FALSE, &Lexed);
+  if (!EFI_ERROR (Status)) {
+    Status = ShellLexSubstituteAlias (CmdLine, &Lexed);
   }
 
-  //
-  // This cannot happen 'inline' since the CmdLine can need extra space.
-  //
-  NewCmdLine = NULL;
-  if (!ShellCommandIsCommandOnList (CommandName)) {
-    //
-    // Convert via alias
-    //
-    Status = ShellConvertAlias (&CommandName);
-    if (EFI_ERROR (Status)) {
-      return (Status);
-    }
+  ShellLexFree (&Lexed);
 
-    PostAliasSize = 0;
-    NewCmdLine    = StrnCatGrow (&NewCmdLine, &PostAliasSize, CommandName, 0);
-    if (NewCmdLine == NULL) {
-      SHELL_FREE_NON_NULL (CommandName);
-      SHELL_FREE_NON_NULL (*CmdLine);
-      return (EFI_OUT_OF_RESOURCES);
-    }
+  return (Status);
+}
 
-    NewCmdLine = StrnCatGrow (&NewCmdLine, &PostAliasSize, StrStr ((*CmdLine), L" "), 0);
-    if (NewCmdLine == NULL) {
-      SHELL_FREE_NON_NULL (CommandName);
-      SHELL_FREE_NON_NULL (*CmdLine);
-      return (EFI_OUT_OF_RESOURCES);
-    }
-  } else {
-    NewCmdLine = StrnCatGrow (&NewCmdLine, NULL, (*CmdLine), 0);
-  }
+//
+// PLUGINs, embedded in plugins.h by bin2hex or, if plugins.h was written by "bin2hex /pak:",
+// packaged in \EFI\BOOT\PLUGINS.PAK on the boot volume. For the package only the index is read
+// at boot, PluginImage() reads a plugin when it runs for the first time and keeps it in memory.
+// Payloads are PLUGINLZ compressed unless bin2hex was told to store them, PluginImage()
+// decompresses a payload once and keeps the image.
+//
+typedef struct _PLUGIN_ENTRY {
+    const wchar_t* wcsCmd;                      // command name
+    char* pStart;                               // payload, NULL until read from PLUGINS.PAK
+    size_t size;                                // payload size
+    unsigned Flags;                             // PLUGINPAK_FLAG_...
+    char* pImage;                               // .COFF image, NULL until read and decompressed
+    size_t ImageSize;                           // .COFF image size
+    uint64_t Offset;                            // PLUGINS.PAK only: image offset in the file
+    uint32_t Hash;                              // PLUGINS.PAK only: PluginPakHash() of the image
+} PLUGIN_ENTRY;
+
+static PLUGIN_ENTRY* mPlugins;
+static size_t mPluginCount;
+
+#ifdef UEFI_SHELL_PLUGIN_PACKAGE
+static EFI_HANDLE mPluginDevice;                // boot volume holding PLUGINS.PAK
+static EFI_BOOT_SERVICES* mPluginBootServices;  // from PluginInit(), which runs before gBS is set
+
+static EFI_FILE_PROTOCOL* PluginPackageOpen(void)
+{
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
+    EFI_FILE_PROTOCOL* pEFI_FILE_PROTOCOL = NULL, * pROOT;
 
-  SHELL_FREE_NON_NULL (*CmdLine);
-  SHELL_FREE_NON_NULL (CommandName);
+    if (EFI_SUCCESS != mPluginBootServices->HandleProtocol(mPluginDevice, &gEfiSimpleFileSystemProtocolGuid, &pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL)
+        || EFI_SUCCESS != pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL->OpenVolume(pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL, &pROOT))
+        return NULL;
 
-  //
-  // re-assign the passed in double pointer to point to our newly allocated buffer
-  //
-  *CmdLine = NewCmdLine;
+    if (EFI_SUCCESS != pROOT->Open(pROOT, &pEFI_FILE_PROTOCOL, L"\\EFI\\BOOT\\PLUGINS.PAK", EFI_FILE_MODE_READ, 0))
+        pEFI_FILE_PROTOCOL = NULL;
 
-  return (EFI_SUCCESS);
+    pROOT->Close(pROOT);
+
+    return pEFI_FILE_PROTOCOL;
+}
+
+static void PluginInit(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
+{
+    EFI_LOADED_IMAGE_PROTOCOL* pLoadedImageProtocol;
+    EFI_FILE_PROTOCOL* pEFI_FILE_PROTOCOL = NULL;
+    PLUGINPAK_HEADER Header;
+    PLUGINPAK_ENTRY* pIndex = NULL;
+    wchar_t* pwcsNames;
+    UINTN n;
+    size_t i, j;
+
+    mPluginBootServices = SystemTable->BootServices;
+
+    do
+    {
+        if (EFI_SUCCESS != SystemTable->BootServices->HandleProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid, &pLoadedImageProtocol))
+            break;
+        mPluginDevice = pLoadedImageProtocol->DeviceHandle;
+
+        if (NULL == (pEFI_FILE_PROTOCOL = PluginPackageOpen()))
+            break;
+
+        //
+        // header and index only, the images stay on the disk
+        //
+        n = sizeof(Header);
+        if (EFI_SUCCESS != pEFI_FILE_PROTOCOL->Read(pEFI_FILE_PROTOCOL, &n, &Header)
+            || sizeof(Header) != n
+            || 0 != memcmp(Header.Signature, PLUGINPAK_SIGNATURE, sizeof(Header.Signature))
+            || PLUGINPAK_VERSION != Header.Version
+            || 0 == Header.Count)
+            break;
+
+        n = Header.Count * sizeof(PLUGINPAK_ENTRY);
+        if (NULL == (pIndex = malloc(n))
+            || EFI_SUCCESS != pEFI_FILE_PROTOCOL->Read(pEFI_FILE_PROTOCOL, &n, pIndex)
+            || Header.Count * sizeof(PLUGINPAK_ENTRY) != n)
+            break;
+
+        //
+        // one allocation for the table and the wide command names behind it
+        //
+        if (NULL == (mPlugins = calloc(Header.Count, sizeof(PLUGIN_ENTRY) + PLUGINPAK_NAME_MAX * sizeof(wchar_t))))
+            break;
+        pwcsNames = (wchar_t*)&mPlugins[Header.Count];
+
+        for (i = 0; i < Header.Count; i++, pwcsNames += PLUGINPAK_NAME_MAX)
+        {
+            for (j = 0; j < PLUGINPAK_NAME_MAX - 1 && '\0' != pIndex[i].szName[j]; j++)
+                pwcsNames[j] = (unsigned char)pIndex[i].szName[j];
+
+            mPlugins[i].wcsCmd = pwcsNames;
+            mPlugins[i].size = (size_t)pIndex[i].Size;
+            mPlugins[i].Flags = pIndex[i].Flags;
+            mPlugins[i].Offset = pIndex[i].Offset;
+            mPlugins[i].Hash = pIndex[i].Hash;
+        }
+        mPluginCount = Header.Count;
+
+    } while (0);
+
+    if (NULL != pEFI_FILE_PROTOCOL)
+        pEFI_FILE_PROTOCOL->Close(pEFI_FILE_PROTOCOL);
+    free(pIndex);
+}
+#else//UEFI_SHELL_PLUGIN_PACKAGE
+static void PluginInit(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
+{
+    size_t i;
+
+    if (NULL == (mPlugins = calloc(sizeof(plugin) / sizeof(plugin[0]), sizeof(PLUGIN_ENTRY))))
+        return;
+
+    for (i = 0; i < sizeof(plugin) / sizeof(plugin[0]); i++)
+        mPlugins[i].wcsCmd = plugin[i].wcsCmd,
+        mPlugins[i].pStart = plugin[i].pStart,
+        mPlugins[i].size = plugin[i].size,
+        mPlugins[i].Flags = plugin[i].Flags;
+
+    mPluginCount = i;
+}
+#endif//UEFI_SHELL_PLUGIN_PACKAGE
+
+//
+// image of a PLUGIN, NULL if it can't be read from PLUGINS.PAK, doesn't match the index
+// or can't be decompressed
+//
+static char* PluginImage(PLUGIN_ENTRY* pPlugin)
+{
+    char* pImage;
+#ifdef UEFI_SHELL_PLUGIN_PACKAGE
+    EFI_FILE_PROTOCOL* pEFI_FILE_PROTOCOL;
+    UINTN n = pPlugin->size;
+#endif//UEFI_SHELL_PLUGIN_PACKAGE
+
+    if (NULL != pPlugin->pImage)
+        return pPlugin->pImage;
+
+#ifdef UEFI_SHELL_PLUGIN_PACKAGE
+    if (NULL == (pEFI_FILE_PROTOCOL = PluginPackageOpen()))
+        return NULL;
+
+    pImage = malloc(pPlugin->size);
+    if (NULL != pImage
+        && (EFI_SUCCESS != pEFI_FILE_PROTOCOL->SetPosition(pEFI_FILE_PROTOCOL, pPlugin->Offset)
+            || EFI_SUCCESS != pEFI_FILE_PROTOCOL->Read(pEFI_FILE_PROTOCOL, &n, pImage)
+            || pPlugin->size != n
+            || pPlugin->Hash != PluginPakHash(pImage, n)))
+        free(pImage), pImage = NULL;
+
+    pEFI_FILE_PROTOCOL->Close(pEFI_FILE_PROTOCOL);
+
+    if (NULL == (pPlugin->pStart = pImage))
+        return NULL;
+#endif//UEFI_SHELL_PLUGIN_PACKAGE
+
+    if (0 == (pPlugin->Flags & PLUGINPAK_FLAG_COMPRESSED))
+    {
+        pPlugin->pImage = pPlugin->pStart;
+        pPlugin->ImageSize = pPlugin->size;
+        return pPlugin->pImage;
+    }
+
+    //
+    // decompress once, the image is kept for the next run of the PLUGIN
+    //
+    pPlugin->ImageSize = PluginLzSize(pPlugin->pStart, pPlugin->size);
+    pImage = 0 == pPlugin->ImageSize ? NULL : malloc(pPlugin->ImageSize);
+    if (NULL != pImage && !PluginLzDecompress(pPlugin->pStart, pPlugin->size, pImage))
+        free(pImage), pImage = NULL;
+    pPlugin->pImage = pImage;
+
+#ifdef UEFI_SHELL_PLUGIN_PACKAGE
+    free(pPlugin->pStart);                      // payload read from PLUGINS.PAK is not needed any more
+    pPlugin->pStart = NULL;
+#endif//UEFI_SHELL_PLUGIN_PACKAGE
+
+    return pPlugin->pImage;
 }
 
 /**
@@ -2196,7 +4401,7 @@ GetOperationType (
   //
   // Test for a PLUGIN
   //
-  for (int i = 0; i < sizeof(plugin) / sizeof(plugin[0]); i++)
+  for (size_t i = 0; i < mPluginCount; i++)
   {
       wchar_t wcsCmdName[48];
 
@@ -2204,7 +4409,7 @@ GetOperationType (
 
       swscanf(CmdName, L"%s", &wcsCmdName);
 
-      if (0 == _wcsicmp(wcsCmdName, plugin[i].wcsCmd))
+      if (0 == _wcsicmp(wcsCmdName, mPlugins[i].wcsCmd))
       {
           //CDETRACE((TRCINF(1) "--> \n"));
           return (Efi_Application);
@@ -2288,7 +4493,7 @@ IsValidSplit (
     TempWalker = (CHAR16 *)Temp;
     if (!EFI_ERROR (GetNextParameter (&TempWalker, &FirstParameter, StrSize (CmdLine), TRUE))) {
       if (GetOperationType (FirstParameter) == Unknown_Invalid) {
-        ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
+        ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
         SetLastError (SHELL_NOT_FOUND);
         Status = EFI_NOT_FOUND;
       }
@@ -2383,7 +4588,7 @@ ProcessNewSplitCommandLine (
   }
 
   if (EFI_ERROR (Status)) {
-    ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_INVALID_SPLIT), ShellInfoObject.HiiHandle, CmdLine);
+    ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_INVALID_SPLIT), ShellInfoObject.HiiHandle, CmdLine);
   }
 
   return (Status);
@@ -2419,7 +4624,7 @@ ChangeMappedDrive (
   // Report any errors
   //
   if (EFI_ERROR (Status)) {
-    ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_INVALID_MAPPING), ShellInfoObject.HiiHandle, CmdLine);
+    ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_INVALID_MAPPING), ShellInfoObject.HiiHandle, CmdLine);
   }
 
   return (Status);
@@ -2437,45 +4642,16 @@ DoHelpUpdate (
   IN OUT CHAR16  **CmdLine
   )
 {
-  CHAR16      *CurrentParameter;
-  CHAR16      *Walker;
-  CHAR16      *NewCommandLine;
-  EFI_STATUS  Status;
-  UINTN       NewCmdLineSize;
-
-  Status = EFI_SUCCESS;
-
-  CurrentParameter = AllocateZeroPool (StrSize (*CmdLine));
-  if (CurrentParameter == NULL) {
-    return (EFI_OUT_OF_RESOURCES);
-  }
-
-  Walker = *CmdLine;
-  while (Walker != NULL && *Walker != CHAR_NULL) {
-    if (!EFI_ERROR (GetNextParameter (&Walker, &CurrentParameter, StrSize (*CmdLine), TRUE))) {
-      if (StrStr (CurrentParameter, L"-?") == CurrentParameter) {
-        CurrentParameter[0] = L' ';
-        CurrentParameter[1] = L' ';
-        NewCmdLineSize      = StrSize (L"help ") + StrSize (*CmdLine);
-        NewCommandLine      = AllocateZeroPool (NewCmdLineSize);
-        if (NewCommandLine == NULL) {
-          Status = EFI_OUT_OF_RESOURCES;
-          break;
-        }
+  SHELL_LEXED_LINE  Lexed;
+  EFI_STATUS        Status;
 
-        //
-        // We know the space is sufficient since we just calculated it.
-        //
-        StrnCpyS (NewCommandLine, NewCmdLineSize/sizeof (CHAR16), L"help ", 5);
-        StrnCatS (NewCommandLine, NewCmdLineSize/sizeof (CHAR16), *CmdLine, StrLen (*CmdLine));
-        SHELL_FREE_NON_NULL (*CmdLine);
-        *CmdLine = NewCommandLine;
-        break;
-      }
-    }
+  ZeroMem (&Lexed, sizeof (Lexed));
+  Status = ShellLexCommandLine (*CmdLine, FALSE, &Lexed);
+  if (!EFI_ERROR (Status) && ((Lexed.Flags & SHELL_TOKEN_HELP) != 0)) {
+    Status = ShellLexSplice (CmdLine, &Lexed, 0, FALSE, L"help ");
   }
 
-  SHELL_FREE_NON_NULL (CurrentParameter);
+  ShellLexFree (&Lexed);
 
   return (Status);
 }
@@ -2507,53 +4683,89 @@ SetLastError (
 }
 
 /**
-  Converts the command line to its post-processed form.  this replaces variables and alias' per UEFI Shell spec.
+  Converts a trimmed, lexed command line to its post-processed form.  this replaces variables and alias' per
+  UEFI Shell spec and keeps the tokens in step with the line.
 
   @param[in,out] CmdLine        pointer to the command line to update
+  @param[in,out] Lexed          the tokens of the command line
 
   @retval EFI_SUCCESS           The operation was successful
   @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
   @return                       some other error occurred
 **/
+STATIC
 EFI_STATUS
-ProcessCommandLineToFinal (
-  IN OUT CHAR16  **CmdLine
+ShellLexProcessToFinal (
+  IN OUT CHAR16            **CmdLine,
+  IN OUT SHELL_LEXED_LINE  *Lexed
   )
 {
   EFI_STATUS  Status;
 
-  TrimSpaces (CmdLine);
-
-  Status = ShellSubstituteAliases (CmdLine);
+  Status = ShellLexSubstituteAlias (CmdLine, Lexed);
   if (EFI_ERROR (Status)) {
     return (Status);
   }
 
-  TrimSpaces (CmdLine);
+  //
+  // A line without any % has nothing to replace.  Variable values can bring
+  // their own quotes, pipes and -?, so an expanded line is lexed again.
+  //
+  if ((Lexed->Flags & SHELL_TOKEN_PERCENT) != 0) {
+    Status = ShellSubstituteVariables (CmdLine);
+    if (EFI_ERROR (Status)) {
+      return (Status);
+    }
 
-  Status = ShellSubstituteVariables (CmdLine);
-  if (EFI_ERROR (Status)) {
-    return (Status);
-  }
+    ASSERT (*CmdLine != NULL);
 
-  ASSERT (*CmdLine != NULL);
+    Status = ShellLexCommandLine (*CmdLine, FALSE, Lexed);
+    if (EFI_ERROR (Status)) {
+      return (Status);
+    }
 
-  TrimSpaces (CmdLine);
+    ShellLexTrim (*CmdLine, Lexed);
+  }
 
   //
   // update for help parsing
   //
-  if (StrStr (*CmdLine, L"?") != NULL) {
-    //
-    // This may do nothing if the ? does not indicate help.
-    // Save all the details for in the API below.
-    //
-    Status = DoHelpUpdate (CmdLine);
+  if ((Lexed->Flags & SHELL_TOKEN_HELP) != 0) {
+    Status = ShellLexSplice (CmdLine, Lexed, 0, FALSE, L"help ");
   }
 
-  TrimSpaces (CmdLine);
+  return (Status);
+}
+
+/**
+  Converts the command line to its post-processed form.  this replaces variables and alias' per UEFI Shell spec.
+
+  @param[in,out] CmdLine        pointer to the command line to update
 
-  return (EFI_SUCCESS);
+  @retval EFI_SUCCESS           The operation was successful
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @return                       some other error occurred
+**/
+EFI_STATUS
+ProcessCommandLineToFinal (
+  IN OUT CHAR16  **CmdLine
+  )
+{
+  SHELL_LEXED_LINE  Lexed;
+  EFI_STATUS        Status;
+
+  ZeroMem (&Lexed, sizeof (Lexed));
+  Status = ShellLexCommandLine (*CmdLine, FALSE, &Lexed);
+  if (!EFI_ERROR (Status)) {
+    ShellLexTrim (*CmdLine, &Lexed);
+    if (Lexed.Count > 0) {
+      Status = ShellLexProcessToFinal (CmdLine, &Lexed);
+    }
+  }
+
+  ShellLexFree (&Lexed);
+
+  return (Status);
 }
 
 /**
@@ -2602,9 +4814,19 @@ RunInternalCommand (
   Status = UpdateArgcArgv (ParamProtocol, NewCmdLine, Internal_Command, &Argv, &Argc);
   if (!EFI_ERROR (Status)) {
     //
-    // Run the internal command.
+    // Run the internal command.  "ver -t" reports the boot phase times, which
+    // only the shell itself knows.
     //
-    Status = ShellCommandRunCommandHandler (FirstParameter, &CommandReturnedStatus, &LastError);
+    if (  (Argc == 2)
+       && (gUnicodeCollation->StriColl (gUnicodeCollation, FirstParameter, L"ver") == 0)
+       && (gUnicodeCollation->StriColl (gUnicodeCollation, Argv[1], L"-t") == 0))
+    {
+      BootTimeReport ();
+      CommandReturnedStatus = SHELL_SUCCESS;
+      LastError             = TRUE;
+    } else {
+      Status = ShellCommandRunCommandHandler (FirstParameter, &CommandReturnedStatus, &LastError);
+    }
 
     if (!EFI_ERROR (Status)) {
       if (CommandStatus != NULL) {
@@ -2719,9 +4941,9 @@ RunCommandOrFile (
               puts(""); // new line
               // list PLUGINs
               printf("TORO UEFI SHELL PLUGINs:\n");
-              for (int i = 1; i <= sizeof(plugin) / sizeof(plugin[0]); i++)
+              for (size_t i = 1; i <= mPluginCount; i++)
               {
-                  printf("%s%ls", pstrCommaLF,plugin[i - 1].wcsCmd);
+                  printf("%s%ls", pstrCommaLF,mPlugins[i - 1].wcsCmd);
                   if (0 == (i % 8))
                       pstrCommaLF = "\n    ";
                   else
@@ -2731,7 +4953,8 @@ RunCommandOrFile (
           }
           if (0 == _wcsicmp(CmdLine, L"ver"))
           {
-              printf("\n    TORO UEFI SHELL with PLUGIN Extension, v%d.%d.%d Build %d\n    Based on \"edk2-stable202505\"\n\n", MAJORVER, MINORVER, PATCHVER, BUILDNUM);
+              printf("\n    TORO UEFI SHELL with PLUGIN Extension, v%d.%d.%d Build %d\n    Based on \"edk2-stable202505\"\n", MAJORVER, MINORVER, PATCHVER, BUILDNUM);
+              printf("    Open file handles: %zu\n\n", (size_t)ShellFileHandleGetOpenCount());
           }
       }
       break;
@@ -2759,7 +4982,7 @@ RunCommandOrFile (
       // This should be impossible now.
       //
       ASSERT (CommandWithPath != NULL);
-        ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
+        ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
         SetLastError (SHELL_NOT_FOUND);
         return EFI_NOT_FOUND;
       }
@@ -2768,7 +4991,7 @@ RunCommandOrFile (
       // Make sure that path is not just a directory (or not found)
       //
       if (!EFI_ERROR (ShellIsDirectory (CommandWithPath))) {
-        ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
+        ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
         SetLastError (SHELL_NOT_FOUND);
       }
 
@@ -2796,7 +5019,7 @@ RunCommandOrFile (
             {
                 wchar_t wcsCmdName[48];
                 char fIsPlugin = 0;
-                int i;
+                size_t i;
                 static EFI_GUID guidSTOP = EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL_GUID;
                 EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL* pSTOP;
                 size_t CurrentModeNumber;
@@ -2804,18 +5027,23 @@ RunCommandOrFile (
                 gSystemTable->BootServices->LocateProtocol(&guidSTOP, NULL, (void**)&pSTOP);
                 CurrentModeNumber = pSTOP->Mode->Mode;
 
-                for (i = 0; i < sizeof(plugin) / sizeof(plugin[0]); i++)
-                {
-                    memset(wcsCmdName, 0, sizeof(wcsCmdName));
+                //
+                // command name, also needed below if there is no PLUGIN at all
+                //
+                memset(wcsCmdName, 0, sizeof(wcsCmdName));
 
-                    swscanf(CmdLine, L"%s", &wcsCmdName);
+                swscanf(CmdLine, L"%47s", wcsCmdName);
 
-                    if (0 == _wcsicmp(wcsCmdName, plugin[i].wcsCmd))
+                for (i = 0; i < mPluginCount; i++)
+                {
+                    if (0 == _wcsicmp(wcsCmdName, mPlugins[i].wcsCmd))
                     {
                         CDETRACE((TRCINF(1) "--> \n"));
                         fIsPlugin = 1;
-                        
-                        if (1)
+
+                        if (NULL == PluginImage(&mPlugins[i]))
+                            printf("%ls: can't load the PLUGIN image\n", mPlugins[i].wcsCmd);
+                        else
                         {
                             static EFI_GUID guidEFI_SHELL_PARAMETERS_PROTOCOL = EFI_SHELL_PARAMETERS_PROTOCOL_GUID;
                             static EFI_GUID guidEFI_DEVICE_PATH_TO_TEXT_PROTOCOL = EFI_DEVICE_PATH_TO_TEXT_PROTOCOL_GUID;
@@ -2836,14 +5064,14 @@ RunCommandOrFile (
                             pMEMMAP_DEVICE_PATH->Header.Type = HARDWARE_DEVICE_PATH;
                             pMEMMAP_DEVICE_PATH->Header.SubType = HW_MEMMAP_DP;
                             pMEMMAP_DEVICE_PATH->MemoryType = EfiConventionalMemory;
-                            pMEMMAP_DEVICE_PATH->StartingAddress = (EFI_PHYSICAL_ADDRESS)plugin[i].pStart;
-                            pMEMMAP_DEVICE_PATH->EndingAddress = (EFI_PHYSICAL_ADDRESS)&plugin[i].pStart[plugin[i].size];
+                            pMEMMAP_DEVICE_PATH->StartingAddress = (EFI_PHYSICAL_ADDRESS)mPlugins[i].pImage;
+                            pMEMMAP_DEVICE_PATH->EndingAddress = (EFI_PHYSICAL_ADDRESS)&mPlugins[i].pImage[mPlugins[i].ImageSize];
                             pMEMMAP_DEVICE_PATH->Header.Length[0] = (unsigned char)sizeof(MEMMAP_DEVICE_PATH);
                             pMEMMAP_DEVICE_PATH->Header.Length[1] = (unsigned char)(sizeof(MEMMAP_DEVICE_PATH) >> 8);
 
                             DevPath = pEFI_DEVICE_PATH = pEFI_DEVICE_PATH_UTILITIES_PROTOCOL->AppendDeviceNode(NULL, (EFI_DEVICE_PATH_PROTOCOL*)pMEMMAP_DEVICE_PATH);
-                            _gPLUGINSTART = plugin[i].pStart;
-                            _gPLUGINSIZE = plugin[i].size;
+                            _gPLUGINSTART = mPlugins[i].pImage;
+                            _gPLUGINSIZE = mPlugins[i].ImageSize;
 
                                     CDETRACE((TRCINF(1) "--> %ls\n", pEFI_DEVICE_PATH_TO_TEXT_PROTOCOL->ConvertDevicePathToText(pEFI_DEVICE_PATH, 1, 0)));
 
@@ -2911,23 +5139,31 @@ RunCommandOrFile (
                     }
                 }
 
-                //
-                // Execute the device path
-                //
-                CDETRACE((TRCINF(1) "### CmdLine: \"%ls\", CommandWithPath:\"%ls\"\n", CmdLine, CommandWithPath));
-                Status = InternalShellExecuteDevicePath(
-                    &gImageHandle,
-                    DevPath,
-                    CmdLine,
-                    NULL,
-                    &StartStatus
-                );
-
-                SHELL_FREE_NON_NULL(DevPath);
+                if (DevPath == NULL) {
+                    //
+                    // PLUGIN image not loaded, reported with the last error below
+                    //
+                    Status = EFI_LOAD_ERROR;
+                }
+                else
+                {
+                    //
+                    // Execute the device path
+                    //
+                    CDETRACE((TRCINF(1) "### CmdLine: \"%ls\", CommandWithPath:\"%ls\"\n", CmdLine, CommandWithPath));
+                    Status = InternalShellExecuteDevicePath(
+                        &gImageHandle,
+                        DevPath,
+                        CmdLine,
+                        NULL,
+                        &StartStatus
+                    );
 
-                if(0 == _wcsnicmp(wcsCmdName, L"pciview", wcslen(L"pciview")))
-                    pSTOP->SetMode(pSTOP, CurrentModeNumber);
+                    SHELL_FREE_NON_NULL(DevPath);
 
+                    if(0 == _wcsnicmp(wcsCmdName, L"pciview", wcslen(L"pciview")))
+                        pSTOP->SetMode(pSTOP, CurrentModeNumber);
+                }
             }
 
 
@@ -3018,9 +5254,9 @@ SetupAndRunCommandOrFile (
   if (EFI_ERROR (Status)) {
     ConstScriptFile = ShellCommandGetCurrentScriptFile ();
     if ((ConstScriptFile == NULL) || (ConstScriptFile->CurrentCommand == NULL)) {
-      ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_ERROR), ShellInfoObject.HiiHandle, (VOID *)(Status));
+      ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_ERROR), ShellInfoObject.HiiHandle, (VOID *)(Status));
     } else {
-      ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_ERROR_SCRIPT), ShellInfoObject.HiiHandle, (VOID *)(Status), ConstScriptFile->CurrentCommand->Line);
+      ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_ERROR_SCRIPT), ShellInfoObject.HiiHandle, (VOID *)(Status), ConstScriptFile->CurrentCommand->Line);
     }
   }
 
@@ -3053,7 +5289,7 @@ RunShellCommand (
   EFI_STATUS             Status;
   CHAR16                 *CleanOriginal;
   CHAR16                 *FirstParameter;
-  CHAR16                 *TempWalker;
+  SHELL_LEXED_LINE       Lexed;
   SHELL_OPERATION_TYPES  Type;
   CONST CHAR16           *CurDir;
 
@@ -3065,41 +5301,43 @@ RunShellCommand (
   Status        = EFI_SUCCESS;
   CleanOriginal = NULL;
 
+  //
+  // Devices plugged in since the last command are usable by this one.
+  //
+  MapHotPlugProcess (FALSE);
+
   CleanOriginal = StrnCatGrow (&CleanOriginal, NULL, CmdLine, 0);
   if (CleanOriginal == NULL) {
     return (EFI_OUT_OF_RESOURCES);
   }
 
-  TrimSpaces (&CleanOriginal);
-
   //
-  // NULL out comments (leveraged from RunScriptFileHandle() ).
+  // Split the line into tokens once; the stages below read and patch the tokens.
   // The # character on a line is used to denote that all characters on the same line
-  // and to the right of the # are to be ignored by the shell.
-  // Afterwards, again remove spaces, in case any were between the last command-parameter and '#'.
-  //
-  for (TempWalker = CleanOriginal; TempWalker != NULL && *TempWalker != CHAR_NULL; TempWalker++) {
-    if (*TempWalker == L'^') {
-      if (*(TempWalker + 1) == L'#') {
-        TempWalker++;
-      }
-    } else if (*TempWalker == L'#') {
-      *TempWalker = CHAR_NULL;
-    }
+  // and to the right of the # are to be ignored by the shell (as in RunScriptFileHandle() ),
+  // so the lexer stops there.  Trimming drops the spaces around the remaining tokens.
+  //
+  ZeroMem (&Lexed, sizeof (Lexed));
+  Status = ShellLexCommandLine (CleanOriginal, TRUE, &Lexed);
+  if (EFI_ERROR (Status)) {
+    SHELL_FREE_NON_NULL (CleanOriginal);
+    return (Status);
   }
 
-  TrimSpaces (&CleanOriginal);
+  ShellLexTrim (CleanOriginal, &Lexed);
 
   //
   // Handle case that passed in command line is just 1 or more " " characters.
   //
-  if (StrLen (CleanOriginal) == 0) {
+  if (Lexed.Count == 0) {
+    ShellLexFree (&Lexed);
     SHELL_FREE_NON_NULL (CleanOriginal);
     return (EFI_SUCCESS);
   }
 
-  Status = ProcessCommandLineToFinal (&CleanOriginal);
+  Status = ShellLexProcessToFinal (&CleanOriginal, &Lexed);
   if (EFI_ERROR (Status)) {
+    ShellLexFree (&Lexed);
     SHELL_FREE_NON_NULL (CleanOriginal);
     return (Status);
   }
@@ -3108,7 +5346,8 @@ RunShellCommand (
   // We don't do normal processing with a split command line (output from one command input to another)
   //
   CDETRACE((TRCINF(1)"-->ContainsSplit(\"%ls\")\n", CleanOriginal));
-  if (ContainsSplit (CleanOriginal)) {
+  if ((Lexed.Flags & SHELL_TOKEN_PIPE) != 0) {
+    ShellLexFree (&Lexed);
     Status = ProcessNewSplitCommandLine (CleanOriginal);
     SHELL_FREE_NON_NULL (CleanOriginal);
     return (Status);
@@ -3119,12 +5358,22 @@ RunShellCommand (
   //
   FirstParameter = AllocateZeroPool (StrSize (CleanOriginal));
   if (FirstParameter == NULL) {
+    ShellLexFree (&Lexed);
     SHELL_FREE_NON_NULL (CleanOriginal);
     return (EFI_OUT_OF_RESOURCES);
   }
 
-  TempWalker = CleanOriginal;
-  if (!EFI_ERROR (GetNextParameter (&TempWalker, &FirstParameter, StrSize (CleanOriginal), TRUE))) {
+  //
+  // A quote opened in the first parameter and never closed leaves no valid
+  // first parameter; the line is reported as not found below.
+  //
+  if ((Lexed.Count > 1) || ((Lexed.Count == 1) && ((Lexed.Flags & SHELL_TOKEN_OPEN_QUOTE) == 0))) {
+    ShellLexCopyToken (CleanOriginal, &Lexed.Tokens[0], FirstParameter);
+  }
+
+  ShellLexFree (&Lexed);
+
+  if (FirstParameter[0] != CHAR_NULL) {
     //
     // Depending on the first parameter we change the behavior
     //
@@ -3136,25 +5385,38 @@ RunShellCommand (
       case Script_File_Name:
       case Efi_Application:
           Status = SetupAndRunCommandOrFile (Type, CleanOriginal, FirstParameter, ShellInfoObject.NewShellParametersProtocol, CommandStatus);
+        if (Type != Internal_Command) {
+          //
+          // images can touch file systems behind the shell's back
+          //
+          mCwdCheckPending = TRUE;
+        }
+
         break;
       default:
         //
         // Whatever was typed, it was invalid.
         //
-        ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
+        ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
         SetLastError (SHELL_NOT_FOUND);
         break;
     }
   } else {
-    ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
+    ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_NOT_FOUND), ShellInfoObject.HiiHandle, FirstParameter);
     SetLastError (SHELL_NOT_FOUND);
   }
 
+  //
+  // A command may have changed PlatformLang, which invalidates the cached HII strings.
+  //
+  ShellCommandCheckHiiLanguage ();
+
   //
   // Check whether the current file system still exists. If not exist, we need update "cwd" and gShellCurMapping.
+  // The file system is only probed if something that could invalidate the cwd happened since the last probe.
   //
   CurDir = EfiShellGetCurDir (NULL);
-  if (CurDir != NULL) {
+  if ((CurDir != NULL) && CwdNeedsValidation (CurDir)) {
     if (EFI_ERROR (ShellFileExists (CurDir))) {
       //
       // EfiShellSetCurDir() cannot set current directory to NULL.
@@ -3163,6 +5425,9 @@ RunShellCommand (
       //
       InternalEfiShellSetEnv (L"cwd", NULL, TRUE);
       gShellCurMapping = NULL;
+      mCwdCheckPending = TRUE;
+    } else {
+      CwdValidated (CurDir);
     }
   }
 
@@ -3453,9 +5718,9 @@ RunScriptFileHandle (
             if (ShellCommandGetEchoState ()) {
               CurDir = ShellInfoObject.NewEfiShellProtocol->GetEnv (L"cwd");
               if ((CurDir != NULL) && (StrLen (CurDir) > 1)) {
-                ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_CURDIR), ShellInfoObject.HiiHandle, CurDir);
+                ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_CURDIR), ShellInfoObject.HiiHandle, CurDir);
               } else {
-                ShellPrintHiiEx (-1, -1, NULL, STRING_TOKEN (STR_SHELL_SHELL), ShellInfoObject.HiiHandle);
+                ShellCommandPrintHii (-1, -1, NULL, STRING_TOKEN (STR_SHELL_SHELL), ShellInfoObject.HiiHandle);
               }
 
               ShellPrintEx (-1, -1, L"%s\r\n", CommandLine2);
@@ -3557,6 +5822,11 @@ RunScriptFile (
     return (EFI_INVALID_PARAMETER);
   }
 
+  //
+  // non volatile environment writes of the script are committed once, when it ends
+  //
+  ShellEnvBatchBegin ();
+
   //
   // get the argc and argv updated for scripts
   //
@@ -3589,6 +5859,8 @@ RunScriptFile (
   //
   RestoreArgcArgv (ParamProtocol, &Argv, &Argc);
 
+  ShellEnvBatchEnd ();
+
   return (Status);
 }
 
@@ -3611,21 +5883,26 @@ FindFirstCharacter (
 {
   UINTN  WalkChar;
   UINTN  WalkStr;
+  UINTN  StringLength;
+  UINTN  ListLength;
+
+  StringLength = StrLen (String);
+  ListLength   = StrLen (CharacterList);
 
-  for (WalkStr = 0; WalkStr < StrLen (String); WalkStr++) {
+  for (WalkStr = 0; WalkStr < StringLength; WalkStr++) {
     if (String[WalkStr] == EscapeCharacter) {
       WalkStr++;
       continue;
     }
 
-    for (WalkChar = 0; WalkChar < StrLen (CharacterList); WalkChar++) {
+    for (WalkChar = 0; WalkChar < ListLength; WalkChar++) {
       if (String[WalkStr] == CharacterList[WalkChar]) {
         return (&String[WalkStr]);
       }
     }
   }
 
-  return (String + StrLen (String));
+  return (String + StringLength);
 }
 
 /************************************************************************************************************************/
@@ -3633,14 +5910,6 @@ FindFirstCharacter (
 /************************************************************************************************************************/
 extern char* _strefierror(size_t);
 
-void _mysleep(int millisec)
-{
-    clock_t clk = (millisec + CLOCKS_PER_SEC / 1000) + clock();
-
-    while (clk > clock())
-        ;
-}
-
 void _mymenuF8Key(void)
 {
     fSkipSTARTUPNSH = 1;
@@ -3653,6 +5922,474 @@ void _mymenuF5Key(void)
     fSkipSTARTUPNSH = 1;
 }
 
+//
+// BOOTX64.INI parser
+//
+// The file is read with one EFI_FILE_PROTOCOL.Read() into a buffer sized by GetInfo(),
+// UTF-16 files (FF FE / FE FF BOM) are converted to UTF-8, a UTF-8 BOM is skipped.
+// Lines are "KEY value ..." or "KEY = value, ...", optionally grouped in [SECTION]s;
+// '#' starts a comment anywhere, ';' at the start of a line. Unknown keys are ignored.
+//
+typedef enum _BOOTINI_TYPE {
+    BOOTINI_FLAG,                               // char, set by the bare key or by 1/ON/TRUE/YES, cleared by 0/OFF/FALSE/NO
+    BOOTINI_SIZE,                               // size_t, one decimal number
+    BOOTINI_SIZE_PAIR                           // two consecutive size_t, two decimal numbers
+} BOOTINI_TYPE;
+
+typedef struct _BOOTINI_KEY {
+    const char*  pszSection;                    // "" for keys before the first [SECTION]
+    const char*  pszKey;
+    BOOTINI_TYPE Type;
+    size_t       Offset;                        // offset of the field in BOOTINI_CONFIG
+} BOOTINI_KEY;
+
+static const BOOTINI_KEY mBootIniKeys[] = {
+    { "", "TEXTRESOLUTION",            BOOTINI_SIZE_PAIR, offsetof(BOOTINI_CONFIG, TextColumns) },
+    { "", "DEFAULT_UEFI_DRIVE_NAMING", BOOTINI_FLAG,      offsetof(BOOTINI_CONFIG, fDefaultUefiDriveNaming) },
+    { "", "PERSISTENT_HISTORY",        BOOTINI_FLAG,      offsetof(BOOTINI_CONFIG, fPersistentHistory) },
+    { "", "BOOT_DELAY",                BOOTINI_SIZE,      offsetof(BOOTINI_CONFIG, BootDelay) },
+};
+
+#define BOOTINI_MAX_VALUES 8
+
+static int BootIniParseSize(const char* pszValue, size_t* pSize)
+{
+    char* pEnd;
+    unsigned long long ull = strtoull(pszValue, &pEnd, 10);
+
+    if (pEnd == pszValue || '\0' != *pEnd)
+        return 0;
+
+    *pSize = (size_t)ull;
+    return 1;
+}
+
+//
+// store the values of one line, if the key is known
+//
+static void BootIniApply(BOOTINI_CONFIG* pConfig, const char* pszSection, const char* pszKey, int nValues, char** ppszValues)
+{
+    const BOOTINI_KEY* pKey;
+    char* pField;
+    size_t Size[2];
+
+    for (pKey = &mBootIniKeys[0]; pKey < &mBootIniKeys[sizeof(mBootIniKeys) / sizeof(mBootIniKeys[0])]; pKey++)
+    {
+        if (0 != _stricmp(pKey->pszSection, pszSection) || 0 != _stricmp(pKey->pszKey, pszKey))
+            continue;
+
+        pField = (char*)pConfig + pKey->Offset;
+
+        switch (pKey->Type)
+        {
+            case BOOTINI_FLAG:
+                if (0 == nValues || 0 == _stricmp(ppszValues[0], "1") || 0 == _stricmp(ppszValues[0], "ON") || 0 == _stricmp(ppszValues[0], "TRUE") || 0 == _stricmp(ppszValues[0], "YES"))
+                    *pField = 1;
+                else if (0 == _stricmp(ppszValues[0], "0") || 0 == _stricmp(ppszValues[0], "OFF") || 0 == _stricmp(ppszValues[0], "FALSE") || 0 == _stricmp(ppszValues[0], "NO"))
+                    *pField = 0;
+                break;
+
+            case BOOTINI_SIZE:
+                if (1 <= nValues && BootIniParseSize(ppszValues[0], &Size[0]))
+                    memcpy(pField, &Size[0], sizeof(size_t));
+                break;
+
+            case BOOTINI_SIZE_PAIR:
+                if (2 <= nValues && BootIniParseSize(ppszValues[0], &Size[0]) && BootIniParseSize(ppszValues[1], &Size[1]))
+                    memcpy(pField, &Size[0], 2 * sizeof(size_t));
+                break;
+        }
+        return;
+    }
+}
+
+//
+// parse a NUL terminated UTF-8 buffer in place
+//
+static void BootIniParse(char* pBuf, BOOTINI_CONFIG* pConfig)
+{
+    char szSection[32] = "";
+    char* pLine, * pNext, * p;
+    char* ppszFields[1 + BOOTINI_MAX_VALUES];
+    int nFields;
+    size_t len;
+
+    for (pLine = pBuf; NULL != pLine; pLine = pNext)
+    {
+        pNext = strchr(pLine, '\n');
+        if (NULL != pNext)
+            *pNext++ = '\0';
+
+        p = strchr(pLine, '#');                 // remove comment lead by '#'
+        if (NULL != p)
+            *p = '\0';
+
+        while (isspace((unsigned char)*pLine))
+            pLine++;
+        len = strlen(pLine);
+        while (0 < len && isspace((unsigned char)pLine[len - 1]))
+            pLine[--len] = '\0';
+
+        if ('\0' == *pLine || ';' == *pLine)
+            continue;
+
+        if ('[' == *pLine)                      // [SECTION]
+        {
+            p = strchr(pLine, ']');
+            if (NULL != p)
+            {
+                *p = '\0';
+                for (pLine++; isspace((unsigned char)*pLine); pLine++)
+                    ;
+                len = strlen(pLine);
+                while (0 < len && isspace((unsigned char)pLine[len - 1]))
+                    pLine[--len] = '\0';
+                strncpy(szSection, pLine, sizeof(szSection) - 1);
+            }
+            continue;
+        }
+
+        //
+        // split into key and values, separated by blanks, '=' or ','
+        //
+        for (nFields = 0, p = pLine; '\0' != *p && nFields < 1 + BOOTINI_MAX_VALUES;)
+        {
+            while (isspace((unsigned char)*p) || '=' == *p || ',' == *p)
+                *p++ = '\0';
+            if ('\0' == *p)
+                break;
+            ppszFields[nFields++] = p;
+            while ('\0' != *p && !isspace((unsigned char)*p) && '=' != *p && ',' != *p)
+                p++;
+        }
+        *p = '\0';                              // values beyond BOOTINI_MAX_VALUES are dropped
+
+        if (0 < nFields)
+            BootIniApply(pConfig, szSection, ppszFields[0], nFields - 1, &ppszFields[1]);
+    }
+}
+
+//
+// convert UTF-16 without BOM to a NUL terminated UTF-8 buffer
+// surrogate pairs become one 4 byte sequence, unpaired surrogates become U+FFFD
+//
+static char* BootIniUtf16ToUtf8(const unsigned char* pSrc, size_t cbSrc, int fBigEndian)
+{
+    char* pDst = malloc(cbSrc / 2 * 3 + 1), * p = pDst;
+    unsigned c, c2;
+    size_t i;
+
+    if (NULL == pDst)
+        return NULL;
+
+    for (i = 0; i + 1 < cbSrc; i += 2)
+    {
+        c = fBigEndian ? (pSrc[i] << 8 | pSrc[i + 1]) : (pSrc[i] | pSrc[i + 1] << 8);
+
+        if (0xD800 <= c && c < 0xDC00 && i + 3 < cbSrc)
+        {
+            c2 = fBigEndian ? (pSrc[i + 2] << 8 | pSrc[i + 3]) : (pSrc[i + 2] | pSrc[i + 3] << 8);
+            if (0xDC00 <= c2 && c2 < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+                i += 2;
+            }
+        }
+        if (0xD800 <= c && c < 0xE000)
+            c = 0xFFFD;
+
+        if (c < 0x80)
+            *p++ = (char)c;
+        else if (c < 0x800)
+            *p++ = (char)(0xC0 | c >> 6),
+            *p++ = (char)(0x80 | (c & 0x3F));
+        else if (c < 0x10000)
+            *p++ = (char)(0xE0 | c >> 12),
+            *p++ = (char)(0x80 | (c >> 6 & 0x3F)),
+            *p++ = (char)(0x80 | (c & 0x3F));
+        else
+            *p++ = (char)(0xF0 | c >> 18),
+            *p++ = (char)(0x80 | (c >> 12 & 0x3F)),
+            *p++ = (char)(0x80 | (c >> 6 & 0x3F)),
+            *p++ = (char)(0x80 | (c & 0x3F));
+    }
+    *p = '\0';
+
+    return pDst;
+}
+
+//
+// read \EFI\BOOT\BOOTX64.INI from the boot volume into pConfig, which is zeroed first
+//
+static void BootIniLoad(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable, BOOTINI_CONFIG* pConfig)
+{
+    EFI_STATUS Status;
+    EFI_LOADED_IMAGE_PROTOCOL* pLoadedImageProtocol;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
+    EFI_FILE_PROTOCOL* pEFI_FILE_PROTOCOL = NULL, * pROOT = NULL;
+    EFI_FILE_INFO* pInfo = NULL;
+    UINTN InfoSize = 0, n;
+    unsigned char* pBuf = NULL;
+    char* pText = NULL;
+
+    memset(pConfig, 0, sizeof(BOOTINI_CONFIG));
+    pConfig->BootDelay = BOOTINI_DEFAULT_BOOT_DELAY;
+
+    do
+    {
+        Status = SystemTable->BootServices->HandleProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid, &pLoadedImageProtocol);
+        if (EFI_SUCCESS != Status)
+            break;
+
+        Status = SystemTable->BootServices->HandleProtocol(
+            pLoadedImageProtocol->DeviceHandle,
+            &gEfiSimpleFileSystemProtocolGuid,
+            &pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL
+        );
+        if (EFI_SUCCESS != Status)
+            break;
+
+        Status = pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL->OpenVolume(pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL, &pROOT);
+        if (EFI_SUCCESS != Status)
+            break;
+
+        Status = pROOT->Open(pROOT, &pEFI_FILE_PROTOCOL, L"\\EFI\\BOOT\\BOOTX64.INI", EFI_FILE_MODE_READ, 0);
+        if (EFI_SUCCESS != Status)
+        {
+            pEFI_FILE_PROTOCOL = NULL;
+            break;
+        }
+        pConfig->fFound = 1;
+
+        //
+        // size from GetInfo(), then one Read() for the whole file
+        //
+        Status = pEFI_FILE_PROTOCOL->GetInfo(pEFI_FILE_PROTOCOL, &gEfiFileInfoGuid, &InfoSize, NULL);
+        if (EFI_BUFFER_TOO_SMALL != Status || NULL == (pInfo = malloc(InfoSize)))
+            break;
+        Status = pEFI_FILE_PROTOCOL->GetInfo(pEFI_FILE_PROTOCOL, &gEfiFileInfoGuid, &InfoSize, pInfo);
+        if (EFI_SUCCESS != Status || NULL == (pBuf = malloc((size_t)pInfo->FileSize + 1)))
+            break;
+
+        n = (UINTN)pInfo->FileSize;
+        Status = pEFI_FILE_PROTOCOL->Read(pEFI_FILE_PROTOCOL, &n, pBuf);
+        if (EFI_SUCCESS != Status)
+            break;
+        pBuf[n] = '\0';
+
+        if (2 <= n && 0xFF == pBuf[0] && 0xFE == pBuf[1])
+            pText = BootIniUtf16ToUtf8(&pBuf[2], n - 2, 0);
+        else if (2 <= n && 0xFE == pBuf[0] && 0xFF == pBuf[1])
+            pText = BootIniUtf16ToUtf8(&pBuf[2], n - 2, 1);
+
+        if (NULL != pText)
+            BootIniParse(pText, pConfig);
+        else if (3 <= n && 0xEF == pBuf[0] && 0xBB == pBuf[1] && 0xBF == pBuf[2])
+            BootIniParse((char*)&pBuf[3], pConfig);
+        else
+            BootIniParse((char*)pBuf, pConfig);
+
+    } while (0);
+
+    if (NULL != pEFI_FILE_PROTOCOL)
+        pEFI_FILE_PROTOCOL->Close(pEFI_FILE_PROTOCOL);
+    if (NULL != pROOT)
+        pROOT->Close(pROOT);
+
+    free(pText);
+    free(pBuf);
+    free(pInfo);
+}
+
+//
+// console mode remembered across boots
+//
+// Probing for the text mode costs a SetMode() per candidate, and each may reprogram the GOP.
+// The mode found is stored in an NV variable together with a fingerprint of the ConOut and
+// GOP mode tables and the requested TEXTRESOLUTION. A later boot with the same fingerprint
+// sets the mode directly, a changed display or BOOTX64.INI probes again.
+//
+#define CONSOLE_MODE_VARIABLE L"TOROConsoleMode"
+
+typedef struct _CONSOLE_MODE_CACHE {
+    UINT64 Fingerprint;
+    UINT32 Mode;
+} CONSOLE_MODE_CACHE;
+
+static UINT64 ConsoleModeHash(UINT64 Hash, const void* pData, size_t Size)
+{
+    const unsigned char* p = pData;
+
+    while (0 < Size--)                          // FNV-1a
+        Hash = (Hash ^ *p++) * 0x100000001B3ULL;
+
+    return Hash;
+}
+
+static UINT64 ConsoleModeFingerprint(EFI_SYSTEM_TABLE* SystemTable, EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL* pSTOP, EFI_GRAPHICS_OUTPUT_PROTOCOL* pGOP, size_t col, size_t row)
+{
+    UINT64 Hash = 0xCBF29CE484222325ULL;
+    UINTN Mode, Columns, Rows, InfoSize;
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* pInfo;
+
+    Hash = ConsoleModeHash(Hash, &col, sizeof(col));
+    Hash = ConsoleModeHash(Hash, &row, sizeof(row));
+
+    //
+    // QueryMode() only reports, it does not touch the hardware
+    //
+    Hash = ConsoleModeHash(Hash, &pSTOP->Mode->MaxMode, sizeof(pSTOP->Mode->MaxMode));
+    for (Mode = 0; Mode < (UINTN)pSTOP->Mode->MaxMode; Mode++)
+    {
+        if (EFI_SUCCESS != pSTOP->QueryMode(pSTOP, Mode, &Columns, &Rows))
+            Columns = Rows = 0;
+        Hash = ConsoleModeHash(Hash, &Columns, sizeof(Columns));
+        Hash = ConsoleModeHash(Hash, &Rows, sizeof(Rows));
+    }
+
+    if (NULL != pGOP)
+    {
+        Hash = ConsoleModeHash(Hash, &pGOP->Mode->MaxMode, sizeof(pGOP->Mode->MaxMode));
+        for (Mode = 0; Mode < pGOP->Mode->MaxMode; Mode++)
+        {
+            if (EFI_SUCCESS != pGOP->QueryMode(pGOP, (UINT32)Mode, &InfoSize, &pInfo))
+                continue;
+            Hash = ConsoleModeHash(Hash, &pInfo->HorizontalResolution, sizeof(pInfo->HorizontalResolution));
+            Hash = ConsoleModeHash(Hash, &pInfo->VerticalResolution, sizeof(pInfo->VerticalResolution));
+            SystemTable->BootServices->FreePool(pInfo);
+        }
+    }
+
+    return Hash;
+}
+
+static int ConsoleModeLookup(EFI_SYSTEM_TABLE* SystemTable, UINT64 Fingerprint, UINTN* pMode)
+{
+    CONSOLE_MODE_CACHE Cache;
+    UINTN Size = sizeof(Cache);
+    EFI_STATUS Status;
+
+    Status = SystemTable->RuntimeServices->GetVariable(CONSOLE_MODE_VARIABLE, &gToroShellVariableGuid, NULL, &Size, &Cache);
+
+    if (EFI_SUCCESS != Status || sizeof(Cache) != Size || Fingerprint != Cache.Fingerprint)
+        return 0;
+
+    *pMode = Cache.Mode;
+    return 1;
+}
+
+static void ConsoleModeRemember(EFI_SYSTEM_TABLE* SystemTable, UINT64 Fingerprint, UINTN Mode)
+{
+    CONSOLE_MODE_CACHE Cache;
+
+    memset(&Cache, 0, sizeof(Cache));
+    Cache.Fingerprint = Fingerprint;
+    Cache.Mode = (UINT32)Mode;
+
+    SystemTable->RuntimeServices->SetVariable(
+        CONSOLE_MODE_VARIABLE,
+        &gToroShellVariableGuid,
+        EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+        sizeof(Cache),
+        &Cache
+    );
+}
+
+//
+// boot countdown
+//
+// Waits up to DelayMs for a key on any SimpleTextInputEx device and prints a dot for every
+// full BOOT_COUNTDOWN_DOT_MS. The devices are located once, then the CPU idles in WaitForEvent()
+// on a one-shot timer and the WaitForKeyEx events of all devices. The timer is rearmed for
+// each period, the last one only for the rest of DelayMs. A DelayMs of 0 only picks up a key
+// that is already pressed. Returns 1 with the key in pKeyData, 0 on timeout.
+//
+#define BOOT_COUNTDOWN_DOT_MS 333
+
+static int BootCountdown(EFI_SYSTEM_TABLE* SystemTable, size_t DelayMs, EFI_KEY_DATA* pKeyData)
+{
+    EFI_BOOT_SERVICES* pBS = SystemTable->BootServices;
+    EFI_HANDLE* pHandles = NULL;
+    EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL** ppIF = NULL;
+    EFI_EVENT* pEvents = NULL;
+    EFI_EVENT TimerEvent = NULL;
+    UINTN NoHandles = 0, nEvents = 0, n, Index;
+    size_t Period, Elapsed = 0;
+    int fKey = 0;
+
+    do
+    {
+        pBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleTextInputExProtocolGuid, NULL, &NoHandles, &pHandles);
+
+        //
+        // slot 0 is the timer, the others are the input devices
+        //
+        ppIF = malloc((NoHandles + 1) * sizeof(EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL*));
+        pEvents = malloc((NoHandles + 1) * sizeof(EFI_EVENT));
+        if (NULL == ppIF || NULL == pEvents)
+            break;
+
+        if (EFI_SUCCESS != pBS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &TimerEvent))
+        {
+            TimerEvent = NULL;
+            break;
+        }
+        ppIF[nEvents] = NULL;
+        pEvents[nEvents++] = TimerEvent;
+
+        for (n = 0; n < NoHandles; n++)
+            if (EFI_SUCCESS == pBS->HandleProtocol(pHandles[n], &gEfiSimpleTextInputExProtocolGuid, (void**)&ppIF[nEvents]))
+                pEvents[nEvents] = ppIF[nEvents]->WaitForKeyEx,
+                nEvents++;
+
+        if (0 == DelayMs)
+        {
+            for (Index = 1; Index < nEvents && 0 == fKey; Index++)
+                if (EFI_SUCCESS == pBS->CheckEvent(pEvents[Index]))
+                    memset(pKeyData, 0, sizeof(EFI_KEY_DATA)),
+                    fKey = (EFI_SUCCESS == ppIF[Index]->ReadKeyStrokeEx(ppIF[Index], pKeyData));
+            break;
+        }
+
+        Period = 0;
+
+        while (0 == fKey && Elapsed < DelayMs)
+        {
+            if (0 == Period)
+            {
+                Period = DelayMs - Elapsed < BOOT_COUNTDOWN_DOT_MS ? DelayMs - Elapsed : BOOT_COUNTDOWN_DOT_MS;
+                pBS->SetTimer(TimerEvent, TimerRelative, (UINT64)Period * 10000);    // 100ns units
+            }
+
+            if (EFI_SUCCESS != pBS->WaitForEvent(nEvents, pEvents, &Index))
+                break;
+
+            if (0 == Index)
+            {
+                if (BOOT_COUNTDOWN_DOT_MS == Period)
+                    printf(".");
+                Elapsed += Period;
+                Period = 0;
+                continue;
+            }
+
+            memset(pKeyData, 0, sizeof(EFI_KEY_DATA));
+            fKey = (EFI_SUCCESS == ppIF[Index]->ReadKeyStrokeEx(ppIF[Index], pKeyData));
+        }
+
+    } while (0);
+
+    if (NULL != TimerEvent)
+        pBS->SetTimer(TimerEvent, TimerCancel, 0),
+        pBS->CloseEvent(TimerEvent);
+    if (NULL != pHandles)
+        pBS->FreePool(pHandles);
+    free(pEvents);
+    free(ppIF);
+
+    return fKey;
+}
+
 int main(int argc, char** argv)
 {
     int i = 0;
@@ -3661,15 +6398,16 @@ int main(int argc, char** argv)
     EFI_SYSTEM_TABLE* SystemTable = (void*)argv[-1];
     static EFI_GUID guidSTOP = EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL_GUID;
     static EFI_GUID guidSTIP = EFI_SIMPLE_TEXT_INPUT_PROTOCOL_GUID;
-    static EFI_GUID guidSTIPEx = EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL_GUID;
     static EFI_GUID guidGOP = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
     EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL* pSTOP;
     EFI_SIMPLE_TEXT_INPUT_PROTOCOL* pSTIP;
     //EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL* pSTIPEx;
-    EFI_GRAPHICS_OUTPUT_PROTOCOL* pGOP;
-    size_t NumSTIPEx,n,row = 0,col = 0;
+    EFI_GRAPHICS_OUTPUT_PROTOCOL* pGOP = NULL;
+    size_t NumSTIPEx,row = 0,col = 0;
     EFI_HANDLE* pphndSTIPEx = NULL;
 
+    BOOT_PHASE_MARK(BootPhaseEntry);
+
     gImageHandle = (void*)argv[-2];
     gSystemTable = (void*)argv[-1];
 
@@ -3681,102 +6419,41 @@ int main(int argc, char** argv)
     //
     // read \EFI\BOOT\BOOTX64.INI
     //
-    if (1) do
-    {
-        EFI_FILE_PROTOCOL* pEFI_FILE_PROTOCOL, * pROOT;
-        static EFI_GUID guidEFI_SIMPLE_FILE_SYSTEM_PROTOCOL = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-        EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
-        EFI_LOADED_IMAGE_PROTOCOL* pLoadedImageProtocol;
-        Status = SystemTable->BootServices->HandleProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid, &pLoadedImageProtocol);
-        char *pBuf = realloc(NULL, 1), *pStr;
-        
-        pBuf[0] = '\0';
-
-        Status = SystemTable->BootServices->HandleProtocol(
-            pLoadedImageProtocol->DeviceHandle, 
-            &guidEFI_SIMPLE_FILE_SYSTEM_PROTOCOL, 
-            &pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL
-        );
-        Status = pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL->OpenVolume(pEFI_SIMPLE_FILE_SYSTEM_PROTOCOL, &pROOT);
-
-        Status = pROOT->Open(pROOT, &pEFI_FILE_PROTOCOL, L"\\EFI\\BOOT\\BOOTX64.INI", EFI_FILE_MODE_READ, 0);
-        
-        if (EFI_SUCCESS != Status)
-            break;
-        
-        i = 0;
-        do {
-            char c;
-            n = 1;
-            Status = pEFI_FILE_PROTOCOL->Read(pEFI_FILE_PROTOCOL, &n, &c);
-            if (1 == n)
-            {
-                pBuf = realloc(pBuf, i + 1);
-                pBuf[i] = c;
-                i++;
-            }
-        } while (1 == n);
-        pBuf = realloc(pBuf, i + 3);
-        pBuf[i + 0] = '\0';
-        pBuf[i + 1] = '\0';
-        pBuf[i + 2] = '\0';
+    BootIniLoad(ImageHandle, SystemTable, &mBootIni);
 
-        if ((unsigned char)0xFF == pBuf[0] && (unsigned char)0xFE == pBuf[1])
-            wcstombs(pBuf, (wchar_t*) & pBuf[2], i / 2);
+    //
+    // PLUGIN table, only the index of \EFI\BOOT\PLUGINS.PAK if the PLUGINs are packaged
+    //
+    PluginInit(ImageHandle, SystemTable);
 
-        pStr = strtok(pBuf, "\n");
-        while (pStr != NULL)
-        {
-            int tok;
-            char* pComment;
-            char buf0[32];
-            char buf1[32];
-            char buf2[32];
-            char buf3[32];
-
-            // remove  comment lead by '#'
-            pComment = strchr(pStr, '#');
-            
-            if (NULL != pComment)
-                while (*pComment != '\0')
-                    *pComment++ = '\x20';
+    if (0 != mBootIni.TextColumns)
+        col = mBootIni.TextColumns,
+        row = mBootIni.TextRows,
+        swprintf(wcsSetScreenResolutionByMode, 20, L"MODE %zd %zd", col /*= 100 */, row /*= 31*/);
 
-            tok = sscanf(pStr, "%s %s %s %s", &buf0, &buf1, &buf2, &buf3);
-            //
-            // textresolution
-            //
-            if (0 == _stricmp(buf0, "TEXTRESOLUTION"))
-                sscanf(buf1, "%lld", &col),
-                sscanf(buf2, "%lld", &row),
-                swprintf(wcsSetScreenResolutionByMode, 20, L"MODE %zd %zd", col /*= 100 */, row /*= 31*/);
-            //printf("--> textres %lld %lld\n", col, row);
-            
-            //
-            // drive naming A:, B:, C: or DEFAULT_UEFI_DRIVE_NAMING FS0:, FS1 ...
-            //
-            if (0 == _stricmp(buf0, "DEFAULT_UEFI_DRIVE_NAMING"))
-                _gfDEFAULT_UEFI_DRIVE_NAMING = 1;
-                
-            pStr = strtok(NULL, "\n");
-        }
-    
-    } while (0);
+    _gfDEFAULT_UEFI_DRIVE_NAMING = mBootIni.fDefaultUefiDriveNaming;
+    BOOT_PHASE_MARK(BootPhaseIni);
     
     if (1)
     {
-        char countdown = 4;
-        clock_t clk = (4 * CLOCKS_PER_SEC / 3) + clock();
-        clock_t clkstart = clock();
-        clock_t clkdot = clkstart + (1 * CLOCKS_PER_SEC / 3);
-        int fNOT_F5Key = 1, fNOT_F8Key = 1, fNOT_ANYKey = 1;
-        //UINTN Index;
         EFI_KEY_DATA KeyData = { 0 };
-        EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL* pIF;
-        size_t NoHandles;
+        UINTN Mode;
+        UINT64 ModeFingerprint;
 
-        Status = SystemTable->BootServices->LocateHandleBuffer(ByProtocol, &guidSTIPEx, NULL, &NoHandles, &pphndSTIPEx);
+        ModeFingerprint = ConsoleModeFingerprint(SystemTable, pSTOP, pGOP, col, row);
 
-        if (0 == col) 
+        if (ConsoleModeLookup(SystemTable, ModeFingerprint, &Mode)
+            && ((UINTN)pSTOP->Mode->Mode == Mode || EFI_SUCCESS == pSTOP->SetMode(pSTOP, Mode)))
+        {
+            //
+            // same mode tables and TEXTRESOLUTION as on an earlier boot, no probing
+            // and no SetMode() either if the firmware already left the console in that mode
+            //
+            if (0 == col)
+                pSTOP->QueryMode(pSTOP, Mode, &col, &row),
+                swprintf(wcsSetScreenResolutionByMode, 20, L"MODE %zd %zd", col /*= 100 */, row /*= 31*/);
+        }
+        else if (0 == col) 
         {
             i = 0;
             do
@@ -3785,13 +6462,17 @@ int main(int argc, char** argv)
 
             } while (EFI_SUCCESS != Status && -1 < (pSTOP->Mode->MaxMode - ++i));
 
-            pSTOP->QueryMode(pSTOP, pSTOP->Mode->MaxMode - i, &col, &row);
+            Mode = pSTOP->Mode->MaxMode - i;
+            if (EFI_SUCCESS == Status)
+                ConsoleModeRemember(SystemTable, ModeFingerprint, Mode);
+
+            pSTOP->QueryMode(pSTOP, Mode, &col, &row);
             swprintf(wcsSetScreenResolutionByMode, 20, L"MODE %zd %zd", col /*= 100 */, row /*= 31*/);
         }
         else {
             unsigned u, count;
             size_t Columns, Rows;
-            for (u = 0, count = 0; u < pGOP->Mode->MaxMode; u++) {
+            for (u = 0, count = 0; u < (unsigned)pSTOP->Mode->MaxMode; u++) {
 
                 Status = pSTOP->SetMode(pSTOP, u);
 
@@ -3805,7 +6486,10 @@ int main(int argc, char** argv)
                     break;
             }
 
+            if (u < (unsigned)pSTOP->Mode->MaxMode)
+                ConsoleModeRemember(SystemTable, ModeFingerprint, u);
         }
+        BOOT_PHASE_MARK(BootPhaseConsoleMode);
     
         pSTOP->SetAttribute(pSTOP, EFI_BACKGROUND_BLACK + EFI_WHITE);
         pSTOP->ClearScreen(pSTOP);
@@ -3816,74 +6500,15 @@ int main(int argc, char** argv)
     // https://github.com/KilianKegel/toro-C-Library#implementation-status
     //
 
-        while (fNOT_F5Key && fNOT_F8Key && fNOT_ANYKey && clk > clock())
+        if (BootCountdown(SystemTable, mBootIni.BootDelay, &KeyData))
         {
-            if (clkdot < clock())
-                printf("."),
-                countdown--,
-                clkdot += (1 * CLOCKS_PER_SEC / 3);
-
-            for (n = 0; n < NoHandles; n++)
-            {
-
-                //printf("--> KeyData.Key.ScanCode %X\n", KeyData.Key.ScanCode);
-
-                if (0x0F == KeyData.Key.ScanCode)   // F5
-                {
-                    fNOT_F5Key = 0;
-                    break;
-                }
-
-                if (0x12 == KeyData.Key.ScanCode)
-                {
-                    fNOT_F8Key = 0;
-                    break;
-                }
-
-                if (0 != KeyData.Key.ScanCode || 0 != KeyData.Key.UnicodeChar || 0 != KeyData.KeyState.KeyShiftState || 0 != KeyData.KeyState.KeyToggleState)
-                {
-                    fNOT_ANYKey = 0;
-                    break;
-                }
-
-
-                memset(&KeyData, 0, sizeof(KeyData));
-
-                Status = SystemTable->BootServices->HandleProtocol(pphndSTIPEx[n], &guidSTIPEx, &pIF);
+            if (0x0F == KeyData.Key.ScanCode)   // F5
+                _mymenuF5Key();
 
-                memset(&KeyData, 0, sizeof(KeyData));
-
-                Status = SystemTable->BootServices->CheckEvent(pIF->WaitForKeyEx);
-
-                if (EFI_SUCCESS == Status)
-                {
-                    Status = pIF->ReadKeyStrokeEx(pIF, &KeyData);
-
-                    if (EFI_SUCCESS != Status)
-                        memset(&KeyData, 0xFF, sizeof(KeyData));
-                    else {
-                        KeyData.Key.ScanCode;
-                        KeyData.Key.UnicodeChar;
-                        KeyData.KeyState.KeyShiftState;
-                        KeyData.KeyState.KeyToggleState;
-
-                        //printf("%zd: ScanCode %04X , UnicodeChar %04X, KeyShiftState %08X, KeyToggleState %02X\n",
-                        //    n,
-                        //    KeyData.Key.ScanCode,
-                        //    KeyData.Key.UnicodeChar,
-                        //    KeyData.KeyState.KeyShiftState,
-                        //    KeyData.KeyState.KeyToggleState
-                        //);
-                    }
-                }
-            }
+            if (0x12 == KeyData.Key.ScanCode)   // F8
+                _mymenuF8Key();
         }
-
-        if (0 == fNOT_F5Key)
-            _mymenuF5Key();
-
-        if (0 == fNOT_F8Key)
-            _mymenuF8Key();
+        BOOT_PHASE_MARK(BootPhaseCountdown);
     }
 
     Status = UefiMainCDEHOOKED(ImageHandle, SystemTable);
@@ -0,0 +1,891 @@
+/** @file
+  function declarations for shell environment functions.
+
+  The in memory copy of the environment (gShellEnvVarList) is kept in
+  insertion order for listing and is additionally indexed by a hash table
+  over the variable names, so that lookup, update and removal of a single
+  variable do not have to walk the whole list.
+
+  Values are never changed in place.  ShellGetEnvVarFromList() returns the
+  stored value itself; once a value was returned that way, replacing or
+  removing it hands it to the free list of the outermost command level it
+  was returned at, so the pointer stays valid until the command that got it
+  returns, even if a command it runs changes the variable.
+
+  Copyright (c) 2009 - 2019, Intel Corporation. All rights reserved.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "Shell.h"
+
+#define INIT_NAME_BUFFER_SIZE  128
+#define INIT_DATA_BUFFER_SIZE  1024
+
+BOOLEAN
+ShellEnvMirrorPending (
+  IN CONST CHAR16  *Name
+  );
+
+UINTN
+GetBufferListLevel (
+  VOID
+  );
+
+VOID
+AddBufferToLevelFreeList (
+  IN VOID   *Buffer,
+  IN UINTN  Level
+  );
+
+//
+// The list is used to cache the environment variables.
+//
+ENV_VAR_LIST  gShellEnvVarList;
+
+//
+// Number of hash buckets for the name index.  Must be a power of two.
+//
+#define ENV_VAR_HASH_BUCKETS  128
+
+///
+/// Node of gShellEnvVarList.  Node must stay the first member so that an
+/// ENV_VAR_LIST pointer into gShellEnvVarList can be freed with FreePool
+/// like any other ENV_VAR_LIST.
+///
+typedef struct {
+  ENV_VAR_LIST    Node;       ///< Linked into gShellEnvVarList, insertion order.
+  LIST_ENTRY      HashLink;   ///< Linked into mEnvVarHash[Hash].
+  UINT32          Hash;       ///< Full hash of Node.Key.
+  BOOLEAN         Lent;       ///< Node.Val was returned by ShellGetEnvVarFromList().
+  UINTN           LentLevel;  ///< Outermost buffer list level Node.Val was returned at.
+} ENV_VAR_ENTRY;
+
+STATIC LIST_ENTRY  mEnvVarHash[ENV_VAR_HASH_BUCKETS];
+STATIC BOOLEAN     mEnvVarHashReady = FALSE;
+
+/**
+  Compute the FNV-1a hash of an environment variable name.
+
+  The name compare used by the shell is case sensitive, so the hash is too.
+
+  @param[in] Key    The variable name.
+
+  @return           The hash value.
+**/
+STATIC
+UINT32
+EnvVarHash (
+  IN CONST CHAR16  *Key
+  )
+{
+  UINT32  Hash;
+
+  Hash = 2166136261u;
+  for ( ; *Key != CHAR_NULL; Key++) {
+    Hash ^= (UINT32)*Key;
+    Hash *= 16777619u;
+  }
+
+  return Hash;
+}
+
+/**
+  Reset the name index to empty.  Does not touch gShellEnvVarList.
+**/
+STATIC
+VOID
+EnvVarHashReset (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < ENV_VAR_HASH_BUCKETS; Index++) {
+    InitializeListHead (&mEnvVarHash[Index]);
+  }
+
+  mEnvVarHashReady = TRUE;
+}
+
+/**
+  Find the node for Key in gShellEnvVarList via the name index.
+
+  @param[in] Key    The variable name.
+  @param[in] Hash   EnvVarHash (Key).
+
+  @return           The node, or NULL if Key is not in the list.
+**/
+STATIC
+ENV_VAR_ENTRY *
+EnvVarHashFind (
+  IN CONST CHAR16  *Key,
+  IN UINT32        Hash
+  )
+{
+  LIST_ENTRY     *Bucket;
+  LIST_ENTRY     *Link;
+  ENV_VAR_ENTRY  *Entry;
+
+  if (!mEnvVarHashReady) {
+    return NULL;
+  }
+
+  Bucket = &mEnvVarHash[Hash & (ENV_VAR_HASH_BUCKETS - 1)];
+  for (Link = GetFirstNode (Bucket); !IsNull (Bucket, Link); Link = GetNextNode (Bucket, Link)) {
+    Entry = BASE_CR (Link, ENV_VAR_ENTRY, HashLink);
+    if ((Entry->Hash == Hash) && (Entry->Node.Key != NULL) && (StrCmp (Key, Entry->Node.Key) == 0)) {
+      return Entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Release the value of a node of gShellEnvVarList.  A value that was handed
+  out by ShellGetEnvVarFromList() goes to the free list of the level it was
+  handed out at.
+
+  @param[in] Entry    The node.
+**/
+STATIC
+VOID
+EnvVarReleaseValue (
+  IN ENV_VAR_ENTRY  *Entry
+  )
+{
+  if (Entry->Node.Val != NULL) {
+    if (Entry->Lent) {
+      AddBufferToLevelFreeList (Entry->Node.Val, Entry->LentLevel);
+    } else {
+      FreePool (Entry->Node.Val);
+    }
+  }
+
+  Entry->Node.Val = NULL;
+  Entry->Lent     = FALSE;
+}
+
+/**
+  Link a new node at the end of gShellEnvVarList and into the name index.
+  Ownership of Key and Value passes to the list.
+
+  @param[in] Key      Allocated variable name.
+  @param[in] Value    Allocated variable value.
+  @param[in] Atts     Variable attributes.
+
+  @retval EFI_SUCCESS           The node was added.
+  @retval EFI_OUT_OF_RESOURCES  Out of memory; Key and Value are untouched.
+**/
+STATIC
+EFI_STATUS
+EnvVarListInsert (
+  IN CHAR16  *Key,
+  IN CHAR16  *Value,
+  IN UINT32  Atts
+  )
+{
+  ENV_VAR_ENTRY  *Entry;
+
+  Entry = AllocateZeroPool (sizeof (ENV_VAR_ENTRY));
+  if (Entry == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (!mEnvVarHashReady) {
+    EnvVarHashReset ();
+  }
+
+  Entry->Node.Key  = Key;
+  Entry->Node.Val  = Value;
+  Entry->Node.Atts = Atts;
+  Entry->Hash      = EnvVarHash (Key);
+  InsertTailList (&gShellEnvVarList.Link, &Entry->Node.Link);
+  InsertTailList (&mEnvVarHash[Entry->Hash & (ENV_VAR_HASH_BUCKETS - 1)], &Entry->HashLink);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Reports whether an environment variable is Volatile or Non-Volatile.
+
+  The in memory list is consulted first, so that variables whose write to
+  the variable store is still deferred report their current attributes.  A
+  variable whose delete is still deferred does not exist, so it is volatile.
+
+  @param EnvVarName             The name of the environment variable in question
+  @param Volatile               Return TRUE if the environment variable is volatile
+
+  @retval EFI_SUCCESS           The volatile attribute is returned successfully
+  @retval others                Some errors happened.
+
+**/
+EFI_STATUS
+IsVolatileEnv (
+  IN CONST CHAR16  *EnvVarName,
+  OUT BOOLEAN      *Volatile
+  )
+{
+  EFI_STATUS     Status;
+  UINTN          Size;
+  VOID           *Buffer;
+  UINT32         Attribs;
+  ENV_VAR_ENTRY  *Entry;
+
+  ASSERT (Volatile != NULL);
+
+  Entry = EnvVarHashFind (EnvVarName, EnvVarHash (EnvVarName));
+  if (Entry != NULL) {
+    *Volatile = !(BOOLEAN)((Entry->Node.Atts & EFI_VARIABLE_NON_VOLATILE) == EFI_VARIABLE_NON_VOLATILE);
+    return EFI_SUCCESS;
+  }
+
+  if (ShellEnvMirrorPending (EnvVarName)) {
+    *Volatile = TRUE;
+    return EFI_SUCCESS;
+  }
+
+  Size   = 0;
+  Buffer = NULL;
+
+  //
+  // get the variable
+  //
+  Status = gRT->GetVariable (
+                  (CHAR16 *)EnvVarName,
+                  &gShellVariableGuid,
+                  &Attribs,
+                  &Size,
+                  Buffer
+                  );
+  if (Status == EFI_BUFFER_TOO_SMALL) {
+    Buffer = AllocateZeroPool (Size);
+    if (Buffer == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = gRT->GetVariable (
+                    (CHAR16 *)EnvVarName,
+                    &gShellVariableGuid,
+                    &Attribs,
+                    &Size,
+                    Buffer
+                    );
+    FreePool (Buffer);
+  }
+
+  //
+  // not found means volatile
+  //
+  if (Status == EFI_NOT_FOUND) {
+    *Volatile = TRUE;
+    return EFI_SUCCESS;
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // check for the Non Volatile bit
+  //
+  *Volatile = !(BOOLEAN)((Attribs & EFI_VARIABLE_NON_VOLATILE) == EFI_VARIABLE_NON_VOLATILE);
+  return EFI_SUCCESS;
+}
+
+/**
+  free function for ENV_VAR_LIST objects.
+
+  @param[in] List               The pointer to pointer to list.
+**/
+VOID
+FreeEnvironmentVariableList (
+  IN LIST_ENTRY  *List
+  )
+{
+  ENV_VAR_LIST  *Node;
+
+  ASSERT (List != NULL);
+  if (List == NULL) {
+    return;
+  }
+
+  for ( Node = (ENV_VAR_LIST *)GetFirstNode (List)
+        ; !IsListEmpty (List)
+        ; Node = (ENV_VAR_LIST *)GetFirstNode (List)
+        )
+  {
+    ASSERT (Node != NULL);
+    RemoveEntryList (&Node->Link);
+    if (Node->Key != NULL) {
+      FreePool (Node->Key);
+    }
+
+    if (Node->Val != NULL) {
+      FreePool (Node->Val);
+    }
+
+    FreePool (Node);
+  }
+}
+
+/**
+  Creates a list of all Shell-Guid-based environment variables.
+
+  @param[in, out] ListHead       The pointer to pointer to LIST ENTRY object for
+                                 storing this list.
+
+  @retval EFI_SUCCESS           the list was created successfully.
+**/
+EFI_STATUS
+GetEnvironmentVariableList (
+  IN OUT LIST_ENTRY  *ListHead
+  )
+{
+  CHAR16        *VariableName;
+  UINTN         NameSize;
+  UINTN         NameBufferSize;
+  EFI_STATUS    Status;
+  EFI_GUID      Guid;
+  UINTN         ValSize;
+  UINTN         ValBufferSize;
+  ENV_VAR_LIST  *VarList;
+
+  if (ListHead == NULL) {
+    return (EFI_INVALID_PARAMETER);
+  }
+
+  Status = EFI_SUCCESS;
+
+  ValBufferSize  = INIT_DATA_BUFFER_SIZE;
+  NameBufferSize = INIT_NAME_BUFFER_SIZE;
+  VariableName   = AllocateZeroPool (NameBufferSize);
+  if (VariableName == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  *VariableName = CHAR_NULL;
+
+  while (!EFI_ERROR (Status)) {
+    NameSize = NameBufferSize;
+    Status   = gRT->GetNextVariableName (&NameSize, VariableName, &Guid);
+    if (Status == EFI_NOT_FOUND) {
+      Status = EFI_SUCCESS;
+      break;
+    } else if (Status == EFI_BUFFER_TOO_SMALL) {
+      NameBufferSize = NameSize > NameBufferSize * 2 ? NameSize : NameBufferSize * 2;
+      SHELL_FREE_NON_NULL (VariableName);
+      VariableName = AllocateZeroPool (NameBufferSize);
+      if (VariableName == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        break;
+      }
+
+      NameSize = NameBufferSize;
+      Status   = gRT->GetNextVariableName (&NameSize, VariableName, &Guid);
+    }
+
+    if (!EFI_ERROR (Status) && CompareGuid (&Guid, &gShellVariableGuid)) {
+      VarList = AllocateZeroPool (sizeof (ENV_VAR_LIST));
+      if (VarList == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+      } else {
+        ValSize = ValBufferSize;
+        //
+        // We need another CHAR16 to save '\0' in VarList->Val.
+        //
+        VarList->Val = AllocateZeroPool (ValSize + sizeof (CHAR16));
+        if (VarList->Val == NULL) {
+          SHELL_FREE_NON_NULL (VarList);
+          Status = EFI_OUT_OF_RESOURCES;
+          break;
+        }
+
+        Status = SHELL_GET_ENVIRONMENT_VARIABLE_AND_ATTRIBUTES (VariableName, &VarList->Atts, &ValSize, VarList->Val);
+        if (Status == EFI_BUFFER_TOO_SMALL) {
+          ValBufferSize = ValSize > ValBufferSize * 2 ? ValSize : ValBufferSize * 2;
+          SHELL_FREE_NON_NULL (VarList->Val);
+          //
+          // We need another CHAR16 to save '\0' in VarList->Val.
+          //
+          VarList->Val = AllocateZeroPool (ValBufferSize + sizeof (CHAR16));
+          if (VarList->Val == NULL) {
+            SHELL_FREE_NON_NULL (VarList);
+            Status = EFI_OUT_OF_RESOURCES;
+            break;
+          }
+
+          ValSize = ValBufferSize;
+          Status  = SHELL_GET_ENVIRONMENT_VARIABLE_AND_ATTRIBUTES (VariableName, &VarList->Atts, &ValSize, VarList->Val);
+        }
+
+        if (!EFI_ERROR (Status)) {
+          VarList->Key = AllocateCopyPool (StrSize (VariableName), VariableName);
+          if (VarList->Key == NULL) {
+            SHELL_FREE_NON_NULL (VarList->Val);
+            SHELL_FREE_NON_NULL (VarList);
+            Status = EFI_OUT_OF_RESOURCES;
+          } else {
+            InsertTailList (ListHead, &VarList->Link);
+          }
+        } else {
+          SHELL_FREE_NON_NULL (VarList->Val);
+          SHELL_FREE_NON_NULL (VarList);
+        }
+      } // if (VarList == NULL) ... else ...
+    } // compare guid
+  } // while
+
+  SHELL_FREE_NON_NULL (VariableName);
+
+  if (EFI_ERROR (Status)) {
+    FreeEnvironmentVariableList (ListHead);
+  }
+
+  return (Status);
+}
+
+/**
+  Sets a list of all Shell-Guid-based environment variables.  this will
+  also eliminate all existing shell environment variables (even if they
+  are not on the list).
+
+  This function will also deallocate the memory from List.
+
+  The in memory copy in gShellEnvVarList is rebuilt from the result, so
+  that the shell sees the same environment as the variable store.
+
+  @param[in] ListHead           The pointer to LIST_ENTRY from
+                                GetShellEnvVarList().
+
+  @retval EFI_SUCCESS           the list was Set successfully.
+**/
+EFI_STATUS
+SetEnvironmentVariableList (
+  IN LIST_ENTRY  *ListHead
+  )
+{
+  ENV_VAR_LIST  VarList;
+  ENV_VAR_LIST  *Node;
+  EFI_STATUS    Status;
+  UINTN         Size;
+
+  InitializeListHead (&VarList.Link);
+
+  //
+  // Delete all the current environment variables
+  //
+  Status = GetEnvironmentVariableList (&VarList.Link);
+  ASSERT_EFI_ERROR (Status);
+
+  for ( Node = (ENV_VAR_LIST *)GetFirstNode (&VarList.Link)
+        ; !IsNull (&VarList.Link, &Node->Link)
+        ; Node = (ENV_VAR_LIST *)GetNextNode (&VarList.Link, &Node->Link)
+        )
+  {
+    if (Node->Key != NULL) {
+      Status = SHELL_DELETE_ENVIRONMENT_VARIABLE (Node->Key);
+    }
+
+    ASSERT_EFI_ERROR (Status);
+  }
+
+  FreeEnvironmentVariableList (&VarList.Link);
+
+  //
+  // set all the variables from the list
+  //
+  for ( Node = (ENV_VAR_LIST *)GetFirstNode (ListHead)
+        ; !IsNull (ListHead, &Node->Link)
+        ; Node = (ENV_VAR_LIST *)GetNextNode (ListHead, &Node->Link)
+        )
+  {
+    Size = StrSize (Node->Val) - sizeof (CHAR16);
+    if (Node->Atts & EFI_VARIABLE_NON_VOLATILE) {
+      Status = SHELL_SET_ENVIRONMENT_VARIABLE_NV (Node->Key, Size, Node->Val);
+    } else {
+      Status = SHELL_SET_ENVIRONMENT_VARIABLE_V (Node->Key, Size, Node->Val);
+    }
+
+    ASSERT_EFI_ERROR (Status);
+  }
+
+  FreeEnvironmentVariableList (ListHead);
+
+  ShellFreeEnvVarList ();
+  ShellInitEnvVarList ();
+
+  return (Status);
+}
+
+/**
+  sets a list of all Shell-Guid-based environment variables.
+
+  @param Environment        Points to a NULL-terminated array of environment
+                            variables with the format 'x=y', where x is the
+                            environment variable name and y is the value.
+
+  @retval EFI_SUCCESS       The command executed successfully.
+  @retval EFI_INVALID_PARAMETER The parameter is invalid.
+  @retval EFI_OUT_OF_RESOURCES Out of resources.
+
+  @sa SetEnvironmentVariableList
+**/
+EFI_STATUS
+SetEnvironmentVariables (
+  IN CONST CHAR16  **Environment
+  )
+{
+  CONST CHAR16  *CurrentString;
+  UINTN         CurrentCount;
+  ENV_VAR_LIST  *VarList;
+  ENV_VAR_LIST  *Node;
+
+  VarList = NULL;
+
+  if (Environment == NULL) {
+    return (EFI_INVALID_PARAMETER);
+  }
+
+  //
+  // Build a list identical to the ones used for get/set list functions above
+  //
+  for ( CurrentCount = 0
+        ;
+        ; CurrentCount++
+        )
+  {
+    CurrentString = Environment[CurrentCount];
+    if (CurrentString == NULL) {
+      break;
+    }
+
+    ASSERT (StrStr (CurrentString, L"=") != NULL);
+    Node = AllocateZeroPool (sizeof (ENV_VAR_LIST));
+    if (Node == NULL) {
+      SetEnvironmentVariableList (&VarList->Link);
+      return (EFI_OUT_OF_RESOURCES);
+    }
+
+    Node->Key = AllocateZeroPool ((StrStr (CurrentString, L"=") - CurrentString + 1) * sizeof (CHAR16));
+    if (Node->Key == NULL) {
+      SHELL_FREE_NON_NULL (Node);
+      SetEnvironmentVariableList (&VarList->Link);
+      return (EFI_OUT_OF_RESOURCES);
+    }
+
+    //
+    // Copy the string into the Key, leaving the last character allocated as NULL to terminate
+    //
+    StrnCpyS (
+      Node->Key,
+      StrStr (CurrentString, L"=") - CurrentString + 1,
+      CurrentString,
+      StrStr (CurrentString, L"=") - CurrentString
+      );
+
+    //
+    // ValueSize = TotalSize - already removed size - size for '=' + size for terminator (the last 2 items cancel each other)
+    //
+    Node->Val = AllocateCopyPool (StrSize (CurrentString) - StrSize (Node->Key), CurrentString + StrLen (Node->Key) + 1);
+    if (Node->Val == NULL) {
+      SHELL_FREE_NON_NULL (Node->Key);
+      SHELL_FREE_NON_NULL (Node);
+      SetEnvironmentVariableList (&VarList->Link);
+      return (EFI_OUT_OF_RESOURCES);
+    }
+
+    Node->Atts = EFI_VARIABLE_BOOTSERVICE_ACCESS;
+
+    if (VarList == NULL) {
+      VarList = AllocateZeroPool (sizeof (ENV_VAR_LIST));
+      if (VarList == NULL) {
+        SHELL_FREE_NON_NULL (Node->Key);
+        SHELL_FREE_NON_NULL (Node->Val);
+        SHELL_FREE_NON_NULL (Node);
+        return (EFI_OUT_OF_RESOURCES);
+      }
+
+      InitializeListHead (&VarList->Link);
+    }
+
+    InsertTailList (&VarList->Link, &Node->Link);
+  } // for loop
+
+  //
+  // If we didn't have any valid strings, we are done.
+  //
+  if (VarList == NULL) {
+    return (EFI_SUCCESS);
+  }
+
+  //
+  // set this new list as the set of all environment variables.
+  // this function also frees the memory and deletes all pre-existing
+  // shell-guid based environment variables.
+  //
+  return (SetEnvironmentVariableList (&VarList->Link));
+}
+
+/**
+  Find an environment variable in the gShellEnvVarList.
+
+  @param Key        The name of the environment variable.
+  @param Value      The value of the environment variable, the buffer
+                    shoule be freed by the caller.
+  @param ValueSize  The size in bytes of the environment variable
+                    including the tailing CHAR_NELL.
+  @param Atts       The attributes of the variable.
+
+  @retval EFI_SUCCESS       The command executed successfully.
+  @retval EFI_NOT_FOUND     The environment variable is not found in
+                            gShellEnvVarList.
+
+**/
+EFI_STATUS
+ShellFindEnvVarInList (
+  IN  CONST CHAR16  *Key,
+  OUT CHAR16        **Value,
+  OUT UINTN         *ValueSize,
+  OUT UINT32        *Atts OPTIONAL
+  )
+{
+  ENV_VAR_ENTRY  *Entry;
+
+  if ((Key == NULL) || (Value == NULL) || (ValueSize == NULL)) {
+    return SHELL_INVALID_PARAMETER;
+  }
+
+  Entry = EnvVarHashFind (Key, EnvVarHash (Key));
+  if (Entry == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  *ValueSize = StrSize (Entry->Node.Val);
+  *Value     = AllocateCopyPool (*ValueSize, Entry->Node.Val);
+  if (Atts != NULL) {
+    *Atts = Entry->Node.Atts;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Find an environment variable in the gShellEnvVarList without copying it.
+
+  The returned value must not be modified or freed.  It remains valid at
+  least until the command that is running returns, even if the variable is
+  changed or removed in the meantime.
+
+  @param Key        The name of the environment variable.
+  @param Atts       The attributes of the variable.
+
+  @return           The value, or NULL if Key is not in gShellEnvVarList.
+**/
+CONST CHAR16 *
+ShellGetEnvVarFromList (
+  IN  CONST CHAR16  *Key,
+  OUT UINT32        *Atts OPTIONAL
+  )
+{
+  ENV_VAR_ENTRY  *Entry;
+
+  if (Key == NULL) {
+    return NULL;
+  }
+
+  Entry = EnvVarHashFind (Key, EnvVarHash (Key));
+  if (Entry == NULL) {
+    return NULL;
+  }
+
+  if (Atts != NULL) {
+    *Atts = Entry->Node.Atts;
+  }
+
+  if (!Entry->Lent || (GetBufferListLevel () < Entry->LentLevel)) {
+    Entry->LentLevel = GetBufferListLevel ();
+  }
+
+  Entry->Lent = TRUE;
+  return Entry->Node.Val;
+}
+
+/**
+  Add an environment variable into gShellEnvVarList.
+
+  @param Key        The name of the environment variable.
+  @param Value      The value of environment variable.
+  @param ValueSize  The size in bytes of the environment variable
+                    including the tailing CHAR_NULL
+  @param Atts       The attributes of the variable.
+
+  @retval EFI_SUCCESS  The environment variable was added to list successfully.
+  @retval others       Some errors happened.
+
+**/
+EFI_STATUS
+ShellAddEnvVarToList (
+  IN CONST CHAR16  *Key,
+  IN CONST CHAR16  *Value,
+  IN UINTN         ValueSize,
+  IN UINT32        Atts
+  )
+{
+  ENV_VAR_ENTRY  *Entry;
+  CHAR16         *LocalKey;
+  CHAR16         *LocalValue;
+  EFI_STATUS     Status;
+
+  if ((Key == NULL) || (Value == NULL) || (ValueSize == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  LocalValue = AllocateCopyPool (ValueSize, Value);
+  if (LocalValue == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // Update the variable value if it exists in gShellEnvVarList; it keeps
+  // its position in the list.
+  //
+  Entry = EnvVarHashFind (Key, EnvVarHash (Key));
+  if (Entry != NULL) {
+    Entry->Node.Atts = Atts;
+    EnvVarReleaseValue (Entry);
+    Entry->Node.Val = LocalValue;
+    return EFI_SUCCESS;
+  }
+
+  //
+  // If the environment variable key doesn't exist in list just insert
+  // a new node.
+  //
+  LocalKey = AllocateCopyPool (StrSize (Key), Key);
+  if (LocalKey == NULL) {
+    FreePool (LocalValue);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = EnvVarListInsert (LocalKey, LocalValue, Atts);
+  if (EFI_ERROR (Status)) {
+    FreePool (LocalKey);
+    FreePool (LocalValue);
+  }
+
+  return Status;
+}
+
+/**
+  Remove a specified environment variable in gShellEnvVarList.
+
+  @param Key        The name of the environment variable.
+
+  @retval EFI_SUCCESS       The command executed successfully.
+  @retval EFI_NOT_FOUND     The environment variable is not found in
+                            gShellEnvVarList.
+**/
+EFI_STATUS
+ShellRemvoeEnvVarFromList (
+  IN CONST CHAR16  *Key
+  )
+{
+  ENV_VAR_ENTRY  *Entry;
+
+  if (Key == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = EnvVarHashFind (Key, EnvVarHash (Key));
+  if (Entry == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  RemoveEntryList (&Entry->HashLink);
+  RemoveEntryList (&Entry->Node.Link);
+  EnvVarReleaseValue (Entry);
+  SHELL_FREE_NON_NULL (Entry->Node.Key);
+  FreePool (Entry);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Initialize the gShellEnvVarList and cache all Shell-Guid-based environment
+  variables.
+
+  The variables are read into a temporary list and then moved into indexed
+  nodes, keeping the order in which the variable store returned them.
+**/
+EFI_STATUS
+ShellInitEnvVarList (
+  VOID
+  )
+{
+  EFI_STATUS    Status;
+  LIST_ENTRY    VarList;
+  ENV_VAR_LIST  *Node;
+
+  InitializeListHead (&gShellEnvVarList.Link);
+  EnvVarHashReset ();
+
+  InitializeListHead (&VarList);
+  Status = GetEnvironmentVariableList (&VarList);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  while (!IsListEmpty (&VarList)) {
+    Node = (ENV_VAR_LIST *)GetFirstNode (&VarList);
+    RemoveEntryList (&Node->Link);
+    //
+    // A name that is already present cannot come back from the store, but
+    // keep the list unique regardless.
+    //
+    if (EnvVarHashFind (Node->Key, EnvVarHash (Node->Key)) == NULL) {
+      Status = EnvVarListInsert (Node->Key, Node->Val, Node->Atts);
+      if (!EFI_ERROR (Status)) {
+        Node->Key = NULL;
+        Node->Val = NULL;
+      }
+    }
+
+    SHELL_FREE_NON_NULL (Node->Key);
+    SHELL_FREE_NON_NULL (Node->Val);
+    FreePool (Node);
+    if (EFI_ERROR (Status)) {
+      FreeEnvironmentVariableList (&VarList);
+      ShellFreeEnvVarList ();
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Destructs the gShellEnvVarList.
+**/
+VOID
+ShellFreeEnvVarList (
+  VOID
+  )
+{
+  ENV_VAR_LIST  *Node;
+
+  for ( Node = (ENV_VAR_LIST *)GetFirstNode (&gShellEnvVarList.Link)
+        ; !IsNull (&gShellEnvVarList.Link, &Node->Link)
+        ; Node = (ENV_VAR_LIST *)GetNextNode (&gShellEnvVarList.Link, &Node->Link)
+        )
+  {
+    EnvVarReleaseValue (BASE_CR (Node, ENV_VAR_ENTRY, Node));
+  }
+
+  FreeEnvironmentVariableList (&gShellEnvVarList.Link);
+  InitializeListHead (&gShellEnvVarList.Link);
+  EnvVarHashReset ();
+
+  return;
+}
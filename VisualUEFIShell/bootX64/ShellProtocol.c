@@ -10,12 +10,27 @@
 **/
 
 #include "Shell.h"
+#include "../UefiShellCommandLib/ShellStringBuilder.h"
+#include "../UefiShellCommandLib/ShellMapIndex.h"
+#include <Library/OrderedCollectionLib.h>
 #define NCDETRACE/* REMOVE TO ENABLE TRACES */
 #define _CRT_SECURE_NO_WARNINGS
 #define _NO_CRT_STDIO_INLINE
 extern char* _strefierror(EFI_STATUS);
 extern char* _gPLUGINSTART;                           // .COFF plugin address im memory
 extern size_t _gPLUGINSIZE;                            // .COFF plugin size
+extern UINTN EFIAPI ShellCommandGetMapGeneration (VOID);
+VOID FileOpenCacheFlush (IN BOOLEAN KeepRoots);
+VOID ShellEnvMirrorFlush (VOID);
+BOOLEAN ShellEnvMirrorPending (IN CONST CHAR16 *Name);
+EFI_STATUS ShellEnvCommit (VOID);
+EFI_STATUS ShellEnvScopePush (IN CONST CHAR16 **Environment);
+VOID ShellEnvScopePop (VOID);
+BOOLEAN ShellEnvScopeActive (VOID);
+CONST CHAR16 *ShellGetEnvVarFromList (IN CONST CHAR16 *Key, OUT UINT32 *Atts OPTIONAL);
+VOID AliasIndexInvalidate (VOID);
+UINTN GetBufferListLevel (VOID);
+VOID AddBufferToLevelFreeList (IN VOID *Buffer, IN UINTN Level);
 #include <stdio.h>
 #include <cde.h>
 #define INIT_NAME_BUFFER_SIZE  128
@@ -138,6 +153,8 @@ EfiShellSetMap (
     return (EFI_INVALID_PARAMETER);
   }
 
+  FileOpenCacheFlush (FALSE);
+
   //
   // Delete the mapping
   //
@@ -152,6 +169,7 @@ EfiShellSetMap (
           )
     {
       if (StringNoCaseCompare (&MapListNode->MapName, &Mapping) == 0) {
+        ShellCommandMapIndexInvalidate ();
         RemoveEntryList (&MapListNode->Link);
         SHELL_FREE_NON_NULL (MapListNode->DevicePath);
         SHELL_FREE_NON_NULL (MapListNode->MapName);
@@ -213,21 +231,8 @@ EfiShellGetDevicePathFromMap (
   )
 {
   SHELL_MAP_LIST  *MapListItem;
-  CHAR16          *NewName;
-  UINTN           Size;
-
-  NewName = NULL;
-  Size    = 0;
-
-  StrnCatGrow (&NewName, &Size, Mapping, 0);
-  if (Mapping[StrLen (Mapping)-1] != L':') {
-    StrnCatGrow (&NewName, &Size, L":", 0);
-  }
-
-  MapListItem = ShellCommandFindMapItem (NewName);
-
-  FreePool (NewName);
 
+  MapListItem = ShellCommandFindMapItemByName (Mapping);
   if (MapListItem != NULL) {
     return (MapListItem->DevicePath);
   }
@@ -261,9 +266,7 @@ EfiShellGetMapFromDevicePath (
   IN OUT EFI_DEVICE_PATH_PROTOCOL  **DevicePath
   )
 {
-  SHELL_MAP_LIST  *Node;
-  CHAR16          *PathForReturn;
-  UINTN           PathSize;
+  CHAR16  *PathForReturn;
 
   //  EFI_HANDLE                  PathHandle;
   //  EFI_HANDLE                  MapHandle;
@@ -275,26 +278,10 @@ EfiShellGetMapFromDevicePath (
     return (NULL);
   }
 
-  PathForReturn = NULL;
-  PathSize      = 0;
-
-  for ( Node = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
-        ; !IsNull (&gShellMapList.Link, &Node->Link)
-        ; Node = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &Node->Link)
-        )
-  {
-    //
-    // check for exact match
-    //
-    if (DevicePathCompare (DevicePath, &Node->DevicePath) == 0) {
-      ASSERT ((PathForReturn == NULL && PathSize == 0) || (PathForReturn != NULL));
-      if (PathSize != 0) {
-        PathForReturn = StrnCatGrow (&PathForReturn, &PathSize, L";", 0);
-      }
-
-      PathForReturn = StrnCatGrow (&PathForReturn, &PathSize, Node->MapName, 0);
-    }
-  }
+  //
+  // exact matches only, from the device path trie
+  //
+  PathForReturn = ShellCommandGetMapNamesFromDevicePath (*DevicePath);
 
   if (PathForReturn != NULL) {
     while (!IsDevicePathEndType (*DevicePath)) {
@@ -388,18 +375,14 @@ EfiShellGetFilePathFromDevicePath (
   )
 {
   EFI_DEVICE_PATH_PROTOCOL  *DevicePathCopy;
-  EFI_DEVICE_PATH_PROTOCOL  *MapPathCopy;
   SHELL_MAP_LIST            *MapListItem;
-  CHAR16                    *PathForReturn;
-  UINTN                     PathSize;
+  SHELL_STRING_BUILDER      Builder;
   EFI_HANDLE                PathHandle;
-  EFI_HANDLE                MapHandle;
   EFI_STATUS                Status;
   FILEPATH_DEVICE_PATH      *FilePath;
   FILEPATH_DEVICE_PATH      *AlignedNode;
 
-  PathForReturn = NULL;
-  PathSize      = 0;
+  ShellStrBuilderInit (&Builder);
 
   DevicePathCopy = (EFI_DEVICE_PATH_PROTOCOL *)Path;
   ASSERT (DevicePathCopy != NULL);
@@ -415,80 +398,57 @@ EfiShellGetFilePathFromDevicePath (
   }
 
   //
-  //  check each of the device paths we have to get the root of the path
+  // the first mapping of the file system handle is the root of the path
   //
-  for ( MapListItem = (SHELL_MAP_LIST *)GetFirstNode (&gShellMapList.Link)
-        ; !IsNull (&gShellMapList.Link, &MapListItem->Link)
-        ; MapListItem = (SHELL_MAP_LIST *)GetNextNode (&gShellMapList.Link, &MapListItem->Link)
-        )
-  {
-    MapPathCopy = (EFI_DEVICE_PATH_PROTOCOL *)MapListItem->DevicePath;
-    ASSERT (MapPathCopy != NULL);
-    /// @todo BlockIo?
-    Status = gBS->LocateDevicePath (&gEfiSimpleFileSystemProtocolGuid, &MapPathCopy, &MapHandle);
-    if (MapHandle == PathHandle) {
-      ASSERT ((PathForReturn == NULL && PathSize == 0) || (PathForReturn != NULL));
-      PathForReturn = StrnCatGrow (&PathForReturn, &PathSize, MapListItem->MapName, 0);
+  MapListItem = ShellCommandFindMapItemByFileSystem (PathHandle);
+  if (MapListItem != NULL) {
+    ShellStrBuilderAppend (&Builder, MapListItem->MapName, 0);
+    //
+    // go through all the remaining nodes in the device path
+    //
+    for ( FilePath = (FILEPATH_DEVICE_PATH *)DevicePathCopy
+          ; !IsDevicePathEnd (&FilePath->Header)
+          ; FilePath = (FILEPATH_DEVICE_PATH *)NextDevicePathNode (&FilePath->Header)
+          )
+    {
       //
-      // go through all the remaining nodes in the device path
+      // If any node is not a file path node, then the conversion can not be completed
       //
-      for ( FilePath = (FILEPATH_DEVICE_PATH *)DevicePathCopy
-            ; !IsDevicePathEnd (&FilePath->Header)
-            ; FilePath = (FILEPATH_DEVICE_PATH *)NextDevicePathNode (&FilePath->Header)
-            )
+      if ((DevicePathType (&FilePath->Header) != MEDIA_DEVICE_PATH) ||
+          (DevicePathSubType (&FilePath->Header) != MEDIA_FILEPATH_DP))
       {
-        //
-        // If any node is not a file path node, then the conversion can not be completed
-        //
-        if ((DevicePathType (&FilePath->Header) != MEDIA_DEVICE_PATH) ||
-            (DevicePathSubType (&FilePath->Header) != MEDIA_FILEPATH_DP))
-        {
-          if (PathForReturn != NULL) {
-            FreePool (PathForReturn);
-          }
-
-          return NULL;
-        }
-
-        //
-        // append the path part onto the filepath.
-        //
-        ASSERT ((PathForReturn == NULL && PathSize == 0) || (PathForReturn != NULL));
-
-        AlignedNode = AllocateCopyPool (DevicePathNodeLength (FilePath), FilePath);
-        if (AlignedNode == NULL) {
-          if (PathForReturn != NULL) {
-            FreePool (PathForReturn);
-          }
-
-          return NULL;
-        }
+        ShellStrBuilderFree (&Builder);
+        return NULL;
+      }
 
-        // File Path Device Path Nodes 'can optionally add a "\" separator to
-        //  the beginning and/or the end of the Path Name string.'
-        // (UEFI Spec 2.4 section 9.3.6.4).
-        // If necessary, add a "\", but otherwise don't
-        // (This is specified in the above section, and also implied by the
-        //  UEFI Shell spec section 3.7)
-        if ((PathSize != 0)                        &&
-            (PathForReturn != NULL)                &&
-            (PathForReturn[PathSize / sizeof (CHAR16) - 1] != L'\\') &&
-            (AlignedNode->PathName[0]    != L'\\'))
-        {
-          PathForReturn = StrnCatGrow (&PathForReturn, &PathSize, L"\\", 1);
-        }
+      //
+      // append the path part onto the filepath.
+      //
+      AlignedNode = AllocateCopyPool (DevicePathNodeLength (FilePath), FilePath);
+      if (AlignedNode == NULL) {
+        ShellStrBuilderFree (&Builder);
+        return NULL;
+      }
 
-        PathForReturn = StrnCatGrow (&PathForReturn, &PathSize, AlignedNode->PathName, 0);
-        FreePool (AlignedNode);
-      } // for loop of remaining nodes
-    }
+      // File Path Device Path Nodes 'can optionally add a "\" separator to
+      //  the beginning and/or the end of the Path Name string.'
+      // (UEFI Spec 2.4 section 9.3.6.4).
+      // If necessary, add a "\", but otherwise don't
+      // (This is specified in the above section, and also implied by the
+      //  UEFI Shell spec section 3.7)
+      if ((Builder.Length != 0)                           &&
+          (Builder.Buffer[Builder.Length - 1] != L'\\') &&
+          (AlignedNode->PathName[0]           != L'\\'))
+      {
+        ShellStrBuilderAppend (&Builder, L"\\", 1);
+      }
 
-    if (PathForReturn != NULL) {
-      break;
-    }
-  } // for loop of paths to check
+      ShellStrBuilderAppend (&Builder, AlignedNode->PathName, 0);
+      FreePool (AlignedNode);
+    } // for loop of remaining nodes
+  }
 
-  return (PathForReturn);
+  return (ShellStrBuilderFinalize (&Builder));
 }
 
 /**
@@ -973,6 +933,384 @@ EfiShellBatchIsActive (
   return (TRUE);
 }
 
+//
+// Cache of open volume roots and recently used directory handles, used by
+// InternalOpenFileDevicePath so repeated opens inside one directory become a
+// single relative Open() instead of LocateDevicePath + OpenVolume + a walk
+// from the root.  Entries are keyed by the SimpleFileSystem handle and are
+// dropped on media change, on mapping changes ("map -r", SetMap), before an
+// image is started, and when a file is deleted or a directory renamed.  The
+// directory paths are compared without case, as FAT does.
+//
+#define FILE_OPEN_CACHE_VOLUMES  8
+#define FILE_OPEN_CACHE_DIRS     4
+
+typedef struct {
+  CHAR16               *Path;           ///< Directory relative to the root, no leading '\'.
+  EFI_FILE_PROTOCOL    *Handle;
+  UINTN                LastUse;
+} FILE_OPEN_CACHE_DIR;
+
+typedef struct {
+  EFI_HANDLE                         Device;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL    *SimpleFileSystem;
+  BOOLEAN                            MediaPresent;
+  UINT32                             MediaId;
+  EFI_FILE_PROTOCOL                  *Root;
+  CHAR16                             *MapName;
+  UINTN                              LastUse;
+  FILE_OPEN_CACHE_DIR                Dir[FILE_OPEN_CACHE_DIRS];
+} FILE_OPEN_CACHE_VOLUME;
+
+STATIC FILE_OPEN_CACHE_VOLUME  mFileOpenCache[FILE_OPEN_CACHE_VOLUMES];
+STATIC UINTN                   mFileOpenCacheTick          = 0;
+STATIC UINTN                   mFileOpenCacheMapGeneration = 0;
+
+/**
+  Close the cached directory handles of a volume, keeping its root.
+
+  @param[in, out] Volume    The cache entry to trim.
+**/
+STATIC
+VOID
+FileOpenCacheFlushDirs (
+  IN OUT FILE_OPEN_CACHE_VOLUME  *Volume
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < FILE_OPEN_CACHE_DIRS; Index++) {
+    if (Volume->Dir[Index].Handle != NULL) {
+      Volume->Dir[Index].Handle->Close (Volume->Dir[Index].Handle);
+    }
+
+    SHELL_FREE_NON_NULL (Volume->Dir[Index].Path);
+    ZeroMem (&Volume->Dir[Index], sizeof (FILE_OPEN_CACHE_DIR));
+  }
+}
+
+/**
+  Close all cached handles of a volume and free the entry.
+
+  @param[in, out] Volume    The cache entry to drop.
+**/
+STATIC
+VOID
+FileOpenCacheFlushVolume (
+  IN OUT FILE_OPEN_CACHE_VOLUME  *Volume
+  )
+{
+  FileOpenCacheFlushDirs (Volume);
+  if (Volume->Root != NULL) {
+    Volume->Root->Close (Volume->Root);
+  }
+
+  SHELL_FREE_NON_NULL (Volume->MapName);
+  ZeroMem (Volume, sizeof (FILE_OPEN_CACHE_VOLUME));
+}
+
+/**
+  Drop the whole volume and directory handle cache.
+
+  @param[in] KeepRoots    TRUE to only close directory handles and keep the
+                          volume roots open.
+**/
+VOID
+FileOpenCacheFlush (
+  IN BOOLEAN  KeepRoots
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < FILE_OPEN_CACHE_VOLUMES; Index++) {
+    if (mFileOpenCache[Index].Device == NULL) {
+      continue;
+    }
+
+    if (KeepRoots) {
+      FileOpenCacheFlushDirs (&mFileOpenCache[Index]);
+    } else {
+      FileOpenCacheFlushVolume (&mFileOpenCache[Index]);
+    }
+  }
+}
+
+/**
+  Read the media state of the block device under a file system.
+
+  @param[in] Device         The SimpleFileSystem handle.
+  @param[out] MediaPresent  TRUE if media is present (or there is no BlockIo).
+  @param[out] MediaId       The current media id, 0 if there is no BlockIo.
+**/
+STATIC
+VOID
+FileOpenCacheGetMedia (
+  IN  EFI_HANDLE  Device,
+  OUT BOOLEAN     *MediaPresent,
+  OUT UINT32      *MediaId
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+
+  *MediaPresent = TRUE;
+  *MediaId      = 0;
+  if (!EFI_ERROR (gBS->HandleProtocol (Device, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo)) && (BlockIo->Media != NULL)) {
+    *MediaPresent = BlockIo->Media->MediaPresent;
+    *MediaId      = BlockIo->Media->MediaId;
+  }
+}
+
+/**
+  Find or create the cache entry for a file system, opening its root.
+
+  A cached entry is only reused if the same SimpleFileSystem instance is still
+  installed on the handle and the media has not changed.
+
+  @param[in] Device         The SimpleFileSystem handle.
+
+  @return                   The cache entry.
+  @retval NULL              The volume could not be opened.
+**/
+STATIC
+FILE_OPEN_CACHE_VOLUME *
+FileOpenCacheGetVolume (
+  IN EFI_HANDLE  Device
+  )
+{
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *SimpleFileSystem;
+  EFI_DEVICE_PATH_PROTOCOL         *DevPath;
+  FILE_OPEN_CACHE_VOLUME           *Volume;
+  CONST CHAR16                     *MapName;
+  BOOLEAN                          MediaPresent;
+  UINT32                           MediaId;
+  UINTN                            Index;
+
+  if (EFI_ERROR (gBS->HandleProtocol (Device, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&SimpleFileSystem))) {
+    return (NULL);
+  }
+
+  FileOpenCacheGetMedia (Device, &MediaPresent, &MediaId);
+
+  Volume = NULL;
+  for (Index = 0; Index < FILE_OPEN_CACHE_VOLUMES; Index++) {
+    if (mFileOpenCache[Index].Device == Device) {
+      Volume = &mFileOpenCache[Index];
+      if (  (Volume->SimpleFileSystem == SimpleFileSystem)
+         && (Volume->MediaPresent == MediaPresent)
+         && (Volume->MediaId == MediaId))
+      {
+        Volume->LastUse = ++mFileOpenCacheTick;
+        return (Volume);
+      }
+
+      FileOpenCacheFlushVolume (Volume);
+      break;
+    }
+  }
+
+  if (!MediaPresent) {
+    return (NULL);
+  }
+
+  //
+  // pick a free slot, or evict the least recently used volume
+  //
+  if (Volume == NULL) {
+    Volume = &mFileOpenCache[0];
+    for (Index = 0; Index < FILE_OPEN_CACHE_VOLUMES; Index++) {
+      if (mFileOpenCache[Index].Device == NULL) {
+        Volume = &mFileOpenCache[Index];
+        break;
+      }
+
+      if (mFileOpenCache[Index].LastUse < Volume->LastUse) {
+        Volume = &mFileOpenCache[Index];
+      }
+    }
+
+    if (Volume->Device != NULL) {
+      FileOpenCacheFlushVolume (Volume);
+    }
+  }
+
+  if (EFI_ERROR (SimpleFileSystem->OpenVolume (SimpleFileSystem, &Volume->Root))) {
+    Volume->Root = NULL;
+    return (NULL);
+  }
+
+  MapName = NULL;
+  if (!EFI_ERROR (gBS->HandleProtocol (Device, &gEfiDevicePathProtocolGuid, (VOID **)&DevPath))) {
+    MapName = EfiShellGetMapFromDevicePath (&DevPath);
+  }
+
+  Volume->Device           = Device;
+  Volume->SimpleFileSystem = SimpleFileSystem;
+  Volume->MediaPresent     = MediaPresent;
+  Volume->MediaId          = MediaId;
+  Volume->MapName          = (MapName == NULL) ? NULL : AllocateCopyPool (StrSize (MapName), MapName);
+  Volume->LastUse          = ++mFileOpenCacheTick;
+
+  return (Volume);
+}
+
+/**
+  Get a directory handle on a cached volume, opening and caching it on a miss.
+
+  @param[in, out] Volume    The volume cache entry.
+  @param[in] DirPath        The directory relative to the root. Empty for the root.
+
+  @return                   The directory handle, owned by the cache.
+  @retval NULL              The directory could not be opened.
+**/
+STATIC
+EFI_FILE_PROTOCOL *
+FileOpenCacheGetDir (
+  IN OUT FILE_OPEN_CACHE_VOLUME  *Volume,
+  IN CONST CHAR16                *DirPath
+  )
+{
+  FILE_OPEN_CACHE_DIR  *Slot;
+  EFI_FILE_PROTOCOL    *DirHandle;
+  UINTN                Index;
+
+  if (*DirPath == CHAR_NULL) {
+    return (Volume->Root);
+  }
+
+  Slot = &Volume->Dir[0];
+  for (Index = 0; Index < FILE_OPEN_CACHE_DIRS; Index++) {
+    if ((Volume->Dir[Index].Path != NULL) && (StringNoCaseCompare (&Volume->Dir[Index].Path, &DirPath) == 0)) {
+      Volume->Dir[Index].LastUse = ++mFileOpenCacheTick;
+      return (Volume->Dir[Index].Handle);
+    }
+
+    if (Volume->Dir[Index].LastUse < Slot->LastUse) {
+      Slot = &Volume->Dir[Index];
+    }
+  }
+
+  if (EFI_ERROR (Volume->Root->Open (Volume->Root, &DirHandle, (CHAR16 *)DirPath, EFI_FILE_MODE_READ, 0))) {
+    return (NULL);
+  }
+
+  if (Slot->Handle != NULL) {
+    Slot->Handle->Close (Slot->Handle);
+  }
+
+  SHELL_FREE_NON_NULL (Slot->Path);
+  Slot->Path = AllocateCopyPool (StrSize (DirPath), DirPath);
+  if (Slot->Path == NULL) {
+    DirHandle->Close (DirHandle);
+    ZeroMem (Slot, sizeof (FILE_OPEN_CACHE_DIR));
+    return (NULL);
+  }
+
+  Slot->Handle  = DirHandle;
+  Slot->LastUse = ++mFileOpenCacheTick;
+  return (DirHandle);
+}
+
+/**
+  Try to open a file through the volume and directory handle cache.
+
+  Only device paths that end in a single file path node are handled.  Any
+  failure other than the file itself not existing drops the volume from the
+  cache and reports EFI_UNSUPPORTED, so the caller falls back to the full
+  walk from a freshly opened root.
+
+  @param DevicePath               Device Path of the file.
+  @param FileHandle               Pointer to the file upon a successful return.
+  @param OpenMode                 mode to open file in.
+  @param Attributes               the File Attributes to use when creating a new file.
+
+  @retval EFI_SUCCESS             the file is open and FileHandle is valid
+  @retval EFI_NOT_FOUND           the file does not exist in its (existing) directory
+  @retval EFI_UNSUPPORTED         the cache could not be used; do the full walk
+**/
+STATIC
+EFI_STATUS
+InternalOpenFileCached (
+  IN EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  OUT SHELL_FILE_HANDLE        *FileHandle,
+  IN UINT64                    OpenMode,
+  IN UINT64                    Attributes OPTIONAL
+  )
+{
+  EFI_STATUS              Status;
+  EFI_HANDLE              Device;
+  FILE_OPEN_CACHE_VOLUME  *Volume;
+  FILEPATH_DEVICE_PATH    *AlignedNode;
+  EFI_FILE_PROTOCOL       *DirHandle;
+  EFI_FILE_PROTOCOL       *NewHandle;
+  CHAR16                  *DirPath;
+  CHAR16                  *Leaf;
+
+  if (mFileOpenCacheMapGeneration != ShellCommandGetMapGeneration ()) {
+    FileOpenCacheFlush (FALSE);
+    mFileOpenCacheMapGeneration = ShellCommandGetMapGeneration ();
+  }
+
+  Status = gBS->LocateDevicePath (&gEfiSimpleFileSystemProtocolGuid, &DevicePath, &Device);
+  if (EFI_ERROR (Status)) {
+    return (EFI_UNSUPPORTED);
+  }
+
+  if (  (DevicePathType (DevicePath) != MEDIA_DEVICE_PATH)
+     || (DevicePathSubType (DevicePath) != MEDIA_FILEPATH_DP)
+     || !IsDevicePathEnd (NextDevicePathNode (DevicePath)))
+  {
+    return (EFI_UNSUPPORTED);
+  }
+
+  AlignedNode = AllocateCopyPool (DevicePathNodeLength (DevicePath), DevicePath);
+  if (AlignedNode == NULL) {
+    return (EFI_UNSUPPORTED);
+  }
+
+  //
+  // split "\dir\sub\leaf" into "dir\sub" and "leaf"
+  //
+  DirPath = AlignedNode->PathName;
+  while (*DirPath == L'\\') {
+    DirPath++;
+  }
+
+  Leaf = DirPath + StrLen (DirPath);
+  while (Leaf > DirPath && *(Leaf - 1) != L'\\') {
+    Leaf--;
+  }
+
+  if (  (*Leaf == CHAR_NULL)
+     || (StrCmp (Leaf, L".") == 0)
+     || (StrCmp (Leaf, L"..") == 0))
+  {
+    FreePool (AlignedNode);
+    return (EFI_UNSUPPORTED);
+  }
+
+  if (Leaf > DirPath) {
+    *(Leaf - 1) = CHAR_NULL;
+  }
+
+  Status = EFI_UNSUPPORTED;
+  Volume = FileOpenCacheGetVolume (Device);
+  if (Volume != NULL) {
+    DirHandle = FileOpenCacheGetDir (Volume, (Leaf > DirPath) ? DirPath : L"");
+    if (DirHandle != NULL) {
+      Status = DirHandle->Open (DirHandle, &NewHandle, Leaf, OpenMode, Attributes);
+      if (!EFI_ERROR (Status)) {
+        *FileHandle = ConvertEfiFileProtocolToShellHandle (NewHandle, Volume->MapName);
+      } else if (Status != EFI_NOT_FOUND) {
+        FileOpenCacheFlushVolume (Volume);
+        Status = EFI_UNSUPPORTED;
+      }
+    }
+  }
+
+  FreePool (AlignedNode);
+  return (Status);
+}
+
 /**
   Worker function to open a file based on a device path.  this will open the root
   of the volume and then traverse down to the file itself.
@@ -1014,6 +1352,11 @@ InternalOpenFileDevicePath (
   FilePathNode = NULL;
   AlignedNode  = NULL;
 
+  Status = InternalOpenFileCached (DevicePath, FileHandle, OpenMode, Attributes);
+  if (Status != EFI_UNSUPPORTED) {
+    return (Status);
+  }
+
   Status = EfiShellOpenRoot (DevicePath, &ShellHandle);
 
   if (!EFI_ERROR (Status)) {
@@ -1438,24 +1781,81 @@ EfiShellDeleteFileByName (
 }
 
 /**
-  Disables the page break output mode.
+  Delete a file and close its handle.
+
+  Cached directory handles are dropped first, the deleted file may be one of
+  them or contain one of them.
+
+  @param[in] FileHandle           The file handle to delete.
+
+  @retval EFI_SUCCESS             The file was closed and deleted, and the handle was closed.
+  @retval EFI_WARN_DELETE_FAILURE The handle was closed but the file was not deleted.
 **/
-VOID
+EFI_STATUS
 EFIAPI
-EfiShellDisablePageBreak (
-  VOID
+EfiShellDeleteFile (
+  IN SHELL_FILE_HANDLE  FileHandle
   )
 {
-  ShellInfoObject.PageBreakEnabled = FALSE;
+  FileOpenCacheFlush (TRUE);
+  ShellFileHandleRemove (FileHandle);
+  return (FileHandleDelete (ConvertShellHandleToEfiFileProtocol (FileHandle)));
 }
 
 /**
-  Enables the page break output mode.
+  Set the information about a file, e.g. to rename or move it.
+
+  If a directory is renamed or moved, cached directory handles are dropped
+  first so it is not reached again through its old name.  Setting the size,
+  times or attributes (cp does that for every file) keeps the cache.
+
+  @param[in] FileHandle           The file handle.
+  @param[in] FileInfo             The new file information.
+
+  @retval EFI_SUCCESS             The information was set.
+  @return                         An error from EFI_FILE_PROTOCOL.SetInfo().
 **/
-VOID
+EFI_STATUS
 EFIAPI
-EfiShellEnablePageBreak (
-  VOID
+EfiShellSetFileInfo (
+  IN SHELL_FILE_HANDLE    FileHandle,
+  IN CONST EFI_FILE_INFO  *FileInfo
+  )
+{
+  EFI_FILE_PROTOCOL  *EfiFileHandle;
+  EFI_FILE_INFO      *OldInfo;
+
+  EfiFileHandle = ConvertShellHandleToEfiFileProtocol (FileHandle);
+  OldInfo       = FileHandleGetInfo (EfiFileHandle);
+  if (  (OldInfo == NULL)
+     || (((OldInfo->Attribute & EFI_FILE_DIRECTORY) != 0) && (StrCmp (OldInfo->FileName, FileInfo->FileName) != 0)))
+  {
+    FileOpenCacheFlush (TRUE);
+  }
+
+  SHELL_FREE_NON_NULL (OldInfo);
+  return (FileHandleSetInfo (EfiFileHandle, FileInfo));
+}
+
+/**
+  Disables the page break output mode.
+**/
+VOID
+EFIAPI
+EfiShellDisablePageBreak (
+  VOID
+  )
+{
+  ShellInfoObject.PageBreakEnabled = FALSE;
+}
+
+/**
+  Enables the page break output mode.
+**/
+VOID
+EFIAPI
+EfiShellEnablePageBreak (
+  VOID
   )
 {
   ShellInfoObject.PageBreakEnabled = TRUE;
@@ -1497,7 +1897,7 @@ InternalShellExecuteDevicePath (
   EFI_STATUS                     CleanupStatus;
   EFI_HANDLE                     NewHandle;
   EFI_LOADED_IMAGE_PROTOCOL      *LoadedImage;
-  LIST_ENTRY                     OrigEnvs;
+  BOOLEAN                        EnvScope;
   EFI_SHELL_PARAMETERS_PROTOCOL  ShellParamsProtocol;
   CHAR16                         *ImagePath;
   UINTN                          Index;
@@ -1508,9 +1908,19 @@ InternalShellExecuteDevicePath (
     return (EFI_INVALID_PARAMETER);
   }
   CDETRACE((TRCINF(1)"-->\n"));
-  InitializeListHead (&OrigEnvs);
+  EnvScope = FALSE;
   ZeroMem (&ShellParamsProtocol, sizeof (EFI_SHELL_PARAMETERS_PROTOCOL));
 
+  //
+  // the image may reformat, disconnect or otherwise touch file systems directly
+  //
+  FileOpenCacheFlush (FALSE);
+
+  //
+  // the image (or a nested shell) reads the environment from the variable store
+  //
+  ShellEnvMirrorFlush ();
+
   NewHandle = NULL;
 
   NewCmdLine = AllocateCopyPool (StrSize (CommandLine), CommandLine);
@@ -1581,12 +1991,16 @@ InternalShellExecuteDevicePath (
     }
 
     //
-    // Save our current environment settings for later restoration if necessary
+    // Apply the environment as a scope over the current one, dropped again below
     //
     if (Environment != NULL) {
-      Status = GetEnvironmentVariableList (&OrigEnvs);
+      Status = ShellEnvScopePush (Environment);
       if (!EFI_ERROR (Status)) {
-        Status = SetEnvironmentVariables (Environment);
+        EnvScope = TRUE;
+        //
+        // the image may be a nested shell, which reads the variable store
+        //
+        ShellEnvMirrorFlush ();
       }
     }
 
@@ -1644,6 +2058,11 @@ InternalShellExecuteDevicePath (
                            0,
                            NULL
                            );
+
+      //
+      // a nested shell sets aliases in the variable store directly
+      //
+      AliasIndexInvalidate ();
       if (StartImageStatus != NULL) {
         *StartImageStatus = StartStatus;
       }
@@ -1676,9 +2095,8 @@ FreeAlloc:
   }
 
   // Restore environment variables
-  if (!IsListEmpty (&OrigEnvs)) {
-    CleanupStatus = SetEnvironmentVariableList (&OrigEnvs);
-    ASSERT_EFI_ERROR (CleanupStatus);
+  if (EnvScope) {
+    ShellEnvScopePop ();
   }
 
   FreePool (NewCmdLine);
@@ -1713,19 +2131,13 @@ InternalShellExecute (
   )
 {
   EFI_STATUS  Status;
-  EFI_STATUS  CleanupStatus;
-  LIST_ENTRY  OrigEnvs;
-
-  InitializeListHead (&OrigEnvs);
 
   //
-  // Save our current environment settings for later restoration if necessary
+  // Apply the environment as a scope over the current one, dropped again below
   //
   if (Environment != NULL) {
-    Status = GetEnvironmentVariableList (&OrigEnvs);
-    if (!EFI_ERROR (Status)) {
-      Status = SetEnvironmentVariables (Environment);
-    } else {
+    Status = ShellEnvScopePush (Environment);
+    if (EFI_ERROR (Status)) {
       return Status;
     }
   }
@@ -1733,9 +2145,8 @@ InternalShellExecute (
   Status = RunShellCommand (CommandLine, StartImageStatus);
 
   // Restore environment variables
-  if (!IsListEmpty (&OrigEnvs)) {
-    CleanupStatus = SetEnvironmentVariableList (&OrigEnvs);
-    ASSERT_EFI_ERROR (CleanupStatus);
+  if (Environment != NULL) {
+    ShellEnvScopePop ();
   }
 
   return (Status);
@@ -2126,12 +2537,11 @@ CreateAndPopulateShellFileInfo (
   IN CONST EFI_FILE_INFO      *Info
   )
 {
-  EFI_SHELL_FILE_INFO  *ShellFileListItem;
-  CHAR16               *TempString;
-  UINTN                Size;
+  EFI_SHELL_FILE_INFO   *ShellFileListItem;
+  CHAR16                *TempString;
+  SHELL_STRING_BUILDER  FullName;
 
   TempString = NULL;
-  Size       = 0;
 
   ShellFileListItem = AllocateZeroPool (sizeof (EFI_SHELL_FILE_INFO));
   if (ShellFileListItem == NULL) {
@@ -2162,32 +2572,33 @@ CreateAndPopulateShellFileInfo (
     ShellFileListItem->FileName = NULL;
   }
 
-  Size       = 0;
+  //
+  // FullName is BasePath followed by FileName, built in one allocation.  It
+  // stays NULL if there is neither.
+  //
   TempString = NULL;
-  if (BasePath != NULL) {
-    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
-    TempString = StrnCatGrow (&TempString, &Size, BasePath, 0);
-    if (TempString == NULL) {
-      FreePool ((VOID *)ShellFileListItem->FileName);
+  if ((BasePath != NULL) || (ShellFileListItem->FileName != NULL)) {
+    ShellStrBuilderInit (&FullName);
+    ShellStrBuilderReserve (
+      &FullName,
+      (BasePath == NULL ? 0 : StrLen (BasePath)) +
+      (ShellFileListItem->FileName == NULL ? 0 : StrLen (ShellFileListItem->FileName))
+      );
+    ShellStrBuilderAppend (&FullName, BasePath, 0);
+    ShellStrBuilderAppend (&FullName, ShellFileListItem->FileName, 0);
+    if (FullName.Failed) {
+      if (ShellFileListItem->FileName != NULL) {
+        FreePool ((VOID *)ShellFileListItem->FileName);
+      }
+
       SHELL_FREE_NON_NULL (ShellFileListItem->Info);
       FreePool (ShellFileListItem);
       return (NULL);
     }
-  }
 
-  if (ShellFileListItem->FileName != NULL) {
-    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
-    TempString = StrnCatGrow (&TempString, &Size, ShellFileListItem->FileName, 0);
-    if (TempString == NULL) {
-      FreePool ((VOID *)ShellFileListItem->FileName);
-      FreePool (ShellFileListItem->Info);
-      FreePool (ShellFileListItem);
-      return (NULL);
-    }
+    TempString = PathCleanUpDirectories (ShellStrBuilderFinalize (&FullName));
   }
 
-  TempString = PathCleanUpDirectories (TempString);
-
   ShellFileListItem->FullName = TempString;
   ShellFileListItem->Status   = Status;
   ShellFileListItem->Handle   = Handle;
@@ -2850,6 +3261,7 @@ EfiShellGetEnvEx (
   UINTN         Size;
   ENV_VAR_LIST  *Node;
   CHAR16        *CurrentWriteLocation;
+  CONST CHAR16  *Value;
 
   Size   = 0;
   Buffer = NULL;
@@ -2891,11 +3303,22 @@ EfiShellGetEnvEx (
     }
   } else {
     //
-    // We are doing a specific environment variable
+    // We are doing a specific environment variable.  The value in the list
+    // is returned as it is, without a copy on the buffer free list.
     //
-    Status = ShellFindEnvVarInList (Name, (CHAR16 **)&Buffer, &Size, Attributes);
+    Value = ShellGetEnvVarFromList (Name, Attributes);
+    if (Value != NULL) {
+      return (Value);
+    }
 
-    if (EFI_ERROR (Status)) {
+    //
+    // While a scope is open the variable store may still hold values the
+    // scope has overridden or deleted, so the in memory list is final.  So it
+    // is for a variable with a pending write: it is missing from the list
+    // because it was deleted, and the store still holds the old value
+    // ("set foo bar", run an image, "set -d foo", then read foo).
+    //
+    if (!ShellEnvScopeActive () && !ShellEnvMirrorPending (Name)) {
       //
       // get the size we need for this EnvVariable
       //
@@ -2927,9 +3350,12 @@ EfiShellGetEnvEx (
         // but get it from UEFI variable storage successfully then we need update
         // the gShellEnvVarList.
         //
+        FreePool (Buffer);
+        ShellEnvMirrorFlush ();
         ShellFreeEnvVarList ();
         Status = ShellInitEnvVarList ();
         ASSERT (Status == EFI_SUCCESS);
+        return (ShellGetEnvVarFromList (Name, Attributes));
       }
     }
   }
@@ -2972,184 +3398,683 @@ EfiShellGetEnv (
   return (EfiShellGetEnvEx (Name, NULL));
 }
 
+//
+// Environment variables whose current state so far only exists in
+// gShellEnvVarList.
+//
+// Volatile variables are owned by the shell, so writing them through to the
+// UEFI variable store after every command (e.g. lasterror, cwd or loop
+// counters in scripts) only costs SetVariable calls.  Non volatile writes are
+// deferred while a batch is open (a script or the startup phase) and are
+// committed once when the outermost batch ends, or by the "commit" command.
+//
+// ShellEnvMirrorFlush() writes everything out when something outside this
+// shell instance may read the store: before an image is started, before the
+// list is reloaded from the store, and when the shell exits.
+//
+typedef struct {
+  LIST_ENTRY    Link;
+  BOOLEAN       NonVolatile;        ///< A non volatile variable is involved.
+  CHAR16        *Name;
+} SHELL_ENV_PENDING;
+
+STATIC LIST_ENTRY  mEnvMirrorPending    = INITIALIZE_LIST_HEAD_VARIABLE (mEnvMirrorPending);
+STATIC UINTN       mEnvBatchDepth       = 0;
+STATIC UINTN       mEnvMirrorWriteCount = 0;
+
+//
+// Copy-on-write environment scopes, used to run a command with an
+// Environment array (EfiShellExecute).  The variables of the array are set
+// on top of the current environment.  The first time a variable is changed
+// while a scope is open, its previous state is saved in the innermost scope;
+// closing the scope puts the saved states back.  All writes made while a
+// scope is open stay in memory, so neither opening nor closing a scope costs
+// variable store traffic unless the store was written in between.
+//
+typedef struct {
+  LIST_ENTRY    Link;
+  CHAR16        *Name;
+  CHAR16        *Value;             ///< NULL if the variable did not exist.
+  UINT32        Atts;
+  BOOLEAN       WasPending;         ///< Name was in mEnvMirrorPending.
+} SHELL_ENV_SAVED;
+
+typedef struct {
+  LIST_ENTRY    Link;
+  LIST_ENTRY    Saved;              ///< SHELL_ENV_SAVED, in save order.
+  UINTN         WriteCount;         ///< mEnvMirrorWriteCount when opened.
+} SHELL_ENV_SCOPE;
+
+STATIC LIST_ENTRY  mEnvScopes = INITIALIZE_LIST_HEAD_VARIABLE (mEnvScopes);
+
 /**
-  Internal variable setting function.  Allows for setting of the read only variables.
+  Find the pending entry for an environment variable.
 
-  @param Name                   Points to the NULL-terminated environment variable name.
-  @param Value                  Points to the NULL-terminated environment variable value. If the value is an
-                                empty string then the environment variable is deleted.
-  @param Volatile               Indicates whether the variable is non-volatile (FALSE) or volatile (TRUE).
+  @param[in] Name               The name of the environment variable.
 
-  @retval EFI_SUCCESS           The environment variable was successfully updated.
+  @return                       The pending entry, or NULL if there is none.
 **/
-EFI_STATUS
-InternalEfiShellSetEnv (
-  IN CONST CHAR16  *Name,
-  IN CONST CHAR16  *Value,
-  IN BOOLEAN       Volatile
+STATIC
+SHELL_ENV_PENDING *
+ShellEnvMirrorFind (
+  IN CONST CHAR16  *Name
   )
 {
-  EFI_STATUS  Status;
+  SHELL_ENV_PENDING  *Node;
 
-  if ((Value == NULL) || (StrLen (Value) == 0)) {
-    Status = SHELL_DELETE_ENVIRONMENT_VARIABLE (Name);
-    if (!EFI_ERROR (Status)) {
-      ShellRemvoeEnvVarFromList (Name);
-    }
-  } else {
-    SHELL_DELETE_ENVIRONMENT_VARIABLE (Name);
-    Status = ShellAddEnvVarToList (
-               Name,
-               Value,
-               StrSize (Value),
-               EFI_VARIABLE_BOOTSERVICE_ACCESS | (Volatile ? 0 : EFI_VARIABLE_NON_VOLATILE)
-               );
-    if (!EFI_ERROR (Status)) {
-      Status = Volatile
-             ? SHELL_SET_ENVIRONMENT_VARIABLE_V (Name, StrSize (Value) - sizeof (CHAR16), Value)
-             : SHELL_SET_ENVIRONMENT_VARIABLE_NV (Name, StrSize (Value) - sizeof (CHAR16), Value);
-      if (EFI_ERROR (Status)) {
-        ShellRemvoeEnvVarFromList (Name);
-      }
+  for ( Node = (SHELL_ENV_PENDING *)GetFirstNode (&mEnvMirrorPending)
+        ; !IsNull (&mEnvMirrorPending, &Node->Link)
+        ; Node = (SHELL_ENV_PENDING *)GetNextNode (&mEnvMirrorPending, &Node->Link)
+        )
+  {
+    if (StrCmp (Node->Name, Name) == 0) {
+      return (Node);
     }
   }
 
-  return Status;
+  return (NULL);
 }
 
 /**
-  Sets the environment variable.
-
-  This function changes the current value of the specified environment variable. If the
-  environment variable exists and the Value is an empty string, then the environment
-  variable is deleted. If the environment variable exists and the Value is not an empty
-  string, then the value of the environment variable is changed. If the environment
-  variable does not exist and the Value is an empty string, there is no action. If the
-  environment variable does not exist and the Value is a non-empty string, then the
-  environment variable is created and assigned the specified value.
-
-  For a description of volatile and non-volatile environment variables, see UEFI Shell
-  2.0 specification section 3.6.1.
-
-  @param Name                   Points to the NULL-terminated environment variable name.
-  @param Value                  Points to the NULL-terminated environment variable value. If the value is an
-                                empty string then the environment variable is deleted.
-  @param Volatile               Indicates whether the variable is non-volatile (FALSE) or volatile (TRUE).
+  Remember that an environment variable has to be written to the UEFI
+  variable store.
 
-  @retval EFI_SUCCESS           The environment variable was successfully updated.
+  @param[in] Name               The name of the environment variable.
+  @param[in] NonVolatile        TRUE if a non volatile variable is involved.
 **/
-EFI_STATUS
-EFIAPI
-EfiShellSetEnv (
+STATIC
+VOID
+ShellEnvMirrorMark (
   IN CONST CHAR16  *Name,
-  IN CONST CHAR16  *Value,
-  IN BOOLEAN       Volatile
+  IN BOOLEAN       NonVolatile
   )
 {
-  if ((Name == NULL) || (*Name == CHAR_NULL)) {
-    return (EFI_INVALID_PARAMETER);
+  SHELL_ENV_PENDING  *Node;
+
+  Node = ShellEnvMirrorFind (Name);
+  if (Node != NULL) {
+    Node->NonVolatile = (BOOLEAN)(Node->NonVolatile || NonVolatile);
+    return;
   }
 
-  //
-  // Make sure we dont 'set' a predefined read only variable
-  //
-  if ((StrCmp (Name, L"cwd") == 0) ||
-      (StrCmp (Name, L"lasterror") == 0) ||
-      (StrCmp (Name, L"profiles") == 0) ||
-      (StrCmp (Name, L"uefishellsupport") == 0) ||
-      (StrCmp (Name, L"uefishellversion") == 0) ||
-      (StrCmp (Name, L"uefiversion") == 0) ||
-      (!ShellInfoObject.ShellInitSettings.BitUnion.Bits.NoNest &&
-       (StrCmp (Name, mNoNestingEnvVarName) == 0))
-      )
-  {
-    return (EFI_INVALID_PARAMETER);
+  Node = AllocateZeroPool (sizeof (SHELL_ENV_PENDING));
+  if (Node == NULL) {
+    return;
   }
 
-  return (InternalEfiShellSetEnv (Name, Value, Volatile));
+  Node->Name = AllocateCopyPool (StrSize (Name), Name);
+  if (Node->Name == NULL) {
+    FreePool (Node);
+    return;
+  }
+
+  Node->NonVolatile = NonVolatile;
+  InsertTailList (&mEnvMirrorPending, &Node->Link);
 }
 
 /**
-  Returns the current directory on the specified device.
+  Forget a pending environment variable, because it was just written through.
 
-  If FileSystemMapping is NULL, it returns the current working directory. If the
-  FileSystemMapping is not NULL, it returns the current directory associated with the
-  FileSystemMapping. In both cases, the returned name includes the file system
-  mapping (i.e. fs0:\current-dir).
+  @param[in] Name               The name of the environment variable.
+**/
+STATIC
+VOID
+ShellEnvMirrorUnmark (
+  IN CONST CHAR16  *Name
+  )
+{
+  SHELL_ENV_PENDING  *Node;
 
-  Note that the current directory string should exclude the tailing backslash character.
+  Node = ShellEnvMirrorFind (Name);
+  if (Node != NULL) {
+    RemoveEntryList (&Node->Link);
+    FreePool (Node->Name);
+    FreePool (Node);
+  }
+}
 
-  @param FileSystemMapping      A pointer to the file system mapping. If NULL,
-                                then the current working directory is returned.
+/**
+  Write pending environment variables to the UEFI variable store, as they
+  are in gShellEnvVarList.  Variables no longer in the list are deleted.
 
-  @retval !=NULL                The current directory.
-  @retval NULL                  Current directory does not exist.
+  @param[in] NonVolatileOnly    TRUE to only write entries that involve a non
+                                volatile variable.
+
+  @retval EFI_SUCCESS           All writes succeeded.
+  @return                       The first error from the variable store.
 **/
-CONST CHAR16 *
-EFIAPI
-EfiShellGetCurDir (
-  IN CONST CHAR16  *FileSystemMapping OPTIONAL
+STATIC
+EFI_STATUS
+ShellEnvMirrorWrite (
+  IN BOOLEAN  NonVolatileOnly
   )
 {
-  CHAR16          *PathToReturn;
-  UINTN           Size;
-  SHELL_MAP_LIST  *MapListItem;
+  SHELL_ENV_PENDING  *Node;
+  SHELL_ENV_PENDING  *Next;
+  CHAR16             *Value;
+  UINTN              Size;
+  UINT32             Atts;
+  EFI_STATUS         Status;
+  EFI_STATUS         RetVal;
 
-  if (!IsListEmpty (&gShellMapList.Link)) {
-    //
-    // if parameter is NULL, use current
-    //
-    if (FileSystemMapping == NULL) {
-      return (EfiShellGetEnv (L"cwd"));
-    } else {
-      Size         = 0;
-      PathToReturn = NULL;
-      MapListItem  = ShellCommandFindMapItem (FileSystemMapping);
-      if (MapListItem != NULL) {
-        ASSERT ((PathToReturn == NULL && Size == 0) || (PathToReturn != NULL));
-        PathToReturn = StrnCatGrow (&PathToReturn, &Size, MapListItem->MapName, 0);
-        PathToReturn = StrnCatGrow (&PathToReturn, &Size, MapListItem->CurrentDirectoryPath, 0);
+  RetVal = EFI_SUCCESS;
+  for ( Node = (SHELL_ENV_PENDING *)GetFirstNode (&mEnvMirrorPending)
+        ; !IsNull (&mEnvMirrorPending, &Node->Link)
+        ; Node = Next
+        )
+  {
+    Next = (SHELL_ENV_PENDING *)GetNextNode (&mEnvMirrorPending, &Node->Link);
+    if (NonVolatileOnly && !Node->NonVolatile) {
+      continue;
+    }
+
+    RemoveEntryList (&Node->Link);
+    Value = NULL;
+    Atts  = 0;
+    mEnvMirrorWriteCount++;
+
+    SHELL_DELETE_ENVIRONMENT_VARIABLE (Node->Name);
+    Status = ShellFindEnvVarInList (Node->Name, &Value, &Size, &Atts);
+    if (!EFI_ERROR (Status)) {
+      Status = ((Atts & EFI_VARIABLE_NON_VOLATILE) != 0)
+             ? SHELL_SET_ENVIRONMENT_VARIABLE_NV (Node->Name, StrSize (Value) - sizeof (CHAR16), Value)
+             : SHELL_SET_ENVIRONMENT_VARIABLE_V (Node->Name, StrSize (Value) - sizeof (CHAR16), Value);
+      if (EFI_ERROR (Status) && !EFI_ERROR (RetVal)) {
+        RetVal = Status;
       }
     }
 
-    return (AddBufferToFreeList (PathToReturn));
-  } else {
-    return (NULL);
+    SHELL_FREE_NON_NULL (Value);
+    FreePool (Node->Name);
+    FreePool (Node);
   }
+
+  return (RetVal);
 }
 
 /**
-  Changes the current directory on the specified device.
-
-  If the FileSystem is NULL, and the directory Dir does not contain a file system's
-  mapped name, this function changes the current working directory.
-
-  If the FileSystem is NULL and the directory Dir contains a mapped name, then the
-  current file system and the current directory on that file system are changed.
-
-  If FileSystem is NULL, and Dir is not NULL, then this changes the current working file
-  system.
+  Report whether an environment variable has a write to the UEFI variable
+  store pending, so the store does not hold its current state.
 
-  If FileSystem is not NULL and Dir is not NULL, then this function changes the current
-  directory on the specified file system.
+  @param[in] Name               The name of the environment variable.
 
-  If the current working directory or the current working file system is changed then the
-  %cwd% environment variable will be updated
+  @retval TRUE                  A write is pending.
+  @retval FALSE                 The store is up to date for Name.
+**/
+BOOLEAN
+ShellEnvMirrorPending (
+  IN CONST CHAR16  *Name
+  )
+{
+  return ((BOOLEAN)(ShellEnvMirrorFind (Name) != NULL));
+}
 
-  Note that the current directory string should exclude the tailing backslash character.
+/**
+  Write all environment variables that only exist in memory to the UEFI
+  variable store, and delete the ones that were removed in memory.
+**/
+VOID
+ShellEnvMirrorFlush (
+  VOID
+  )
+{
+  ShellEnvMirrorWrite (FALSE);
+}
 
-  @param FileSystem             A pointer to the file system's mapped name. If NULL, then the current working
-                                directory is changed.
-  @param Dir                    Points to the NULL-terminated directory on the device specified by FileSystem.
+/**
+  Commit deferred non volatile environment variable writes.
 
-  @retval EFI_SUCCESS           The operation was successful
-  @retval EFI_NOT_FOUND         The file system could not be found
+  @retval EFI_SUCCESS           All writes succeeded.
+  @return                       The first error from the variable store.
 **/
 EFI_STATUS
-EFIAPI
-EfiShellSetCurDir (
-  IN CONST CHAR16  *FileSystem OPTIONAL,
-  IN CONST CHAR16  *Dir
+ShellEnvCommit (
+  VOID
+  )
+{
+  return (ShellEnvMirrorWrite (TRUE));
+}
+
+/**
+  Open a batch of environment writes.  Non volatile writes are kept in memory
+  until the outermost batch is closed.  Batches nest.
+**/
+VOID
+ShellEnvBatchBegin (
+  VOID
+  )
+{
+  mEnvBatchDepth++;
+}
+
+/**
+  Close a batch of environment writes, committing deferred non volatile writes
+  when the outermost batch is closed.
+**/
+VOID
+ShellEnvBatchEnd (
+  VOID
+  )
+{
+  ASSERT (mEnvBatchDepth > 0);
+  if (mEnvBatchDepth > 0) {
+    mEnvBatchDepth--;
+  }
+
+  if (mEnvBatchDepth == 0) {
+    ShellEnvCommit ();
+  }
+}
+
+/**
+  Report whether an environment scope is open.
+
+  @retval TRUE                  At least one scope is open.
+  @retval FALSE                 No scope is open.
+**/
+BOOLEAN
+ShellEnvScopeActive (
+  VOID
+  )
+{
+  return ((BOOLEAN)!IsListEmpty (&mEnvScopes));
+}
+
+/**
+  Save the current state of an environment variable in the innermost scope,
+  unless the scope already holds it.
+
+  @param[in] Name               The name of the environment variable.
+
+  @retval EFI_SUCCESS           The state is saved.
+  @retval EFI_OUT_OF_RESOURCES  Out of memory.
+**/
+STATIC
+EFI_STATUS
+ShellEnvScopeSave (
+  IN CONST CHAR16  *Name
+  )
+{
+  SHELL_ENV_SCOPE  *Scope;
+  SHELL_ENV_SAVED  *Saved;
+  UINTN            Size;
+
+  Scope = (SHELL_ENV_SCOPE *)GetFirstNode (&mEnvScopes);
+  for ( Saved = (SHELL_ENV_SAVED *)GetFirstNode (&Scope->Saved)
+        ; !IsNull (&Scope->Saved, &Saved->Link)
+        ; Saved = (SHELL_ENV_SAVED *)GetNextNode (&Scope->Saved, &Saved->Link)
+        )
+  {
+    if (StrCmp (Saved->Name, Name) == 0) {
+      return (EFI_SUCCESS);
+    }
+  }
+
+  Saved = AllocateZeroPool (sizeof (SHELL_ENV_SAVED));
+  if (Saved == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  Saved->Name = AllocateCopyPool (StrSize (Name), Name);
+  if (Saved->Name == NULL) {
+    FreePool (Saved);
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  if (EFI_ERROR (ShellFindEnvVarInList (Name, &Saved->Value, &Size, &Saved->Atts))) {
+    Saved->Value = NULL;
+    Saved->Atts  = 0;
+  }
+
+  Saved->WasPending = (BOOLEAN)(ShellEnvMirrorFind (Name) != NULL);
+  InsertTailList (&Scope->Saved, &Saved->Link);
+
+  return (EFI_SUCCESS);
+}
+
+/**
+  Internal variable setting function.  Allows for setting of the read only variables.
+
+  @param Name                   Points to the NULL-terminated environment variable name.
+  @param Value                  Points to the NULL-terminated environment variable value. If the value is an
+                                empty string then the environment variable is deleted.
+  @param Volatile               Indicates whether the variable is non-volatile (FALSE) or volatile (TRUE).
+
+  @retval EFI_SUCCESS           The environment variable was successfully updated.
+**/
+EFI_STATUS
+InternalEfiShellSetEnv (
+  IN CONST CHAR16  *Name,
+  IN CONST CHAR16  *Value,
+  IN BOOLEAN       Volatile
+  )
+{
+  EFI_STATUS  Status;
+  CHAR16      *OldValue;
+  UINTN       OldSize;
+  UINT32      OldAtts;
+  BOOLEAN     Found;
+
+  if (ShellEnvScopeActive ()) {
+    Status = ShellEnvScopeSave (Name);
+    if (EFI_ERROR (Status)) {
+      return (Status);
+    }
+  }
+
+  //
+  // Volatile variables that are new or already volatile, non volatile
+  // variables while a batch is open, and all variables while a scope is
+  // open, are kept in memory only, see ShellEnvMirrorWrite().
+  //
+  if (Volatile || (mEnvBatchDepth > 0) || ShellEnvScopeActive ()) {
+    OldValue = NULL;
+    OldAtts  = 0;
+    Found    = (BOOLEAN)!EFI_ERROR (ShellFindEnvVarInList (Name, &OldValue, &OldSize, &OldAtts));
+    SHELL_FREE_NON_NULL (OldValue);
+
+    if (!Volatile || !Found || ((OldAtts & EFI_VARIABLE_NON_VOLATILE) == 0) || ShellEnvScopeActive ()) {
+      if ((Value != NULL) && (StrLen (Value) != 0)) {
+        Status = ShellAddEnvVarToList (
+                   Name,
+                   Value,
+                   StrSize (Value),
+                   EFI_VARIABLE_BOOTSERVICE_ACCESS | (Volatile ? 0 : EFI_VARIABLE_NON_VOLATILE)
+                   );
+        if (!EFI_ERROR (Status)) {
+          ShellEnvMirrorMark (Name, (BOOLEAN)(!Volatile || (Found && ((OldAtts & EFI_VARIABLE_NON_VOLATILE) != 0))));
+        }
+
+        return (Status);
+      } else if (Found) {
+        ShellRemvoeEnvVarFromList (Name);
+        ShellEnvMirrorMark (Name, (BOOLEAN)((OldAtts & EFI_VARIABLE_NON_VOLATILE) != 0));
+        return (EFI_SUCCESS);
+      }
+    }
+  }
+
+  ShellEnvMirrorUnmark (Name);
+
+  if ((Value == NULL) || (StrLen (Value) == 0)) {
+    Status = SHELL_DELETE_ENVIRONMENT_VARIABLE (Name);
+    if (!EFI_ERROR (Status)) {
+      ShellRemvoeEnvVarFromList (Name);
+    }
+  } else {
+    SHELL_DELETE_ENVIRONMENT_VARIABLE (Name);
+    Status = ShellAddEnvVarToList (
+               Name,
+               Value,
+               StrSize (Value),
+               EFI_VARIABLE_BOOTSERVICE_ACCESS | (Volatile ? 0 : EFI_VARIABLE_NON_VOLATILE)
+               );
+    if (!EFI_ERROR (Status)) {
+      Status = Volatile
+             ? SHELL_SET_ENVIRONMENT_VARIABLE_V (Name, StrSize (Value) - sizeof (CHAR16), Value)
+             : SHELL_SET_ENVIRONMENT_VARIABLE_NV (Name, StrSize (Value) - sizeof (CHAR16), Value);
+      if (EFI_ERROR (Status)) {
+        ShellRemvoeEnvVarFromList (Name);
+      }
+    }
+  }
+
+  return Status;
+}
+
+/**
+  Open an environment scope and set the variables of Environment in it as
+  volatile variables.
+
+  @param[in] Environment        NULL-terminated array of 'x=y' strings.
+
+  @retval EFI_SUCCESS           The scope is open.
+  @retval EFI_INVALID_PARAMETER An entry has no variable name; no scope is open.
+  @retval EFI_OUT_OF_RESOURCES  Out of memory; no scope is open.
+**/
+EFI_STATUS
+ShellEnvScopePush (
+  IN CONST CHAR16  **Environment
+  )
+{
+  SHELL_ENV_SCOPE  *Scope;
+  CONST CHAR16     *Equal;
+  CHAR16           *Name;
+  UINTN            Index;
+  EFI_STATUS       Status;
+
+  Scope = AllocateZeroPool (sizeof (SHELL_ENV_SCOPE));
+  if (Scope == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  InitializeListHead (&Scope->Saved);
+  Scope->WriteCount = mEnvMirrorWriteCount;
+  InsertHeadList (&mEnvScopes, &Scope->Link);
+
+  Status = EFI_SUCCESS;
+  for (Index = 0; Environment != NULL && Environment[Index] != NULL; Index++) {
+    Equal = StrStr (Environment[Index], L"=");
+    if ((Equal == NULL) || (Equal == Environment[Index])) {
+      Status = EFI_INVALID_PARAMETER;
+      break;
+    }
+
+    Name = AllocateCopyPool ((Equal - Environment[Index] + 1) * sizeof (CHAR16), Environment[Index]);
+    if (Name == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      break;
+    }
+
+    Name[Equal - Environment[Index]] = CHAR_NULL;
+    Status                           = InternalEfiShellSetEnv (Name, Equal + 1, TRUE);
+    FreePool (Name);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    ShellEnvScopePop ();
+  }
+
+  return (Status);
+}
+
+/**
+  Close the innermost environment scope, putting back every variable that
+  was changed while it was open.
+**/
+VOID
+ShellEnvScopePop (
+  VOID
+  )
+{
+  SHELL_ENV_SCOPE  *Scope;
+  SHELL_ENV_SAVED  *Saved;
+  BOOLEAN          Written;
+  BOOLEAN          NonVolatile;
+  CHAR16           *Value;
+  UINTN            Size;
+  UINT32           Atts;
+
+  ASSERT (ShellEnvScopeActive ());
+  if (!ShellEnvScopeActive ()) {
+    return;
+  }
+
+  Scope = (SHELL_ENV_SCOPE *)GetFirstNode (&mEnvScopes);
+  RemoveEntryList (&Scope->Link);
+  Written = (BOOLEAN)(Scope->WriteCount != mEnvMirrorWriteCount);
+
+  while (!IsListEmpty (&Scope->Saved)) {
+    Saved = (SHELL_ENV_SAVED *)GetFirstNode (&Scope->Saved);
+    RemoveEntryList (&Saved->Link);
+
+    Value = NULL;
+    Atts  = 0;
+    ShellFindEnvVarInList (Saved->Name, &Value, &Size, &Atts);
+    SHELL_FREE_NON_NULL (Value);
+    NonVolatile = (BOOLEAN)(((Atts | Saved->Atts) & EFI_VARIABLE_NON_VOLATILE) != 0);
+
+    if (Saved->Value == NULL) {
+      ShellRemvoeEnvVarFromList (Saved->Name);
+    } else {
+      ShellAddEnvVarToList (Saved->Name, Saved->Value, StrSize (Saved->Value), Saved->Atts);
+    }
+
+    //
+    // If the store was written while the scope was open it may hold the
+    // scope's value; otherwise it is as it was when the scope was opened.
+    //
+    if (Written || Saved->WasPending) {
+      ShellEnvMirrorMark (Saved->Name, NonVolatile);
+    } else {
+      ShellEnvMirrorUnmark (Saved->Name);
+    }
+
+    SHELL_FREE_NON_NULL (Saved->Value);
+    FreePool (Saved->Name);
+    FreePool (Saved);
+  }
+
+  FreePool (Scope);
+}
+
+/**
+  Sets the environment variable.
+
+  This function changes the current value of the specified environment variable. If the
+  environment variable exists and the Value is an empty string, then the environment
+  variable is deleted. If the environment variable exists and the Value is not an empty
+  string, then the value of the environment variable is changed. If the environment
+  variable does not exist and the Value is an empty string, there is no action. If the
+  environment variable does not exist and the Value is a non-empty string, then the
+  environment variable is created and assigned the specified value.
+
+  For a description of volatile and non-volatile environment variables, see UEFI Shell
+  2.0 specification section 3.6.1.
+
+  @param Name                   Points to the NULL-terminated environment variable name.
+  @param Value                  Points to the NULL-terminated environment variable value. If the value is an
+                                empty string then the environment variable is deleted.
+  @param Volatile               Indicates whether the variable is non-volatile (FALSE) or volatile (TRUE).
+
+  @retval EFI_SUCCESS           The environment variable was successfully updated.
+**/
+EFI_STATUS
+EFIAPI
+EfiShellSetEnv (
+  IN CONST CHAR16  *Name,
+  IN CONST CHAR16  *Value,
+  IN BOOLEAN       Volatile
+  )
+{
+  if ((Name == NULL) || (*Name == CHAR_NULL)) {
+    return (EFI_INVALID_PARAMETER);
+  }
+
+  //
+  // Make sure we dont 'set' a predefined read only variable
+  //
+  if ((StrCmp (Name, L"cwd") == 0) ||
+      (StrCmp (Name, L"lasterror") == 0) ||
+      (StrCmp (Name, L"profiles") == 0) ||
+      (StrCmp (Name, L"uefishellsupport") == 0) ||
+      (StrCmp (Name, L"uefishellversion") == 0) ||
+      (StrCmp (Name, L"uefiversion") == 0) ||
+      (StrCmp (Name, L"startuptimes") == 0) ||
+      (!ShellInfoObject.ShellInitSettings.BitUnion.Bits.NoNest &&
+       (StrCmp (Name, mNoNestingEnvVarName) == 0))
+      )
+  {
+    return (EFI_INVALID_PARAMETER);
+  }
+
+  return (InternalEfiShellSetEnv (Name, Value, Volatile));
+}
+
+/**
+  Returns the current directory on the specified device.
+
+  If FileSystemMapping is NULL, it returns the current working directory. If the
+  FileSystemMapping is not NULL, it returns the current directory associated with the
+  FileSystemMapping. In both cases, the returned name includes the file system
+  mapping (i.e. fs0:\current-dir).
+
+  Note that the current directory string should exclude the tailing backslash character.
+
+  @param FileSystemMapping      A pointer to the file system mapping. If NULL,
+                                then the current working directory is returned.
+
+  @retval !=NULL                The current directory.
+  @retval NULL                  Current directory does not exist.
+**/
+CONST CHAR16 *
+EFIAPI
+EfiShellGetCurDir (
+  IN CONST CHAR16  *FileSystemMapping OPTIONAL
+  )
+{
+  CHAR16          *PathToReturn;
+  UINTN           Size;
+  SHELL_MAP_LIST  *MapListItem;
+
+  if (!IsListEmpty (&gShellMapList.Link)) {
+    //
+    // if parameter is NULL, use current
+    //
+    if (FileSystemMapping == NULL) {
+      return (EfiShellGetEnv (L"cwd"));
+    } else {
+      Size         = 0;
+      PathToReturn = NULL;
+      MapListItem  = ShellCommandFindMapItem (FileSystemMapping);
+      if (MapListItem != NULL) {
+        ASSERT ((PathToReturn == NULL && Size == 0) || (PathToReturn != NULL));
+        PathToReturn = StrnCatGrow (&PathToReturn, &Size, MapListItem->MapName, 0);
+        PathToReturn = StrnCatGrow (&PathToReturn, &Size, MapListItem->CurrentDirectoryPath, 0);
+      }
+    }
+
+    return (AddBufferToFreeList (PathToReturn));
+  } else {
+    return (NULL);
+  }
+}
+
+/**
+  Changes the current directory on the specified device.
+
+  If the FileSystem is NULL, and the directory Dir does not contain a file system's
+  mapped name, this function changes the current working directory.
+
+  If the FileSystem is NULL and the directory Dir contains a mapped name, then the
+  current file system and the current directory on that file system are changed.
+
+  If FileSystem is NULL, and Dir is not NULL, then this changes the current working file
+  system.
+
+  If FileSystem is not NULL and Dir is not NULL, then this function changes the current
+  directory on the specified file system.
+
+  If the current working directory or the current working file system is changed then the
+  %cwd% environment variable will be updated
+
+  Note that the current directory string should exclude the tailing backslash character.
+
+  @param FileSystem             A pointer to the file system's mapped name. If NULL, then the current working
+                                directory is changed.
+  @param Dir                    Points to the NULL-terminated directory on the device specified by FileSystem.
+
+  @retval EFI_SUCCESS           The operation was successful
+  @retval EFI_NOT_FOUND         The file system could not be found
+**/
+EFI_STATUS
+EFIAPI
+EfiShellSetCurDir (
+  IN CONST CHAR16  *FileSystem OPTIONAL,
+  IN CONST CHAR16  *Dir
   )
 {
   CHAR16          *MapName;
@@ -3251,175 +4176,527 @@ EfiShellSetCurDir (
     }
 
     //
-    // FileSystem != NULL
+    // FileSystem != NULL
+    //
+    MapListItem = ShellCommandFindMapItem (FileSystem);
+    if (MapListItem == NULL) {
+      FreePool (DirectoryName);
+      return (EFI_INVALID_PARAMETER);
+    }
+
+    //    gShellCurMapping = MapListItem;
+    if (DirectoryName != NULL) {
+      //
+      // change current dir on that file system
+      //
+
+      if (MapListItem->CurrentDirectoryPath != NULL) {
+        FreePool (MapListItem->CurrentDirectoryPath);
+        DEBUG_CODE (
+          MapListItem->CurrentDirectoryPath = NULL;
+          );
+      }
+
+      //      ASSERT((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
+      //      MapListItem->CurrentDirectoryPath = StrnCatGrow(&MapListItem->CurrentDirectoryPath, &Size, FileSystem, 0);
+      ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
+      MapListItem->CurrentDirectoryPath = StrnCatGrow (&MapListItem->CurrentDirectoryPath, &Size, L"\\", 0);
+      ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
+      MapListItem->CurrentDirectoryPath = StrnCatGrow (&MapListItem->CurrentDirectoryPath, &Size, DirectoryName, 0);
+      if ((MapListItem->CurrentDirectoryPath != NULL) && (MapListItem->CurrentDirectoryPath[StrLen (MapListItem->CurrentDirectoryPath)-1] == L'\\')) {
+        ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
+        MapListItem->CurrentDirectoryPath[StrLen (MapListItem->CurrentDirectoryPath)-1] = CHAR_NULL;
+      }
+    }
+  }
+
+  FreePool (DirectoryName);
+  //
+  // if updated the current directory then update the environment variable
+  //
+  if (MapListItem == gShellCurMapping) {
+    Size = 0;
+    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
+    StrnCatGrow (&TempString, &Size, MapListItem->MapName, 0);
+    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
+    StrnCatGrow (&TempString, &Size, MapListItem->CurrentDirectoryPath, 0);
+    Status =  InternalEfiShellSetEnv (L"cwd", TempString, TRUE);
+    FreePool (TempString);
+    return (Status);
+  }
+
+  return (EFI_SUCCESS);
+}
+
+/**
+  Return help information about a specific command.
+
+  This function returns the help information for the specified command. The help text
+  can be internal to the shell or can be from a UEFI Shell manual page.
+
+  If Sections is specified, then each section name listed will be compared in a casesensitive
+  manner, to the section names described in Appendix B. If the section exists,
+  it will be appended to the returned help text. If the section does not exist, no
+  information will be returned. If Sections is NULL, then all help text information
+  available will be returned.
+
+  @param Command                Points to the NULL-terminated UEFI Shell command name.
+  @param Sections               Points to the NULL-terminated comma-delimited
+                                section names to return. If NULL, then all
+                                sections will be returned.
+  @param HelpText               On return, points to a callee-allocated buffer
+                                containing all specified help text.
+
+  @retval EFI_SUCCESS           The help text was returned.
+  @retval EFI_OUT_OF_RESOURCES  The necessary buffer could not be allocated to hold the
+                                returned help text.
+  @retval EFI_INVALID_PARAMETER HelpText is NULL
+  @retval EFI_NOT_FOUND         There is no help text available for Command.
+**/
+EFI_STATUS
+EFIAPI
+EfiShellGetHelpText (
+  IN CONST CHAR16  *Command,
+  IN CONST CHAR16  *Sections OPTIONAL,
+  OUT CHAR16       **HelpText
+  )
+{
+  CONST CHAR16  *ManFileName;
+  CHAR16        *FixCommand;
+  EFI_STATUS    Status;
+
+  ASSERT (HelpText != NULL);
+  FixCommand = NULL;
+
+  ManFileName = ShellCommandGetManFileNameHandler (Command);
+
+  if (ManFileName != NULL) {
+    return (ProcessManFile (ManFileName, Command, Sections, NULL, HelpText));
+  } else {
+    if (  (StrLen (Command) > 4)
+       && ((Command[StrLen (Command)-1] == L'i') || (Command[StrLen (Command)-1] == L'I'))
+       && ((Command[StrLen (Command)-2] == L'f') || (Command[StrLen (Command)-2] == L'F'))
+       && ((Command[StrLen (Command)-3] == L'e') || (Command[StrLen (Command)-3] == L'E'))
+       && (Command[StrLen (Command)-4] == L'.')
+          )
+    {
+      FixCommand = AllocateZeroPool (StrSize (Command) - 4 * sizeof (CHAR16));
+      if (FixCommand == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+      }
+
+      StrnCpyS (
+        FixCommand,
+        (StrSize (Command) - 4 * sizeof (CHAR16))/sizeof (CHAR16),
+        Command,
+        StrLen (Command)-4
+        );
+      Status = ProcessManFile (FixCommand, FixCommand, Sections, NULL, HelpText);
+      FreePool (FixCommand);
+      return Status;
+    } else {
+      return (ProcessManFile (Command, Command, Sections, NULL, HelpText));
+    }
+  }
+}
+
+/**
+  Gets the enable status of the page break output mode.
+
+  User can use this function to determine current page break mode.
+
+  @retval TRUE                  The page break output mode is enabled.
+  @retval FALSE                 The page break output mode is disabled.
+**/
+BOOLEAN
+EFIAPI
+EfiShellGetPageBreak (
+  VOID
+  )
+{
+  return (ShellInfoObject.PageBreakEnabled);
+}
+
+/**
+  Judges whether the active shell is the root shell.
+
+  This function makes the user to know that whether the active Shell is the root shell.
+
+  @retval TRUE                  The active Shell is the root Shell.
+  @retval FALSE                 The active Shell is NOT the root Shell.
+**/
+BOOLEAN
+EFIAPI
+EfiShellIsRootShell (
+  VOID
+  )
+{
+  return (ShellInfoObject.RootShellInstance);
+}
+
+//
+// Values returned by EfiShellGetAlias(), including misses, since every
+// command line is checked for an alias.  A value that was returned is moved
+// to the free list of the outermost command level it was returned at instead
+// of being freed when its entry is dropped, so the pointer stays valid until
+// the command that got it returns.  An entry is dropped when its alias is set
+// or deleted, and all of them together with the alias index, or when
+// ALIAS_VALUE_CACHE_MAX names are cached and another one is asked for.
+//
+#define ALIAS_VALUE_CACHE_MAX  64
+
+typedef struct {
+  CHAR16     *Name;
+  CHAR16     *Value;                ///< NULL if Name is not an alias.
+  UINT32     Attribs;
+  BOOLEAN    Lent;                  ///< Value was returned to a caller.
+  UINTN      LentLevel;             ///< Outermost buffer list level Value was returned at.
+} ALIAS_VALUE;
+
+STATIC ORDERED_COLLECTION  *mAliasValues     = NULL;
+STATIC UINTN               mAliasValueCount = 0;
+
+/**
+  ORDERED_COLLECTION_USER_COMPARE function for the alias value cache.
+
+  @param[in] Value1AsVoid  The first ALIAS_VALUE.
+  @param[in] Value2AsVoid  The second ALIAS_VALUE.
+
+  @retval <0  If Value1 compares less than Value2.
+  @retval  0  If Value1 compares equal to Value2.
+  @retval >0  If Value1 compares greater than Value2.
+**/
+STATIC
+INTN
+EFIAPI
+AliasValueCompare (
+  IN CONST VOID  *Value1AsVoid,
+  IN CONST VOID  *Value2AsVoid
+  )
+{
+  return (StrCmp (((CONST ALIAS_VALUE *)Value1AsVoid)->Name, ((CONST ALIAS_VALUE *)Value2AsVoid)->Name));
+}
+
+/**
+  ORDERED_COLLECTION_KEY_COMPARE function for the alias value cache.
+
+  @param[in] NameAsVoid   The alias name to look for.
+  @param[in] ValueAsVoid  The ALIAS_VALUE to compare against.
+
+  @retval <0  If Name compares less than Value->Name.
+  @retval  0  If Name compares equal to Value->Name.
+  @retval >0  If Name compares greater than Value->Name.
+**/
+STATIC
+INTN
+EFIAPI
+AliasValueKeyCompare (
+  IN CONST VOID  *NameAsVoid,
+  IN CONST VOID  *ValueAsVoid
+  )
+{
+  return (StrCmp ((CONST CHAR16 *)NameAsVoid, ((CONST ALIAS_VALUE *)ValueAsVoid)->Name));
+}
+
+/**
+  Free an alias value cache entry.
+
+  @param[in] Cached             The entry, no longer in mAliasValues.
+**/
+STATIC
+VOID
+AliasValueRelease (
+  IN ALIAS_VALUE  *Cached
+  )
+{
+  if (Cached->Value != NULL) {
+    if (Cached->Lent) {
+      AddBufferToLevelFreeList (Cached->Value, Cached->LentLevel);
+    } else {
+      FreePool (Cached->Value);
+    }
+  }
+
+  FreePool (Cached->Name);
+  FreePool (Cached);
+}
+
+/**
+  Drop the cached value of one alias.
+
+  @param[in] Name               The lowercase alias name.
+**/
+STATIC
+VOID
+AliasValueForget (
+  IN CONST CHAR16  *Name
+  )
+{
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  VOID                      *Cached;
+
+  if (mAliasValues == NULL) {
+    return;
+  }
+
+  Entry = OrderedCollectionFind (mAliasValues, Name);
+  if (Entry != NULL) {
+    OrderedCollectionDelete (mAliasValues, Entry, &Cached);
+    AliasValueRelease (Cached);
+    mAliasValueCount--;
+  }
+}
+
+/**
+  Drop all cached alias values.
+**/
+STATIC
+VOID
+AliasValueFlush (
+  VOID
+  )
+{
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  VOID                      *Cached;
+
+  if (mAliasValues == NULL) {
+    return;
+  }
+
+  while ((Entry = OrderedCollectionMin (mAliasValues)) != NULL) {
+    OrderedCollectionDelete (mAliasValues, Entry, &Cached);
+    AliasValueRelease (Cached);
+  }
+
+  OrderedCollectionUninit (mAliasValues);
+  mAliasValues     = NULL;
+  mAliasValueCount = 0;
+}
+
+/**
+  Look up an alias through the value cache, reading the variable store only
+  the first time a name is asked for.
+
+  @param[in] Name               The lowercase alias name.
+  @param[out] Value             The alias value, or NULL if Name is not an
+                                alias.  Must not be modified or freed.
+  @param[out] Attribs           The attributes of the alias variable.
+
+  @retval EFI_SUCCESS           Value and Attribs are returned.
+  @return                       The cache could not answer; read the variable
+                                store directly.
+**/
+STATIC
+EFI_STATUS
+AliasValueGet (
+  IN  CONST CHAR16  *Name,
+  OUT CONST CHAR16  **Value,
+  OUT UINT32        *Attribs
+  )
+{
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  ALIAS_VALUE               *Cached;
+  UINTN                     Size;
+  EFI_STATUS                Status;
+
+  if (  (mAliasValueCount >= ALIAS_VALUE_CACHE_MAX)
+     && (OrderedCollectionFind (mAliasValues, Name) == NULL))
+  {
+    AliasValueFlush ();
+  }
+
+  if (mAliasValues == NULL) {
+    mAliasValues = OrderedCollectionInit (AliasValueCompare, AliasValueKeyCompare);
+    if (mAliasValues == NULL) {
+      return (EFI_OUT_OF_RESOURCES);
+    }
+  }
+
+  Entry = OrderedCollectionFind (mAliasValues, Name);
+  if (Entry != NULL) {
+    Cached = OrderedCollectionUserStruct (Entry);
+  } else {
+    Cached = AllocateZeroPool (sizeof (ALIAS_VALUE));
+    if (Cached == NULL) {
+      return (EFI_OUT_OF_RESOURCES);
+    }
+
+    Cached->Name = AllocateCopyPool (StrSize (Name), Name);
+    if (Cached->Name == NULL) {
+      FreePool (Cached);
+      return (EFI_OUT_OF_RESOURCES);
+    }
+
+    Size   = 0;
+    Status = gRT->GetVariable ((CHAR16 *)Name, &gShellAliasGuid, &Cached->Attribs, &Size, NULL);
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+      Cached->Value = AllocateZeroPool (Size + sizeof (CHAR16));
+      if (Cached->Value == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+      } else {
+        Status = gRT->GetVariable ((CHAR16 *)Name, &gShellAliasGuid, &Cached->Attribs, &Size, Cached->Value);
+      }
+    }
+
+    //
+    // only a definite miss is remembered
     //
-    MapListItem = ShellCommandFindMapItem (FileSystem);
-    if (MapListItem == NULL) {
-      FreePool (DirectoryName);
-      return (EFI_INVALID_PARAMETER);
+    if (EFI_ERROR (Status)) {
+      SHELL_FREE_NON_NULL (Cached->Value);
+      Cached->Attribs = 0;
+      if (Status != EFI_NOT_FOUND) {
+        AliasValueRelease (Cached);
+        return (Status);
+      }
     }
 
-    //    gShellCurMapping = MapListItem;
-    if (DirectoryName != NULL) {
-      //
-      // change current dir on that file system
-      //
+    if (RETURN_ERROR (OrderedCollectionInsert (mAliasValues, NULL, Cached))) {
+      AliasValueRelease (Cached);
+      return (EFI_OUT_OF_RESOURCES);
+    }
 
-      if (MapListItem->CurrentDirectoryPath != NULL) {
-        FreePool (MapListItem->CurrentDirectoryPath);
-        DEBUG_CODE (
-          MapListItem->CurrentDirectoryPath = NULL;
-          );
-      }
+    mAliasValueCount++;
+  }
 
-      //      ASSERT((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
-      //      MapListItem->CurrentDirectoryPath = StrnCatGrow(&MapListItem->CurrentDirectoryPath, &Size, FileSystem, 0);
-      ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
-      MapListItem->CurrentDirectoryPath = StrnCatGrow (&MapListItem->CurrentDirectoryPath, &Size, L"\\", 0);
-      ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
-      MapListItem->CurrentDirectoryPath = StrnCatGrow (&MapListItem->CurrentDirectoryPath, &Size, DirectoryName, 0);
-      if ((MapListItem->CurrentDirectoryPath != NULL) && (MapListItem->CurrentDirectoryPath[StrLen (MapListItem->CurrentDirectoryPath)-1] == L'\\')) {
-        ASSERT ((MapListItem->CurrentDirectoryPath == NULL && Size == 0) || (MapListItem->CurrentDirectoryPath != NULL));
-        MapListItem->CurrentDirectoryPath[StrLen (MapListItem->CurrentDirectoryPath)-1] = CHAR_NULL;
-      }
+  if (Cached->Value != NULL) {
+    if (!Cached->Lent || (GetBufferListLevel () < Cached->LentLevel)) {
+      Cached->LentLevel = GetBufferListLevel ();
     }
-  }
 
-  FreePool (DirectoryName);
-  //
-  // if updated the current directory then update the environment variable
-  //
-  if (MapListItem == gShellCurMapping) {
-    Size = 0;
-    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
-    StrnCatGrow (&TempString, &Size, MapListItem->MapName, 0);
-    ASSERT ((TempString == NULL && Size == 0) || (TempString != NULL));
-    StrnCatGrow (&TempString, &Size, MapListItem->CurrentDirectoryPath, 0);
-    Status =  InternalEfiShellSetEnv (L"cwd", TempString, TRUE);
-    FreePool (TempString);
-    return (Status);
+    Cached->Lent = TRUE;
   }
 
+  *Value   = Cached->Value;
+  *Attribs = Cached->Attribs;
   return (EFI_SUCCESS);
 }
 
-/**
-  Return help information about a specific command.
-
-  This function returns the help information for the specified command. The help text
-  can be internal to the shell or can be from a UEFI Shell manual page.
+//
+// In-memory index of the alias names stored under gShellAliasGuid, so listing
+// aliases does not walk every UEFI variable in the system.  It is seeded once
+// from the variable store, kept up to date by InternalSetAlias() and reseeded
+// after an image ran, since a nested shell writes aliases directly.
+//
+STATIC ORDERED_COLLECTION  *mAliasIndex     = NULL;
+STATIC UINTN               mAliasIndexChars = 0;      ///< Characters needed to list all names, separators included.
+STATIC BOOLEAN             mAliasIndexValid = FALSE;
 
-  If Sections is specified, then each section name listed will be compared in a casesensitive
-  manner, to the section names described in Appendix B. If the section exists,
-  it will be appended to the returned help text. If the section does not exist, no
-  information will be returned. If Sections is NULL, then all help text information
-  available will be returned.
+/**
+  ORDERED_COLLECTION_USER_COMPARE and ORDERED_COLLECTION_KEY_COMPARE function
+  for the alias index.  Both sides are alias names.
 
-  @param Command                Points to the NULL-terminated UEFI Shell command name.
-  @param Sections               Points to the NULL-terminated comma-delimited
-                                section names to return. If NULL, then all
-                                sections will be returned.
-  @param HelpText               On return, points to a callee-allocated buffer
-                                containing all specified help text.
+  @param[in] Name1AsVoid  The first alias name.
+  @param[in] Name2AsVoid  The second alias name.
 
-  @retval EFI_SUCCESS           The help text was returned.
-  @retval EFI_OUT_OF_RESOURCES  The necessary buffer could not be allocated to hold the
-                                returned help text.
-  @retval EFI_INVALID_PARAMETER HelpText is NULL
-  @retval EFI_NOT_FOUND         There is no help text available for Command.
+  @retval <0  If Name1 compares less than Name2.
+  @retval  0  If Name1 compares equal to Name2.
+  @retval >0  If Name1 compares greater than Name2.
 **/
-EFI_STATUS
+STATIC
+INTN
 EFIAPI
-EfiShellGetHelpText (
-  IN CONST CHAR16  *Command,
-  IN CONST CHAR16  *Sections OPTIONAL,
-  OUT CHAR16       **HelpText
+AliasIndexCompare (
+  IN CONST VOID  *Name1AsVoid,
+  IN CONST VOID  *Name2AsVoid
   )
 {
-  CONST CHAR16  *ManFileName;
-  CHAR16        *FixCommand;
-  EFI_STATUS    Status;
-
-  ASSERT (HelpText != NULL);
-  FixCommand = NULL;
-
-  ManFileName = ShellCommandGetManFileNameHandler (Command);
+  return (StrCmp ((CONST CHAR16 *)Name1AsVoid, (CONST CHAR16 *)Name2AsVoid));
+}
 
-  if (ManFileName != NULL) {
-    return (ProcessManFile (ManFileName, Command, Sections, NULL, HelpText));
-  } else {
-    if (  (StrLen (Command) > 4)
-       && ((Command[StrLen (Command)-1] == L'i') || (Command[StrLen (Command)-1] == L'I'))
-       && ((Command[StrLen (Command)-2] == L'f') || (Command[StrLen (Command)-2] == L'F'))
-       && ((Command[StrLen (Command)-3] == L'e') || (Command[StrLen (Command)-3] == L'E'))
-       && (Command[StrLen (Command)-4] == L'.')
-          )
-    {
-      FixCommand = AllocateZeroPool (StrSize (Command) - 4 * sizeof (CHAR16));
-      if (FixCommand == NULL) {
-        return EFI_OUT_OF_RESOURCES;
-      }
+/**
+  Free the alias index and mark it as not seeded.
+**/
+STATIC
+VOID
+AliasIndexFree (
+  VOID
+  )
+{
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  VOID                      *Name;
 
-      StrnCpyS (
-        FixCommand,
-        (StrSize (Command) - 4 * sizeof (CHAR16))/sizeof (CHAR16),
-        Command,
-        StrLen (Command)-4
-        );
-      Status = ProcessManFile (FixCommand, FixCommand, Sections, NULL, HelpText);
-      FreePool (FixCommand);
-      return Status;
-    } else {
-      return (ProcessManFile (Command, Command, Sections, NULL, HelpText));
+  if (mAliasIndex != NULL) {
+    while ((Entry = OrderedCollectionMin (mAliasIndex)) != NULL) {
+      OrderedCollectionDelete (mAliasIndex, Entry, &Name);
+      FreePool (Name);
     }
+
+    OrderedCollectionUninit (mAliasIndex);
+    mAliasIndex = NULL;
   }
+
+  mAliasIndexChars = 0;
+  mAliasIndexValid = FALSE;
 }
 
 /**
-  Gets the enable status of the page break output mode.
+  Add an alias name to the index.
 
-  User can use this function to determine current page break mode.
+  @param[in] Name               The alias name.
 
-  @retval TRUE                  The page break output mode is enabled.
-  @retval FALSE                 The page break output mode is disabled.
+  @retval EFI_SUCCESS           The name is in the index.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
 **/
-BOOLEAN
-EFIAPI
-EfiShellGetPageBreak (
-  VOID
+STATIC
+EFI_STATUS
+AliasIndexAdd (
+  IN CONST CHAR16  *Name
   )
 {
-  return (ShellInfoObject.PageBreakEnabled);
+  CHAR16         *Copy;
+  RETURN_STATUS  Status;
+
+  if (OrderedCollectionFind (mAliasIndex, Name) != NULL) {
+    return (EFI_SUCCESS);
+  }
+
+  Copy = AllocateCopyPool (StrSize (Name), Name);
+  if (Copy == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  Status = OrderedCollectionInsert (mAliasIndex, NULL, Copy);
+  if (RETURN_ERROR (Status)) {
+    FreePool (Copy);
+    return (EFI_OUT_OF_RESOURCES);
+  }
+
+  mAliasIndexChars += StrLen (Name) + 1;
+  return (EFI_SUCCESS);
 }
 
 /**
-  Judges whether the active shell is the root shell.
-
-  This function makes the user to know that whether the active Shell is the root shell.
+  Remove an alias name from the index.
 
-  @retval TRUE                  The active Shell is the root Shell.
-  @retval FALSE                 The active Shell is NOT the root Shell.
+  @param[in] Name               The alias name.
 **/
-BOOLEAN
-EFIAPI
-EfiShellIsRootShell (
-  VOID
+STATIC
+VOID
+AliasIndexRemove (
+  IN CONST CHAR16  *Name
   )
 {
-  return (ShellInfoObject.RootShellInstance);
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  VOID                      *Copy;
+
+  Entry = OrderedCollectionFind (mAliasIndex, Name);
+  if (Entry != NULL) {
+    OrderedCollectionDelete (mAliasIndex, Entry, &Copy);
+    mAliasIndexChars -= StrLen ((CHAR16 *)Copy) + 1;
+    FreePool (Copy);
+  }
 }
 
 /**
-  function to return a semi-colon delimited list of all alias' in the current shell
+  Seed the alias index from the UEFI variable store.
 
-  up to caller to free the memory.
-
-  @retval NULL    No alias' were found
-  @retval NULL    An error occurred getting alias'
-  @return !NULL   a list of all alias'
+  @retval EFI_SUCCESS           The index is seeded.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @return                       An error from GetNextVariableName.
 **/
-CHAR16 *
-InternalEfiShellGetListAlias (
+STATIC
+EFI_STATUS
+AliasIndexSeed (
   VOID
   )
 {
@@ -3428,16 +4705,19 @@ InternalEfiShellGetListAlias (
   CHAR16      *VariableName;
   UINTN       NameSize;
   UINTN       NameBufferSize;
-  CHAR16      *RetVal;
-  UINTN       RetSize;
+
+  AliasIndexFree ();
+
+  mAliasIndex = OrderedCollectionInit (AliasIndexCompare, AliasIndexCompare);
+  if (mAliasIndex == NULL) {
+    return (EFI_OUT_OF_RESOURCES);
+  }
 
   NameBufferSize = INIT_NAME_BUFFER_SIZE;
   VariableName   = AllocateZeroPool (NameBufferSize);
-  RetSize        = 0;
-  RetVal         = NULL;
-
   if (VariableName == NULL) {
-    return (NULL);
+    AliasIndexFree ();
+    return (EFI_OUT_OF_RESOURCES);
   }
 
   VariableName[0] = CHAR_NULL;
@@ -3446,6 +4726,7 @@ InternalEfiShellGetListAlias (
     NameSize = NameBufferSize;
     Status   = gRT->GetNextVariableName (&NameSize, VariableName, &Guid);
     if (Status == EFI_NOT_FOUND) {
+      Status = EFI_SUCCESS;
       break;
     } else if (Status == EFI_BUFFER_TOO_SMALL) {
       NameBufferSize = NameSize > NameBufferSize * 2 ? NameSize : NameBufferSize * 2;
@@ -3453,8 +4734,6 @@ InternalEfiShellGetListAlias (
       VariableName = AllocateZeroPool (NameBufferSize);
       if (VariableName == NULL) {
         Status = EFI_OUT_OF_RESOURCES;
-        SHELL_FREE_NON_NULL (RetVal);
-        RetVal = NULL;
         break;
       }
 
@@ -3462,21 +4741,112 @@ InternalEfiShellGetListAlias (
       Status   = gRT->GetNextVariableName (&NameSize, VariableName, &Guid);
     }
 
+    if (!EFI_ERROR (Status) && CompareGuid (&Guid, &gShellAliasGuid)) {
+      Status = AliasIndexAdd (VariableName);
+    }
+
     if (EFI_ERROR (Status)) {
-      SHELL_FREE_NON_NULL (RetVal);
-      RetVal = NULL;
       break;
     }
-
-    if (CompareGuid (&Guid, &gShellAliasGuid)) {
-      ASSERT ((RetVal == NULL && RetSize == 0) || (RetVal != NULL));
-      RetVal = StrnCatGrow (&RetVal, &RetSize, VariableName, 0);
-      RetVal = StrnCatGrow (&RetVal, &RetSize, L";", 0);
-    } // compare guid
   } // while
 
   SHELL_FREE_NON_NULL (VariableName);
 
+  if (EFI_ERROR (Status)) {
+    AliasIndexFree ();
+  } else {
+    mAliasIndexValid = TRUE;
+  }
+
+  return (Status);
+}
+
+/**
+  Drop the alias index and the cached alias values; both are filled from the
+  variable store again on next use.
+**/
+VOID
+AliasIndexInvalidate (
+  VOID
+  )
+{
+  AliasIndexFree ();
+  AliasValueFlush ();
+}
+
+/**
+  Update the alias index after an alias was set or deleted in the variable store.
+
+  @param[in] Alias              The lowercase alias name.
+  @param[in] Deleted            TRUE if the alias was deleted.
+**/
+STATIC
+VOID
+AliasIndexUpdate (
+  IN CONST CHAR16  *Alias,
+  IN BOOLEAN       Deleted
+  )
+{
+  AliasValueForget (Alias);
+
+  if (!mAliasIndexValid) {
+    return;
+  }
+
+  if (Deleted) {
+    AliasIndexRemove (Alias);
+  } else if (EFI_ERROR (AliasIndexAdd (Alias))) {
+    AliasIndexFree ();
+  }
+}
+
+/**
+  function to return a semi-colon delimited list of all alias' in the current shell
+
+  up to caller to free the memory.
+
+  @retval NULL    No alias' were found
+  @retval NULL    An error occurred getting alias'
+  @return !NULL   a list of all alias'
+**/
+CHAR16 *
+InternalEfiShellGetListAlias (
+  VOID
+  )
+{
+  ORDERED_COLLECTION_ENTRY  *Entry;
+  CONST CHAR16              *Name;
+  CHAR16                    *RetVal;
+  CHAR16                    *Walker;
+  UINTN                     Length;
+
+  if (!mAliasIndexValid && EFI_ERROR (AliasIndexSeed ())) {
+    return (NULL);
+  }
+
+  if (mAliasIndexChars == 0) {
+    return (NULL);
+  }
+
+  //
+  // one allocation sized from the index, names are copied in sorted order
+  //
+  RetVal = AllocatePool ((mAliasIndexChars + 1) * sizeof (CHAR16));
+  if (RetVal == NULL) {
+    return (NULL);
+  }
+
+  Walker = RetVal;
+  for (Entry = OrderedCollectionMin (mAliasIndex); Entry != NULL; Entry = OrderedCollectionNext (Entry)) {
+    Name   = OrderedCollectionUserStruct (Entry);
+    Length = StrLen (Name);
+    CopyMem (Walker, Name, Length * sizeof (CHAR16));
+    Walker   += Length;
+    *Walker++ = L';';
+  }
+
+  *Walker = CHAR_NULL;
+
   return (RetVal);
 }
 
@@ -3529,12 +4899,13 @@ EfiShellGetAlias (
   OUT BOOLEAN       *Volatile OPTIONAL
   )
 {
-  CHAR16      *RetVal;
-  UINTN       RetSize;
-  UINT32      Attribs;
-  EFI_STATUS  Status;
-  CHAR16      *AliasLower;
-  CHAR16      *AliasVal;
+  CHAR16        *RetVal;
+  UINTN         RetSize;
+  UINT32        Attribs;
+  EFI_STATUS    Status;
+  CHAR16        *AliasLower;
+  CHAR16        *AliasVal;
+  CONST CHAR16  *CachedVal;
 
   // Convert to lowercase to make aliases case-insensitive
   if (Alias != NULL) {
@@ -3545,6 +4916,19 @@ EfiShellGetAlias (
 
     ToLower (AliasLower);
 
+    //
+    // Return the cached value itself; a copy is only made if the cache
+    // cannot answer.
+    //
+    if (!EFI_ERROR (AliasValueGet (AliasLower, &CachedVal, &Attribs))) {
+      FreePool (AliasLower);
+      if ((CachedVal != NULL) && (Volatile != NULL)) {
+        *Volatile = (BOOLEAN)((Attribs & EFI_VARIABLE_NON_VOLATILE) == 0);
+      }
+
+      return (CachedVal);
+    }
+
     if (Volatile == NULL) {
       GetVariable2 (AliasLower, &gShellAliasGuid, (VOID **)&AliasVal, NULL);
       FreePool (AliasLower);
@@ -3647,6 +5031,10 @@ InternalSetAlias (
                     );
   }
 
+  if (!EFI_ERROR (Status)) {
+    AliasIndexUpdate (AliasLower, DeleteAlias);
+  }
+
   FreePool (AliasLower);
 
   return Status;
@@ -3728,13 +5116,13 @@ EFI_SHELL_PROTOCOL  mShellProtocol = {
   EfiShellGetPageBreak,
   EfiShellGetDeviceName,
   (EFI_SHELL_GET_FILE_INFO)FileHandleGetInfo,         // *
-  (EFI_SHELL_SET_FILE_INFO)FileHandleSetInfo,         // *
+  EfiShellSetFileInfo,
   EfiShellOpenFileByName,
   EfiShellClose,
   EfiShellCreateFile,
   (EFI_SHELL_READ_FILE)FileHandleRead,                // *
   (EFI_SHELL_WRITE_FILE)FileHandleWrite,              // *
-  (EFI_SHELL_DELETE_FILE)FileHandleDelete,            // *
+  EfiShellDeleteFile,
   EfiShellDeleteFileByName,
   (EFI_SHELL_GET_FILE_POSITION)FileHandleGetPosition, // *
   (EFI_SHELL_SET_FILE_POSITION)FileHandleSetPosition, // *
@@ -3925,6 +5313,10 @@ CleanUpShellProtocol (
 {
   SHELL_PROTOCOL_HANDLE_LIST  *Node2;
 
+  FileOpenCacheFlush (FALSE);
+  ShellEnvMirrorFlush ();
+  AliasIndexInvalidate ();
+
   //
   // if we need to restore old protocols...
   //